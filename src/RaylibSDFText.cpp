@@ -228,6 +228,7 @@ void main() {
 
         std::vector<Image> atlas_images_;
         std::vector<Texture2D> atlas_textures_;
+        std::unique_ptr<IAtlasStorage> atlasStorage_; // Textures of atlas_images_; HeadlessAtlasStorage runs without GL
         int current_atlas_idx_ = -1;
         Vector2 current_atlas_pen_pos_ = {0, 0};
         float current_atlas_max_row_height_ = 0.0f;
@@ -235,6 +236,16 @@ void main() {
         int atlas_height_;
         GlyphAtlasType atlas_type_hint_;
 
+        // 整块布局缓存 (LayoutStyledTextCached)，最近使用的在链表头部
+        struct LayoutCacheEntry {
+            size_t hash;
+            std::shared_ptr<const TextBlock> block;
+        };
+        std::list<LayoutCacheEntry> lru_layout_list_;
+        std::unordered_map<size_t, std::list<LayoutCacheEntry>::iterator> layout_cache_map_;
+        size_t layout_cache_capacity_ = 64;
+        LayoutCacheStats layout_cache_stats_;
+
         Shader sdfShader_ = {0};
         int uniform_sdfTexture_loc_ = -1, uniform_textColor_loc_ = -1, uniform_sdfEdgeValue_loc_ = -1, uniform_sdfSmoothness_loc_ = -1;
         int uniform_enableOutline_loc_ = -1, uniform_outlineColor_loc_ = -1, uniform_outlineWidth_loc_ = -1;
@@ -357,7 +368,7 @@ void main() {
                     }
 
                     atlas_images_.push_back(new_atlas_image);
-                    Texture2D new_texture = LoadTextureFromImage(atlas_images_.back());
+                    Texture2D new_texture = atlasStorage_->CreatePage(atlas_images_.back());
                     if (new_texture.id == 0) {
                         TraceLog(LOG_ERROR, "STBTextEngine: Failed to load texture from new atlas image %d", current_atlas_idx_);
                         UnloadImage(atlas_images_.back());
@@ -365,7 +376,6 @@ void main() {
                         current_atlas_idx_--;
                         return {0,0,0,0};
                     }
-                    SetTextureFilter(new_texture, TEXTURE_FILTER_BILINEAR);
                     atlas_textures_.push_back(new_texture);
                     TraceLog(LOG_INFO, "STBTextEngine: Created new glyph atlas #%d (%dx%d, Grayscale)", current_atlas_idx_, atlas_width_, atlas_height_);
                 }
@@ -397,7 +407,7 @@ void main() {
                       spot,
                       WHITE);
 
-            UpdateTextureRec(atlas_textures_[current_atlas_idx_], spot, bitmapData);
+            atlasStorage_->UpdatePage(atlas_textures_[current_atlas_idx_], spot, bitmapData);
 
             current_atlas_pen_pos_.x += width;
             current_atlas_max_row_height_ = std::max(current_atlas_max_row_height_, (float)height);
@@ -406,7 +416,8 @@ void main() {
 
         void finalizeLine(TextBlock& textBlock, LineLayoutInfo& currentLineLayout, float finalPenXNoIndent, float& currentLineBoxTopY, const ScaledFontMetrics& paraDefaultMetrics, bool isCurrentLineFirstInPara, uint32_t nextCharGlobalByteIndex) {
             currentLineLayout.lineWidth = finalPenXNoIndent;
-            textBlock.overallBounds.width = std::max(textBlock.overallBounds.width, finalPenXNoIndent + (isCurrentLineFirstInPara ? textBlock.paragraphStyleUsed.firstLineIndent : 0.0f));
+            currentLineLayout.lineExtentX = finalPenXNoIndent + (isCurrentLineFirstInPara ? textBlock.paragraphStyleUsed.firstLineIndent : 0.0f);
+            textBlock.overallBounds.width = std::max(textBlock.overallBounds.width, currentLineLayout.lineExtentX);
             currentLineLayout.sourceTextByteEndIndexInBlockText = nextCharGlobalByteIndex;
 
             float contentActualHeight = currentLineLayout.maxContentAscent + currentLineLayout.maxContentDescent;
@@ -463,13 +474,18 @@ void main() {
         }
 
     public:
-        STBTextEngineImpl() :
+        explicit STBTextEngineImpl(std::unique_ptr<IAtlasStorage> atlasStorage) :
                 glyph_cache_capacity_(512),
+                atlasStorage_(atlasStorage ? std::move(atlasStorage) : std::make_unique<GpuAtlasStorage>()),
                 atlas_width_(1024),
                 atlas_height_(1024),
                 atlas_type_hint_(GlyphAtlasType::SDF_BITMAP)
         {
-            // Shader loading and uniform location retrieval
+            // Shader loading and uniform location retrieval (no GL context with a headless atlas storage)
+            if (!atlasStorage_->HasGpu()) {
+                TraceLog(LOG_INFO, "STBTextEngine: Headless atlas storage, drawing is disabled.");
+                return;
+            }
             sdfShader_ = LoadShaderFromMemory(nullptr, sdfMasterFragmentShaderSrc);
             if (sdfShader_.id == rlGetShaderIdDefault()) {
                 TraceLog(LOG_WARNING, "STBTextEngine: SDF shader failed to load.");
@@ -565,6 +581,7 @@ void main() {
 
         void UnloadFont(FontId fontId) override {
             if (loadedFonts_.erase(fontId) > 0) {
+                ClearLayoutCache();
                 auto lru_it = lru_glyph_list_.begin();
                 while (lru_it != lru_glyph_list_.end()) {
                     if (lru_it->fontId == fontId) {
@@ -591,6 +608,7 @@ void main() {
 
         void SetDefaultFont(FontId fontId) override {
             if (IsFontValid(fontId) || fontId == INVALID_FONT_ID) {
+                if (defaultFontId_ != fontId) ClearLayoutCache();
                 defaultFontId_ = fontId;
             } else {
                 TraceLog(LOG_WARNING, "STBTextEngine: Attempted to set invalid FontID %d as default.", fontId);
@@ -649,10 +667,16 @@ void main() {
         // RaylibSDFText.cpp -> STBTextEngineImpl 类内部
 // 替换掉之前的 LayoutStyledText 方法
 
-        TextBlock LayoutStyledText(const std::vector<TextSpan>& spans, const ParagraphStyle& paraStyle) override {
-            TextBlock textBlock;
+        using ITextEngine::LayoutStyledText;
+        using ITextEngine::LayoutStyledTextCached;
+
+        TextBlock LayoutStyledText(std::shared_ptr<const std::vector<TextSpan>> spansSnapshot, const ParagraphStyle& paraStyle,
+                                   std::pmr::memory_resource* resultResource = nullptr) override {
+            if (!spansSnapshot) spansSnapshot = std::make_shared<const std::vector<TextSpan>>();
+            const std::vector<TextSpan>& spans = *spansSnapshot; // TextBlock 直接持有快照，不复制 spans
+            TextBlock textBlock(resultResource);
             textBlock.paragraphStyleUsed = paraStyle;
-            textBlock.sourceSpansCopied = spans;
+            textBlock.sourceSpans = spansSnapshot;
 
             // --- 1. 确定段落主字体和字号及其度量 ---
             FontId paraPrimaryFontId = paraStyle.defaultCharacterStyle.fontId;
@@ -956,16 +980,20 @@ void main() {
                 currentLineBoxTopY += emptyLine.lineBoxHeight;
             }
 
+            RebuildLineIndex(textBlock);
+            AssignElementSourceByteOffsets(textBlock);
+
             // --- 6. Calculate overall bounds ---
             if (!textBlock.lines.empty()) {
                 textBlock.overallBounds.x = 0;
                 textBlock.overallBounds.y = textBlock.lines.front().lineBoxY;
                 float maxVisualLineWidth = 0;
                 for(size_t i=0; i < textBlock.lines.size(); ++i) {
-                    const auto& l = textBlock.lines[i];
+                    auto& l = textBlock.lines[i];
                     bool isActualFirst = (l.sourceTextByteStartIndexInBlockText == 0) ||
                                          (l.sourceTextByteStartIndexInBlockText > 0 && !textBlock.sourceTextConcatenated.empty() && l.sourceTextByteStartIndexInBlockText <= textBlock.sourceTextConcatenated.length() && textBlock.sourceTextConcatenated[l.sourceTextByteStartIndexInBlockText-1] == '\n');
-                    maxVisualLineWidth = std::max(maxVisualLineWidth, l.lineWidth + (isActualFirst ? paraStyle.firstLineIndent : 0.0f));
+                    l.lineExtentX = l.lineWidth + (isActualFirst ? paraStyle.firstLineIndent : 0.0f);
+                    maxVisualLineWidth = std::max(maxVisualLineWidth, l.lineExtentX);
                 }
                 textBlock.overallBounds.width = maxVisualLineWidth;
                 textBlock.overallBounds.height = currentLineBoxTopY - textBlock.lines.front().lineBoxY; // currentLineBoxTopY 现在是下一行的起始Y
@@ -978,7 +1006,8 @@ void main() {
 // 辅助函数 finalizeLine 的签名也需要匹配调用时传递的参数
         void finalizeLine(TextBlock& textBlock, LineLayoutInfo& currentLineLayout, float finalPenXNoIndent, float& currentLineBoxTopY, const ScaledFontMetrics& paraDefaultMetrics, bool isCurrentLineFirstInPara, uint32_t nextCharGlobalByteIndex, float paraMainFontSize) {
             currentLineLayout.lineWidth = finalPenXNoIndent;
-            textBlock.overallBounds.width = std::max(textBlock.overallBounds.width, finalPenXNoIndent + (isCurrentLineFirstInPara ? textBlock.paragraphStyleUsed.firstLineIndent : 0.0f));
+            currentLineLayout.lineExtentX = finalPenXNoIndent + (isCurrentLineFirstInPara ? textBlock.paragraphStyleUsed.firstLineIndent : 0.0f);
+            textBlock.overallBounds.width = std::max(textBlock.overallBounds.width, currentLineLayout.lineExtentX);
             currentLineLayout.sourceTextByteEndIndexInBlockText = nextCharGlobalByteIndex;
 
             float contentActualHeight = currentLineLayout.maxContentAscent + currentLineLayout.maxContentDescent;
@@ -1011,8 +1040,133 @@ void main() {
             currentLineLayout.maxContentDescent = paraDefaultMetrics.descent;
         }
 
+        bool Rewrap(TextBlock& textBlock, float newWrapWidth, HorizontalAlignment newAlignment) override {
+            // STB 后端没有独立的整形阶段，逐字符布局本身就很便宜：直接用新样式重新布局
+            if (!textBlock.sourceSpans) return false;
+            ParagraphStyle newStyle = textBlock.paragraphStyleUsed;
+            newStyle.wrapWidth = newWrapWidth;
+            newStyle.alignment = newAlignment;
+            std::shared_ptr<const std::vector<TextSpan>> spans = textBlock.sourceSpans.Snapshot();
+            textBlock = LayoutStyledText(spans, newStyle, textBlock.elements.get_allocator().resource());
+            return false;
+        }
+
+        std::shared_ptr<const TextBlock> LayoutStyledTextCached(const std::vector<TextSpan>& spans, const ParagraphStyle& paraStyle) override {
+            return layoutCached(spans, nullptr, paraStyle);
+        }
+
+        std::shared_ptr<const TextBlock> LayoutStyledTextCached(std::shared_ptr<const std::vector<TextSpan>> spans, const ParagraphStyle& paraStyle) override {
+            if (!spans) spans = std::make_shared<const std::vector<TextSpan>>();
+            const std::vector<TextSpan>& spanList = *spans;
+            return layoutCached(spanList, std::move(spans), paraStyle);
+        }
+
+        // spansSnapshot 可以为空：只有未命中时才为 spans 生成快照
+        std::shared_ptr<const TextBlock> layoutCached(const std::vector<TextSpan>& spans, std::shared_ptr<const std::vector<TextSpan>> spansSnapshot,
+                                                      const ParagraphStyle& paraStyle) {
+            auto layoutSnapshot = [&]() {
+                if (!spansSnapshot) spansSnapshot = std::make_shared<const std::vector<TextSpan>>(spans);
+                return std::make_shared<const TextBlock>(LayoutStyledText(std::move(spansSnapshot), paraStyle));
+            };
+            if (layout_cache_capacity_ == 0) {
+                layout_cache_stats_.misses++;
+                return layoutSnapshot();
+            }
+            size_t hash = HashLayoutInput(spans, paraStyle);
+            auto cacheIt = layout_cache_map_.find(hash);
+            if (cacheIt != layout_cache_map_.end()) {
+                const TextBlock& cachedBlock = *cacheIt->second->block;
+                if (IsSameLayoutInput(spans, paraStyle, cachedBlock.GetSourceSpans(), cachedBlock.paragraphStyleUsed)) {
+                    layout_cache_stats_.hits++;
+                    lru_layout_list_.splice(lru_layout_list_.begin(), lru_layout_list_, cacheIt->second);
+                    return cacheIt->second->block;
+                }
+                // 哈希碰撞：新布局占用该槽位
+                lru_layout_list_.erase(cacheIt->second);
+                layout_cache_map_.erase(cacheIt);
+            }
+            layout_cache_stats_.misses++;
+            auto block = layoutSnapshot();
+            while (layout_cache_map_.size() >= layout_cache_capacity_ && !lru_layout_list_.empty()) {
+                layout_cache_map_.erase(lru_layout_list_.back().hash);
+                lru_layout_list_.pop_back();
+                layout_cache_stats_.evictions++;
+            }
+            lru_layout_list_.push_front({hash, block});
+            layout_cache_map_[hash] = lru_layout_list_.begin();
+            return block;
+        }
+
+        void SetLayoutCacheCapacity(size_t maxEntries) override {
+            layout_cache_capacity_ = maxEntries;
+            while (layout_cache_map_.size() > layout_cache_capacity_ && !lru_layout_list_.empty()) {
+                layout_cache_map_.erase(lru_layout_list_.back().hash);
+                lru_layout_list_.pop_back();
+                layout_cache_stats_.evictions++;
+            }
+        }
+
+        void ClearLayoutCache() override {
+            layout_cache_map_.clear();
+            lru_layout_list_.clear();
+        }
+
+        LayoutCacheStats GetLayoutCacheStats() const override {
+            LayoutCacheStats stats = layout_cache_stats_;
+            stats.entries = layout_cache_map_.size();
+            stats.capacity = layout_cache_capacity_;
+            return stats;
+        }
+
+        TextMeasurement MeasureStyledText(const std::vector<TextSpan>& spans, const ParagraphStyle& paraStyle) override {
+            // STB 后端在每个字符前都可以换行：一次布局给出 size / lineCount，固有宽度直接从这次布局的元素推出
+            TextMeasurement measurement;
+            TextBlock block = LayoutStyledText(std::make_shared<const std::vector<TextSpan>>(spans), paraStyle);
+            measurement.size = {block.overallBounds.width, block.overallBounds.height};
+            measurement.lineCount = block.lines.size();
+
+            // min-content: 每个元素单独成行时最宽的一个；max-content: 按硬换行分组，把软换行拆开的行宽连同
+            // 断开处丢掉的字距对加回去 (行首制表符的宽度与不换行时不同，这里不做修正)
+            float minContent = 0.0f, maxContent = 0.0f, hardLineWidth = 0.0f;
+            const PositionedGlyph* prevLineLastGlyph = nullptr;
+            for (const auto& line : block.lines) {
+                uint32_t lineStart = line.sourceTextByteStartIndexInBlockText;
+                float indent = (lineStart == 0) ? paraStyle.firstLineIndent : 0.0f;
+                if (lineStart == 0 || block.sourceTextConcatenated[lineStart - 1] == '\n') {
+                    maxContent = std::max(maxContent, hardLineWidth);
+                    hardLineWidth = indent;
+                } else if (prevLineLastGlyph && line.numElementsInLine > 0) {
+                    const auto* firstGlyph = std::get_if<PositionedGlyph>(&block.elements[line.firstElementIndexInBlockElements]);
+                    if (firstGlyph && firstGlyph->sourceFont == prevLineLastGlyph->sourceFont && IsFontValid(firstGlyph->sourceFont) &&
+                        fabsf(firstGlyph->sourceSize - prevLineLastGlyph->sourceSize) < 0.1f) {
+                        hardLineWidth += stbtt_GetCodepointKernAdvance(&loadedFonts_.at(firstGlyph->sourceFont).fontInfo, prevLineLastGlyph->glyphId, firstGlyph->glyphId) *
+                                         GetScaledFontMetrics(firstGlyph->sourceFont, firstGlyph->sourceSize).scale;
+                    }
+                }
+                hardLineWidth += line.lineWidth;
+                prevLineLastGlyph = nullptr;
+                for (size_t i = 0; i < line.numElementsInLine; ++i) {
+                    const auto& element = block.elements[line.firstElementIndexInBlockElements + i];
+                    const auto* glyph = std::get_if<PositionedGlyph>(&element);
+                    float advance = glyph ? glyph->xAdvance : std::get<PositionedImage>(element).penAdvanceX;
+                    minContent = std::max(minContent, (lineStart == 0 && i == 0 ? indent : 0.0f) + advance);
+                    prevLineLastGlyph = glyph;
+                }
+            }
+            measurement.minContentWidth = minContent;
+            measurement.maxContentWidth = std::max(std::max(maxContent, hardLineWidth), minContent);
+            return measurement;
+        }
+
+        // 本后端没有预生成网格，DrawTextBlock 总是立即绘制；这一对调用只为满足接口
+        void BeginTextFrame() override {}
+        void EndTextFrame() override {}
+        bool IsTextFrameActive() const override { return false; } // No batching: DrawTextBlock always draws immediately
+
         void DrawTextBlock(const TextBlock& textBlock, const Matrix& transform, Color globalTint, const Rectangle* clipRect) override {
+            if (!atlasStorage_->HasGpu()) return;
             if (textBlock.elements.empty() && textBlock.lines.empty()) return;
+            if (clipRect && (clipRect->width <= 0 || clipRect->height <= 0)) return;
 
             bool useSDFShader = (sdfShader_.id > 0 && sdfShader_.id != rlGetShaderIdDefault());
 
@@ -1020,8 +1174,19 @@ void main() {
             rlPushMatrix();
             rlMultMatrixf(MatrixToFloat(transform));
 
+            // clipRect is in the space transform maps into; the scissor clips exactly, lines outside it are skipped
             bool scissorMode = false;
-            // if (clipRect) { BeginScissorMode((int)clipRect->x, (int)clipRect->y, (int)clipRect->width, (int)clipRect->height); scissorMode = true; }
+            size_t firstLine = 0, endLine = textBlock.lines.size();
+            if (clipRect) {
+                BeginScissorMode((int)floorf(clipRect->x), (int)floorf(clipRect->y),
+                                 (int)ceilf(clipRect->x + clipRect->width) - (int)floorf(clipRect->x),
+                                 (int)ceilf(clipRect->y + clipRect->height) - (int)floorf(clipRect->y));
+                scissorMode = true;
+                Rectangle clipInBlock;
+                if (GetClipBoundsInBlockSpace(transform, *clipRect, clipInBlock)) {
+                    FindLineRangeForYSpan(textBlock, clipInBlock.y, clipInBlock.y + clipInBlock.height, firstLine, endLine);
+                }
+            }
 
 
             if (useSDFShader) {
@@ -1034,8 +1199,9 @@ void main() {
                 BatchRenderState currentBatchState;
                 bool isFirstElementInBatch = true;
 
-                for (const auto& line : textBlock.lines) {
-                    float lineVisualBaselineY = line.lineBoxY + line.baselineYInBox;
+                for (size_t lineIdx = firstLine; lineIdx < endLine; ++lineIdx) {
+                    const auto& line = textBlock.lines[lineIdx];
+                    float lineVisualBaselineY = GetLineTopY(textBlock, line) + line.baselineYInBox;
 
                     float lineDrawStartX = 0.0f;
                     if (textBlock.paragraphStyleUsed.alignment == HorizontalAlignment::RIGHT) {
@@ -1043,15 +1209,15 @@ void main() {
                     } else if (textBlock.paragraphStyleUsed.alignment == HorizontalAlignment::CENTER) {
                         lineDrawStartX = ((textBlock.paragraphStyleUsed.wrapWidth > 0 ? textBlock.paragraphStyleUsed.wrapWidth : line.lineWidth) - line.lineWidth) / 2.0f;
                     }
-                    bool isLineActuallyFirstInPara = (line.sourceTextByteStartIndexInBlockText == 0) ||
-                                                     (line.sourceTextByteStartIndexInBlockText > 0 && !textBlock.sourceTextConcatenated.empty() && textBlock.sourceTextConcatenated[line.sourceTextByteStartIndexInBlockText-1] == '\n');
+                    bool isLineActuallyFirstInPara = (GetLineByteStart(textBlock, line) == 0) ||
+                                                     (GetLineByteStart(textBlock, line) > 0 && !textBlock.sourceTextConcatenated.empty() && textBlock.sourceTextConcatenated[GetLineByteStart(textBlock, line)-1] == '\n');
                     if (isLineActuallyFirstInPara) {
                         lineDrawStartX += textBlock.paragraphStyleUsed.firstLineIndent;
                     }
 
 
                     for (size_t i = 0; i < line.numElementsInLine; ++i) {
-                        const auto& elementVariant = textBlock.elements[line.firstElementIndexInBlockElements + i];
+                        const auto& elementVariant = textBlock.elements[GetLineFirstElementIndex(textBlock, line) + i];
 
                         if (elementVariant.index() == 0) { // PositionedGlyph
                             const auto& glyph = std::get<PositionedGlyph>(elementVariant);
@@ -1205,17 +1371,18 @@ void main() {
                 EndShaderMode();
             } else {
                 TraceLog(LOG_WARNING, "STBTextEngine: SDF Shader not available/functional for DrawTextBlock. Glyphs will not be rendered correctly.");
-                for (const auto& line : textBlock.lines) {
-                    float lineVisualBaselineY = line.lineBoxY + line.baselineYInBox;
+                for (size_t lineIdx = firstLine; lineIdx < endLine; ++lineIdx) {
+                    const auto& line = textBlock.lines[lineIdx];
+                    float lineVisualBaselineY = GetLineTopY(textBlock, line) + line.baselineYInBox;
                     float lineDrawStartX = 0.0f;
-                    bool isLineActuallyFirstInPara = (line.sourceTextByteStartIndexInBlockText == 0) ||
-                                                     (line.sourceTextByteStartIndexInBlockText > 0 && !textBlock.sourceTextConcatenated.empty() && textBlock.sourceTextConcatenated[line.sourceTextByteStartIndexInBlockText-1] == '\n');
+                    bool isLineActuallyFirstInPara = (GetLineByteStart(textBlock, line) == 0) ||
+                                                     (GetLineByteStart(textBlock, line) > 0 && !textBlock.sourceTextConcatenated.empty() && textBlock.sourceTextConcatenated[GetLineByteStart(textBlock, line)-1] == '\n');
                     if (isLineActuallyFirstInPara) {
                         lineDrawStartX += textBlock.paragraphStyleUsed.firstLineIndent;
                     }
 
                     for (size_t i = 0; i < line.numElementsInLine; ++i) {
-                        const auto& elementVariant = textBlock.elements[line.firstElementIndexInBlockElements + i];
+                        const auto& elementVariant = textBlock.elements[GetLineFirstElementIndex(textBlock, line) + i];
                         if (elementVariant.index() == 1) { // PositionedImage
                             const auto& img = std::get<PositionedImage>(elementVariant);
                             if (img.imageParams.texture.id > 0) {
@@ -1235,7 +1402,7 @@ void main() {
         // --- Glyph Cache Management ---
         void ClearGlyphCache() override {
             for (Texture2D tex : atlas_textures_) {
-                if (tex.id > 0) UnloadTexture(tex);
+                atlasStorage_->ReleasePage(tex);
             }
             atlas_textures_.clear();
             for (Image img : atlas_images_) {
@@ -1245,12 +1412,22 @@ void main() {
 
             glyph_cache_map_.clear();
             lru_glyph_list_.clear();
+            ClearLayoutCache(); // 缓存的 TextBlock 引用了图集中的字形矩形
             current_atlas_idx_ = -1;
             current_atlas_pen_pos_ = {0, 0};
             current_atlas_max_row_height_ = 0.0f;
             TraceLog(LOG_INFO, "STBTextEngine: Glyph cache and atlases cleared.");
         }
 
+        void RenderTextBlockToImage(const TextBlock&, Image&, const Matrix&, Color) override {
+            TraceLog(LOG_WARNING, "STBTextEngine: RenderTextBlockToImage is not supported by this backend.");
+        }
+
+        void SetGlyphRenderPath(GlyphRenderPath path) override {
+            if (path != GlyphRenderPath::VERTEX_MESH) TraceLog(LOG_INFO, "STBTextEngine: Instanced glyph rendering is not supported, using the vertex path.");
+        }
+        GlyphRenderPath GetGlyphRenderPath() const override { return GlyphRenderPath::VERTEX_MESH; }
+
         void SetGlyphAtlasOptions(size_t maxGlyphsEstimate, int atlasWidth, int atlasHeight, GlyphAtlasType typeHint) override {
             if (!atlas_textures_.empty() || !atlas_images_.empty()) {
                 TraceLog(LOG_INFO, "STBTextEngine: Atlas options changed, clearing existing atlases and cache.");
@@ -1307,121 +1484,110 @@ void main() {
                 return cInfo;
             }
 
-            for (size_t lineIdx = 0; lineIdx < textBlock.lines.size(); ++lineIdx) {
-                const auto& line = textBlock.lines[lineIdx];
-                bool isLastLine = (lineIdx == textBlock.lines.size() - 1);
+            // 只需检查行索引二分得到的候选行；不匹配时落到下面的末行兜底
+            const size_t lineIdx = FindLineIndexForByteOffset(textBlock, cInfo.byteOffset);
+            const auto& line = textBlock.lines[lineIdx];
+            bool isLastLine = (lineIdx == textBlock.lines.size() - 1);
 
-                if ( (cInfo.byteOffset >= line.sourceTextByteStartIndexInBlockText && cInfo.byteOffset < line.sourceTextByteEndIndexInBlockText) ||
-                     (cInfo.byteOffset == line.sourceTextByteEndIndexInBlockText && (isLastLine || (lineIdx + 1 < textBlock.lines.size() && cInfo.byteOffset < textBlock.lines[lineIdx+1].sourceTextByteStartIndexInBlockText )))
-                        ) {
-                    cInfo.lineIndex = lineIdx;
-                    cInfo.visualPosition.y = line.lineBoxY + line.baselineYInBox;
-                    cInfo.isAtLogicalLineEnd = (cInfo.byteOffset == line.sourceTextByteEndIndexInBlockText);
+            if ( (cInfo.byteOffset >= GetLineByteStart(textBlock, line) && cInfo.byteOffset < GetLineByteEnd(textBlock, line)) ||
+                 (cInfo.byteOffset == GetLineByteEnd(textBlock, line) && (isLastLine || (lineIdx + 1 < textBlock.lines.size() && cInfo.byteOffset < GetLineByteStart(textBlock, textBlock.lines[lineIdx+1]) )))
+                    ) {
+                cInfo.lineIndex = lineIdx;
+                cInfo.visualPosition.y = GetLineTopY(textBlock, line) + line.baselineYInBox;
+                cInfo.isAtLogicalLineEnd = (cInfo.byteOffset == GetLineByteEnd(textBlock, line));
 
-                    float lineDrawStartX = 0.0f;
-                    if (textBlock.paragraphStyleUsed.alignment == HorizontalAlignment::RIGHT) {
-                        lineDrawStartX = (textBlock.paragraphStyleUsed.wrapWidth > 0 ? textBlock.paragraphStyleUsed.wrapWidth : line.lineWidth) - line.lineWidth;
-                    } else if (textBlock.paragraphStyleUsed.alignment == HorizontalAlignment::CENTER) {
-                        lineDrawStartX = ((textBlock.paragraphStyleUsed.wrapWidth > 0 ? textBlock.paragraphStyleUsed.wrapWidth : line.lineWidth) - line.lineWidth) / 2.0f;
-                    }
-                    bool isLineActuallyFirstInPara = (line.sourceTextByteStartIndexInBlockText == 0) ||
-                                                     (line.sourceTextByteStartIndexInBlockText > 0 && !textBlock.sourceTextConcatenated.empty() && textBlock.sourceTextConcatenated[line.sourceTextByteStartIndexInBlockText-1] == '\n');
-                    if (isLineActuallyFirstInPara) {
-                        lineDrawStartX += textBlock.paragraphStyleUsed.firstLineIndent;
-                    }
+                float lineDrawStartX = 0.0f;
+                if (textBlock.paragraphStyleUsed.alignment == HorizontalAlignment::RIGHT) {
+                    lineDrawStartX = (textBlock.paragraphStyleUsed.wrapWidth > 0 ? textBlock.paragraphStyleUsed.wrapWidth : line.lineWidth) - line.lineWidth;
+                } else if (textBlock.paragraphStyleUsed.alignment == HorizontalAlignment::CENTER) {
+                    lineDrawStartX = ((textBlock.paragraphStyleUsed.wrapWidth > 0 ? textBlock.paragraphStyleUsed.wrapWidth : line.lineWidth) - line.lineWidth) / 2.0f;
+                }
+                bool isLineActuallyFirstInPara = (GetLineByteStart(textBlock, line) == 0) ||
+                                                 (GetLineByteStart(textBlock, line) > 0 && !textBlock.sourceTextConcatenated.empty() && textBlock.sourceTextConcatenated[GetLineByteStart(textBlock, line)-1] == '\n');
+                if (isLineActuallyFirstInPara) {
+                    lineDrawStartX += textBlock.paragraphStyleUsed.firstLineIndent;
+                }
 
-                    bool foundElementForCursor = false;
-                    for (size_t elIdx = 0; elIdx < line.numElementsInLine; ++elIdx) {
-                        const auto& elementVariant = textBlock.elements[line.firstElementIndexInBlockElements + elIdx];
-                        uint32_t elSrcSpanIdx = 0;
-                        uint32_t elSrcByteOffsetInSpan = 0;
-                        uint16_t elSrcNumBytesInSpan = 0;
-                        float elAdvanceX = 0;
-                        float elPosX = 0;
-                        ScaledFontMetrics elMetrics;
+                bool foundElementForCursor = false;
+                for (size_t elIdx = 0; elIdx < line.numElementsInLine; ++elIdx) {
+                    const auto& elementVariant = textBlock.elements[GetLineFirstElementIndex(textBlock, line) + elIdx];
+                    uint16_t elSrcNumBytesInSpan = 0;
+                    float elAdvanceX = 0;
+                    float elPosX = 0;
+                    ScaledFontMetrics elMetrics;
+
+                    if (elementVariant.index() == 0) { // PositionedGlyph
+                        const auto& glyph = std::get<PositionedGlyph>(elementVariant);
+                        elSrcNumBytesInSpan = glyph.numSourceCharBytesInSpan;
+                        elAdvanceX = glyph.xAdvance;
+                        elPosX = glyph.position.x;
+                        if(IsFontValid(glyph.sourceFont)) elMetrics = GetScaledFontMetrics(glyph.sourceFont, glyph.sourceSize);
+                        else elMetrics = defaultMetrics;
+                    } else { // PositionedImage
+                        const auto& img = std::get<PositionedImage>(elementVariant);
+                        elSrcNumBytesInSpan = img.numSourceCharBytesInSpan;
+                        elAdvanceX = img.penAdvanceX;
+                        elPosX = img.position.x;
+                        elMetrics.ascent = img.ascent; elMetrics.descent = img.descent;
+                    }
 
-                        if (elementVariant.index() == 0) { // PositionedGlyph
-                            const auto& glyph = std::get<PositionedGlyph>(elementVariant);
-                            elSrcSpanIdx = glyph.sourceSpanIndex;
-                            elSrcByteOffsetInSpan = glyph.sourceCharByteOffsetInSpan;
-                            elSrcNumBytesInSpan = glyph.numSourceCharBytesInSpan;
-                            elAdvanceX = glyph.xAdvance;
-                            elPosX = glyph.position.x;
-                            if(IsFontValid(glyph.sourceFont)) elMetrics = GetScaledFontMetrics(glyph.sourceFont, glyph.sourceSize);
-                            else elMetrics = defaultMetrics;
-                        } else { // PositionedImage
-                            const auto& img = std::get<PositionedImage>(elementVariant);
-                            elSrcSpanIdx = img.sourceSpanIndex;
-                            elSrcByteOffsetInSpan = img.sourceCharByteOffsetInSpan;
-                            elSrcNumBytesInSpan = img.numSourceCharBytesInSpan;
-                            elAdvanceX = img.penAdvanceX;
-                            elPosX = img.position.x;
-                            elMetrics.ascent = img.ascent; elMetrics.descent = img.descent;
-                        }
+                    uint32_t elStartByteInBlock = GetElementSourceByteStart(textBlock, elementVariant);
 
-                        uint32_t elStartByteInBlock = 0;
-                        for(uint32_t k=0; k < elSrcSpanIdx; ++k) {
-                            if (textBlock.sourceSpansCopied[k].style.isImage && textBlock.sourceSpansCopied[k].text.empty()) elStartByteInBlock += 3;
-                            else elStartByteInBlock += textBlock.sourceSpansCopied[k].text.length();
-                        }
-                        elStartByteInBlock += elSrcByteOffsetInSpan;
-
-                        if (cInfo.byteOffset >= elStartByteInBlock && cInfo.byteOffset < elStartByteInBlock + elSrcNumBytesInSpan) {
-                            cInfo.visualPosition.x = lineDrawStartX + elPosX;
-                            if (preferLeadingEdge) {
-                                cInfo.isTrailingEdge = false;
+                    if (cInfo.byteOffset >= elStartByteInBlock && cInfo.byteOffset < elStartByteInBlock + elSrcNumBytesInSpan) {
+                        cInfo.visualPosition.x = lineDrawStartX + elPosX;
+                        if (preferLeadingEdge) {
+                            cInfo.isTrailingEdge = false;
+                        } else {
+                            const char* p_temp_cstr = textBlock.sourceTextConcatenated.c_str();
+                            const char* charStart = p_temp_cstr + cInfo.byteOffset;
+                            int bytesForThisChar = 0;
+                            GetNextCodepointFromUTF8(&charStart, &bytesForThisChar);
+                            if ( (cInfo.byteOffset - elStartByteInBlock) >= (uint32_t)(bytesForThisChar / 2) ) {
+                                cInfo.visualPosition.x = lineDrawStartX + elPosX + elAdvanceX;
+                                cInfo.isTrailingEdge = true;
                             } else {
-                                const char* p_temp_cstr = textBlock.sourceTextConcatenated.c_str();
-                                const char* charStart = p_temp_cstr + cInfo.byteOffset;
-                                int bytesForThisChar = 0;
-                                GetNextCodepointFromUTF8(&charStart, &bytesForThisChar);
-                                if ( (cInfo.byteOffset - elStartByteInBlock) >= (uint32_t)(bytesForThisChar / 2) ) {
-                                    cInfo.visualPosition.x = lineDrawStartX + elPosX + elAdvanceX;
-                                    cInfo.isTrailingEdge = true;
-                                } else {
-                                    cInfo.isTrailingEdge = false;
-                                }
+                                cInfo.isTrailingEdge = false;
                             }
-                            cInfo.cursorAscent = elMetrics.ascent;
-                            cInfo.cursorDescent = elMetrics.descent;
-                            foundElementForCursor = true;
-                            break;
-                        } else if (cInfo.byteOffset == elStartByteInBlock + elSrcNumBytesInSpan) {
-                            cInfo.visualPosition.x = lineDrawStartX + elPosX + elAdvanceX;
-                            cInfo.isTrailingEdge = true;
-                            cInfo.cursorAscent = elMetrics.ascent;
-                            cInfo.cursorDescent = elMetrics.descent;
-                            foundElementForCursor = true;
-                            if (elIdx == line.numElementsInLine - 1 || preferLeadingEdge) break;
                         }
+                        cInfo.cursorAscent = elMetrics.ascent;
+                        cInfo.cursorDescent = elMetrics.descent;
+                        foundElementForCursor = true;
+                        break;
+                    } else if (cInfo.byteOffset == elStartByteInBlock + elSrcNumBytesInSpan) {
+                        cInfo.visualPosition.x = lineDrawStartX + elPosX + elAdvanceX;
+                        cInfo.isTrailingEdge = true;
+                        cInfo.cursorAscent = elMetrics.ascent;
+                        cInfo.cursorDescent = elMetrics.descent;
+                        foundElementForCursor = true;
+                        if (elIdx == line.numElementsInLine - 1 || preferLeadingEdge) break;
                     }
+                }
 
-                    if (!foundElementForCursor) {
-                        if(cInfo.byteOffset == line.sourceTextByteStartIndexInBlockText) {
-                            cInfo.visualPosition.x = lineDrawStartX;
-                            cInfo.isTrailingEdge = false;
-                        } else {
-                            cInfo.visualPosition.x = lineDrawStartX + line.lineWidth;
-                            cInfo.isTrailingEdge = true;
-                        }
-                        cInfo.cursorAscent = (line.maxContentAscent > 0.001f) ? line.maxContentAscent : defaultMetrics.ascent;
-                        cInfo.cursorDescent = (line.maxContentDescent > 0.001f) ? line.maxContentDescent : defaultMetrics.descent;
+                if (!foundElementForCursor) {
+                    if(cInfo.byteOffset == GetLineByteStart(textBlock, line)) {
+                        cInfo.visualPosition.x = lineDrawStartX;
+                        cInfo.isTrailingEdge = false;
+                    } else {
+                        cInfo.visualPosition.x = lineDrawStartX + line.lineWidth;
+                        cInfo.isTrailingEdge = true;
                     }
-                    cInfo.cursorHeight = cInfo.cursorAscent + cInfo.cursorDescent;
-                    if (cInfo.cursorHeight < 0.001f) cInfo.cursorHeight = defaultMetrics.ascent + defaultMetrics.descent;
-                    return cInfo;
+                    cInfo.cursorAscent = (line.maxContentAscent > 0.001f) ? line.maxContentAscent : defaultMetrics.ascent;
+                    cInfo.cursorDescent = (line.maxContentDescent > 0.001f) ? line.maxContentDescent : defaultMetrics.descent;
                 }
+                cInfo.cursorHeight = cInfo.cursorAscent + cInfo.cursorDescent;
+                if (cInfo.cursorHeight < 0.001f) cInfo.cursorHeight = defaultMetrics.ascent + defaultMetrics.descent;
+                return cInfo;
             }
 
             if (cInfo.lineIndex == -1 && !textBlock.lines.empty()) {
                 cInfo.lineIndex = textBlock.lines.size() - 1;
                 const auto& lastLine = textBlock.lines.back();
-                cInfo.visualPosition.y = lastLine.lineBoxY + lastLine.baselineYInBox;
+                cInfo.visualPosition.y = GetLineTopY(textBlock, lastLine) + lastLine.baselineYInBox;
                 float lineDrawStartX = 0.0f;
                 if (textBlock.paragraphStyleUsed.alignment == HorizontalAlignment::RIGHT) lineDrawStartX = (textBlock.paragraphStyleUsed.wrapWidth > 0 ? textBlock.paragraphStyleUsed.wrapWidth : lastLine.lineWidth) - lastLine.lineWidth;
                 else if (textBlock.paragraphStyleUsed.alignment == HorizontalAlignment::CENTER) lineDrawStartX = ((textBlock.paragraphStyleUsed.wrapWidth > 0 ? textBlock.paragraphStyleUsed.wrapWidth : lastLine.lineWidth) - lastLine.lineWidth) / 2.0f;
-                bool isLastLineActuallyFirstInPara = (lastLine.sourceTextByteStartIndexInBlockText == 0) ||
-                                                     (lastLine.sourceTextByteStartIndexInBlockText > 0 && !textBlock.sourceTextConcatenated.empty() && textBlock.sourceTextConcatenated[lastLine.sourceTextByteStartIndexInBlockText-1] == '\n');
+                bool isLastLineActuallyFirstInPara = (GetLineByteStart(textBlock, lastLine) == 0) ||
+                                                     (GetLineByteStart(textBlock, lastLine) > 0 && !textBlock.sourceTextConcatenated.empty() && textBlock.sourceTextConcatenated[GetLineByteStart(textBlock, lastLine)-1] == '\n');
                 if (isLastLineActuallyFirstInPara) {
                     lineDrawStartX += textBlock.paragraphStyleUsed.firstLineIndent;
                 }
@@ -1455,11 +1621,12 @@ void main() {
             int targetLineIdx = 0;
             float minDistYToLineCenter = 1e9f;
 
-            for (size_t i = 0; i < textBlock.lines.size(); ++i) {
+            const size_t lineAtOrAboveY = FindLineIndexForY(textBlock, positionInBlockLocalCoords.y); // 只有它和下一行可能最近
+            for (size_t i = lineAtOrAboveY; i < std::min(lineAtOrAboveY + 2, textBlock.lines.size()); ++i) {
                 const auto& line = textBlock.lines[i];
-                float lineCenterY = line.lineBoxY + line.lineBoxHeight / 2.0f;
+                float lineCenterY = GetLineTopY(textBlock, line) + line.lineBoxHeight / 2.0f;
                 float distY = fabsf(positionInBlockLocalCoords.y - lineCenterY);
-                if (positionInBlockLocalCoords.y >= line.lineBoxY && positionInBlockLocalCoords.y < line.lineBoxY + line.lineBoxHeight) {
+                if (positionInBlockLocalCoords.y >= GetLineTopY(textBlock, line) && positionInBlockLocalCoords.y < GetLineTopY(textBlock, line) + line.lineBoxHeight) {
                     targetLineIdx = i;
                     minDistYToLineCenter = -1.0f;
                     break;
@@ -1471,7 +1638,7 @@ void main() {
             }
 
             const auto& line = textBlock.lines[targetLineIdx];
-            uint32_t closestByteOffset = line.sourceTextByteStartIndexInBlockText;
+            uint32_t closestByteOffset = GetLineByteStart(textBlock, line);
             float minAbsXDist = 1e9f;
 
             float lineDrawStartX = 0.0f;
@@ -1480,8 +1647,8 @@ void main() {
             } else if (textBlock.paragraphStyleUsed.alignment == HorizontalAlignment::CENTER) {
                 lineDrawStartX = ((textBlock.paragraphStyleUsed.wrapWidth > 0 ? textBlock.paragraphStyleUsed.wrapWidth : line.lineWidth) - line.lineWidth) / 2.0f;
             }
-            bool isLineActuallyFirstInPara = (line.sourceTextByteStartIndexInBlockText == 0) ||
-                                             (line.sourceTextByteStartIndexInBlockText > 0 && !textBlock.sourceTextConcatenated.empty() && textBlock.sourceTextConcatenated[line.sourceTextByteStartIndexInBlockText-1] == '\n');
+            bool isLineActuallyFirstInPara = (GetLineByteStart(textBlock, line) == 0) ||
+                                             (GetLineByteStart(textBlock, line) > 0 && !textBlock.sourceTextConcatenated.empty() && textBlock.sourceTextConcatenated[GetLineByteStart(textBlock, line)-1] == '\n');
             if (isLineActuallyFirstInPara) {
                 lineDrawStartX += textBlock.paragraphStyleUsed.firstLineIndent;
             }
@@ -1489,30 +1656,24 @@ void main() {
             if (positionInBlockLocalCoords.x < lineDrawStartX) {
                 if(isTrailingEdge) *isTrailingEdge = false;
                 if(distanceToClosestEdge) *distanceToClosestEdge = fabsf(positionInBlockLocalCoords.x - lineDrawStartX);
-                return line.sourceTextByteStartIndexInBlockText;
+                return GetLineByteStart(textBlock, line);
             }
 
             for (size_t elIdx = 0; elIdx < line.numElementsInLine; ++elIdx) {
-                if ((line.firstElementIndexInBlockElements + elIdx) >= textBlock.elements.size()) break;
-                const auto& elementVariant = textBlock.elements[line.firstElementIndexInBlockElements + elIdx];
+                if ((GetLineFirstElementIndex(textBlock, line) + elIdx) >= textBlock.elements.size()) break;
+                const auto& elementVariant = textBlock.elements[GetLineFirstElementIndex(textBlock, line) + elIdx];
 
-                uint32_t elSrcSpanIdx = 0;
-                uint32_t elSrcByteOffsetInSpan = 0;
                 uint16_t elSrcNumBytesInSpan = 0;
                 float elLogicalXStartOnLine = 0;
                 float elAdvanceX = 0;
 
                 if (elementVariant.index() == 0) { // PositionedGlyph
                     const auto& g = std::get<PositionedGlyph>(elementVariant);
-                    elSrcSpanIdx = g.sourceSpanIndex;
-                    elSrcByteOffsetInSpan = g.sourceCharByteOffsetInSpan;
                     elSrcNumBytesInSpan = g.numSourceCharBytesInSpan;
                     elLogicalXStartOnLine = g.position.x;
                     elAdvanceX = g.xAdvance;
                 } else if (elementVariant.index() == 1) { // PositionedImage
                     const auto& img = std::get<PositionedImage>(elementVariant);
-                    elSrcSpanIdx = img.sourceSpanIndex;
-                    elSrcByteOffsetInSpan = img.sourceCharByteOffsetInSpan;
                     elSrcNumBytesInSpan = img.numSourceCharBytesInSpan;
                     elLogicalXStartOnLine = img.position.x;
                     elAdvanceX = img.penAdvanceX;
@@ -1520,12 +1681,7 @@ void main() {
                     continue;
                 }
 
-                uint32_t currentElementByteStartInBlock = 0;
-                for(uint32_t k=0; k < elSrcSpanIdx; ++k) {
-                    if (textBlock.sourceSpansCopied[k].style.isImage && textBlock.sourceSpansCopied[k].text.empty()) currentElementByteStartInBlock += 3;
-                    else currentElementByteStartInBlock += textBlock.sourceSpansCopied[k].text.length();
-                }
-                currentElementByteStartInBlock += elSrcByteOffsetInSpan;
+                uint32_t currentElementByteStartInBlock = GetElementSourceByteStart(textBlock, elementVariant);
 
                 float visualElementStartX = lineDrawStartX + elLogicalXStartOnLine;
                 float visualElementEndX = visualElementStartX + elAdvanceX;
@@ -1549,7 +1705,7 @@ void main() {
             }
 
             if (line.numElementsInLine > 0) {
-                const auto& lastElementVariant = textBlock.elements[line.firstElementIndexInBlockElements + line.numElementsInLine -1];
+                const auto& lastElementVariant = textBlock.elements[GetLineFirstElementIndex(textBlock, line) + line.numElementsInLine -1];
                 float lastElVisualEndX = 0;
                 if(lastElementVariant.index() == 0) {
                     const auto& glyph = std::get<PositionedGlyph>(lastElementVariant);
@@ -1562,7 +1718,7 @@ void main() {
                     float dist = fabsf(positionInBlockLocalCoords.x - lastElVisualEndX);
                     if (dist < minAbsXDist) {
                         minAbsXDist = dist;
-                        closestByteOffset = line.sourceTextByteEndIndexInBlockText;
+                        closestByteOffset = GetLineByteEnd(textBlock, line);
                         if (isTrailingEdge) *isTrailingEdge = true;
                     }
                 }
@@ -1573,7 +1729,7 @@ void main() {
                     if (isTrailingEdge) *isTrailingEdge = false;
                 }
                 minAbsXDist = fabsf(positionInBlockLocalCoords.x - lineDrawStartX);
-                closestByteOffset = line.sourceTextByteStartIndexInBlockText;
+                closestByteOffset = GetLineByteStart(textBlock, line);
             }
 
             if(distanceToClosestEdge) *distanceToClosestEdge = minAbsXDist;
@@ -1586,5 +1742,9 @@ void main() {
 
 // --- Global Factory Function ---
 std::unique_ptr<ITextEngine> CreateTextEngine() {
-   return std::make_unique<STBTextEngineImpl>();
+   return std::make_unique<STBTextEngineImpl>(nullptr);
+}
+
+std::unique_ptr<ITextEngine> CreateTextEngine(std::unique_ptr<IAtlasStorage> atlasStorage) {
+   return std::make_unique<STBTextEngineImpl>(std::move(atlasStorage));
 }
\ No newline at end of file
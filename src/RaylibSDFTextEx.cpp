@@ -19,9 +19,15 @@
 #include <unordered_map>
 #include <algorithm>
 #include <cmath>
+#include <cfloat>  // FLT_MAX
 #include <cstdlib>
 #include <cstring>
+#include <cstddef> // offsetof
+#include <thread>  // RenderTextBlockToImage scanline bands
+#include <array>
 #include <variant> // For std::holds_alternative / std::get
+#include <string_view>
+#include <memory_resource> // std::pmr layout arena
 
 // FreeType Headers
 #include <ft2build.h>
@@ -40,6 +46,7 @@
 #include <unicode/utypes.h>
 #include <unicode/ustring.h> // For UTF-16 string functions (u_strFromUTF8, u_strToUTF8 etc.)
 #include <unicode/ubidi.h>   // For BiDi algorithm
+#include <unicode/uchar.h>   // For u_charDirection
 #include <unicode/ubrk.h>    // For line breaking
 #include <unicode/uscript.h> // For script detection
 #include <unicode/uloc.h>    // For locales
@@ -48,7 +55,7 @@
 // Global variable for dynamically adjusting SDF smoothness (from main.cpp)
 extern float dynamicSmoothnessAdd;
 
-// Custom HarfBuzz glyph advances callback (remains the same)
+// Custom HarfBuzz glyph advances callback
 static void my_custom_get_glyph_h_advances_callback(
         hb_font_t *hb_font,
         void *font_data,
@@ -79,6 +86,135 @@ static void my_custom_get_glyph_h_advances_callback(
     }
 }
 
+// Width-independent result of the shape-then-break layout, kept in TextBlock::shapingCache so Rewrap can assign
+// lines again without reshaping. Only built when no line edge had to be reshaped. Holds shaping output only: Rewrap
+// takes styles from the block's source spans and render info from the glyph cache when it rebuilds the elements.
+struct TextBlockShapingCache {
+    struct GlyphRun { // One shaped item: a single span, font and size
+        uint32_t spanIdx = 0;
+        FontId fontId = INVALID_FONT_ID;
+        float fontSize = 0.0f;
+        ITextEngine::ScaledFontMetrics metrics;
+    };
+    struct ShapedGlyph { // One glyph or inline image placeholder, as emitShapedGlyphs placed it
+        uint32_t glyphId = 0;
+        uint32_t u8Cluster = 0;          // Byte offset in the block text
+        uint32_t runIdx = 0;
+        uint32_t byteOffsetInSpan = 0;
+        uint16_t numBytesInSpan = 0;
+        bool isImage = false;            // Image boxes are resolved again from the span's imageParams
+        float xOffsetFromPen = 0.0f;     // position.x relative to the pen position before this glyph
+        float positionY = 0.0f;
+        float xOffset = 0.0f, yOffset = 0.0f, xAdvance = 0.0f, yAdvance = 0.0f; // Images: penAdvanceX in xAdvance
+        float ascent = 0.0f, descent = 0.0f;
+        float visualLeft = 0.0f, visualRight = 0.0f;
+    };
+    std::vector<GlyphRun> runs;                                // Indexed like the layout's shaped items
+    std::vector<ShapedGlyph> glyphs;                           // Logical order (ascending u8Cluster)
+    std::vector<std::pair<uint32_t, bool>> breakOpportunities; // (byte offset, is hard break), ascending
+    std::vector<uint32_t> unsafeBreaks;                        // Opportunities a line cannot end at without reshaping, ascending
+    std::vector<float> advancePrefix;                          // Advance of bytes [a, b) = advancePrefix[b] - advancePrefix[a]
+    std::vector<int32_t> u8ToU16;
+    std::vector<UBiDiLevel> levelsU16;                         // Paragraph BiDi levels; empty on the simple-LTR path
+    std::u16string u16Text;                                    // Only kept alongside levelsU16
+    UBiDiLevel paraLevel = 0;
+    ITextEngine::ScaledFontMetrics paraDefaultMetrics;
+    float paraDefFontSize = 0.0f;
+};
+
+// GPU objects of dropped TextBlockDrawCaches. Deleted by the engine on its next draw (GL calls stay on the render
+// thread and inside the context's lifetime); caches outliving the engine leave theirs to the context teardown.
+struct TextDrawGpuReleaseList {
+    std::vector<unsigned int> vertexArrays;
+    std::vector<unsigned int> buffers;
+    std::vector<unsigned int> textures;
+};
+
+// GPU-resident mesh of one TextBlock, built by FTTextEngineImpl on its first draw and kept in TextBlock::drawCache.
+// Every quad is drawn by the FT SDF shader; a per-vertex mode selects SDF, alpha-coverage or RGBA sampling, and SDF
+// vertices carry a style index into styleTexture. Commands therefore only split where the texture changes.
+struct TextBlockDrawCache {
+    static constexpr int MAX_QUADS_PER_CHUNK = 16384; // 16-bit indices (rlDrawVertexArrayElements)
+    static constexpr int BLOCK_COORD_ATTRIB_LOCATION = 6; // layout(location) of vertexBlockCoord in the SDF vertex shader
+    static constexpr int STYLE_TEXELS = 20;           // RGBA32F texels per style (layout: loadStyle() in the SDF shader)
+    static constexpr int STYLES_PER_ROW = 32;         // styleTexture is STYLE_TEXELS * STYLES_PER_ROW (640) texels wide
+    static constexpr int MAX_GRADIENT_STOPS = 8;
+    enum QuadMode { QUAD_SDF = 0, QUAD_COVERAGE = 1, QUAD_RGBA = 2 }; // fragMode in the SDF shader; SDF and coverage quads have a style
+    enum StyleFlags { STYLE_BOLD = 1, STYLE_OUTLINE = 2, STYLE_GLOW = 4, STYLE_SHADOW = 8,
+                      STYLE_INNER_EFFECT = 16, STYLE_INNER_EFFECT_IS_SHADOW = 32 };
+
+    struct Chunk {
+        unsigned int vao = 0;
+        unsigned int vbo[5] = {0, 0, 0, 0, 0}; // positions (vec3), texcoords (vec2), colors (ubyte4), style index + mode (texcoord2),
+                                               // block coordinates (vec2, BLOCK_COORD_ATTRIB_LOCATION)
+        unsigned int ebo = 0;
+    };
+    // GlyphRenderPath::INSTANCED record (ftSdfInstancedVertexShaderSrc), one per quad in global quad order
+    struct GlyphInstance {
+        float rect[4];            // x, y of the unsheared top-left corner, width, height
+        float uvRect[4];          // u0, v0, u1, v1
+        float params[4];          // style index, QuadMode, italic shear, 0
+        unsigned char color[4];
+    };
+    // One style, untinted, as uploaded: fill, outline, glow, shadow, inner colors; (smoothness, outlineWidth, glowRange,
+    // glowIntensity); (shadow offset in atlas pixels xy, shadowSdfSpread, innerEffectRange); (StyleFlags, gradient stop
+    // count, 0, 0); gradient (start.xy, end.xy); 2 texels of stop positions; MAX_GRADIENT_STOPS stop colors; 1 unused
+    using StyleRow = std::array<float, STYLE_TEXELS * 4>;
+    struct Command {
+        size_t chunk = 0;
+        int firstQuad = 0, quadCount = 0; // Within the chunk
+        unsigned int textureId = 0;
+    };
+    // Quads of one visual run (or of a whole line without runs) and their bounds, for clipRect culling
+    struct CullSpan {
+        Rectangle bounds = {0, 0, 0, 0};
+        size_t firstQuad = 0, quadCount = 0; // Global quad index: chunk * MAX_QUADS_PER_CHUNK + quad in chunk
+    };
+
+    // CPU copy of every quad (4 vertices each, global quad order); chunks are uploaded slices of it.
+    // FTTextEngineImpl::EndTextFrame copies from here into its frame mesh.
+    struct Vertices {
+        std::vector<float> positions;      // vec3
+        std::vector<float> texcoords;      // vec2
+        std::vector<unsigned char> colors; // ubyte4
+        std::vector<float> styleModes;     // texcoord2: (style index, QuadMode)
+        std::vector<float> blockCoords;    // vec2: position / overallBounds, untouched by transforms (gradients)
+    };
+
+    Vertices vertices;
+    std::vector<Chunk> chunks;
+    std::vector<Command> commands;
+    std::vector<CullSpan> cullSpans;
+    std::vector<size_t> lineFirstCullSpan; // lines.size() + 1 entries; line i owns [lineFirstCullSpan[i], lineFirstCullSpan[i + 1])
+    std::vector<StyleRow> styles;
+    unsigned int styleTexture = 0;        // styles, uploaded (0 when the block has no SDF glyphs)
+    bool instanced = false;               // Built for GlyphRenderPath::INSTANCED: chunks are empty placeholders and the quads
+    unsigned int instanceVao = 0;         // live in instanceVbo (one GlyphInstance each) over the engine's shared unit quad
+    unsigned int instanceVbo = 0;
+    unsigned int instanceEbo = 0;         // Unit quad indices; element buffers are VAO state, so one per instance VAO
+    Rectangle blockBounds = {0, 0, 1, 1}; // overallBounds with width / height forced non-zero (blockCoords, instanced blockBounds)
+    const void* owner = nullptr;          // Engine that built it; another engine rebuilds
+    float smoothnessAdd = 0.0f;           // dynamicSmoothnessAdd baked into styles
+    std::weak_ptr<TextDrawGpuReleaseList> releaseList;
+
+    TextBlockDrawCache() = default;
+    TextBlockDrawCache(const TextBlockDrawCache&) = delete;
+    TextBlockDrawCache& operator=(const TextBlockDrawCache&) = delete;
+    ~TextBlockDrawCache() {
+        std::shared_ptr<TextDrawGpuReleaseList> list = releaseList.lock();
+        if (!list) return;
+        for (const Chunk& chunk : chunks) {
+            list->vertexArrays.push_back(chunk.vao);
+            for (unsigned int vbo : chunk.vbo) list->buffers.push_back(vbo);
+            list->buffers.push_back(chunk.ebo);
+        }
+        list->textures.push_back(styleTexture);
+        list->vertexArrays.push_back(instanceVao);
+        list->buffers.push_back(instanceVbo);
+        list->buffers.push_back(instanceEbo);
+    }
+};
+
 namespace { // Anonymous namespace start
 
 // --- Internal Data Structures ---
@@ -117,6 +253,31 @@ namespace { // Anonymous namespace start
         }
     };
 
+    // Shape plan cache key: a plan depends only on the face and the segment properties, not on the font size.
+    struct FTShapePlanKey {
+        FontId fontId;
+        hb_script_t script;
+        hb_language_t language; // Interned pointer, comparable by identity
+        hb_direction_t direction;
+
+        bool operator==(const FTShapePlanKey& other) const {
+            return fontId == other.fontId &&
+                   script == other.script &&
+                   language == other.language &&
+                   direction == other.direction;
+        }
+    };
+
+    struct FTShapePlanKeyHash {
+        std::size_t operator()(const FTShapePlanKey& k) const {
+            std::size_t h1 = std::hash<FontId>()(k.fontId);
+            std::size_t h2 = std::hash<uint32_t>()(static_cast<uint32_t>(k.script));
+            std::size_t h3 = std::hash<const void*>()(static_cast<const void*>(k.language));
+            std::size_t h4 = std::hash<int>()(static_cast<int>(k.direction));
+            return h1 ^ (h2 << 1) ^ (h3 << 2) ^ (h4 << 3);
+        }
+    };
+
     struct FTCachedGlyph {
         GlyphRenderInfo renderInfo; //
         // Metrics at the size the glyph was cached (sdfPixelSize)
@@ -126,31 +287,129 @@ namespace { // Anonymous namespace start
         // uint32_t originalCodepoint = 0; // Might be useful for debugging fallback
     };
 
+    // Default raylib vertex shader plus vertexTexCoord2 = (style index, quad mode) (see TextBlockDrawCache::QuadMode)
+    const char* ftSdfMasterVertexShaderSrc = R"(
+#version 330 core
+in vec3 vertexPosition;
+in vec2 vertexTexCoord;
+in vec4 vertexColor;
+in vec2 vertexTexCoord2;
+layout(location = 6) in vec2 vertexBlockCoord; // Position in the block, normalized to its overallBounds (gradients)
+uniform mat4 mvp;
+out vec2 fragTexCoord;
+out vec4 fragColor;
+out vec2 fragBlockCoord;
+flat out int fragStyleIndex;
+flat out int fragMode;
+void main() {
+    fragTexCoord = vertexTexCoord;
+    fragColor = vertexColor;
+    fragBlockCoord = vertexBlockCoord;
+    fragStyleIndex = int(vertexTexCoord2.x + 0.5);
+    fragMode = int(vertexTexCoord2.y + 0.5);
+    gl_Position = mvp * vec4(vertexPosition, 1.0);
+}
+)";
+
+    // GlyphRenderPath::INSTANCED: one TextBlockDrawCache::GlyphInstance per quad, expanded from a shared unit quad.
+    // Same outputs as ftSdfMasterVertexShaderSrc, so both use ftSdfMasterFragmentShaderSrc.
+    const char* ftSdfInstancedVertexShaderSrc = R"(
+#version 330 core
+layout(location = 0) in vec2 unitCorner;      // (0,0) (0,1) (1,1) (1,0): top-left, bottom-left, bottom-right, top-right
+layout(location = 1) in vec4 instanceRect;    // x, y of the unsheared top-left corner, width, height
+layout(location = 2) in vec4 instanceUvRect;  // u0, v0, u1, v1
+layout(location = 3) in vec4 instanceParams;  // style index, quad mode, italic shear (x offset of the top edge), unused
+layout(location = 4) in vec4 instanceColor;
+uniform mat4 mvp;
+uniform vec4 blockBounds; // overallBounds of the block (width / height never 0), for fragBlockCoord
+out vec2 fragTexCoord;
+out vec4 fragColor;
+out vec2 fragBlockCoord;
+flat out int fragStyleIndex;
+flat out int fragMode;
+void main() {
+    fragTexCoord = mix(instanceUvRect.xy, instanceUvRect.zw, unitCorner);
+    fragColor = instanceColor;
+    fragStyleIndex = int(instanceParams.x + 0.5);
+    fragMode = int(instanceParams.y + 0.5);
+    vec2 position = instanceRect.xy + unitCorner * instanceRect.zw;
+    position.x += (1.0 - unitCorner.y) * instanceParams.z;
+    fragBlockCoord = (position - blockBounds.xy) / blockBounds.zw;
+    gl_Position = mvp * vec4(position, 0.0, 1.0);
+}
+)";
+
     const char* ftSdfMasterFragmentShaderSrc = R"(
 #version 330 core
 in vec2 fragTexCoord;
-uniform sampler2D sdfTexture;
-uniform vec4 textColor;
+in vec4 fragColor;
+in vec2 fragBlockCoord;
+flat in int fragStyleIndex;
+flat in int fragMode; // 0: SDF glyph, 1: alpha-coverage glyph (grayscale atlas), 2: RGBA image
+uniform sampler2D sdfTexture; // Atlas or image of the current draw
+uniform sampler2D styleTexture; // 20 RGBA32F texels per style, 32 styles per row
+uniform vec4 globalTint;
 uniform float sdfEdgeValue;
-uniform float sdfSmoothness;
-uniform bool enableOutline;
-uniform vec4 outlineColor;
-uniform float outlineWidth;
-uniform bool enableGlow;
-uniform vec4 glowColor;
-uniform float glowRange;
-uniform float glowIntensity;
-uniform bool enableShadow;
-uniform vec4 shadowColor;
-uniform vec2 shadowTexCoordOffset;
-uniform float shadowSdfSpread;
-uniform bool enableInnerEffect;
-uniform vec4 innerEffectColor;
-uniform float innerEffectRange;
-uniform bool innerEffectIsShadow;
-uniform bool styleBold;
 uniform float boldStrength;
+// Per-style values, read from styleTexture by loadStyle()
+vec4 textColor;
+float sdfSmoothness;
+bool enableOutline;
+vec4 outlineColor;
+float outlineWidth;
+bool enableGlow;
+vec4 glowColor;
+float glowRange;
+float glowIntensity;
+bool enableShadow;
+vec4 shadowColor;
+vec2 shadowTexCoordOffset;
+float shadowSdfSpread;
+bool enableInnerEffect;
+vec4 innerEffectColor;
+float innerEffectRange;
+bool innerEffectIsShadow;
+bool styleBold;
 out vec4 finalFragColor;
+void loadStyle() {
+    ivec2 base = ivec2((fragStyleIndex % 32) * 20, fragStyleIndex / 32);
+    textColor = texelFetch(styleTexture, base, 0) * globalTint;
+    outlineColor = texelFetch(styleTexture, base + ivec2(1, 0), 0) * globalTint;
+    glowColor = texelFetch(styleTexture, base + ivec2(2, 0), 0) * globalTint;
+    shadowColor = texelFetch(styleTexture, base + ivec2(3, 0), 0) * globalTint;
+    innerEffectColor = texelFetch(styleTexture, base + ivec2(4, 0), 0) * globalTint;
+    vec4 params0 = texelFetch(styleTexture, base + ivec2(5, 0), 0);
+    sdfSmoothness = params0.x; outlineWidth = params0.y; glowRange = params0.z; glowIntensity = params0.w;
+    vec4 params1 = texelFetch(styleTexture, base + ivec2(6, 0), 0);
+    shadowTexCoordOffset = params1.xy / vec2(textureSize(sdfTexture, 0)); // Stored in atlas pixels
+    shadowSdfSpread = params1.z; innerEffectRange = params1.w;
+    vec4 params2 = texelFetch(styleTexture, base + ivec2(7, 0), 0);
+    int flags = int(params2.x + 0.5);
+    styleBold = (flags & 1) != 0;
+    enableOutline = (flags & 2) != 0;
+    enableGlow = (flags & 4) != 0;
+    enableShadow = (flags & 8) != 0;
+    enableInnerEffect = (flags & 16) != 0;
+    innerEffectIsShadow = (flags & 32) != 0;
+    int stopCount = int(params2.y + 0.5);
+    if (stopCount > 0) { // LINEAR_GRADIENT fill: stops sorted by position, colors in texels 11..18
+        vec4 line = texelFetch(styleTexture, base + ivec2(8, 0), 0); // start.xy, end.xy
+        vec4 positionsLo = texelFetch(styleTexture, base + ivec2(9, 0), 0);
+        vec4 positionsHi = texelFetch(styleTexture, base + ivec2(10, 0), 0);
+        float positions[8] = float[8](positionsLo.x, positionsLo.y, positionsLo.z, positionsLo.w,
+                                      positionsHi.x, positionsHi.y, positionsHi.z, positionsHi.w);
+        vec2 direction = line.zw - line.xy;
+        float t = dot(fragBlockCoord - line.xy, direction) / max(dot(direction, direction), 1e-6);
+        vec4 color = texelFetch(styleTexture, base + ivec2(11, 0), 0);
+        for (int i = 1; i < stopCount; ++i) {
+            if (t <= positions[i - 1]) break;
+            vec4 next = texelFetch(styleTexture, base + ivec2(11 + i, 0), 0);
+            color = mix(texelFetch(styleTexture, base + ivec2(10 + i, 0), 0), next,
+                        clamp((t - positions[i - 1]) / max(positions[i] - positions[i - 1], 1e-6), 0.0, 1.0));
+        }
+        textColor = color * globalTint;
+    }
+}
 vec4 alphaBlend(vec4 newColor, vec4 oldColor) {
     float outAlpha = newColor.a + oldColor.a * (1.0 - newColor.a);
     if (outAlpha < 0.0001) return vec4(0.0, 0.0, 0.0, 0.0);
@@ -158,6 +417,16 @@ vec4 alphaBlend(vec4 newColor, vec4 oldColor) {
     return vec4(outRGB, outAlpha);
 }
 void main() {
+    if (fragMode == 1) { // Coverage glyphs use only the fill of their style
+        loadStyle();
+        finalFragColor = vec4(textColor.rgb, textColor.a * texture(sdfTexture, fragTexCoord).r);
+        return;
+    }
+    if (fragMode == 2) {
+        finalFragColor = texture(sdfTexture, fragTexCoord) * fragColor * globalTint;
+        return;
+    }
+    loadStyle();
     float mainDistance = texture(sdfTexture, fragTexCoord).r;
     vec4 accumulatedColor = vec4(0.0, 0.0, 0.0, 0.0);
     float effectiveSdfEdge = sdfEdgeValue;
@@ -209,9 +478,9 @@ void main() {
 }
 )"; //
 
-    // BatchRenderState structure remains the same as in your provided RaylibSDFTextEx.cpp
-    struct BatchRenderState {
-        Texture2D atlasTexture;
+    // The SDF style of a glyph as buildDrawCache interns it into TextBlockDrawCache::styles (see makeStyleRow).
+    // Consecutive glyphs usually share a style, so buildDrawCache only rebuilds and looks up the row when this changes.
+    struct SdfStyleKey {
         FillStyle fill; //
         FontStyle basicStyle; //
         bool outlineEnabled; Color outlineColor; float outlineWidth;
@@ -220,18 +489,17 @@ void main() {
         bool innerEffectEnabled; Color innerEffectColor; float innerEffectRange; bool innerEffectIsShadow;
         float dynamicSmoothnessValue;
 
-        BatchRenderState() : atlasTexture({0}), basicStyle(FontStyle::Normal), //
-                             outlineEnabled(false), outlineColor(BLANK), outlineWidth(0.0f),
-                             glowEnabled(false), glowColor(BLANK), glowRange(0.0f), glowIntensity(0.0f),
-                             shadowEnabled(false), shadowColor(BLANK), shadowOffset({0,0}), shadowSdfSpread(0.0f),
-                             innerEffectEnabled(false), innerEffectColor(BLANK), innerEffectRange(0.0f), innerEffectIsShadow(false),
-                             dynamicSmoothnessValue(0.005f) {
+        SdfStyleKey() : basicStyle(FontStyle::Normal), //
+                        outlineEnabled(false), outlineColor(BLANK), outlineWidth(0.0f),
+                        glowEnabled(false), glowColor(BLANK), glowRange(0.0f), glowIntensity(0.0f),
+                        shadowEnabled(false), shadowColor(BLANK), shadowOffset({0,0}), shadowSdfSpread(0.0f),
+                        innerEffectEnabled(false), innerEffectColor(BLANK), innerEffectRange(0.0f), innerEffectIsShadow(false),
+                        dynamicSmoothnessValue(0.005f) {
             fill.type = FillType::SOLID_COLOR; //
             fill.solidColor = BLACK; //
         }
 
-        BatchRenderState(const PositionedGlyph& glyph, float currentSmoothness) : //
-                atlasTexture(glyph.renderInfo.atlasTexture), //
+        SdfStyleKey(const PositionedGlyph& glyph, float currentSmoothness) : //
                 fill(glyph.appliedStyle.fill), //
                 basicStyle(glyph.appliedStyle.basicStyle), //
                 outlineEnabled(glyph.appliedStyle.outline.enabled), outlineColor(glyph.appliedStyle.outline.color), outlineWidth(glyph.appliedStyle.outline.width), //
@@ -261,8 +529,7 @@ void main() {
             return true;
         }
     public:
-        bool RequiresNewBatchComparedTo(const BatchRenderState& other) const {
-            if (atlasTexture.id != other.atlasTexture.id) return true;
+        bool DiffersFrom(const SdfStyleKey& other) const {
             if (!FillStyleEquals(fill, other.fill)) return true;
             if (basicStyle != other.basicStyle) return true; //
             if (outlineEnabled != other.outlineEnabled) return true;
@@ -289,7 +556,10 @@ void main() {
         std::list<FTGlyphCacheKey> lru_glyph_list_;
         std::unordered_map<FTGlyphCacheKey, std::pair<FTCachedGlyph, std::list<FTGlyphCacheKey>::iterator>, FTGlyphCacheKeyHash> glyph_cache_map_;
         size_t glyph_cache_capacity_ = 512;
+        // (FontId << 32 | GID) -> ascent/descent at the font's SDF size, as getCachedGlyphByGID stores them; never rasterized
+        std::unordered_map<uint64_t, std::pair<float, float>> glyph_extents_map_;
 
+        std::unique_ptr<IAtlasStorage> atlasStorage_; // Textures of atlas_images_; HeadlessAtlasStorage runs without GL
         std::vector<Image> atlas_images_;
         std::vector<Texture2D> atlas_textures_;
         int current_atlas_idx_ = -1;
@@ -300,26 +570,85 @@ void main() {
         GlyphAtlasType atlas_type_hint_ = GlyphAtlasType::SDF_BITMAP; //
 
         Shader sdfShader_ = {0};
-        // Shader uniform locations (remains the same)
-        int uniform_sdfTexture_loc_ = -1, uniform_textColor_loc_ = -1, uniform_sdfEdgeValue_loc_ = -1, uniform_sdfSmoothness_loc_ = -1;
-        int uniform_enableOutline_loc_ = -1, uniform_outlineColor_loc_ = -1, uniform_outlineWidth_loc_ = -1;
-        int uniform_enableGlow_loc_ = -1, uniform_glowColor_loc_ = -1, uniform_glowRange_loc_ = -1, uniform_glowIntensity_loc_ = -1;
-        int uniform_enableShadow_loc_ = -1, uniform_shadowColor_loc_ = -1, uniform_shadowTexCoordOffset_loc_ = -1, uniform_shadowSdfSpread_loc_ = -1;
-        int uniform_enableInnerEffect_loc_ = -1, uniform_innerEffectColor_loc_ = -1, uniform_innerEffectRange_loc_ = -1, uniform_innerEffectIsShadow_loc_ = -1;
-        int uniform_styleBold_loc_ = -1, uniform_boldStrength_loc_ = -1;
-
-
-        // UTF-8/16 conversion helpers (remains the same)
-        std::u16string Utf8ToUtf16(const std::string& u8_str) const {
+        std::vector<std::pair<size_t, size_t>> visibleQuadRanges_; // DrawTextBlock scratch: global quad ranges inside clipRect
+
+        // BeginTextFrame / EndTextFrame: SDF DrawTextBlock calls in between are queued and merged into one frame mesh
+        // Blocks with more quads skip the queue: their mesh is already on the GPU, re-uploading it every frame costs more than a draw call
+        static constexpr size_t FRAME_BATCH_MAX_QUADS = 512;
+        struct QueuedTextBlock {
+            std::shared_ptr<TextBlockDrawCache> cache; // Keeps the mesh alive even if the block goes away before EndTextFrame
+            Matrix world;                              // transform * rlgl transform at submission
+            Color tint;
+            int scissor = -1;                          // Index into frameScissors_, -1 for none
+            int viewProjection = 0;                    // Index into frameViewProjections_: modelview * projection at submission
+            size_t firstRange = 0, rangeCount = 0;     // Into frameVisibleQuads_
+            size_t styleRemapBase = 0;                 // Into frameStyleRemap_: block style index -> frame style index
+        };
+        struct FrameRun { int scissor; int viewProjection; unsigned int textureId; int firstQuad, quadCount; };
+        struct FrameDrawState { int scissor = -1; int viewProjection = -1; };
+        bool frameActive_ = false;
+        std::vector<QueuedTextBlock> frameItems_;
+        std::vector<std::pair<size_t, size_t>> frameVisibleQuads_;
+        std::vector<Rectangle> frameScissors_;
+        std::vector<Matrix> frameViewProjections_;
+        std::vector<TextBlockDrawCache::StyleRow> frameStyles_;
+        std::vector<size_t> frameStyleRemap_;
+        TextBlockDrawCache::Vertices frameVertices_;   // Staging for one frame chunk (MAX_QUADS_PER_CHUNK quads)
+        TextBlockDrawCache::Chunk frameChunk_;         // Dynamic buffers, created on first EndTextFrame
+        unsigned int frameStyleTexture_ = 0;
+        int frameStyleTextureRows_ = 0;
+        // Per-style values live in each block's style texture (TextBlockDrawCache::StyleRow); only these are uniforms
+        int uniform_sdfEdgeValue_loc_ = -1, uniform_boldStrength_loc_ = -1, uniform_styleTexture_loc_ = -1, uniform_globalTint_loc_ = -1;
+        // GlyphRenderPath::INSTANCED: loaded on first SetGlyphRenderPath(INSTANCED), with the unit quad corners all instance VAOs share
+        GlyphRenderPath glyphRenderPath_ = GlyphRenderPath::VERTEX_MESH;
+        Shader sdfInstancedShader_{};
+        int instanced_sdfEdgeValue_loc_ = -1, instanced_boldStrength_loc_ = -1, instanced_styleTexture_loc_ = -1, instanced_globalTint_loc_ = -1;
+        int instanced_blockBounds_loc_ = -1;
+        unsigned int unitQuadVbo_ = 0;
+        // SDF shader constants, shared by bindMeshShader and the CPU rasterizer (RenderTextBlockToImage)
+        static constexpr float SDF_EDGE_VALUE = 128.0f / 255.0f; // Default for FT_RENDER_MODE_SDF
+        static constexpr float SDF_BOLD_STRENGTH = 0.03f;
+
+        // HarfBuzz shaping resources reused across layouts
+        std::vector<hb_buffer_t*> hb_buffer_pool_;
+        static constexpr size_t HB_BUFFER_POOL_MAX_SIZE = 8;
+        std::unordered_map<FTShapePlanKey, hb_shape_plan_t*, FTShapePlanKeyHash> shape_plan_cache_;
+
+        // ICU objects reused across layouts: UBiDi objects (paragraph + line views) and break iterators per (type, locale)
+        std::vector<UBiDi*> ubidi_pool_;
+        std::map<std::pair<int, std::string>, UBreakIterator*> break_iterator_cache_;
+
+        // Whole-block layout cache for LayoutStyledTextCached (MRU at the front, one entry per HashLayoutInput value)
+        struct LayoutCacheEntry {
+            size_t hash;
+            std::shared_ptr<const TextBlock> block;
+        };
+        std::list<LayoutCacheEntry> lru_layout_list_;
+        std::unordered_map<size_t, std::list<LayoutCacheEntry>::iterator> layout_cache_map_;
+        size_t layout_cache_capacity_ = 64;
+        LayoutCacheStats layout_cache_stats_;
+
+        // GPU meshes of TextBlock::drawCache are freed through this list (see TextBlockDrawCache)
+        std::shared_ptr<TextDrawGpuReleaseList> gpu_release_list_ = std::make_shared<TextDrawGpuReleaseList>();
+
+        // Scratch memory for one layout call, released at the start of layoutParagraph. Chunks come from a pool that
+        // keeps them across calls, so steady-state layouts take their temporaries without touching the global heap.
+        static constexpr size_t LAYOUT_ARENA_INITIAL_SIZE = 64 * 1024;
+        std::pmr::unsynchronized_pool_resource layout_arena_upstream_{std::pmr::pool_options{0, 512 * 1024}};
+        std::pmr::monotonic_buffer_resource layout_arena_{LAYOUT_ARENA_INITIAL_SIZE, &layout_arena_upstream_};
+
+
+        // UTF-8/16 conversion helpers
+        std::u16string Utf8ToUtf16(std::string_view u8_str) const {
             if (u8_str.empty()) return std::u16string();
             std::u16string u16_str;
             UErrorCode error_code = U_ZERO_ERROR;
             int32_t u16_len = 0;
-            u_strFromUTF8(nullptr, 0, &u16_len, u8_str.c_str(), static_cast<int32_t>(u8_str.length()), &error_code);
+            u_strFromUTF8(nullptr, 0, &u16_len, u8_str.data(), static_cast<int32_t>(u8_str.length()), &error_code);
             if (error_code == U_BUFFER_OVERFLOW_ERROR || (error_code == U_ZERO_ERROR && u16_len > 0)) {
                 error_code = U_ZERO_ERROR;
                 u16_str.resize(u16_len);
-                u_strFromUTF8(reinterpret_cast<UChar*>(&u16_str[0]), u16_len, nullptr, u8_str.c_str(), static_cast<int32_t>(u8_str.length()), &error_code);
+                u_strFromUTF8(reinterpret_cast<UChar*>(&u16_str[0]), u16_len, nullptr, u8_str.data(), static_cast<int32_t>(u8_str.length()), &error_code);
                 if (U_FAILURE(error_code)) {
                     TraceLog(LOG_WARNING, "FTTextEngine: ICU u_strFromUTF8 failed: %s", u_errorName(error_code));
                     return std::u16string();
@@ -334,6 +663,34 @@ void main() {
             return u16_str;
         }
 
+        // Layout variant of Utf8ToUtf16: converts into out (typically arena-backed) with a single ICU pass.
+        bool Utf8ToUtf16Into(std::string_view u8_str, std::pmr::u16string& out) const {
+            out.clear();
+            if (u8_str.empty()) return true;
+            out.resize(u8_str.length()); // UTF-16 never needs more code units than UTF-8 has bytes
+            UErrorCode error_code = U_ZERO_ERROR;
+            int32_t u16_len = 0;
+            u_strFromUTF8(reinterpret_cast<UChar*>(&out[0]), (int32_t)out.length(), &u16_len, u8_str.data(), static_cast<int32_t>(u8_str.length()), &error_code);
+            if (U_FAILURE(error_code)) {
+                TraceLog(LOG_WARNING, "FTTextEngine: ICU u_strFromUTF8 failed: %s", u_errorName(error_code));
+                out.clear();
+                return false;
+            }
+            out.resize(u16_len);
+            return true;
+        }
+
+        // UTF-8 byte length of UTF-16 text without converting it (unpaired surrogates count as U+FFFD, like u_strToUTF8 substitution)
+        static uint32_t Utf8LengthOfUtf16(std::u16string_view u16) {
+            uint32_t len = 0;
+            for (size_t i = 0; i < u16.length(); ++i) {
+                char16_t c = u16[i];
+                if (U16_IS_LEAD(c) && i + 1 < u16.length() && U16_IS_TRAIL(u16[i + 1])) { len += 4; ++i; }
+                else len += (c < 0x80) ? 1 : (c < 0x800) ? 2 : 3;
+            }
+            return len;
+        }
+
         std::string Utf16ToUtf8(const std::u16string& u16_str) const {
             if (u16_str.empty()) return std::string();
             std::string u8_str;
@@ -380,7 +737,142 @@ void main() {
             return hb_language_from_string(s, -1);
         }
 
-        // findSpaceInAtlasAndPack (remains the same)
+        // Where each source span landed in the concatenated block text
+        struct SpanMapEntry {
+            uint32_t u8_start_offset_in_full; uint32_t u8_length_in_full;
+            uint32_t u16_start_offset_in_full; uint32_t u16_length_in_full;
+            size_t originalSpanIndex;
+        };
+
+        // Script/language parsed once per span instead of once per visual run
+        struct SpanShapingProps {
+            hb_script_t script = HB_SCRIPT_INVALID; // INVALID => let HarfBuzz guess from the text
+            hb_language_t language = nullptr;
+        };
+
+        SpanShapingProps InternSpanShapingProps(const CharacterStyle& style) const {
+            SpanShapingProps props;
+            if (!style.scriptTag.empty()) props.script = HbScriptFromString(style.scriptTag.c_str());
+            props.language = HbLanguageFromString(style.languageTag.empty() ? "und" : style.languageTag.c_str());
+            return props;
+        }
+
+        hb_buffer_t* acquireHbBuffer() {
+            if (hb_buffer_pool_.empty()) return hb_buffer_create();
+            hb_buffer_t* buf = hb_buffer_pool_.back();
+            hb_buffer_pool_.pop_back();
+            return buf;
+        }
+
+        void releaseHbBuffer(hb_buffer_t* buf) {
+            if (!buf) return;
+            if (hb_buffer_pool_.size() >= HB_BUFFER_POOL_MAX_SIZE) { hb_buffer_destroy(buf); return; }
+            hb_buffer_clear_contents(buf); // Keeps the allocation, resets contents and segment properties
+            hb_buffer_pool_.push_back(buf);
+        }
+
+        // Returns a borrowed plan (owned by shape_plan_cache_), or nullptr if HarfBuzz could not build one.
+        hb_shape_plan_t* getOrCreateShapePlan(FontId fontId, const FTFontData& fontData, const hb_segment_properties_t& props) {
+            FTShapePlanKey key = {fontId, props.script, props.language, props.direction};
+            auto it = shape_plan_cache_.find(key);
+            if (it != shape_plan_cache_.end()) return it->second;
+
+            hb_shape_plan_t* plan = hb_shape_plan_create_cached(hb_font_get_face(fontData.hbFont), &props, nullptr, 0, nullptr);
+            if (!plan) {
+                TraceLog(LOG_WARNING, "FTTextEngine: hb_shape_plan_create_cached failed for font %d.", fontId);
+                return nullptr;
+            }
+            shape_plan_cache_[key] = plan;
+            return plan;
+        }
+
+        // Shapes text[itemOffset, itemOffset + itemLength) with the rest of text as context. Clusters in the result are
+        // byte offsets into text. The returned buffer comes from the pool; hand it back with releaseHbBuffer.
+        hb_buffer_t* shapeTextRange(std::string_view text, uint32_t itemOffset, uint32_t itemLength, bool isRTL,
+                                    const SpanShapingProps& shapingProps, FontId fontId, const FTFontData& fontData, float fontSize) {
+            hb_buffer_t* hb_buf = acquireHbBuffer();
+            hb_buffer_add_utf8(hb_buf, text.data(), (int)text.length(), itemOffset, (int)itemLength);
+            hb_buffer_set_direction(hb_buf, isRTL ? HB_DIRECTION_RTL : HB_DIRECTION_LTR);
+            if (shapingProps.script != HB_SCRIPT_INVALID) hb_buffer_set_script(hb_buf, shapingProps.script);
+            hb_buffer_set_language(hb_buf, shapingProps.language);
+            hb_buffer_guess_segment_properties(hb_buf); // Only fills in what is still unset (script)
+
+            FT_Set_Pixel_Sizes(fontData.ftFace, 0, static_cast<FT_UInt>(roundf(fontSize)));
+            hb_segment_properties_t hb_seg_props;
+            hb_buffer_get_segment_properties(hb_buf, &hb_seg_props);
+            hb_shape_plan_t* shapePlan = getOrCreateShapePlan(fontId, fontData, hb_seg_props);
+            if (shapePlan) hb_shape_plan_execute(shapePlan, fontData.hbFont, hb_buf, nullptr, 0);
+            else hb_shape(fontData.hbFont, hb_buf, nullptr, 0);
+            return hb_buf;
+        }
+
+        void releaseShapingResources(FontId fontId) { // INVALID_FONT_ID => release everything
+            for (auto it = shape_plan_cache_.begin(); it != shape_plan_cache_.end();) {
+                if (fontId == INVALID_FONT_ID || it->first.fontId == fontId) {
+                    hb_shape_plan_destroy(it->second);
+                    it = shape_plan_cache_.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+            if (fontId == INVALID_FONT_ID) {
+                for (hb_buffer_t* buf : hb_buffer_pool_) hb_buffer_destroy(buf);
+                hb_buffer_pool_.clear();
+            }
+        }
+
+        UBiDi* acquireUBiDi() {
+            if (ubidi_pool_.empty()) return ubidi_open(); // Grows on demand, no need to presize
+            UBiDi* bidi = ubidi_pool_.back();
+            ubidi_pool_.pop_back();
+            return bidi;
+        }
+
+        void releaseUBiDi(UBiDi* bidi) {
+            if (bidi) ubidi_pool_.push_back(bidi);
+        }
+
+        // Returns a borrowed iterator (owned by break_iterator_cache_); caller must ubrk_setText before use.
+        UBreakIterator* acquireBreakIterator(UBreakIteratorType type, const char* locale) {
+            std::pair<int, std::string> key = {static_cast<int>(type), locale ? locale : ""};
+            auto it = break_iterator_cache_.find(key);
+            if (it != break_iterator_cache_.end()) return it->second;
+
+            UErrorCode status = U_ZERO_ERROR;
+            UBreakIterator* iter = ubrk_open(type, locale, nullptr, 0, &status);
+            if (U_FAILURE(status) || !iter) {
+                if (iter) ubrk_close(iter);
+                return nullptr;
+            }
+            break_iterator_cache_[key] = iter;
+            return iter;
+        }
+
+        // Derives a view of [start, limit) of the paragraph BiDi into lineBiDi without re-running the algorithm.
+        // Falls back to a standalone resolution of the range if ICU rejects the line (e.g. it crosses a paragraph separator).
+        bool setBiDiLineView(UBiDi* lineBiDi, UBiDi* paraBiDi, std::u16string_view paraU16Text, int32_t start, int32_t limit, UBiDiLevel fallbackLevel) {
+            if (!lineBiDi || start >= limit) return false;
+            UErrorCode status = U_ZERO_ERROR;
+            if (paraBiDi) {
+                ubidi_setLine(paraBiDi, start, limit, lineBiDi, &status);
+                if (U_SUCCESS(status)) return true;
+                status = U_ZERO_ERROR;
+            }
+            ubidi_setPara(lineBiDi, reinterpret_cast<const UChar*>(paraU16Text.data()) + start, limit - start, fallbackLevel, nullptr, &status);
+            if (U_FAILURE(status)) {
+                TraceLog(LOG_WARNING, "FTTextEngine: BiDi view [%d, %d) failed: %s", start, limit, u_errorName(status));
+                return false;
+            }
+            return true;
+        }
+
+        void releaseIcuResources() {
+            for (UBiDi* bidi : ubidi_pool_) ubidi_close(bidi);
+            ubidi_pool_.clear();
+            for (auto& pair : break_iterator_cache_) ubrk_close(pair.second);
+            break_iterator_cache_.clear();
+        }
+
         Rectangle findSpaceInAtlasAndPack(int width, int height, const unsigned char* bitmapData, PixelFormat format) {
             if (width <= 0 || height <= 0 || !bitmapData) return {0,0,0,0};
 
@@ -418,14 +910,13 @@ void main() {
                     }
                     atlas_images_.push_back(new_atlas_image);
 
-                    Texture2D new_texture = LoadTextureFromImage(atlas_images_.back());
+                    Texture2D new_texture = atlasStorage_->CreatePage(atlas_images_.back());
                     if (new_texture.id == 0) {
                         TraceLog(LOG_ERROR, "FTTextEngine: Failed to load texture from new atlas image %d", current_atlas_idx_);
                         UnloadImage(atlas_images_.back()); atlas_images_.pop_back();
                         current_atlas_idx_--;
                         return {0,0,0,0};
                     }
-                    SetTextureFilter(new_texture, TEXTURE_FILTER_BILINEAR); // Good for SDF
                     atlas_textures_.push_back(new_texture);
                 }
             }
@@ -443,7 +934,7 @@ void main() {
             Image glyphImage = { const_cast<unsigned char*>(bitmapData), width, height, 1, format };
 
             ImageDraw(currentImageToUpdate, glyphImage, {0,0,(float)width,(float)height}, spot, WHITE); // Draw new glyph onto atlas image
-            UpdateTextureRec(atlas_textures_[current_atlas_idx_], spot, bitmapData); // Update GPU texture
+            atlasStorage_->UpdatePage(atlas_textures_[current_atlas_idx_], spot, bitmapData); // Update GPU texture
 
             current_atlas_pen_pos_.x += width;
             current_atlas_max_row_height_ = std::max(current_atlas_max_row_height_, (float)height);
@@ -582,7 +1073,7 @@ void main() {
                 newCachedGlyph.renderInfo.drawOffset = {0,0};
             }
 
-            // Cache management (remains the same)
+            // Cache management: evict the least recently used glyph
             if (glyph_cache_map_.size() >= glyph_cache_capacity_ && !lru_glyph_list_.empty()) {
                 glyph_cache_map_.erase(lru_glyph_list_.back());
                 lru_glyph_list_.pop_back();
@@ -593,8 +1084,15 @@ void main() {
         }
 
 
+        // Cached blocks reference atlas rects and resolved font ids, so anything that changes those drops them
+        void invalidateLayoutCache() {
+            layout_cache_map_.clear();
+            lru_layout_list_.clear();
+        }
+
         void performCacheCleanup() { //
-            for (Texture2D tex : atlas_textures_) if (tex.id > 0) UnloadTexture(tex);
+            invalidateLayoutCache();
+            for (Texture2D tex : atlas_textures_) atlasStorage_->ReleasePage(tex);
             atlas_textures_.clear();
             for (Image img : atlas_images_) if (img.data) UnloadImage(img);
             atlas_images_.clear();
@@ -604,43 +1102,33 @@ void main() {
 
 
     public:
-        FTTextEngineImpl() { // Constructor remains mostly the same
+        explicit FTTextEngineImpl(std::unique_ptr<IAtlasStorage> atlasStorage)
+            : atlasStorage_(atlasStorage ? std::move(atlasStorage) : std::make_unique<GpuAtlasStorage>()) {
             if (FT_Init_FreeType(&ftLibrary_)) {
                 TraceLog(LOG_FATAL, "FTTextEngine: Could not initialize FreeType library");
                 ftLibrary_ = nullptr; return;
             }
-            sdfShader_ = LoadShaderFromMemory(nullptr, ftSdfMasterFragmentShaderSrc);
-            if (sdfShader_.id == rlGetShaderIdDefault()) { TraceLog(LOG_WARNING, "FTTextEngine: SDF shader failed to load."); }
-            else {
-                TraceLog(LOG_INFO, "FTTextEngine: SDF shader loaded (ID: %d).", sdfShader_.id);
-                uniform_sdfTexture_loc_ = GetShaderLocation(sdfShader_, "sdfTexture");
-                uniform_textColor_loc_ = GetShaderLocation(sdfShader_, "textColor");
-                uniform_sdfEdgeValue_loc_ = GetShaderLocation(sdfShader_, "sdfEdgeValue");
-                uniform_sdfSmoothness_loc_ = GetShaderLocation(sdfShader_, "sdfSmoothness");
-                uniform_enableOutline_loc_ = GetShaderLocation(sdfShader_, "enableOutline");
-                uniform_outlineColor_loc_ = GetShaderLocation(sdfShader_, "outlineColor");
-                uniform_outlineWidth_loc_ = GetShaderLocation(sdfShader_, "outlineWidth");
-                uniform_enableGlow_loc_ = GetShaderLocation(sdfShader_, "enableGlow");
-                uniform_glowColor_loc_ = GetShaderLocation(sdfShader_, "glowColor");
-                uniform_glowRange_loc_ = GetShaderLocation(sdfShader_, "glowRange");
-                uniform_glowIntensity_loc_ = GetShaderLocation(sdfShader_, "glowIntensity");
-                uniform_enableShadow_loc_ = GetShaderLocation(sdfShader_, "enableShadow");
-                uniform_shadowColor_loc_ = GetShaderLocation(sdfShader_, "shadowColor");
-                uniform_shadowTexCoordOffset_loc_ = GetShaderLocation(sdfShader_, "shadowTexCoordOffset");
-                uniform_shadowSdfSpread_loc_ = GetShaderLocation(sdfShader_, "shadowSdfSpread");
-                uniform_enableInnerEffect_loc_ = GetShaderLocation(sdfShader_, "enableInnerEffect");
-                uniform_innerEffectColor_loc_ = GetShaderLocation(sdfShader_, "innerEffectColor");
-                uniform_innerEffectRange_loc_ = GetShaderLocation(sdfShader_, "innerEffectRange");
-                uniform_innerEffectIsShadow_loc_ = GetShaderLocation(sdfShader_, "innerEffectIsShadow");
-                uniform_styleBold_loc_ = GetShaderLocation(sdfShader_, "styleBold");
-                uniform_boldStrength_loc_ = GetShaderLocation(sdfShader_, "boldStrength");
+            if (!atlasStorage_->HasGpu()) { // No GL context: sdfShader_ stays {0}
+                TraceLog(LOG_INFO, "FTTextEngine: Headless atlas storage, drawing is disabled.");
+            } else {
+                sdfShader_ = LoadShaderFromMemory(ftSdfMasterVertexShaderSrc, ftSdfMasterFragmentShaderSrc);
+                if (sdfShader_.id == rlGetShaderIdDefault()) { TraceLog(LOG_WARNING, "FTTextEngine: SDF shader failed to load."); }
+                else {
+                    TraceLog(LOG_INFO, "FTTextEngine: SDF shader loaded (ID: %d).", sdfShader_.id);
+                    uniform_sdfEdgeValue_loc_ = GetShaderLocation(sdfShader_, "sdfEdgeValue");
+                    uniform_boldStrength_loc_ = GetShaderLocation(sdfShader_, "boldStrength");
+                    uniform_styleTexture_loc_ = GetShaderLocation(sdfShader_, "styleTexture");
+                    uniform_globalTint_loc_ = GetShaderLocation(sdfShader_, "globalTint");
+                }
             }
             glyph_cache_capacity_ = 512; atlas_width_ = 1024; atlas_height_ = 1024;
             atlas_type_hint_ = GlyphAtlasType::SDF_BITMAP; //
         }
 
-        ~FTTextEngineImpl() override { // Destructor remains the same
+        ~FTTextEngineImpl() override {
             performCacheCleanup();
+            releaseShapingResources(INVALID_FONT_ID); // Plans reference the hb faces, drop them first
+            releaseIcuResources();
             for (auto& pair : loadedFonts_) {
                 if (pair.second.hbFont) hb_font_destroy(pair.second.hbFont);
                 if (pair.second.ftFace) FT_Done_Face(pair.second.ftFace);
@@ -648,6 +1136,16 @@ void main() {
             loadedFonts_.clear();
             fontFallbackChains_.clear();
             if (ftLibrary_) FT_Done_FreeType(ftLibrary_);
+            frameItems_.clear();
+            releasePendingGpuObjects(); // performCacheCleanup dropped the cached blocks, and with them their meshes
+            if (frameChunk_.vao > 0) {
+                rlUnloadVertexArray(frameChunk_.vao);
+                for (unsigned int vbo : frameChunk_.vbo) rlUnloadVertexBuffer(vbo);
+                rlUnloadVertexBuffer(frameChunk_.ebo);
+            }
+            if (frameStyleTexture_ > 0) rlUnloadTexture(frameStyleTexture_);
+            if (unitQuadVbo_ > 0) rlUnloadVertexBuffer(unitQuadVbo_);
+            if (sdfInstancedShader_.id > 0 && sdfInstancedShader_.id != rlGetShaderIdDefault()) UnloadShader(sdfInstancedShader_);
             if (sdfShader_.id > 0 && sdfShader_.id != rlGetShaderIdDefault()) UnloadShader(sdfShader_);
         }
 
@@ -765,6 +1263,8 @@ void main() {
         void UnloadFont(FontId fontId) override { //
             auto it = loadedFonts_.find(fontId);
             if (it != loadedFonts_.end()) {
+                invalidateLayoutCache();
+                releaseShapingResources(fontId);
                 if (it->second.hbFont) hb_font_destroy(it->second.hbFont);
                 if (it->second.ftFace) FT_Done_Face(it->second.ftFace);
                 loadedFonts_.erase(it);
@@ -774,6 +1274,10 @@ void main() {
                     pair.second.erase(std::remove(pair.second.begin(), pair.second.end(), fontId), pair.second.end());
                 }
 
+                for (auto ext_it = glyph_extents_map_.begin(); ext_it != glyph_extents_map_.end();) {
+                    if ((FontId)(ext_it->first >> 32) == fontId) ext_it = glyph_extents_map_.erase(ext_it);
+                    else ++ext_it;
+                }
                 auto lru_it = lru_glyph_list_.begin();
                 while (lru_it != lru_glyph_list_.end()) {
                     if (lru_it->fontId == fontId) {
@@ -791,7 +1295,10 @@ void main() {
         bool IsFontValid(FontId fontId) const override { return loadedFonts_.count(fontId) > 0; } //
         FontId GetDefaultFont() const override { return defaultFontId_; } //
         void SetDefaultFont(FontId fontId) override { //
-            if (IsFontValid(fontId) || fontId == INVALID_FONT_ID) defaultFontId_ = fontId; //
+            if (IsFontValid(fontId) || fontId == INVALID_FONT_ID) {
+                if (defaultFontId_ != fontId) invalidateLayoutCache();
+                defaultFontId_ = fontId; //
+            }
             else TraceLog(LOG_WARNING, "FTTextEngine: Invalid FontID %d for default.", fontId);
         }
 
@@ -810,6 +1317,7 @@ void main() {
                 }
             }
             fontFallbackChains_[primaryFont] = validFallbackChain;
+            invalidateLayoutCache();
             TraceLog(LOG_INFO, "FTTextEngine: Fallback chain set for FontID %d with %zu valid fallbacks.", primaryFont, validFallbackChain.size());
         }
 
@@ -981,13 +1489,110 @@ void main() {
 
 
 
-        // RaylibSDFTextEx.cpp -> FTTextEngineImpl 类内部
-// 请用这个版本替换你现有的 LayoutStyledText 函数
+        using ITextEngine::LayoutStyledText;
+        using ITextEngine::LayoutStyledTextCached;
+
+        TextBlock LayoutStyledText(std::shared_ptr<const std::vector<TextSpan>> spans, const ParagraphStyle& paragraphStyle,
+                                   std::pmr::memory_resource* resultResource = nullptr) override {
+            if (!spans) spans = std::make_shared<const std::vector<TextSpan>>();
+            const std::vector<TextSpan>& spanList = *spans;
+            return layoutParagraph(spanList, std::move(spans), paragraphStyle, nullptr, resultResource);
+        }
+
+        bool Rewrap(TextBlock& textBlock, float newWrapWidth, HorizontalAlignment newAlignment) override {
+            ParagraphStyle newStyle = textBlock.paragraphStyleUsed;
+            newStyle.wrapWidth = newWrapWidth;
+            newStyle.alignment = newAlignment;
+            if (textBlock.shapingCache && rewrapFromShapingCache(textBlock, newStyle)) return true;
+            if (!textBlock.sourceSpans) return false; // Measurement results and default-constructed blocks have nothing to lay out
+            std::shared_ptr<const std::vector<TextSpan>> spans = textBlock.sourceSpans.Snapshot();
+            const std::vector<TextSpan>& spanList = *spans;
+            textBlock = layoutParagraph(spanList, std::move(spans), newStyle, nullptr, textBlock.elements.get_allocator().resource());
+            return false;
+        }
+
+        TextMeasurement MeasureStyledText(const std::vector<TextSpan>& spans, const ParagraphStyle& paragraphStyle) override {
+            TextMeasurement measurement;
+            layoutParagraph(spans, nullptr, paragraphStyle, &measurement);
+            return measurement;
+        }
+
+        std::shared_ptr<const TextBlock> LayoutStyledTextCached(const std::vector<TextSpan>& spans, const ParagraphStyle& paragraphStyle) override {
+            return layoutCached(spans, nullptr, paragraphStyle);
+        }
+
+        std::shared_ptr<const TextBlock> LayoutStyledTextCached(std::shared_ptr<const std::vector<TextSpan>> spans, const ParagraphStyle& paragraphStyle) override {
+            if (!spans) spans = std::make_shared<const std::vector<TextSpan>>();
+            const std::vector<TextSpan>& spanList = *spans;
+            return layoutCached(spanList, std::move(spans), paragraphStyle);
+        }
+
+        // spansSnapshot may be null; a snapshot of spans is then only made on a miss
+        std::shared_ptr<const TextBlock> layoutCached(const std::vector<TextSpan>& spans, std::shared_ptr<const std::vector<TextSpan>> spansSnapshot,
+                                                      const ParagraphStyle& paragraphStyle) {
+            auto layoutSnapshot = [&]() {
+                if (!spansSnapshot) spansSnapshot = std::make_shared<const std::vector<TextSpan>>(spans);
+                return std::make_shared<const TextBlock>(layoutParagraph(spans, std::move(spansSnapshot), paragraphStyle, nullptr));
+            };
+            if (layout_cache_capacity_ == 0) {
+                layout_cache_stats_.misses++;
+                return layoutSnapshot();
+            }
+            size_t hash = HashLayoutInput(spans, paragraphStyle);
+            auto cacheIt = layout_cache_map_.find(hash);
+            if (cacheIt != layout_cache_map_.end()) {
+                const TextBlock& cachedBlock = *cacheIt->second->block;
+                if (IsSameLayoutInput(spans, paragraphStyle, cachedBlock.GetSourceSpans(), cachedBlock.paragraphStyleUsed)) {
+                    layout_cache_stats_.hits++;
+                    lru_layout_list_.splice(lru_layout_list_.begin(), lru_layout_list_, cacheIt->second);
+                    return cacheIt->second->block;
+                }
+                // Hash collision: the new layout takes over this slot
+                lru_layout_list_.erase(cacheIt->second);
+                layout_cache_map_.erase(cacheIt);
+            }
+            layout_cache_stats_.misses++;
+            auto block = layoutSnapshot();
+            while (layout_cache_map_.size() >= layout_cache_capacity_ && !lru_layout_list_.empty()) {
+                layout_cache_map_.erase(lru_layout_list_.back().hash);
+                lru_layout_list_.pop_back();
+                layout_cache_stats_.evictions++;
+            }
+            lru_layout_list_.push_front({hash, block});
+            layout_cache_map_[hash] = lru_layout_list_.begin();
+            return block;
+        }
+
+        void SetLayoutCacheCapacity(size_t maxEntries) override {
+            layout_cache_capacity_ = maxEntries;
+            while (layout_cache_map_.size() > layout_cache_capacity_ && !lru_layout_list_.empty()) {
+                layout_cache_map_.erase(lru_layout_list_.back().hash);
+                lru_layout_list_.pop_back();
+                layout_cache_stats_.evictions++;
+            }
+        }
+
+        void ClearLayoutCache() override { invalidateLayoutCache(); }
+
+        LayoutCacheStats GetLayoutCacheStats() const override {
+            LayoutCacheStats stats = layout_cache_stats_;
+            stats.entries = layout_cache_map_.size();
+            stats.capacity = layout_cache_capacity_;
+            return stats;
+        }
 
-        TextBlock LayoutStyledText(const std::vector<TextSpan>& spans, const ParagraphStyle& paragraphStyle) {
-            TextBlock textBlock;
+        // Shared by LayoutStyledText and MeasureStyledText. spans is the list being laid out and spansSnapshot (null when
+        // measuring) the shared snapshot the block keeps. With measureOut set the returned block has no source spans and,
+        // on the shape-then-break paths, no lines or elements; only *measureOut is meaningful.
+        // Temporaries come from layout_arena_; the block's own storage from resultResource (nullptr: default resource).
+        TextBlock layoutParagraph(const std::vector<TextSpan>& spans, std::shared_ptr<const std::vector<TextSpan>> spansSnapshot,
+                                  const ParagraphStyle& paragraphStyle, TextMeasurement* measureOut,
+                                  std::pmr::memory_resource* resultResource = nullptr) {
+            layout_arena_.release();
+            std::pmr::memory_resource* scratch = &layout_arena_;
+            TextBlock textBlock(resultResource);
             textBlock.paragraphStyleUsed = paragraphStyle;
-            textBlock.sourceSpansCopied = spans;
+            textBlock.sourceSpans = std::move(spansSnapshot);
 
             if (!ftLibrary_) {
                 TraceLog(LOG_ERROR, "FTTextEngine: FT lib not init in Layout.");
@@ -1018,62 +1623,109 @@ void main() {
                 }
                 emptyLine.lineWidth = 0.0f; emptyLine.lineBoxY = 0.0f;
                 textBlock.lines.push_back(emptyLine);
+                RebuildLineIndex(textBlock);
                 textBlock.overallBounds = {0, 0, paragraphStyle.firstLineIndent, emptyLine.lineBoxHeight};
+                if (measureOut) {
+                    measureOut->size = {textBlock.overallBounds.width, textBlock.overallBounds.height};
+                    measureOut->lineCount = 1;
+                    measureOut->minContentWidth = measureOut->maxContentWidth = paragraphStyle.firstLineIndent;
+                }
                 return textBlock;
             }
 
-            std::string fullUtf8Text_local;
-            struct SpanMapEntry {
-                uint32_t u8_start_offset_in_full; uint32_t u8_length_in_full;
-                uint32_t u16_start_offset_in_full; uint32_t u16_length_in_full;
-                size_t originalSpanIndex;
-            };
-            std::vector<SpanMapEntry> spanMap_local;
+            // The block's own buffer is the only UTF-8 concatenation built during layout
+            std::pmr::string& fullUtf8Text_local = textBlock.sourceTextConcatenated;
+            static const std::string objectReplacementU8 = "\xEF\xBF\xBC"; // U+FFFC
+            size_t totalU8Length = 0;
+            for (const auto& span : spans) totalU8Length += (span.style.isImage && span.text.empty()) ? objectReplacementU8.length() : span.text.length();
+            fullUtf8Text_local.reserve(totalU8Length);
+            std::pmr::vector<SpanMapEntry> spanMap_local(scratch);
+            spanMap_local.reserve(spans.size());
+            std::pmr::vector<SpanShapingProps> spanShapingProps_local(scratch); // Indexed by original span index
+            spanShapingProps_local.reserve(spans.size());
+            const SpanShapingProps paraDefaultShapingProps = InternSpanShapingProps(paragraphStyle.defaultCharacterStyle);
             uint32_t currentU8BytePosInFull = 0; uint32_t currentU16CodeUnitPosInFull = 0;
 
             for (size_t i = 0; i < spans.size(); ++i) {
                 const auto& span = spans[i];
-                std::string text_to_process = span.text;
-                if (span.style.isImage && span.text.empty()) text_to_process = "\xEF\xBF\xBC"; // U+FFFC
+                const std::string& text_to_process = (span.style.isImage && span.text.empty()) ? objectReplacementU8 : span.text;
                 fullUtf8Text_local += text_to_process;
                 uint32_t u8LenOfSpanText = text_to_process.length();
-                std::u16string u16SpanText = Utf8ToUtf16(text_to_process);
-                uint32_t u16LenOfSpanText = u16SpanText.length();
+                uint32_t u16LenOfSpanText = Utf16LengthOfUtf8(text_to_process);
                 spanMap_local.push_back({currentU8BytePosInFull, u8LenOfSpanText, currentU16CodeUnitPosInFull, u16LenOfSpanText, i});
+                spanShapingProps_local.push_back(InternSpanShapingProps(span.style));
                 currentU8BytePosInFull += u8LenOfSpanText; currentU16CodeUnitPosInFull += u16LenOfSpanText;
             }
-            textBlock.sourceTextConcatenated = fullUtf8Text_local;
-            std::u16string fullU16Text_local = Utf8ToUtf16(fullUtf8Text_local);
-            if (fullU16Text_local.empty() && !textBlock.sourceTextConcatenated.empty()) {
+
+            // Fast path: plain LTR text (most UI labels) skips UTF-16 conversion, BiDi and ICU break iterators entirely
+            if (paragraphStyle.baseDirection != TextDirection::RTL &&
+                paragraphStyle.lineBreakStrategy != LineBreakStrategy::ICU_CHARACTER_BOUNDARIES &&
+                IsSimpleLTRText(fullUtf8Text_local)) {
+                float blockBottomY = 0.0f; float maxLineWidth = 0.0f;
+                layoutParagraphShapeThenBreak(textBlock, spans, paragraphStyle, spanMap_local, spanShapingProps_local,
+                                              std::u16string_view(), nullptr, nullptr, 0,
+                                              paraDefFontId, paraDefFontSize, paraDefaultMetrics, blockBottomY, maxLineWidth, measureOut);
+                finishTextBlockLayout(textBlock, blockBottomY, maxLineWidth, true, paraDefaultMetrics, paraDefFontSize);
+                if (measureOut) measureOut->size = {textBlock.overallBounds.width, textBlock.overallBounds.height};
+                return textBlock;
+            }
+
+            std::pmr::u16string fullU16Text_local(scratch);
+            if (!Utf8ToUtf16Into(fullUtf8Text_local, fullU16Text_local) || (fullU16Text_local.empty() && !textBlock.sourceTextConcatenated.empty())) {
                 TraceLog(LOG_ERROR, "FTTextEngine: Full text UTF-16 conversion failed."); return textBlock;
             }
 
             UErrorCode icu_status = U_ZERO_ERROR;
-            UBiDi* paraBiDi = ubidi_openSized(fullU16Text_local.length() + 1, 0, &icu_status);
-            if (U_FAILURE(icu_status)) { TraceLog(LOG_ERROR, "FTTextEngine: ubidi_openSized failed: %s", u_errorName(icu_status)); return textBlock; }
+            UBiDi* paraBiDi = acquireUBiDi();
+            if (!paraBiDi) { TraceLog(LOG_ERROR, "FTTextEngine: ubidi_open failed."); return textBlock; }
             UBiDiLevel paraLvlUBIDI = (paragraphStyle.baseDirection == TextDirection::RTL) ? UBIDI_DEFAULT_RTL : UBIDI_DEFAULT_LTR;
             if (paragraphStyle.baseDirection == TextDirection::AUTO_DETECT_FROM_TEXT) paraLvlUBIDI = UBIDI_DEFAULT_LTR;
             ubidi_setPara(paraBiDi, reinterpret_cast<const UChar*>(fullU16Text_local.data()), fullU16Text_local.length(), paraLvlUBIDI, nullptr, &icu_status);
-            if (U_FAILURE(icu_status)) { TraceLog(LOG_ERROR, "FTTextEngine: ubidi_setPara failed: %s", u_errorName(icu_status)); ubidi_close(paraBiDi); return textBlock; }
+            if (U_FAILURE(icu_status)) { TraceLog(LOG_ERROR, "FTTextEngine: ubidi_setPara failed: %s", u_errorName(icu_status)); releaseUBiDi(paraBiDi); return textBlock; }
             UBiDiLevel actualParaLevel = ubidi_getParaLevel(paraBiDi);
+            UBiDi* lineBiDiView = acquireUBiDi(); // Reused for every segment/line view of paraBiDi
+
+            float currentLineBoxTopY = 0.0f; float overallMaxVisualLineWidth = 0.0f;
+            if (paragraphStyle.lineBreakStrategy == LineBreakStrategy::ICU_LINE_BOUNDARIES_SHAPE_FIRST &&
+                layoutParagraphShapeThenBreak(textBlock, spans, paragraphStyle, spanMap_local, spanShapingProps_local,
+                                              fullU16Text_local, paraBiDi, lineBiDiView, actualParaLevel,
+                                              paraDefFontId, paraDefFontSize, paraDefaultMetrics,
+                                              currentLineBoxTopY, overallMaxVisualLineWidth, measureOut)) {
+                releaseUBiDi(lineBiDiView);
+                releaseUBiDi(paraBiDi);
+                finishTextBlockLayout(textBlock, currentLineBoxTopY, overallMaxVisualLineWidth, true, paraDefaultMetrics, paraDefFontSize);
+                if (measureOut) measureOut->size = {textBlock.overallBounds.width, textBlock.overallBounds.height};
+                return textBlock;
+            }
+            if (measureOut) {
+                // Segment strategies break differently from UBRK_LINE, so size and line count come from the real layout below;
+                // the line-break model still provides the intrinsic min-/max-content widths.
+                float unusedBottomY = 0.0f, unusedMaxWidth = 0.0f;
+                layoutParagraphShapeThenBreak(textBlock, spans, paragraphStyle, spanMap_local, spanShapingProps_local,
+                                              fullU16Text_local, paraBiDi, lineBiDiView, actualParaLevel,
+                                              paraDefFontId, paraDefFontSize, paraDefaultMetrics,
+                                              unusedBottomY, unusedMaxWidth, measureOut);
+            }
 
             const char* localeForBreaks = paragraphStyle.defaultCharacterStyle.languageTag.empty() ? uloc_getDefault() : paragraphStyle.defaultCharacterStyle.languageTag.c_str();
-            UBreakIterator* icuBreakIter = nullptr;
-            if (paragraphStyle.lineBreakStrategy == LineBreakStrategy::ICU_CHARACTER_BOUNDARIES){
-                icuBreakIter = ubrk_open(UBRK_CHARACTER, localeForBreaks, nullptr, 0, &icu_status);
-            } else { icuBreakIter = ubrk_open(UBRK_WORD, localeForBreaks, nullptr, 0, &icu_status); }
-            if (U_FAILURE(icu_status) || !icuBreakIter) {
-                icu_status = U_ZERO_ERROR; icuBreakIter = ubrk_open(UBRK_WORD, uloc_getDefault(), nullptr, 0, &icu_status);
-                if (U_FAILURE(icu_status) || !icuBreakIter) { TraceLog(LOG_FATAL, "FTTextEngine: All ubrk_open attempts failed: %s", u_errorName(icu_status)); if(paraBiDi) ubidi_close(paraBiDi); return textBlock;}
+            UBreakIteratorType breakType = (paragraphStyle.lineBreakStrategy == LineBreakStrategy::ICU_CHARACTER_BOUNDARIES) ? UBRK_CHARACTER : UBRK_WORD;
+            UBreakIterator* icuBreakIter = acquireBreakIterator(breakType, localeForBreaks);
+            if (!icuBreakIter) {
+                icuBreakIter = acquireBreakIterator(UBRK_WORD, uloc_getDefault());
+                if (!icuBreakIter) { TraceLog(LOG_FATAL, "FTTextEngine: All ubrk_open attempts failed."); releaseUBiDi(lineBiDiView); releaseUBiDi(paraBiDi); return textBlock;}
             }
             ubrk_setText(icuBreakIter, reinterpret_cast<const UChar*>(fullU16Text_local.data()), fullU16Text_local.length(), &icu_status);
-            if (U_FAILURE(icu_status)) { TraceLog(LOG_ERROR, "FTTextEngine: ubrk_setText failed: %s", u_errorName(icu_status)); ubrk_close(icuBreakIter); ubidi_close(paraBiDi); return textBlock; }
+            if (U_FAILURE(icu_status)) { TraceLog(LOG_ERROR, "FTTextEngine: ubrk_setText failed: %s", u_errorName(icu_status)); releaseUBiDi(lineBiDiView); releaseUBiDi(paraBiDi); return textBlock; }
 
-            float currentLineBoxTopY = 0.0f; bool isFirstLineOfParagraph = true; float overallMaxVisualLineWidth = 0.0f;
-            std::vector<PositionedElementVariant> pendingLineElements;
+            bool isFirstLineOfParagraph = true;
+            std::pmr::vector<PositionedElementVariant> pendingLineElements(scratch);
+            std::pmr::vector<PositionedElementVariant> elements_for_this_segment(scratch); // Cleared per segment, capacity reused
+            // Segment starts only move forward, so their UTF-8 offsets are tracked incrementally instead of re-converting prefixes
+            int32_t segmentCursorU16 = 0; uint32_t segmentCursorU8 = 0;
             float currentLineCommittedWidth = 0.0f;
             float currentLineMaxAscent = paraDefaultMetrics.ascent; float currentLineMaxDescent = paraDefaultMetrics.descent;
             uint32_t currentLineU8StartIndexInFull_for_lineinfo = 0;
+            int32_t currentLineU16StartInFull = 0;
             LineLayoutInfo currentLineInfoTemplate;
             currentLineInfoTemplate.firstElementIndexInBlockElements = textBlock.elements.size();
             currentLineInfoTemplate.sourceTextByteStartIndexInBlockText = currentLineU8StartIndexInFull_for_lineinfo;
@@ -1088,22 +1740,27 @@ void main() {
                 if (lastU16BreakPos == currentU16BreakPos && !atEndOfParagraph && currentU16BreakPos < (int32_t)fullU16Text_local.length() ) { currentU16BreakPos++; }
                 if (currentU16BreakPos > (int32_t)fullU16Text_local.length()) currentU16BreakPos = (int32_t)fullU16Text_local.length();
 
-                std::u16string segmentU16 = fullU16Text_local.substr(lastU16BreakPos, currentU16BreakPos - lastU16BreakPos);
-                uint32_t segmentU8StartByteInFull = Utf16ToUtf8(fullU16Text_local.substr(0, lastU16BreakPos)).length();
-                bool containsHardNewline = false; std::u16string segmentToShapeU16 = segmentU16;
+                std::u16string_view segmentU16 = std::u16string_view(fullU16Text_local).substr(lastU16BreakPos, currentU16BreakPos - lastU16BreakPos);
+                if (lastU16BreakPos < segmentCursorU16) { segmentCursorU16 = 0; segmentCursorU8 = 0; }
+                segmentCursorU8 += Utf8LengthOfUtf16(std::u16string_view(fullU16Text_local).substr(segmentCursorU16, lastU16BreakPos - segmentCursorU16));
+                segmentCursorU16 = lastU16BreakPos;
+                uint32_t segmentU8StartByteInFull = segmentCursorU8;
+                bool containsHardNewline = false; std::u16string_view segmentToShapeU16 = segmentU16;
                 size_t newlinePosInSegmentU16 = segmentU16.find(u'\n');
-                if (newlinePosInSegmentU16 != std::u16string::npos) { containsHardNewline = true; segmentToShapeU16 = segmentU16.substr(0, newlinePosInSegmentU16); }
+                if (newlinePosInSegmentU16 != std::u16string_view::npos) { containsHardNewline = true; segmentToShapeU16 = segmentU16.substr(0, newlinePosInSegmentU16); }
 
-                std::vector<PositionedElementVariant> elements_for_this_segment;
+                elements_for_this_segment.clear();
                 float width_of_this_segment = 0;
                 float max_ascent_for_this_segment = 0, max_descent_for_this_segment = 0;
                 float penXWithinSegment_for_icu_runs = 0.0f;
 
                 if (!segmentToShapeU16.empty()) {
-                    UBiDi* segmentBiDi = ubidi_openSized(segmentToShapeU16.length() + 1, 0, &icu_status);
-                    ubidi_setPara(segmentBiDi, reinterpret_cast<const UChar*>(segmentToShapeU16.data()), segmentToShapeU16.length(), actualParaLevel, nullptr, &icu_status);
-                    int32_t visualRunCountOnSegment = ubidi_countRuns(segmentBiDi, &icu_status);
-                    if (U_FAILURE(icu_status)) { visualRunCountOnSegment = 0; }
+                    UBiDi* segmentBiDi = lineBiDiView;
+                    int32_t visualRunCountOnSegment = 0;
+                    if (setBiDiLineView(segmentBiDi, paraBiDi, fullU16Text_local, lastU16BreakPos, lastU16BreakPos + (int32_t)segmentToShapeU16.length(), actualParaLevel)) {
+                        visualRunCountOnSegment = ubidi_countRuns(segmentBiDi, &icu_status);
+                        if (U_FAILURE(icu_status)) { visualRunCountOnSegment = 0; icu_status = U_ZERO_ERROR; }
+                    }
 
                     for (int32_t i_run = 0; i_run < visualRunCountOnSegment; ++i_run) {
                         VisualRun current_visual_run_props;
@@ -1111,16 +1768,17 @@ void main() {
                         UBiDiDirection runDirectionUBIDI = ubidi_getVisualRun(segmentBiDi, i_run, &logicalStartU16InSegment, &runLengthU16InSegment);
                         if (runLengthU16InSegment == 0) continue;
 
-                        std::u16string runU16 = segmentToShapeU16.substr(logicalStartU16InSegment, runLengthU16InSegment);
-                        std::string runU8 = Utf16ToUtf8(runU16);
+                        // The run's UTF-8 text is a slice of the block text: no conversion or copy needed
+                        uint32_t runU8StartByteInFull = segmentU8StartByteInFull + Utf8LengthOfUtf16(segmentToShapeU16.substr(0, logicalStartU16InSegment));
+                        std::string_view runU8 = std::string_view(fullUtf8Text_local).substr(runU8StartByteInFull,
+                                                     Utf8LengthOfUtf16(segmentToShapeU16.substr(logicalStartU16InSegment, runLengthU16InSegment)));
 
                         if (runU8 == "طويل") { // Your test log
-                            TraceLog(LOG_INFO, "LayoutStyledText: For run '%s', runDirectionUBIDI is: %s", runU8.c_str(), (runDirectionUBIDI == UBIDI_RTL ? "RTL" : "LTR"));
+                            TraceLog(LOG_INFO, "LayoutStyledText: For run '%.*s', runDirectionUBIDI is: %s", (int)runU8.length(), runU8.data(), (runDirectionUBIDI == UBIDI_RTL ? "RTL" : "LTR"));
                         }
                         current_visual_run_props.direction = (runDirectionUBIDI == UBIDI_LTR) ? PositionedGlyph::BiDiDirectionHint::LTR : PositionedGlyph::BiDiDirectionHint::RTL;
                         current_visual_run_props.logicalStartInOriginalSource = lastU16BreakPos + logicalStartU16InSegment;
                         current_visual_run_props.logicalLengthInOriginalSource = runLengthU16InSegment;
-                        uint32_t runU8StartByteInFull = Utf16ToUtf8(fullU16Text_local.substr(0, current_visual_run_props.logicalStartInOriginalSource)).length();
 
                         size_t runDominantSpanIdx = 0;
                         for(const auto& mapEntry : spanMap_local) { /* ... Find runDominantSpanIdx ... */
@@ -1132,7 +1790,7 @@ void main() {
                                 runDominantSpanIdx = mapEntry.originalSpanIndex; break;
                             }
                         }
-                        CharacterStyle runStyle = (runDominantSpanIdx < spans.size()) ? spans[runDominantSpanIdx].style : paragraphStyle.defaultCharacterStyle;
+                        const CharacterStyle& runStyle = (runDominantSpanIdx < spans.size()) ? spans[runDominantSpanIdx].style : paragraphStyle.defaultCharacterStyle;
                         FontId runFontId = runStyle.fontId; if (!IsFontValid(runFontId)) runFontId = paraDefFontId;
                         float runFontSize = runStyle.fontSize > 0 ? runStyle.fontSize : paraDefFontSize;
 
@@ -1144,15 +1802,9 @@ void main() {
                         current_visual_run_props.scriptTagUsed = runStyle.scriptTag.empty() ? "auto" : runStyle.scriptTag;
                         current_visual_run_props.languageTagUsed = runStyle.languageTag.empty() ? "und" : runStyle.languageTag;
 
-                        hb_buffer_t* hb_buf = hb_buffer_create();
-                        hb_buffer_add_utf8(hb_buf, runU8.c_str(), runU8.length(), 0, runU8.length());
-                        hb_buffer_set_direction(hb_buf, (runDirectionUBIDI == UBIDI_LTR) ? HB_DIRECTION_LTR : HB_DIRECTION_RTL);
-                        hb_buffer_set_script(hb_buf, HbScriptFromString(current_visual_run_props.scriptTagUsed.c_str()));
-                        hb_buffer_set_language(hb_buf, HbLanguageFromString(current_visual_run_props.languageTagUsed.c_str()));
-                        if (runStyle.scriptTag.empty()) { hb_buffer_guess_segment_properties(hb_buf); }
-
-                        FT_Set_Pixel_Sizes(fontData.ftFace, 0, static_cast<FT_UInt>(roundf(runFontSize)));
-                        hb_shape(fontData.hbFont, hb_buf, nullptr, 0);
+                        const SpanShapingProps& runShapingProps = (runDominantSpanIdx < spans.size()) ? spanShapingProps_local[runDominantSpanIdx] : paraDefaultShapingProps;
+                        hb_buffer_t* hb_buf = shapeTextRange(runU8, 0, runU8.length(), runDirectionUBIDI != UBIDI_LTR,
+                                                             runShapingProps, runFontId, fontData, runFontSize);
 
                         unsigned int hb_glyph_count;
                         hb_glyph_info_t* hb_glyph_info = hb_buffer_get_glyph_infos(hb_buf, &hb_glyph_count);
@@ -1160,160 +1812,16 @@ void main() {
 
                         float current_hb_run_pen_x = 0.0f; float current_hb_run_pen_y = 0.0f;
 
-                        for (unsigned int j = 0; j < hb_glyph_count; ++j) {
-                            uint32_t cluster_u8_offset_in_runU8 = hb_glyph_info[j].cluster;
-
-                            int num_bytes_for_this_glyph_original_source = 0;
-                            std::string char_in_cluster_utf8_preview; // For logging
-
-                            if (cluster_u8_offset_in_runU8 < runU8.length()) {
-                                const char* char_start_ptr_for_len_calc = runU8.c_str() + cluster_u8_offset_in_runU8;
-                                GetNextCodepointFromUTF8(&char_start_ptr_for_len_calc, &num_bytes_for_this_glyph_original_source);
-                                if (cluster_u8_offset_in_runU8 + num_bytes_for_this_glyph_original_source > runU8.length()){
-                                    num_bytes_for_this_glyph_original_source = runU8.length() - cluster_u8_offset_in_runU8;
-                                }
-                                if (num_bytes_for_this_glyph_original_source > 0) {
-                                    char_in_cluster_utf8_preview = runU8.substr(cluster_u8_offset_in_runU8, num_bytes_for_this_glyph_original_source);
-                                }
-                            }
-                            // If num_bytes is still 0 (e.g. end of string, or mark without base), HarfBuzz might still produce a glyph.
-                            // Default to 1 if it's a mark or something that GetNextCodepointFromUTF8 might miss if not advancing.
-                            // But usually, a glyph from HB corresponds to some non-zero byte range from source.
-                            // For now, we rely on GetNextCodepointFromUTF8. If it's 0, it might be an issue or an empty cluster.
-
-                            uint32_t original_codepoint_for_glyph = 0;
-                            if (!char_in_cluster_utf8_preview.empty()) {
-                                const char* temp_char_ptr = char_in_cluster_utf8_preview.c_str();
-                                int temp_byte_count_ignored = 0;
-                                original_codepoint_for_glyph = GetNextCodepointFromUTF8(&temp_char_ptr, &temp_byte_count_ignored);
-                            }
-
-                            if (original_codepoint_for_glyph == 0xFFFC) { /* ... Image Handling ... */
-                                // (Your existing image handling logic, ensure pImg.position.x uses penXWithinSegment_for_icu_runs + current_hb_run_pen_x + hb_glyph_pos[j].x_offset/64.0f
-                                // and current_hb_run_pen_x is advanced by image's width or HarfBuzz's x_advance for 0xFFFC)
-                                uint32_t placeholder_global_u8_start = runU8StartByteInFull + cluster_u8_offset_in_runU8;
-                                size_t imageOriginalSpanIdx = runDominantSpanIdx; bool foundImageSpan = false;
-                                for(const auto& mapEntry : spanMap_local){ /* ... find image span ... */
-                                    if (placeholder_global_u8_start >= mapEntry.u8_start_offset_in_full && placeholder_global_u8_start < (mapEntry.u8_start_offset_in_full + mapEntry.u8_length_in_full)) {
-                                        if (spans[mapEntry.originalSpanIndex].style.isImage) { imageOriginalSpanIdx = mapEntry.originalSpanIndex; foundImageSpan = true; break;}
-                                    }
-                                }
-                                if(foundImageSpan){
-                                    PositionedImage pImg; /* ... setup pImg ... */
-                                    const auto& imgSpanStyle = spans[imageOriginalSpanIdx].style;
-                                    pImg.imageParams = imgSpanStyle.imageParams;
-                                    pImg.width = (pImg.imageParams.displayWidth > 0) ? pImg.imageParams.displayWidth : (pImg.imageParams.texture.id > 0 ? (float)pImg.imageParams.texture.width : runFontSize);
-                                    pImg.height = (pImg.imageParams.displayHeight > 0) ? pImg.imageParams.displayHeight : (pImg.imageParams.texture.id > 0 ? (float)pImg.imageParams.texture.height : runFontSize);
-                                    pImg.sourceSpanIndex = imageOriginalSpanIdx; pImg.sourceCharByteOffsetInSpan = 0; pImg.numSourceCharBytesInSpan = 3;
-                                    float imgRelBaselineY = 0; ScaledFontMetrics refMetricsForImgVAlign = runFontMetrics;
-                                    switch(pImg.imageParams.vAlign) { /* ... VAlign logic ... */
-                                        case CharacterStyle::InlineImageParams::VAlign::BASELINE: pImg.ascent = pImg.height; pImg.descent = 0; imgRelBaselineY = -pImg.height; break;
-                                        case CharacterStyle::InlineImageParams::VAlign::MIDDLE_OF_TEXT: { float tMidY = (refMetricsForImgVAlign.xHeight > 0.01f ? refMetricsForImgVAlign.xHeight / 2.0f : (refMetricsForImgVAlign.ascent - refMetricsForImgVAlign.descent)/2.0f); imgRelBaselineY=-(tMidY+pImg.height/2.0f); pImg.ascent=std::max(0.f, tMidY+pImg.height/2.f); pImg.descent=std::max(0.f,pImg.height/2.f - tMidY); break;}
-                                        case CharacterStyle::InlineImageParams::VAlign::TEXT_TOP: imgRelBaselineY=-refMetricsForImgVAlign.ascent; pImg.ascent=refMetricsForImgVAlign.ascent; pImg.descent=std::max(0.f,pImg.height-refMetricsForImgVAlign.ascent); break;
-                                        case CharacterStyle::InlineImageParams::VAlign::TEXT_BOTTOM: imgRelBaselineY=refMetricsForImgVAlign.descent-pImg.height; pImg.descent=refMetricsForImgVAlign.descent; pImg.ascent=std::max(0.f, pImg.height-refMetricsForImgVAlign.descent); break;
-                                        default: pImg.ascent = pImg.height; pImg.descent = 0; imgRelBaselineY = -pImg.height; break;
-                                    }
-                                    pImg.ascent = std::max(0.0f, pImg.ascent); pImg.descent = std::max(0.0f, pImg.descent);
-                                    float image_draw_x_in_hb_run = current_hb_run_pen_x + ((float)hb_glyph_pos[j].x_offset / 64.0f);
-                                    pImg.position = { penXWithinSegment_for_icu_runs + image_draw_x_in_hb_run, imgRelBaselineY };
-                                    elements_for_this_segment.push_back(pImg);
-                                    max_ascent_for_this_segment = std::max(max_ascent_for_this_segment, pImg.ascent);
-                                    max_descent_for_this_segment = std::max(max_descent_for_this_segment, pImg.descent);
-                                    current_hb_run_pen_x += (float)hb_glyph_pos[j].x_advance / 64.0f;
-                                    current_hb_run_pen_y += (float)hb_glyph_pos[j].y_advance / 64.0f;
-                                    continue;
-                                }
-                            }
-
-                            PositionedGlyph pGlyph;
-                            pGlyph.glyphId = hb_glyph_info[j].codepoint;
-                            pGlyph.sourceFont = runFontId; pGlyph.sourceSize = runFontSize;
-                            pGlyph.appliedStyle = runStyle;
-                            pGlyph.xOffset = (float)hb_glyph_pos[j].x_offset / 64.0f;
-                            pGlyph.yOffset = (float)hb_glyph_pos[j].y_offset / 64.0f;
-                            pGlyph.xAdvance = (float)hb_glyph_pos[j].x_advance / 64.0f;
-                            pGlyph.yAdvance = (float)hb_glyph_pos[j].y_advance / 64.0f;
-                            pGlyph.visualRunDirectionHint = current_visual_run_props.direction; // Set this from the run
-
-                            // --- Corrected source text mapping ---
-                            pGlyph.sourceSpanIndex = runDominantSpanIdx;
-                            pGlyph.numSourceCharBytesInSpan = static_cast<uint16_t>(num_bytes_for_this_glyph_original_source); // Use calculated byte length
-
-                            uint32_t cluster_absolute_start_in_full_u8 = runU8StartByteInFull + cluster_u8_offset_in_runU8;
-                            const auto& originalSpanMapEntry = spanMap_local[pGlyph.sourceSpanIndex];
-                            uint32_t originalSpan_start_in_full_u8 = originalSpanMapEntry.u8_start_offset_in_full;
-                            if (cluster_absolute_start_in_full_u8 >= originalSpan_start_in_full_u8) {
-                                pGlyph.sourceCharByteOffsetInSpan = cluster_absolute_start_in_full_u8 - originalSpan_start_in_full_u8;
-                            } else {
-                                pGlyph.sourceCharByteOffsetInSpan = 0;
-                                if (pGlyph.numSourceCharBytesInSpan !=0) { /* Log inconsistent state */ }
-                                pGlyph.numSourceCharBytesInSpan = 0; // Safety
-                                TraceLog(LOG_ERROR, "LayoutText: Cluster mapping error for GID %u", pGlyph.glyphId);
-                            }
-                            // Boundary checks for sourceCharByteOffsetInSpan and numSourceCharBytesInSpan
-                            const std::string* originalSpanTextPtr = nullptr;
-                            if (pGlyph.sourceSpanIndex < spans.size()) { originalSpanTextPtr = &(spans[pGlyph.sourceSpanIndex].text); }
-                            std::string tempImagePlaceholderTextCheck_glyph;
-                            if (pGlyph.sourceSpanIndex < spans.size() && spans[pGlyph.sourceSpanIndex].style.isImage && spans[pGlyph.sourceSpanIndex].text.empty()){ tempImagePlaceholderTextCheck_glyph = "\xEF\xBF\xBC"; originalSpanTextPtr = &tempImagePlaceholderTextCheck_glyph; }
-                            if (originalSpanTextPtr) {
-                                const std::string& effectiveOriginalSpanText = *originalSpanTextPtr;
-                                if (pGlyph.sourceCharByteOffsetInSpan > effectiveOriginalSpanText.length()) {
-                                    pGlyph.sourceCharByteOffsetInSpan = effectiveOriginalSpanText.length(); pGlyph.numSourceCharBytesInSpan = 0;
-                                } else if (pGlyph.sourceCharByteOffsetInSpan + pGlyph.numSourceCharBytesInSpan > effectiveOriginalSpanText.length()) {
-                                    pGlyph.numSourceCharBytesInSpan = effectiveOriginalSpanText.length() - pGlyph.sourceCharByteOffsetInSpan;
-                                }
-                                if (static_cast<int>(pGlyph.numSourceCharBytesInSpan) < 0) pGlyph.numSourceCharBytesInSpan = 0;
-                            } else {
-                                pGlyph.sourceCharByteOffsetInSpan = 0; pGlyph.numSourceCharBytesInSpan = 0;
-                                TraceLog(LOG_ERROR, "LayoutText: Invalid sourceSpanIndex %u for pGlyph text checks.", pGlyph.sourceSpanIndex);
-                            }
-
-                            if (current_visual_run_props.direction == PositionedGlyph::BiDiDirectionHint::RTL) {
-                                TraceLog(LOG_INFO, "LayoutText[RTL Glyph]: Char:'%s'(GID:%u) | SpanIdx:%u, OffInSpan:%u, NumBytes:%u | ClustInRun:%u",
-                                         char_in_cluster_utf8_preview.c_str(), pGlyph.glyphId,
-                                         pGlyph.sourceSpanIndex, pGlyph.sourceCharByteOffsetInSpan, pGlyph.numSourceCharBytesInSpan,
-                                         cluster_u8_offset_in_runU8);
-                            }
-
-                            FontId actualFontForGIDCacheLookup = runFontId;
-                            FTCachedGlyph shapedGlyphRenderData = getCachedGlyphByGID(runFontId, pGlyph.glyphId, runFontSize, actualFontForGIDCacheLookup);
-                            pGlyph.sourceFont = actualFontForGIDCacheLookup;
-                            pGlyph.renderInfo = shapedGlyphRenderData.renderInfo;
-
-                            float scaleFactorForMetrics = 1.0f;
-                            const auto& actualFontDataUsed = loadedFonts_.at(pGlyph.sourceFont);
-                            int sdfSizeForActualFont = actualFontDataUsed.sdfPixelSizeHint > 0 ? actualFontDataUsed.sdfPixelSizeHint : 64;
-                            if (sdfSizeForActualFont > 0 && runFontSize > 0) { scaleFactorForMetrics = runFontSize / (float)sdfSizeForActualFont; }
-                            pGlyph.ascent = shapedGlyphRenderData.ascent_at_cached_size * scaleFactorForMetrics;
-                            pGlyph.descent = shapedGlyphRenderData.descent_at_cached_size * scaleFactorForMetrics;
-
-                            if (IsFontValid(pGlyph.sourceFont)){ /* ... Calculate visualLeft/Right ... */
-                                FT_Face tempFace = loadedFonts_.at(pGlyph.sourceFont).ftFace;
-                                FT_Set_Pixel_Sizes(tempFace, 0, static_cast<FT_UInt>(roundf(runFontSize)));
-                                FT_Error err = FT_Load_Glyph(tempFace, pGlyph.glyphId, FT_LOAD_DEFAULT | FT_LOAD_NO_HINTING | FT_LOAD_NO_BITMAP);
-                                if (!err) {
-                                    pGlyph.visualLeft = ((float)tempFace->glyph->metrics.horiBearingX / 64.0f);
-                                    pGlyph.visualRight = pGlyph.visualLeft + ((float)tempFace->glyph->metrics.width / 64.0f);
-                                } else { pGlyph.visualLeft = 0; pGlyph.visualRight = pGlyph.xAdvance; }
-                            } else { pGlyph.visualLeft = 0; pGlyph.visualRight = pGlyph.xAdvance; }
-
-                            float glyph_draw_origin_x_in_run = current_hb_run_pen_x + pGlyph.xOffset;
-                            float glyph_draw_origin_y_in_run = current_hb_run_pen_y - pGlyph.yOffset;
-                            pGlyph.position = { penXWithinSegment_for_icu_runs + glyph_draw_origin_x_in_run, glyph_draw_origin_y_in_run };
-
-                            elements_for_this_segment.push_back(pGlyph);
-                            max_ascent_for_this_segment = std::max(max_ascent_for_this_segment, pGlyph.ascent - pGlyph.yOffset);
-                            max_descent_for_this_segment = std::max(max_descent_for_this_segment, pGlyph.descent + pGlyph.yOffset);
-
-                            current_hb_run_pen_x += pGlyph.xAdvance;
-                            current_hb_run_pen_y += pGlyph.yAdvance;
-                        }
-                        hb_buffer_destroy(hb_buf);
+                        emitShapedGlyphs(hb_glyph_info, hb_glyph_pos, 0, hb_glyph_count,
+                                         runU8, runU8StartByteInFull, runDominantSpanIdx, spans, spanMap_local,
+                                         runStyle, runFontId, runFontSize, runFontMetrics, current_visual_run_props.direction,
+                                         penXWithinSegment_for_icu_runs, current_hb_run_pen_x, current_hb_run_pen_y,
+                                         elements_for_this_segment, max_ascent_for_this_segment, max_descent_for_this_segment);
+                        releaseHbBuffer(hb_buf);
                         current_visual_run_props.runVisualAdvanceX = current_hb_run_pen_x;
                         penXWithinSegment_for_icu_runs += current_hb_run_pen_x;
                     } // End for each ICU visual run (i_run)
                     width_of_this_segment = penXWithinSegment_for_icu_runs;
-                    ubidi_close(segmentBiDi);
                 } // End if (!segmentToShapeU16.empty())
 
                 // --- Line breaking and element commitment logic ---
@@ -1325,10 +1833,12 @@ void main() {
                                         currentLineMaxAscent, currentLineMaxDescent, currentLineBoxTopY,
                                         isFirstLineOfParagraph, paragraphStyle, paraDefaultMetrics, paraDefFontSize,
                                         segmentU8StartByteInFull, overallMaxVisualLineWidth,
-                                        fullU16Text_local, actualParaLevel);
+                                        fullU16Text_local, paraBiDi, lineBiDiView, actualParaLevel,
+                                        currentLineU16StartInFull, lastU16BreakPos);
                     pendingLineElements.clear(); currentLineCommittedWidth = 0; isFirstLineOfParagraph = false;
                     currentLineMaxAscent = paraDefaultMetrics.ascent; currentLineMaxDescent = paraDefaultMetrics.descent;
                     currentLineU8StartIndexInFull_for_lineinfo = segmentU8StartByteInFull;
+                    currentLineU16StartInFull = lastU16BreakPos;
                     currentLineInfoTemplate = {}; // Reset for new line
                     currentLineInfoTemplate.firstElementIndexInBlockElements = textBlock.elements.size();
                     currentLineInfoTemplate.sourceTextByteStartIndexInBlockText = currentLineU8StartIndexInFull_for_lineinfo;
@@ -1339,7 +1849,7 @@ void main() {
                     float basePenXForSegmentElements = currentLineCommittedWidth;
                     for (auto& el_var : elements_for_this_segment) {
                         std::visit([basePenXForSegmentElements](auto&& arg){ arg.position.x += basePenXForSegmentElements; }, el_var);
-                        pendingLineElements.push_back(el_var);
+                        pendingLineElements.push_back(std::move(el_var));
                     }
                     currentLineCommittedWidth += width_of_this_segment;
                     currentLineMaxAscent = std::max(currentLineMaxAscent, max_ascent_for_this_segment);
@@ -1347,15 +1857,17 @@ void main() {
                 }
 
                 if (containsHardNewline) {
-                    uint32_t u8OffsetAfterNewline = Utf16ToUtf8(fullU16Text_local.substr(0, lastU16BreakPos + segmentToShapeU16.length() + 1)).length();
+                    uint32_t u8OffsetAfterNewline = segmentU8StartByteInFull + Utf8LengthOfUtf16(segmentToShapeU16) + 1; // '\n' is one byte
                     finalizeCurrentLine(textBlock, pendingLineElements, currentLineInfoTemplate, currentLineCommittedWidth,
                                         currentLineMaxAscent, currentLineMaxDescent, currentLineBoxTopY,
                                         isFirstLineOfParagraph, paragraphStyle, paraDefaultMetrics, paraDefFontSize,
                                         u8OffsetAfterNewline, overallMaxVisualLineWidth,
-                                        fullU16Text_local, actualParaLevel);
+                                        fullU16Text_local, paraBiDi, lineBiDiView, actualParaLevel,
+                                        currentLineU16StartInFull, lastU16BreakPos + (int32_t)segmentToShapeU16.length() + 1);
                     pendingLineElements.clear(); currentLineCommittedWidth = 0; isFirstLineOfParagraph = false;
                     currentLineMaxAscent = paraDefaultMetrics.ascent; currentLineMaxDescent = paraDefaultMetrics.descent;
                     currentLineU8StartIndexInFull_for_lineinfo = u8OffsetAfterNewline;
+                    currentLineU16StartInFull = lastU16BreakPos + (int32_t)segmentToShapeU16.length() + 1;
                     currentLineInfoTemplate = {};
                     currentLineInfoTemplate.firstElementIndexInBlockElements = textBlock.elements.size();
                     currentLineInfoTemplate.sourceTextByteStartIndexInBlockText = currentLineU8StartIndexInFull_for_lineinfo;
@@ -1372,20 +1884,36 @@ void main() {
                                     currentLineMaxAscent, currentLineMaxDescent, currentLineBoxTopY,
                                     isFirstLineOfParagraph, paragraphStyle, paraDefaultMetrics, paraDefFontSize,
                                     textBlock.sourceTextConcatenated.length(), overallMaxVisualLineWidth,
-                                    fullU16Text_local, actualParaLevel);
+                                    fullU16Text_local, paraBiDi, lineBiDiView, actualParaLevel,
+                                    currentLineU16StartInFull, (int32_t)fullU16Text_local.length());
             }
 
-            if (icuBreakIter) ubrk_close(icuBreakIter);
-            if (paraBiDi) ubidi_close(paraBiDi);
+            releaseUBiDi(lineBiDiView); // Views first: they reference paraBiDi
+            releaseUBiDi(paraBiDi);
+
+            finishTextBlockLayout(textBlock, currentLineBoxTopY, overallMaxVisualLineWidth, !spans.empty(), paraDefaultMetrics, paraDefFontSize);
+            if (measureOut) {
+                measureOut->size = {textBlock.overallBounds.width, textBlock.overallBounds.height};
+                measureOut->lineCount = textBlock.lines.size();
+                measureOut->maxContentWidth = std::max(measureOut->maxContentWidth, measureOut->minContentWidth);
+            }
+            return textBlock;
+        }
 
-            // Calculate overall bounds (same as before)
+        // Computes overallBounds, rebuilds the line index and element byte offsets, and resolves LINE_TOP/LINE_BOTTOM images once all line boxes are known.
+        void finishTextBlockLayout(TextBlock& textBlock, float blockBottomY, float maxLineWidth, bool hasSpans,
+                                   const ScaledFontMetrics& paraDefaultMetrics, float paraDefFontSize) const {
             textBlock.overallBounds.x = 0;
             textBlock.overallBounds.y = textBlock.lines.empty() ? 0 : textBlock.lines.front().lineBoxY;
-            textBlock.overallBounds.width = overallMaxVisualLineWidth;
-            textBlock.overallBounds.height = currentLineBoxTopY - (textBlock.lines.empty() ? 0 : textBlock.lines.front().lineBoxY);
-            if (textBlock.lines.empty() && !spans.empty() && textBlock.overallBounds.height < 0.01f) {
+            textBlock.overallBounds.width = maxLineWidth;
+            textBlock.overallBounds.height = blockBottomY - (textBlock.lines.empty() ? 0 : textBlock.lines.front().lineBoxY);
+            if (textBlock.lines.empty() && hasSpans && textBlock.overallBounds.height < 0.01f) {
                 textBlock.overallBounds.height = paraDefaultMetrics.recommendedLineHeight > 0 ? paraDefaultMetrics.recommendedLineHeight : paraDefFontSize * 1.2f;
             }
+            RebuildLineIndex(textBlock);
+            AssignElementSourceByteOffsets(textBlock);
+
+            textBlock.drawCache.reset(); // Rewrap reuses the block
 
             // Post-process LINE_TOP/LINE_BOTTOM image alignment
             for (auto& line_info : textBlock.lines) {
@@ -1405,128 +1933,943 @@ void main() {
                     }
                 }
             }
-            return textBlock;
         }
 
-        // In RaylibSDFTextEx.cpp, within FTTextEngineImpl class
+        // --- Shape-then-break (LineBreakStrategy::ICU_LINE_BOUNDARIES_SHAPE_FIRST, and the simple-LTR fast path) ---
 
-        void finalizeCurrentLine(
-                TextBlock& textBlock,
-                std::vector<PositionedElementVariant>& pendingElements,
-                LineLayoutInfo& lineInfoTemplate, // Contains line number, byte start, etc. already set
-                float committedLineWidthNoIndent, // Visual width of elements in pendingElements
-                float lineMaxAscent,              // Max ascent from pendingElements
-                float lineMaxDescent,             // Max descent from pendingElements
-                float& currentLineBoxTopY,        // Y position for the top of this line box, updated for next line
-                bool isFirstLineOfPara,
-                const ParagraphStyle& pStyle,
-                const ScaledFontMetrics& defaultPStyleMetrics, // Correctly named parameter
-                float paraDefaultFontSize,                     // Correctly named parameter
-                uint32_t nextLineU8StartOffsetInFull, // Byte offset in full text where the next line would start, or end of text
-                float& overallMaxVisualLineWidthInOut,
-                const std::u16string& paragraphFullU16Text, // For BiDi map on the line
-                UBiDiLevel paragraphBiDiLevelForLineMap    // The resolved paragraph level for this line's BiDi context
-        ) {
-            // Skip finalization if this segment didn't actually advance text position and wasn't the very first line attempt
-            if (pendingElements.empty() && !(textBlock.lines.empty() && textBlock.sourceTextConcatenated.empty() && lineInfoTemplate.sourceTextByteStartIndexInBlockText == 0)) {
-                if (lineInfoTemplate.sourceTextByteStartIndexInBlockText >= nextLineU8StartOffsetInFull && !textBlock.sourceTextConcatenated.empty() && lineInfoTemplate.sourceTextByteStartIndexInBlockText != 0) {
-                    // This case might occur if a line break happened exactly at a segment boundary without consuming the segment.
-                    // TraceLog(LOG_DEBUG, "finalizeCurrentLine: Skipping finalization of an empty segment that didn't advance text position.");
-                    return;
-                }
+        // UTF-16 length of valid UTF-8 text without an ICU round trip.
+        static int32_t Utf16LengthOfUtf8(std::string_view u8) {
+            int32_t len = 0;
+            for (unsigned char c : u8) {
+                if ((c & 0xC0) != 0x80) ++len; // One unit per lead byte...
+                if (c >= 0xF0) ++len;          // ...plus the low surrogate for 4-byte sequences
             }
+            return len;
+        }
 
-            LineLayoutInfo finalizedLine = lineInfoTemplate; // Copy template info (like start byte index)
-            finalizedLine.lineWidth = committedLineWidthNoIndent;
-            finalizedLine.maxContentAscent = (lineMaxAscent > 0.001f || pendingElements.empty()) ? lineMaxAscent : defaultPStyleMetrics.ascent;
-            finalizedLine.maxContentDescent = (lineMaxDescent > 0.001f || pendingElements.empty()) ? lineMaxDescent : defaultPStyleMetrics.descent;
-            finalizedLine.sourceTextByteEndIndexInBlockText = nextLineU8StartOffsetInFull;
-
-            // Move pendingElements to textBlock.elements
-            finalizedLine.firstElementIndexInBlockElements = textBlock.elements.size();
-            for(const auto& el : pendingElements) {
-                textBlock.elements.push_back(el);
+        // True if the text can be laid out as one LTR run with space/CJK breaks: no strong RTL characters, no BiDi
+        // controls, no combining marks and no scripts that need complex shaping or dictionary line breaking.
+        static bool IsSimpleLTRText(std::string_view u8) {
+            const char* ptr = u8.data();
+            const char* end = ptr + u8.length();
+            while (ptr < end) {
+                int bytes = 0;
+                uint32_t cp = GetNextCodepointFromUTF8(&ptr, &bytes);
+                if (bytes == 0 || (cp == 0xFFFD && bytes == 1)) return false; // Embedded NUL / invalid UTF-8
+                if (cp < 0x0300) continue;
+                if (cp <= 0x036F) return false;                    // Combining diacritics
+                if (cp >= 0x0590 && cp <= 0x08FF) return false;    // Hebrew, Arabic, Syriac, Thaana, NKo, ...
+                if (cp >= 0x0900 && cp <= 0x109F) return false;    // Indic, Thai, Lao, Tibetan, Myanmar
+                if (cp >= 0x1100 && cp <= 0x11FF) return false;    // Hangul conjoining jamo
+                if (cp >= 0x1780 && cp <= 0x18AF) return false;    // Khmer, Mongolian
+                if (cp >= 0x1A00 && cp <= 0x1DFF) return false;    // Tai scripts, Balinese, ..., combining marks
+                if (cp >= 0x200B && cp <= 0x200F) return false;    // ZWSP/ZWNJ/ZWJ, LRM/RLM
+                if (cp >= 0x202A && cp <= 0x202E) return false;    // BiDi embeddings/overrides
+                if (cp >= 0x2066 && cp <= 0x2069) return false;    // BiDi isolates
+                if (cp >= 0x20D0 && cp <= 0x20FF) return false;    // Combining marks for symbols
+                if (cp >= 0xA800 && cp <= 0xABFF) return false;    // Assorted Brahmic/SE Asian blocks
+                if (cp >= 0xFB1D && cp <= 0xFDFF) return false;    // Hebrew/Arabic presentation forms
+                if (cp >= 0xFE00 && cp <= 0xFE2F) return false;    // Variation selectors, combining half marks
+                if (cp >= 0xFE70 && cp <= 0xFEFF) return false;    // Arabic presentation forms-B, BOM
+                if (cp >= 0x10800 && cp <= 0x10FFF) return false;  // Historic RTL scripts
+                if (cp >= 0x11000 && cp <= 0x11FFF) return false;  // Historic Brahmic scripts
+                if (cp >= 0x1E800 && cp <= 0x1EFFF) return false;  // Adlam, Arabic math, ...
+                if (cp >= 0xE0000) return false;                   // Tags, variation selectors supplement
             }
-            finalizedLine.numElementsInLine = pendingElements.size();
-
+            return true;
+        }
 
-            // Line alignment calculation
-            float linePhysicalStartX = isFirstLineOfPara ? pStyle.firstLineIndent : 0.0f;
-            float visualLineWidthWithIndentActual = linePhysicalStartX + finalizedLine.lineWidth;
-            float lineShiftX = 0;
-            float effectiveWrapWidthForAlign = pStyle.wrapWidth > 0 ? pStyle.wrapWidth : visualLineWidthWithIndentActual;
-            // Ensure effectiveWrapWidth is not zero if there's content, to avoid division by zero or huge shifts
-            if (effectiveWrapWidthForAlign < 0.01f && visualLineWidthWithIndentActual > 0.01f) effectiveWrapWidthForAlign = visualLineWidthWithIndentActual;
+        static bool IsCJKBreakable(uint32_t cp) {
+            return (cp >= 0x2E80 && cp <= 0x9FFF) ||   // CJK radicals, punctuation, kana, ideographs
+                   (cp >= 0xAC00 && cp <= 0xD7AF) ||   // Hangul syllables
+                   (cp >= 0xF900 && cp <= 0xFAFF) ||   // CJK compatibility ideographs
+                   (cp >= 0xFF00 && cp <= 0xFFEF) ||   // Full-width forms
+                   (cp >= 0x20000 && cp <= 0x3FFFF);   // CJK extensions
+        }
 
-            if (pStyle.alignment == HorizontalAlignment::RIGHT && visualLineWidthWithIndentActual < effectiveWrapWidthForAlign) {
-                lineShiftX = effectiveWrapWidthForAlign - visualLineWidthWithIndentActual;
-            } else if (pStyle.alignment == HorizontalAlignment::CENTER && visualLineWidthWithIndentActual < effectiveWrapWidthForAlign) {
-                lineShiftX = (effectiveWrapWidthForAlign - visualLineWidthWithIndentActual) / 2.0f;
+        // Minimal kinsoku: CJK closing punctuation never starts a line, opening brackets never end one.
+        static bool IsNoBreakBefore(uint32_t cp) {
+            switch (cp) {
+                case 0x3001: case 0x3002: case 0x300D: case 0x300F: case 0x3011: case 0x30FC:
+                case 0xFF01: case 0xFF09: case 0xFF0C: case 0xFF0E: case 0xFF1A: case 0xFF1B: case 0xFF1F: case 0xFF3D: case 0xFF5D:
+                    return true;
+                default:
+                    return cp == ',' || cp == '.' || cp == ')' || cp == ']' || cp == '}' || cp == '!' || cp == '?' || cp == ':' || cp == ';';
             }
+        }
 
-            // Apply alignment shift to elements of this line
-            if (fabsf(lineShiftX) > 0.001f) {
-                for(size_t i = 0; i < finalizedLine.numElementsInLine; ++i) {
-                    size_t el_idx = finalizedLine.firstElementIndexInBlockElements + i;
-                    if (el_idx < textBlock.elements.size()) { // Ensure element exists
-                        std::visit([lineShiftX](auto&& arg) { arg.position.x += lineShiftX; }, textBlock.elements[el_idx]);
-                    }
+        static bool IsNoBreakAfter(uint32_t cp) {
+            return cp == 0x300C || cp == 0x300E || cp == 0x3010 || cp == 0xFF08 || cp == 0xFF3B || cp == 0xFF5B ||
+                   cp == '(' || cp == '[' || cp == '{';
+        }
+
+        // UTF-8 native break finder for IsSimpleLTRText text: breaks after runs of spaces/tabs, around CJK characters
+        // and (hard) after '\n'. The end of the text is always reported.
+        static void FindSimpleLineBreaks(std::string_view u8, std::pmr::vector<std::pair<uint32_t, bool>>& outBreaks) {
+            const char* base = u8.data();
+            const uint32_t len = (uint32_t)u8.length();
+            uint32_t pos = 0, prevCp = 0;
+            while (pos < len) {
+                const char* ptr = base + pos;
+                int bytes = 0;
+                uint32_t cp = GetNextCodepointFromUTF8(&ptr, &bytes);
+                if (bytes <= 0) bytes = 1;
+                if (pos > 0 && prevCp != '\n') {
+                    bool afterSpace = (prevCp == ' ' || prevCp == '\t') && cp != ' ' && cp != '\t' && cp != '\n';
+                    bool aroundCJK = (IsCJKBreakable(prevCp) || IsCJKBreakable(cp)) && cp != ' ' && cp != '\n' && prevCp != ' ';
+                    if ((afterSpace || aroundCJK) && !IsNoBreakBefore(cp) && !IsNoBreakAfter(prevCp)) outBreaks.push_back({pos, false});
                 }
+                if (cp == '\n') outBreaks.push_back({pos + bytes, true});
+                prevCp = cp;
+                pos += bytes;
             }
-            overallMaxVisualLineWidthInOut = std::max(overallMaxVisualLineWidthInOut, visualLineWidthWithIndentActual + (lineShiftX > 0 ? lineShiftX : 0.0f) );
+            if (outBreaks.empty() || outBreaks.back().first != len) outBreaks.push_back({len, true});
+        }
 
+        // Advance of bytes [fromU8, toU8) from the initial shaping. Trailing white space hangs past the wrap width.
+        static float MeasureLineAdvance(std::string_view u8, const float* advancePrefix, uint32_t fromU8, uint32_t toU8) {
+            while (toU8 > fromU8 && (u8[toU8 - 1] == ' ' || u8[toU8 - 1] == '\t' || u8[toU8 - 1] == '\n' || u8[toU8 - 1] == '\r')) --toU8;
+            return advancePrefix[toU8] - advancePrefix[fromU8];
+        }
 
-            // Line height and baseline calculation
-            finalizedLine.lineBoxHeight = calculateLineBoxHeight(pStyle, defaultPStyleMetrics, finalizedLine.maxContentAscent, finalizedLine.maxContentDescent, paraDefaultFontSize);
-            finalizedLine.baselineYInBox = finalizedLine.maxContentAscent; // Default baseline at max ascent
-            // Adjust baseline if line box is taller due to fixed line height settings (distribute extra space)
-            if (finalizedLine.lineBoxHeight > (finalizedLine.maxContentAscent + finalizedLine.maxContentDescent) + 0.001f &&
-                pStyle.lineHeightType != LineHeightType::CONTENT_SCALED) {
-                finalizedLine.baselineYInBox += (finalizedLine.lineBoxHeight - (finalizedLine.maxContentAscent + finalizedLine.maxContentDescent)) / 2.0f;
+        // Greedy line breaking over (byte offset, is hard break) opportunities; emitLine(startU8, endU8) is called per line.
+        // Shared by layoutParagraphShapeThenBreak and Rewrap so both always pick the same lines.
+        template <typename MeasureFn, typename EmitLineFn>
+        static void BreakLinesGreedy(const std::pair<uint32_t, bool>* opportunities, size_t opportunityCount, uint32_t textLenU8,
+                                     const ParagraphStyle& paragraphStyle, MeasureFn&& measure, EmitLineFn&& emitLine) {
+            bool isFirstLine = true;
+            size_t lineCount = 0;
+            auto emit = [&](uint32_t startU8, uint32_t endU8) { emitLine(startU8, endU8); isFirstLine = false; ++lineCount; };
+            uint32_t lineStartU8 = 0, lastFitU8 = 0;
+            for (size_t i = 0; i < opportunityCount; ++i) {
+                const auto& [breakU8, isHardBreak] = opportunities[i];
+                float lineStartX = isFirstLine ? paragraphStyle.firstLineIndent : 0.0f;
+                if (paragraphStyle.wrapWidth > 0 && lastFitU8 > lineStartU8 &&
+                    lineStartX + measure(lineStartU8, breakU8) > paragraphStyle.wrapWidth) {
+                    emit(lineStartU8, lastFitU8);
+                    lineStartU8 = lastFitU8; // Whatever still overflows from here has no earlier opportunity
+                }
+                lastFitU8 = breakU8;
+                if (isHardBreak || breakU8 >= textLenU8) {
+                    emit(lineStartU8, breakU8);
+                    lineStartU8 = breakU8;
+                }
             }
-            finalizedLine.lineBoxY = currentLineBoxTopY;
+            if (lineStartU8 < textLenU8 || lineCount == 0) emit(lineStartU8, textLenU8);
+        }
 
+        // BiDi levels of one line as ubidi_setLine resolves them: rule L1 puts trailing white space on the paragraph level.
+        static void ResolveLineLevels(const UBiDiLevel* paraLevels, std::u16string_view paraU16Text, int32_t start, int32_t limit,
+                                      UBiDiLevel paraLevel, std::pmr::vector<UBiDiLevel>& outLevels) {
+            outLevels.assign(paraLevels + start, paraLevels + limit);
+            for (int32_t i = limit; i > start; --i) {
+                UCharDirection dir = u_charDirection(paraU16Text[i - 1]);
+                if (dir != U_WHITE_SPACE_NEUTRAL && dir != U_SEGMENT_SEPARATOR && dir != U_BLOCK_SEPARATOR && dir != U_BOUNDARY_NEUTRAL) break;
+                outLevels[i - 1 - start] = paraLevel;
+            }
+        }
 
-            // --- Build VisualRun list for this line ---
-            finalizedLine.visualRuns.clear();
-            if (!pendingElements.empty()) {
-                size_t currentRunStartIdxInLine = 0; // Index within pendingElements for this line
+        // Logical text range with a single span, a single BiDi level and no hard newline, shaped once in paragraph context.
+        struct ShapedItem {
+            uint32_t u8Start = 0, u8End = 0; // Byte range in the block text
+            size_t spanIdx = 0;
+            bool isRTL = false;
+            FontId fontId = INVALID_FONT_ID;
+            float fontSize = 0.0f;
+            ScaledFontMetrics metrics;
+            hb_buffer_t* hbBuf = nullptr;     // nullptr when no valid font could be resolved
+        };
+
+        // Glyphs [outBegin, outEnd) of a shaped item whose clusters lie in [startU8, endU8) (O(log n)). Clusters are
+        // monotonic in glyph order: ascending for LTR buffers, descending for RTL ones, so the piece is one contiguous slice.
+        static void FindGlyphSliceForBytes(const hb_glyph_info_t* infos, unsigned int count, bool isRTL, uint32_t startU8, uint32_t endU8,
+                                           unsigned int& outBegin, unsigned int& outEnd) {
+            const hb_glyph_info_t* end = infos + count;
+            if (!isRTL) {
+                outBegin = (unsigned int)(std::partition_point(infos, end, [startU8](const hb_glyph_info_t& g) { return g.cluster < startU8; }) - infos);
+                outEnd = (unsigned int)(std::partition_point(infos, end, [endU8](const hb_glyph_info_t& g) { return g.cluster < endU8; }) - infos);
+            } else {
+                outBegin = (unsigned int)(std::partition_point(infos, end, [endU8](const hb_glyph_info_t& g) { return g.cluster >= endU8; }) - infos);
+                outEnd = (unsigned int)(std::partition_point(infos, end, [startU8](const hb_glyph_info_t& g) { return g.cluster >= startU8; }) - infos);
+            }
+            if (outEnd < outBegin) outEnd = outBegin;
+        }
 
-                // Initialize current run properties from the first element or paragraph defaults
-                PositionedGlyph::BiDiDirectionHint currentRunDir = PositionedGlyph::BiDiDirectionHint::UNSPECIFIED;
-                FontId currentRunFont = pStyle.defaultCharacterStyle.fontId;
-                if (!IsFontValid(currentRunFont)) currentRunFont = defaultFontId_; // Engine default
-                if (!IsFontValid(currentRunFont) && !loadedFonts_.empty()) currentRunFont = loadedFonts_.begin()->first; // Absolute fallback
+        // Shapes every style run of the paragraph once, picks line break opportunities greedily using the shaped advances,
+        // and only reshapes line edges that HarfBuzz marks unsafe to break.
+        // paraBiDi == nullptr selects the simple-LTR fast path (see IsSimpleLTRText): no ICU at all, one LTR run per line and
+        // opportunities from FindSimpleLineBreaks; fullU16Text is then unused. Otherwise opportunities come from UBRK_LINE.
+        // With measureOut set, nothing is added to textBlock: lines are only measured (no elements, no atlas rasterization,
+        // no BiDi maps) and lineCount/min-/max-content widths are reported; block height/width still come back through
+        // currentLineBoxTopY/overallMaxVisualLineWidth.
+        // Otherwise textBlock.shapingCache is filled for Rewrap unless some line edge had to be reshaped.
+        // Returns false (textBlock untouched) if the line break iterator is unavailable, so the caller can fall back to segment layout.
+        bool layoutParagraphShapeThenBreak(TextBlock& textBlock, const std::vector<TextSpan>& spans, const ParagraphStyle& paragraphStyle,
+                                           const std::pmr::vector<SpanMapEntry>& spanMap, const std::pmr::vector<SpanShapingProps>& spanShapingProps,
+                                           std::u16string_view fullU16Text, UBiDi* paraBiDi, UBiDi* lineBiDiView, UBiDiLevel paraLevel,
+                                           FontId paraDefFontId, float paraDefFontSize, const ScaledFontMetrics& paraDefaultMetrics,
+                                           float& currentLineBoxTopY, float& overallMaxVisualLineWidth,
+                                           TextMeasurement* measureOut = nullptr) {
+            const bool simpleLTR = (paraBiDi == nullptr);
+            std::pmr::memory_resource* scratch = &layout_arena_; // Released by the caller (layoutParagraph)
+            const std::pmr::string& fullU8Text = textBlock.sourceTextConcatenated;
+            const uint32_t textLenU8 = (uint32_t)fullU8Text.length();
+            const int32_t textLenU16 = simpleLTR ? Utf16LengthOfUtf8(fullU8Text) : (int32_t)fullU16Text.length();
+
+            std::pmr::vector<std::pair<uint32_t, bool>> breakOpportunities(scratch); // (byte offset, is hard break), ascending
+            if (simpleLTR) {
+                FindSimpleLineBreaks(fullU8Text, breakOpportunities);
+            } else {
+                const char* localeForBreaks = paragraphStyle.defaultCharacterStyle.languageTag.empty() ? uloc_getDefault() : paragraphStyle.defaultCharacterStyle.languageTag.c_str();
+                UBreakIterator* lineBreakIter = acquireBreakIterator(UBRK_LINE, localeForBreaks);
+                if (!lineBreakIter) lineBreakIter = acquireBreakIterator(UBRK_LINE, uloc_getDefault());
+                if (!lineBreakIter) { TraceLog(LOG_WARNING, "FTTextEngine: UBRK_LINE unavailable, using segment layout."); return false; }
+                UErrorCode icu_status = U_ZERO_ERROR;
+                ubrk_setText(lineBreakIter, reinterpret_cast<const UChar*>(fullU16Text.data()), textLenU16, &icu_status);
+                if (U_FAILURE(icu_status)) { TraceLog(LOG_WARNING, "FTTextEngine: ubrk_setText (line) failed: %s", u_errorName(icu_status)); return false; }
+                ubrk_first(lineBreakIter);
+                for (int32_t breakU16 = ubrk_next(lineBreakIter); breakU16 != UBRK_DONE; breakU16 = ubrk_next(lineBreakIter)) {
+                    int32_t ruleStatus = ubrk_getRuleStatus(lineBreakIter);
+                    breakOpportunities.push_back({(uint32_t)breakU16, ruleStatus >= UBRK_LINE_HARD && ruleStatus < UBRK_LINE_HARD_LIMIT}); // U16 for now, mapped below
+                }
+            }
 
-                float currentRunSize = pStyle.defaultCharacterStyle.fontSize;
-                if (currentRunSize <= 0) currentRunSize = paraDefaultFontSize;
+            // UTF-8 <-> UTF-16 offset tables, valid at code point boundaries
+            std::pmr::vector<uint32_t> u16ToU8(textLenU16 + 1, textLenU8, scratch);
+            std::pmr::vector<int32_t> u8ToU16(textLenU8 + 1, textLenU16, scratch);
+            {
+                uint32_t p8 = 0; int32_t p16 = 0;
+                while (p8 < textLenU8 && p16 < textLenU16) {
+                    const char* ptr = fullU8Text.c_str() + p8;
+                    int bytes = 0;
+                    uint32_t cp = GetNextCodepointFromUTF8(&ptr, &bytes);
+                    if (bytes <= 0) bytes = 1;
+                    u8ToU16[p8] = p16; u16ToU8[p16] = p8;
+                    if (cp > 0xFFFF && p16 + 1 < textLenU16) u16ToU8[p16 + 1] = p8;
+                    p8 += bytes; p16 += (cp > 0xFFFF) ? 2 : 1;
+                }
+            }
+            if (!simpleLTR) {
+                for (auto& bo : breakOpportunities) bo.first = u16ToU8[std::min((int32_t)bo.first, textLenU16)];
+            }
 
-                std::string currentRunScript = pStyle.defaultCharacterStyle.scriptTag;
-                if (currentRunScript.empty()) currentRunScript = "auto"; // Default for HarfBuzz if not specified
-                std::string currentRunLang = pStyle.defaultCharacterStyle.languageTag;
-                if (currentRunLang.empty()) currentRunLang = "und";
+            // --- 1. Itemize (span x BiDi level x hard newline) and shape each item once ---
+            std::pmr::vector<ShapedItem> items(scratch);
+            size_t spanCursor = 0;
+            uint32_t pos = 0;
+            while (pos < textLenU8) {
+                if (fullU8Text[pos] == '\n') { ++pos; continue; }
+                while (spanCursor + 1 < spanMap.size() && pos >= spanMap[spanCursor].u8_start_offset_in_full + spanMap[spanCursor].u8_length_in_full) ++spanCursor;
+                uint32_t end = std::min(textLenU8, spanMap[spanCursor].u8_start_offset_in_full + spanMap[spanCursor].u8_length_in_full);
+                UBiDiLevel level = 0;
+                if (!simpleLTR) {
+                    int32_t logicalLimitU16 = textLenU16; level = paraLevel;
+                    ubidi_getLogicalRun(paraBiDi, u8ToU16[pos], &logicalLimitU16, &level);
+                    end = std::min(end, u16ToU8[std::min(logicalLimitU16, textLenU16)]);
+                }
+                size_t newlinePos = fullU8Text.find('\n', pos);
+                if (newlinePos != std::string::npos && newlinePos < end) end = (uint32_t)newlinePos;
+                if (end <= pos) end = pos + 1; // Defensive: always make progress
+
+                ShapedItem item;
+                item.u8Start = pos; item.u8End = end;
+                item.spanIdx = spanMap[spanCursor].originalSpanIndex;
+                item.isRTL = (level & 1) != 0;
+                const CharacterStyle& itemStyle = spans[item.spanIdx].style;
+                item.fontId = IsFontValid(itemStyle.fontId) ? itemStyle.fontId : paraDefFontId;
+                item.fontSize = itemStyle.fontSize > 0 ? itemStyle.fontSize : paraDefFontSize;
+                if (IsFontValid(item.fontId)) {
+                    item.metrics = GetScaledFontMetrics(item.fontId, item.fontSize);
+                    item.hbBuf = shapeTextRange(fullU8Text, item.u8Start, item.u8End - item.u8Start, item.isRTL,
+                                                spanShapingProps[item.spanIdx], item.fontId, loadedFonts_.at(item.fontId), item.fontSize);
+                }
+                items.push_back(item);
+                pos = end;
+            }
 
+            // Advance of each byte range, from the initial shaping: prefix[b] - prefix[a]
+            std::pmr::vector<float> advancePrefix(textLenU8 + 1, 0.0f, scratch);
+            for (const auto& item : items) {
+                if (!item.hbBuf) continue;
+                unsigned int count = 0;
+                hb_glyph_info_t* infos = hb_buffer_get_glyph_infos(item.hbBuf, &count);
+                hb_glyph_position_t* positions = hb_buffer_get_glyph_positions(item.hbBuf, &count);
+                for (unsigned int i = 0; i < count; ++i) {
+                    if (infos[i].cluster < textLenU8) advancePrefix[infos[i].cluster + 1] += (float)positions[i].x_advance / 64.0f;
+                }
+            }
+            for (uint32_t i = 0; i < textLenU8; ++i) advancePrefix[i + 1] += advancePrefix[i];
+
+            // Cluster safety per byte, built once: a line may start/end at a byte inside an item without reshaping only if
+            // a glyph cluster begins exactly there and HarfBuzz did not flag it HB_GLYPH_FLAG_UNSAFE_TO_BREAK
+            std::pmr::vector<uint8_t> clusterSafety(textLenU8 + 1, 0, scratch); // 0: no cluster starts here, 1: safe, 2: unsafe
+            for (const auto& item : items) {
+                if (!item.hbBuf) continue;
+                unsigned int count = 0;
+                hb_glyph_info_t* infos = hb_buffer_get_glyph_infos(item.hbBuf, &count);
+                for (unsigned int i = 0; i < count; ++i) {
+                    if (infos[i].cluster > textLenU8) continue;
+                    uint8_t& safety = clusterSafety[infos[i].cluster];
+                    safety = (hb_glyph_info_get_glyph_flags(&infos[i]) & HB_GLYPH_FLAG_UNSAFE_TO_BREAK) ? 2 : std::max<uint8_t>(safety, 1);
+                }
+            }
+            auto pieceNeedsReshape = [&clusterSafety](const ShapedItem& item, uint32_t pieceStart, uint32_t pieceEnd) {
+                return (pieceStart > item.u8Start && clusterSafety[pieceStart] != 1) || (pieceEnd < item.u8End && clusterSafety[pieceEnd] != 1);
+            };
 
-                std::visit([&](const auto& el_v){ // Initialize from the first element's actual properties
-                    using T = std::decay_t<decltype(el_v)>;
-                    if constexpr (std::is_same_v<T, PositionedGlyph>) {
-                        currentRunDir = el_v.visualRunDirectionHint; // This was set in LayoutStyledText
-                        currentRunFont = el_v.sourceFont;
-                        currentRunSize = el_v.sourceSize;
+            // Width-independent state for Rewrap; dropped as soon as a line edge has to be reshaped
+            std::shared_ptr<TextBlockShapingCache> rewrapCache;
+            if (!measureOut) {
+                rewrapCache = std::make_shared<TextBlockShapingCache>();
+                rewrapCache->runs.reserve(items.size());
+                for (const ShapedItem& item : items) rewrapCache->runs.push_back({(uint32_t)item.spanIdx, item.fontId, item.fontSize, item.metrics});
+                for (const auto& bo : breakOpportunities) { // Same test as pieceNeedsReshape, for opportunities inside an item
+                    auto itemIt = std::partition_point(items.begin(), items.end(), [&bo](const ShapedItem& it) { return it.u8End <= bo.first; });
+                    if (itemIt != items.end() && itemIt->hbBuf && itemIt->u8Start < bo.first && clusterSafety[bo.first] != 1) {
+                        rewrapCache->unsafeBreaks.push_back(bo.first);
+                    }
+                }
+                rewrapCache->breakOpportunities.assign(breakOpportunities.begin(), breakOpportunities.end());
+            }
+
+            // --- 2. Build one line's elements in visual order, reshaping only unsafe edges ---
+            bool isFirstLineOfParagraph = true;
+            size_t linesEmitted = 0;
+            auto measureLine = [&](uint32_t lineStartU8, uint32_t lineEndU8) { // measureOut mode: logical order is enough for extents
+                if (lineStartU8 >= lineEndU8 && lineStartU8 != 0) return; // Same skip rule as finalizeCurrentLine
+                float lineWidth = 0.0f;
+                float lineMaxAscent = paraDefaultMetrics.ascent, lineMaxDescent = paraDefaultMetrics.descent;
+                auto firstItemIt = std::partition_point(items.begin(), items.end(), [lineStartU8](const ShapedItem& it) { return it.u8End <= lineStartU8; });
+                for (auto it = firstItemIt; it != items.end() && it->u8Start < lineEndU8; ++it) {
+                    const ShapedItem& item = *it;
+                    if (!item.hbBuf) continue;
+                    uint32_t pieceStart = std::max(lineStartU8, item.u8Start), pieceEnd = std::min(lineEndU8, item.u8End);
+                    unsigned int count = 0;
+                    hb_glyph_info_t* infos = hb_buffer_get_glyph_infos(item.hbBuf, &count);
+                    hb_glyph_position_t* positions = hb_buffer_get_glyph_positions(item.hbBuf, &count);
+                    const CharacterStyle& itemStyle = spans[item.spanIdx].style;
+                    if (pieceNeedsReshape(item, pieceStart, pieceEnd)) {
+                        hb_buffer_t* pieceBuf = shapeTextRange(fullU8Text, pieceStart, pieceEnd - pieceStart, item.isRTL,
+                                                               spanShapingProps[item.spanIdx], item.fontId, loadedFonts_.at(item.fontId), item.fontSize);
+                        infos = hb_buffer_get_glyph_infos(pieceBuf, &count);
+                        positions = hb_buffer_get_glyph_positions(pieceBuf, &count);
+                        measureShapedGlyphs(infos, positions, 0, count, itemStyle, item.fontId, item.fontSize, item.metrics, lineWidth, lineMaxAscent, lineMaxDescent);
+                        releaseHbBuffer(pieceBuf);
+                    } else {
+                        unsigned int glyphBegin = 0, glyphEnd = 0;
+                        FindGlyphSliceForBytes(infos, count, item.isRTL, pieceStart, pieceEnd, glyphBegin, glyphEnd);
+                        measureShapedGlyphs(infos, positions, glyphBegin, glyphEnd, itemStyle, item.fontId, item.fontSize, item.metrics, lineWidth, lineMaxAscent, lineMaxDescent);
+                    }
+                }
+                float visualLineWidthWithIndent = 0.0f;
+                float lineShiftX = ComputeLineAlignmentShift(paragraphStyle, isFirstLineOfParagraph, lineWidth, visualLineWidthWithIndent);
+                overallMaxVisualLineWidth = std::max(overallMaxVisualLineWidth, visualLineWidthWithIndent + (lineShiftX > 0 ? lineShiftX : 0.0f));
+                currentLineBoxTopY += calculateLineBoxHeight(paragraphStyle, paraDefaultMetrics, lineMaxAscent, lineMaxDescent, paraDefFontSize);
+                ++linesEmitted;
+            };
+            std::pmr::vector<PositionedElementVariant> lineElements(scratch); // Per-line scratch, capacity reused across lines
+            std::pmr::vector<size_t> runItems(scratch);                       // Items of one visual run; logical order, reversed for RTL runs
+            auto emitLine = [&](uint32_t lineStartU8, uint32_t lineEndU8) {
+                if (measureOut) { measureLine(lineStartU8, lineEndU8); isFirstLineOfParagraph = false; return; }
+                lineElements.clear();
+                float linePenX = 0.0f;
+                float lineMaxAscent = paraDefaultMetrics.ascent, lineMaxDescent = paraDefaultMetrics.descent;
+                int32_t lineStartU16 = u8ToU16[lineStartU8], lineEndU16 = u8ToU16[lineEndU8];
+
+                bool hasLineView = lineStartU16 < lineEndU16 &&
+                                   (simpleLTR || setBiDiLineView(lineBiDiView, paraBiDi, fullU16Text, lineStartU16, lineEndU16, paraLevel));
+                if (hasLineView) {
+                    UErrorCode run_status = U_ZERO_ERROR;
+                    int32_t runCount = simpleLTR ? 1 : ubidi_countRuns(lineBiDiView, &run_status);
+                    if (U_FAILURE(run_status)) runCount = 0;
+                    for (int32_t r = 0; r < runCount; ++r) {
+                        int32_t runLogicalStart = 0, runLength = lineEndU16 - lineStartU16;
+                        UBiDiDirection runDir = simpleLTR ? UBIDI_LTR : ubidi_getVisualRun(lineBiDiView, r, &runLogicalStart, &runLength);
+                        uint32_t runStartU8 = u16ToU8[lineStartU16 + runLogicalStart];
+                        uint32_t runEndU8 = u16ToU8[lineStartU16 + runLogicalStart + runLength];
+                        PositionedGlyph::BiDiDirectionHint runDirHint = (runDir == UBIDI_RTL) ? PositionedGlyph::BiDiDirectionHint::RTL : PositionedGlyph::BiDiDirectionHint::LTR;
+
+                        runItems.clear();
+                        auto firstItemIt = std::partition_point(items.begin(), items.end(), [runStartU8](const ShapedItem& it) { return it.u8End <= runStartU8; });
+                        for (size_t k = firstItemIt - items.begin(); k < items.size() && items[k].u8Start < runEndU8; ++k) runItems.push_back(k);
+                        if (runDir == UBIDI_RTL) std::reverse(runItems.begin(), runItems.end());
+
+                        for (size_t k : runItems) {
+                            const ShapedItem& item = items[k];
+                            if (!item.hbBuf) continue;
+                            uint32_t pieceStart = std::max(runStartU8, item.u8Start), pieceEnd = std::min(runEndU8, item.u8End);
+                            if (pieceStart >= pieceEnd) continue;
+
+                            unsigned int count = 0;
+                            hb_glyph_info_t* infos = hb_buffer_get_glyph_infos(item.hbBuf, &count);
+                            hb_glyph_position_t* positions = hb_buffer_get_glyph_positions(item.hbBuf, &count);
+                            hb_buffer_t* pieceBuf = nullptr;
+                            unsigned int glyphBegin = 0, glyphEnd = 0;
+                            if (pieceNeedsReshape(item, pieceStart, pieceEnd)) {
+                                rewrapCache.reset();
+                                pieceBuf = shapeTextRange(fullU8Text, pieceStart, pieceEnd - pieceStart, item.isRTL,
+                                                          spanShapingProps[item.spanIdx], item.fontId, loadedFonts_.at(item.fontId), item.fontSize);
+                                infos = hb_buffer_get_glyph_infos(pieceBuf, &count);
+                                positions = hb_buffer_get_glyph_positions(pieceBuf, &count);
+                                glyphEnd = count;
+                            } else {
+                                FindGlyphSliceForBytes(infos, count, item.isRTL, pieceStart, pieceEnd, glyphBegin, glyphEnd);
+                            }
+                            float piecePenX = 0.0f, piecePenY = 0.0f;
+                            if (glyphBegin < glyphEnd) {
+                                size_t pieceFirstElement = lineElements.size();
+                                emitShapedGlyphs(infos, positions, glyphBegin, glyphEnd, fullU8Text, 0, item.spanIdx, spans, spanMap,
+                                                 spans[item.spanIdx].style, item.fontId, item.fontSize, item.metrics, runDirHint,
+                                                 linePenX, piecePenX, piecePenY, lineElements, lineMaxAscent, lineMaxDescent);
+                                if (rewrapCache) { // One element per glyph; stored in logical order
+                                    size_t firstRecord = rewrapCache->glyphs.size();
+                                    float recordPenX = linePenX;
+                                    for (size_t e = pieceFirstElement; e < lineElements.size(); ++e) {
+                                        TextBlockShapingCache::ShapedGlyph record;
+                                        record.u8Cluster = infos[glyphBegin + (e - pieceFirstElement)].cluster;
+                                        record.runIdx = (uint32_t)k;
+                                        if (const PositionedGlyph* glyph = std::get_if<PositionedGlyph>(&lineElements[e])) {
+                                            record.glyphId = glyph->glyphId;
+                                            record.byteOffsetInSpan = glyph->sourceCharByteOffsetInSpan; record.numBytesInSpan = glyph->numSourceCharBytesInSpan;
+                                            record.xOffsetFromPen = glyph->position.x - recordPenX; record.positionY = glyph->position.y;
+                                            record.xOffset = glyph->xOffset; record.yOffset = glyph->yOffset;
+                                            record.xAdvance = glyph->xAdvance; record.yAdvance = glyph->yAdvance;
+                                            record.ascent = glyph->ascent; record.descent = glyph->descent;
+                                            record.visualLeft = glyph->visualLeft; record.visualRight = glyph->visualRight;
+                                        } else {
+                                            const PositionedImage& image = std::get<PositionedImage>(lineElements[e]);
+                                            record.isImage = true;
+                                            record.byteOffsetInSpan = image.sourceCharByteOffsetInSpan; record.numBytesInSpan = image.numSourceCharBytesInSpan;
+                                            record.xOffsetFromPen = image.position.x - recordPenX; record.positionY = image.position.y;
+                                            record.xAdvance = image.penAdvanceX;
+                                            record.ascent = image.ascent; record.descent = image.descent;
+                                        }
+                                        recordPenX += record.xAdvance;
+                                        rewrapCache->glyphs.push_back(record);
+                                    }
+                                    if (item.isRTL) std::reverse(rewrapCache->glyphs.begin() + firstRecord, rewrapCache->glyphs.end());
+                                }
+                            }
+                            if (pieceBuf) releaseHbBuffer(pieceBuf);
+                            linePenX += piecePenX;
+                        }
+                    }
+                }
+
+                LineLayoutInfo lineInfoTemplate;
+                lineInfoTemplate.firstElementIndexInBlockElements = textBlock.elements.size();
+                lineInfoTemplate.sourceTextByteStartIndexInBlockText = lineStartU8;
+                lineInfoTemplate.maxContentAscent = paraDefaultMetrics.ascent; lineInfoTemplate.maxContentDescent = paraDefaultMetrics.descent;
+                finalizeCurrentLine(textBlock, lineElements, lineInfoTemplate, linePenX,
+                                    lineMaxAscent, lineMaxDescent, currentLineBoxTopY,
+                                    isFirstLineOfParagraph, paragraphStyle, paraDefaultMetrics, paraDefFontSize,
+                                    lineEndU8, overallMaxVisualLineWidth,
+                                    fullU16Text, paraBiDi, lineBiDiView, paraLevel, lineStartU16, lineEndU16);
+                linesEmitted = textBlock.lines.size();
+                isFirstLineOfParagraph = false;
+            };
+
+            // --- 3. Greedy line breaking over the break opportunities ---
+            auto measure = [&](uint32_t fromU8, uint32_t toU8) { return MeasureLineAdvance(fullU8Text, advancePrefix.data(), fromU8, toU8); };
+            BreakLinesGreedy(breakOpportunities.data(), breakOpportunities.size(), textLenU8, paragraphStyle, measure, emitLine);
+
+            if (measureOut) { // Intrinsic widths: widest unbreakable fragment / widest hard-broken line
+                measureOut->lineCount = linesEmitted;
+                float minContent = 0.0f, maxContent = 0.0f;
+                uint32_t fragmentStartU8 = 0, hardLineStartU8 = 0;
+                for (const auto& [breakU8, isHardBreak] : breakOpportunities) {
+                    minContent = std::max(minContent, (fragmentStartU8 == 0 ? paragraphStyle.firstLineIndent : 0.0f) + measure(fragmentStartU8, breakU8));
+                    fragmentStartU8 = breakU8;
+                    if (isHardBreak || breakU8 >= textLenU8) {
+                        maxContent = std::max(maxContent, (hardLineStartU8 == 0 ? paragraphStyle.firstLineIndent : 0.0f) + measure(hardLineStartU8, breakU8));
+                        hardLineStartU8 = breakU8;
+                    }
+                }
+                measureOut->minContentWidth = minContent;
+                measureOut->maxContentWidth = std::max(maxContent, minContent);
+            }
+
+            if (rewrapCache) {
+                std::stable_sort(rewrapCache->glyphs.begin(), rewrapCache->glyphs.end(),
+                                 [](const TextBlockShapingCache::ShapedGlyph& a, const TextBlockShapingCache::ShapedGlyph& b) { return a.u8Cluster < b.u8Cluster; });
+                rewrapCache->advancePrefix.assign(advancePrefix.begin(), advancePrefix.end());
+                rewrapCache->u8ToU16.assign(u8ToU16.begin(), u8ToU16.end());
+                if (!simpleLTR) {
+                    UErrorCode levels_status = U_ZERO_ERROR;
+                    const UBiDiLevel* levels = ubidi_getLevels(paraBiDi, &levels_status);
+                    if (U_SUCCESS(levels_status) && levels) {
+                        rewrapCache->levelsU16.assign(levels, levels + textLenU16);
+                        rewrapCache->u16Text.assign(fullU16Text);
+                    } else {
+                        rewrapCache.reset();
+                    }
+                }
+            }
+            if (rewrapCache) {
+                rewrapCache->paraLevel = paraLevel;
+                rewrapCache->paraDefaultMetrics = paraDefaultMetrics;
+                rewrapCache->paraDefFontSize = paraDefFontSize;
+                textBlock.shapingCache = std::move(rewrapCache);
+            }
+
+            for (auto& item : items) releaseHbBuffer(item.hbBuf);
+            return true;
+        }
+
+        // Rebuilds the element emitShapedGlyphs produced for a cached glyph, with its pen position at penX.
+        PositionedElementVariant makeElementFromShapedGlyph(const TextBlockShapingCache::GlyphRun& run, const TextBlockShapingCache::ShapedGlyph& record,
+                                                            const CharacterStyle& runStyle, PositionedGlyph::BiDiDirectionHint direction, float penX) {
+            if (record.isImage) {
+                PositionedImage pImg;
+                pImg.imageParams = runStyle.imageParams;
+                float imgRelBaselineY = ResolveInlineImageBox(pImg, run.fontSize, run.metrics);
+                pImg.sourceSpanIndex = run.spanIdx; pImg.sourceCharByteOffsetInSpan = record.byteOffsetInSpan; pImg.numSourceCharBytesInSpan = record.numBytesInSpan;
+                pImg.position = {penX + record.xOffsetFromPen, imgRelBaselineY};
+                pImg.penAdvanceX = record.xAdvance;
+                return pImg;
+            }
+            PositionedGlyph pGlyph;
+            pGlyph.glyphId = record.glyphId;
+            FontId actualFontForGIDCacheLookup = run.fontId;
+            pGlyph.renderInfo = getCachedGlyphByGID(run.fontId, record.glyphId, run.fontSize, actualFontForGIDCacheLookup).renderInfo;
+            pGlyph.sourceFont = actualFontForGIDCacheLookup; pGlyph.sourceSize = run.fontSize;
+            pGlyph.appliedStyle = runStyle;
+            pGlyph.xOffset = record.xOffset; pGlyph.yOffset = record.yOffset;
+            pGlyph.xAdvance = record.xAdvance; pGlyph.yAdvance = record.yAdvance;
+            pGlyph.visualRunDirectionHint = direction;
+            pGlyph.sourceSpanIndex = run.spanIdx; pGlyph.sourceCharByteOffsetInSpan = record.byteOffsetInSpan; pGlyph.numSourceCharBytesInSpan = record.numBytesInSpan;
+            pGlyph.ascent = record.ascent; pGlyph.descent = record.descent;
+            pGlyph.visualLeft = record.visualLeft; pGlyph.visualRight = record.visualRight;
+            pGlyph.position = {penX + record.xOffsetFromPen, record.positionY};
+            return pGlyph;
+        }
+
+        // Rewrap fast path: assigns lines again from textBlock.shapingCache, reusing the shaping results.
+        // Returns false (textBlock untouched) if one of the new line edges would need reshaping.
+        bool rewrapFromShapingCache(TextBlock& textBlock, const ParagraphStyle& paragraphStyle) {
+            std::shared_ptr<const TextBlockShapingCache> cacheRef = textBlock.shapingCache;
+            const TextBlockShapingCache& cache = *cacheRef;
+            layout_arena_.release();
+            std::pmr::memory_resource* scratch = &layout_arena_;
+            std::string_view fullU8Text = textBlock.sourceTextConcatenated;
+            const uint32_t textLenU8 = (uint32_t)fullU8Text.length();
+            if (cache.advancePrefix.size() != textLenU8 + 1) return false;
+            const SourceSpanList& spans = textBlock.GetSourceSpans();
+            for (const auto& run : cache.runs) if (run.spanIdx >= spans.size()) return false;
+
+            std::pmr::vector<std::pair<uint32_t, uint32_t>> lineRanges(scratch);
+            auto measure = [&](uint32_t fromU8, uint32_t toU8) { return MeasureLineAdvance(fullU8Text, cache.advancePrefix.data(), fromU8, toU8); };
+            BreakLinesGreedy(cache.breakOpportunities.data(), cache.breakOpportunities.size(), textLenU8, paragraphStyle, measure,
+                             [&lineRanges](uint32_t startU8, uint32_t endU8) { lineRanges.push_back({startU8, endU8}); });
+            for (const auto& [startU8, endU8] : lineRanges) {
+                if (std::binary_search(cache.unsafeBreaks.begin(), cache.unsafeBreaks.end(), startU8) ||
+                    std::binary_search(cache.unsafeBreaks.begin(), cache.unsafeBreaks.end(), endU8)) return false;
+            }
+
+            textBlock.elements.clear();
+            textBlock.lines.clear();
+            textBlock.paragraphStyleUsed = paragraphStyle;
+            const bool hasLevels = !cache.levelsU16.empty();
+            std::pmr::vector<PositionedElementVariant> lineElements(scratch);
+            std::pmr::vector<UBiDiLevel> lineLevels(scratch), elementLevels(scratch);
+            std::pmr::vector<int32_t> visualOrder(scratch);
+            float currentLineBoxTopY = 0.0f, overallMaxVisualLineWidth = 0.0f;
+            bool isFirstLineOfParagraph = true;
+            auto clusterBefore = [](const TextBlockShapingCache::ShapedGlyph& glyph, uint32_t u8) { return glyph.u8Cluster < u8; };
+            for (const auto& [startU8, endU8] : lineRanges) {
+                auto firstIt = std::lower_bound(cache.glyphs.begin(), cache.glyphs.end(), startU8, clusterBefore);
+                auto lastIt = std::lower_bound(firstIt, cache.glyphs.end(), endU8, clusterBefore);
+                int32_t elementCount = (int32_t)(lastIt - firstIt);
+                int32_t lineStartU16 = cache.u8ToU16[startU8], lineEndU16 = cache.u8ToU16[endU8];
+
+                visualOrder.resize(elementCount);
+                if (hasLevels && elementCount > 0) {
+                    ResolveLineLevels(cache.levelsU16.data(), cache.u16Text, lineStartU16, lineEndU16, cache.paraLevel, lineLevels);
+                    elementLevels.resize(elementCount);
+                    for (int32_t i = 0; i < elementCount; ++i) elementLevels[i] = lineLevels[cache.u8ToU16[firstIt[i].u8Cluster] - lineStartU16];
+                    ubidi_reorderVisual(elementLevels.data(), elementCount, visualOrder.data());
+                } else {
+                    for (int32_t i = 0; i < elementCount; ++i) visualOrder[i] = i;
+                }
+
+                lineElements.clear();
+                float linePenX = 0.0f;
+                float lineMaxAscent = cache.paraDefaultMetrics.ascent, lineMaxDescent = cache.paraDefaultMetrics.descent;
+                for (int32_t v = 0; v < elementCount; ++v) {
+                    const TextBlockShapingCache::ShapedGlyph& record = firstIt[visualOrder[v]];
+                    const TextBlockShapingCache::GlyphRun& run = cache.runs[record.runIdx];
+                    bool isRTL = hasLevels && (elementLevels[visualOrder[v]] & 1);
+                    lineElements.push_back(makeElementFromShapedGlyph(run, record, spans[run.spanIdx].style,
+                                                                      isRTL ? PositionedGlyph::BiDiDirectionHint::RTL : PositionedGlyph::BiDiDirectionHint::LTR, linePenX));
+                    linePenX += record.xAdvance;
+                    lineMaxAscent = std::max(lineMaxAscent, record.ascent - record.yOffset); // yOffset is 0 for images
+                    lineMaxDescent = std::max(lineMaxDescent, record.descent + record.yOffset);
+                }
+
+                LineLayoutInfo lineInfoTemplate;
+                lineInfoTemplate.firstElementIndexInBlockElements = textBlock.elements.size();
+                lineInfoTemplate.sourceTextByteStartIndexInBlockText = startU8;
+                lineInfoTemplate.maxContentAscent = cache.paraDefaultMetrics.ascent; lineInfoTemplate.maxContentDescent = cache.paraDefaultMetrics.descent;
+                finalizeCurrentLine(textBlock, lineElements, lineInfoTemplate, linePenX,
+                                    lineMaxAscent, lineMaxDescent, currentLineBoxTopY,
+                                    isFirstLineOfParagraph, paragraphStyle, cache.paraDefaultMetrics, cache.paraDefFontSize,
+                                    endU8, overallMaxVisualLineWidth,
+                                    cache.u16Text, nullptr, nullptr, cache.paraLevel, lineStartU16, lineEndU16,
+                                    hasLevels ? cache.levelsU16.data() : nullptr);
+                isFirstLineOfParagraph = false;
+            }
+            finishTextBlockLayout(textBlock, currentLineBoxTopY, overallMaxVisualLineWidth, true, cache.paraDefaultMetrics, cache.paraDefFontSize);
+            return true;
+        }
+
+        // Sizes an inline image (pImg.imageParams must be set) and resolves its vertical placement. Returns the image top
+        // relative to the baseline. LINE_TOP/LINE_BOTTOM are provisional here and fixed up in finishTextBlockLayout.
+        static float ResolveInlineImageBox(PositionedImage& pImg, float runFontSize, const ScaledFontMetrics& refMetricsForImgVAlign) {
+            pImg.width = (pImg.imageParams.displayWidth > 0) ? pImg.imageParams.displayWidth : (pImg.imageParams.texture.id > 0 ? (float)pImg.imageParams.texture.width : runFontSize);
+            pImg.height = (pImg.imageParams.displayHeight > 0) ? pImg.imageParams.displayHeight : (pImg.imageParams.texture.id > 0 ? (float)pImg.imageParams.texture.height : runFontSize);
+            float imgRelBaselineY = 0;
+            switch(pImg.imageParams.vAlign) { /* ... VAlign logic ... */
+                case CharacterStyle::InlineImageParams::VAlign::BASELINE: pImg.ascent = pImg.height; pImg.descent = 0; imgRelBaselineY = -pImg.height; break;
+                case CharacterStyle::InlineImageParams::VAlign::MIDDLE_OF_TEXT: { float tMidY = (refMetricsForImgVAlign.xHeight > 0.01f ? refMetricsForImgVAlign.xHeight / 2.0f : (refMetricsForImgVAlign.ascent - refMetricsForImgVAlign.descent)/2.0f); imgRelBaselineY=-(tMidY+pImg.height/2.0f); pImg.ascent=std::max(0.f, tMidY+pImg.height/2.f); pImg.descent=std::max(0.f,pImg.height/2.f - tMidY); break;}
+                case CharacterStyle::InlineImageParams::VAlign::TEXT_TOP: imgRelBaselineY=-refMetricsForImgVAlign.ascent; pImg.ascent=refMetricsForImgVAlign.ascent; pImg.descent=std::max(0.f,pImg.height-refMetricsForImgVAlign.ascent); break;
+                case CharacterStyle::InlineImageParams::VAlign::TEXT_BOTTOM: imgRelBaselineY=refMetricsForImgVAlign.descent-pImg.height; pImg.descent=refMetricsForImgVAlign.descent; pImg.ascent=std::max(0.f, pImg.height-refMetricsForImgVAlign.descent); break;
+                default: pImg.ascent = pImg.height; pImg.descent = 0; imgRelBaselineY = -pImg.height; break;
+            }
+            pImg.ascent = std::max(0.0f, pImg.ascent); pImg.descent = std::max(0.0f, pImg.descent);
+            return imgRelBaselineY;
+        }
+
+        // Ascent/descent of a glyph at the font's SDF generation size: the numbers getCachedGlyphByGID stores, loaded
+        // once per glyph without rendering it or touching the atlas.
+        std::pair<float, float> getGlyphExtentsAtCachedSize(FontId fontId, uint32_t glyphId) {
+            const uint64_t key = ((uint64_t)(uint32_t)fontId << 32) | glyphId;
+            auto it = glyph_extents_map_.find(key);
+            if (it != glyph_extents_map_.end()) return it->second;
+            std::pair<float, float> extents = {0.0f, 0.0f};
+            const auto& fontData = loadedFonts_.at(fontId);
+            int sdfGenSize = fontData.sdfPixelSizeHint > 0 ? fontData.sdfPixelSizeHint : 64;
+            FT_Face face = fontData.ftFace;
+            if (!FT_Set_Pixel_Sizes(face, 0, (FT_UInt)sdfGenSize) && !FT_Load_Glyph(face, glyphId, FT_LOAD_DEFAULT | FT_LOAD_NO_HINTING)) {
+                extents.first = (float)face->glyph->metrics.horiBearingY / 64.0f;
+                extents.second = (float)(face->glyph->metrics.height - face->glyph->metrics.horiBearingY) / 64.0f;
+            }
+            glyph_extents_map_.emplace(key, extents);
+            return extents;
+        }
+
+        // Measurement-only counterpart of emitShapedGlyphs for one item of the shape-then-break path: accumulates the
+        // advance and vertical extents of glyphs [glyphBegin, glyphEnd) without building elements or rasterizing.
+        // Advances are HarfBuzz's; extents are the cached SDF-size metrics scaled exactly as emitShapedGlyphs scales them,
+        // so the measured size matches LayoutStyledText.
+        void measureShapedGlyphs(const hb_glyph_info_t* glyphInfos, const hb_glyph_position_t* glyphPositions,
+                                 unsigned int glyphBegin, unsigned int glyphEnd, const CharacterStyle& runStyle,
+                                 FontId runFontId, float runFontSize, const ScaledFontMetrics& runFontMetrics,
+                                 float& advanceInOut, float& maxAscentInOut, float& maxDescentInOut) {
+            const auto& runFontData = loadedFonts_.at(runFontId);
+            int sdfGenSize = runFontData.sdfPixelSizeHint > 0 ? runFontData.sdfPixelSizeHint : 64;
+            float scaleFactorForMetrics = runFontSize > 0 ? runFontSize / (float)sdfGenSize : 1.0f;
+            for (unsigned int j = glyphBegin; j < glyphEnd; ++j) {
+                float yOffset = (float)glyphPositions[j].y_offset / 64.0f;
+                if (runStyle.isImage) { // Items never mix spans, so the whole item is the U+FFFC placeholder
+                    PositionedImage pImg;
+                    pImg.imageParams = runStyle.imageParams;
+                    ResolveInlineImageBox(pImg, runFontSize, runFontMetrics);
+                    maxAscentInOut = std::max(maxAscentInOut, pImg.ascent);
+                    maxDescentInOut = std::max(maxDescentInOut, pImg.descent);
+                } else {
+                    auto [ascent, descent] = getGlyphExtentsAtCachedSize(runFontId, glyphInfos[j].codepoint);
+                    maxAscentInOut = std::max(maxAscentInOut, ascent * scaleFactorForMetrics - yOffset);
+                    maxDescentInOut = std::max(maxDescentInOut, descent * scaleFactorForMetrics + yOffset);
+                }
+                advanceInOut += (float)glyphPositions[j].x_advance / 64.0f;
+            }
+        }
+
+        // Horizontal shift applied to a line for its paragraph alignment; also returns the line's width including indent.
+        static float ComputeLineAlignmentShift(const ParagraphStyle& pStyle, bool isFirstLineOfPara, float lineWidthNoIndent, float& visualLineWidthWithIndentOut) {
+            float linePhysicalStartX = isFirstLineOfPara ? pStyle.firstLineIndent : 0.0f;
+            float visualLineWidthWithIndentActual = linePhysicalStartX + lineWidthNoIndent;
+            float lineShiftX = 0;
+            float effectiveWrapWidthForAlign = pStyle.wrapWidth > 0 ? pStyle.wrapWidth : visualLineWidthWithIndentActual;
+            // Ensure effectiveWrapWidth is not zero if there's content, to avoid division by zero or huge shifts
+            if (effectiveWrapWidthForAlign < 0.01f && visualLineWidthWithIndentActual > 0.01f) effectiveWrapWidthForAlign = visualLineWidthWithIndentActual;
+
+            if (pStyle.alignment == HorizontalAlignment::RIGHT && visualLineWidthWithIndentActual < effectiveWrapWidthForAlign) {
+                lineShiftX = effectiveWrapWidthForAlign - visualLineWidthWithIndentActual;
+            } else if (pStyle.alignment == HorizontalAlignment::CENTER && visualLineWidthWithIndentActual < effectiveWrapWidthForAlign) {
+                lineShiftX = (effectiveWrapWidthForAlign - visualLineWidthWithIndentActual) / 2.0f;
+            }
+            visualLineWidthWithIndentOut = visualLineWidthWithIndentActual;
+            return lineShiftX;
+        }
+
+        // Converts HarfBuzz output glyphs [glyphBegin, glyphEnd) of one shaped run into positioned elements.
+        // Clusters are UTF-8 offsets into runU8, which starts at runU8StartByteInFull in the block text.
+        // Element x positions are penXOrigin + the run pen; the pen (current_hb_run_pen_x/y) is advanced in place.
+        void emitShapedGlyphs(const hb_glyph_info_t* glyphInfos, const hb_glyph_position_t* glyphPositions,
+                              unsigned int glyphBegin, unsigned int glyphEnd,
+                              std::string_view runU8, uint32_t runU8StartByteInFull, size_t runDominantSpanIdx,
+                              const std::vector<TextSpan>& spans, const std::pmr::vector<SpanMapEntry>& spanMap,
+                              const CharacterStyle& runStyle, FontId runFontId, float runFontSize, const ScaledFontMetrics& runFontMetrics,
+                              PositionedGlyph::BiDiDirectionHint runDirection, float penXOrigin,
+                              float& current_hb_run_pen_x, float& current_hb_run_pen_y,
+                              std::pmr::vector<PositionedElementVariant>& outElements, float& maxAscentInOut, float& maxDescentInOut) {
+            for (unsigned int j = glyphBegin; j < glyphEnd; ++j) {
+                uint32_t cluster_u8_offset_in_runU8 = glyphInfos[j].cluster;
+
+                int num_bytes_for_this_glyph_original_source = 0;
+                std::string_view char_in_cluster_utf8_preview; // For logging
+
+                if (cluster_u8_offset_in_runU8 < runU8.length()) {
+                    const char* char_start_ptr_for_len_calc = runU8.data() + cluster_u8_offset_in_runU8;
+                    GetNextCodepointFromUTF8(&char_start_ptr_for_len_calc, &num_bytes_for_this_glyph_original_source);
+                    if (cluster_u8_offset_in_runU8 + num_bytes_for_this_glyph_original_source > runU8.length()){
+                        num_bytes_for_this_glyph_original_source = runU8.length() - cluster_u8_offset_in_runU8;
+                    }
+                    if (num_bytes_for_this_glyph_original_source > 0) {
+                        char_in_cluster_utf8_preview = runU8.substr(cluster_u8_offset_in_runU8, num_bytes_for_this_glyph_original_source);
+                    }
+                }
+                // If num_bytes is still 0 (e.g. end of string, or mark without base), HarfBuzz might still produce a glyph.
+                // Default to 1 if it's a mark or something that GetNextCodepointFromUTF8 might miss if not advancing.
+                // But usually, a glyph from HB corresponds to some non-zero byte range from source.
+                // For now, we rely on GetNextCodepointFromUTF8. If it's 0, it might be an issue or an empty cluster.
+
+                uint32_t original_codepoint_for_glyph = 0;
+                if (!char_in_cluster_utf8_preview.empty()) {
+                    const char* temp_char_ptr = char_in_cluster_utf8_preview.data(); // Decoding stops at the cluster's first code point
+                    int temp_byte_count_ignored = 0;
+                    original_codepoint_for_glyph = GetNextCodepointFromUTF8(&temp_char_ptr, &temp_byte_count_ignored);
+                }
+
+                if (original_codepoint_for_glyph == 0xFFFC) { /* ... Image Handling ... */
+                    // pImg.position.x uses penXOrigin + current_hb_run_pen_x + x_offset; current_hb_run_pen_x advances by HarfBuzz's x_advance for U+FFFC
+                    uint32_t placeholder_global_u8_start = runU8StartByteInFull + cluster_u8_offset_in_runU8;
+                    size_t imageOriginalSpanIdx = runDominantSpanIdx; bool foundImageSpan = false;
+                    for(const auto& mapEntry : spanMap){ /* ... find image span ... */
+                        if (placeholder_global_u8_start >= mapEntry.u8_start_offset_in_full && placeholder_global_u8_start < (mapEntry.u8_start_offset_in_full + mapEntry.u8_length_in_full)) {
+                            if (spans[mapEntry.originalSpanIndex].style.isImage) { imageOriginalSpanIdx = mapEntry.originalSpanIndex; foundImageSpan = true; break;}
+                        }
+                    }
+                    if(foundImageSpan){
+                        PositionedImage pImg; /* ... setup pImg ... */
+                        const auto& imgSpanStyle = spans[imageOriginalSpanIdx].style;
+                        pImg.imageParams = imgSpanStyle.imageParams;
+                        pImg.sourceSpanIndex = imageOriginalSpanIdx; pImg.sourceCharByteOffsetInSpan = 0; pImg.numSourceCharBytesInSpan = 3;
+                        float imgRelBaselineY = ResolveInlineImageBox(pImg, runFontSize, runFontMetrics);
+                        float image_draw_x_in_hb_run = current_hb_run_pen_x + ((float)glyphPositions[j].x_offset / 64.0f);
+                        pImg.position = { penXOrigin + image_draw_x_in_hb_run, imgRelBaselineY };
+                        pImg.penAdvanceX = (float)glyphPositions[j].x_advance / 64.0f;
+                        outElements.push_back(pImg);
+                        maxAscentInOut = std::max(maxAscentInOut, pImg.ascent);
+                        maxDescentInOut = std::max(maxDescentInOut, pImg.descent);
+                        current_hb_run_pen_x += (float)glyphPositions[j].x_advance / 64.0f;
+                        current_hb_run_pen_y += (float)glyphPositions[j].y_advance / 64.0f;
+                        continue;
+                    }
+                }
+
+                PositionedGlyph pGlyph;
+                pGlyph.glyphId = glyphInfos[j].codepoint;
+                pGlyph.sourceFont = runFontId; pGlyph.sourceSize = runFontSize;
+                pGlyph.appliedStyle = runStyle;
+                pGlyph.xOffset = (float)glyphPositions[j].x_offset / 64.0f;
+                pGlyph.yOffset = (float)glyphPositions[j].y_offset / 64.0f;
+                pGlyph.xAdvance = (float)glyphPositions[j].x_advance / 64.0f;
+                pGlyph.yAdvance = (float)glyphPositions[j].y_advance / 64.0f;
+                pGlyph.visualRunDirectionHint = runDirection; // Set this from the run
+
+                // --- Corrected source text mapping ---
+                pGlyph.sourceSpanIndex = runDominantSpanIdx;
+                pGlyph.numSourceCharBytesInSpan = static_cast<uint16_t>(num_bytes_for_this_glyph_original_source); // Use calculated byte length
+
+                uint32_t cluster_absolute_start_in_full_u8 = runU8StartByteInFull + cluster_u8_offset_in_runU8;
+                const auto& originalSpanMapEntry = spanMap[pGlyph.sourceSpanIndex];
+                uint32_t originalSpan_start_in_full_u8 = originalSpanMapEntry.u8_start_offset_in_full;
+                if (cluster_absolute_start_in_full_u8 >= originalSpan_start_in_full_u8) {
+                    pGlyph.sourceCharByteOffsetInSpan = cluster_absolute_start_in_full_u8 - originalSpan_start_in_full_u8;
+                } else {
+                    pGlyph.sourceCharByteOffsetInSpan = 0;
+                    if (pGlyph.numSourceCharBytesInSpan !=0) { /* Log inconsistent state */ }
+                    pGlyph.numSourceCharBytesInSpan = 0; // Safety
+                    TraceLog(LOG_ERROR, "LayoutText: Cluster mapping error for GID %u", pGlyph.glyphId);
+                }
+                // Boundary checks for sourceCharByteOffsetInSpan and numSourceCharBytesInSpan
+                const std::string* originalSpanTextPtr = nullptr;
+                if (pGlyph.sourceSpanIndex < spans.size()) { originalSpanTextPtr = &(spans[pGlyph.sourceSpanIndex].text); }
+                static const std::string imagePlaceholderTextCheck_glyph = "\xEF\xBF\xBC";
+                if (pGlyph.sourceSpanIndex < spans.size() && spans[pGlyph.sourceSpanIndex].style.isImage && spans[pGlyph.sourceSpanIndex].text.empty()){ originalSpanTextPtr = &imagePlaceholderTextCheck_glyph; }
+                if (originalSpanTextPtr) {
+                    const std::string& effectiveOriginalSpanText = *originalSpanTextPtr;
+                    if (pGlyph.sourceCharByteOffsetInSpan > effectiveOriginalSpanText.length()) {
+                        pGlyph.sourceCharByteOffsetInSpan = effectiveOriginalSpanText.length(); pGlyph.numSourceCharBytesInSpan = 0;
+                    } else if (pGlyph.sourceCharByteOffsetInSpan + pGlyph.numSourceCharBytesInSpan > effectiveOriginalSpanText.length()) {
+                        pGlyph.numSourceCharBytesInSpan = effectiveOriginalSpanText.length() - pGlyph.sourceCharByteOffsetInSpan;
+                    }
+                    if (static_cast<int>(pGlyph.numSourceCharBytesInSpan) < 0) pGlyph.numSourceCharBytesInSpan = 0;
+                } else {
+                    pGlyph.sourceCharByteOffsetInSpan = 0; pGlyph.numSourceCharBytesInSpan = 0;
+                    TraceLog(LOG_ERROR, "LayoutText: Invalid sourceSpanIndex %u for pGlyph text checks.", pGlyph.sourceSpanIndex);
+                }
+
+                if (runDirection == PositionedGlyph::BiDiDirectionHint::RTL) {
+                    TraceLog(LOG_INFO, "LayoutText[RTL Glyph]: Char:'%.*s'(GID:%u) | SpanIdx:%u, OffInSpan:%u, NumBytes:%u | ClustInRun:%u",
+                             (int)char_in_cluster_utf8_preview.length(), char_in_cluster_utf8_preview.data(), pGlyph.glyphId,
+                             pGlyph.sourceSpanIndex, pGlyph.sourceCharByteOffsetInSpan, pGlyph.numSourceCharBytesInSpan,
+                             cluster_u8_offset_in_runU8);
+                }
+
+                FontId actualFontForGIDCacheLookup = runFontId;
+                FTCachedGlyph shapedGlyphRenderData = getCachedGlyphByGID(runFontId, pGlyph.glyphId, runFontSize, actualFontForGIDCacheLookup);
+                pGlyph.sourceFont = actualFontForGIDCacheLookup;
+                pGlyph.renderInfo = shapedGlyphRenderData.renderInfo;
+
+                float scaleFactorForMetrics = 1.0f;
+                const auto& actualFontDataUsed = loadedFonts_.at(pGlyph.sourceFont);
+                int sdfSizeForActualFont = actualFontDataUsed.sdfPixelSizeHint > 0 ? actualFontDataUsed.sdfPixelSizeHint : 64;
+                if (sdfSizeForActualFont > 0 && runFontSize > 0) { scaleFactorForMetrics = runFontSize / (float)sdfSizeForActualFont; }
+                pGlyph.ascent = shapedGlyphRenderData.ascent_at_cached_size * scaleFactorForMetrics;
+                pGlyph.descent = shapedGlyphRenderData.descent_at_cached_size * scaleFactorForMetrics;
+
+                if (IsFontValid(pGlyph.sourceFont)){ /* ... Calculate visualLeft/Right ... */
+                    FT_Face tempFace = loadedFonts_.at(pGlyph.sourceFont).ftFace;
+                    FT_Set_Pixel_Sizes(tempFace, 0, static_cast<FT_UInt>(roundf(runFontSize)));
+                    FT_Error err = FT_Load_Glyph(tempFace, pGlyph.glyphId, FT_LOAD_DEFAULT | FT_LOAD_NO_HINTING | FT_LOAD_NO_BITMAP);
+                    if (!err) {
+                        pGlyph.visualLeft = ((float)tempFace->glyph->metrics.horiBearingX / 64.0f);
+                        pGlyph.visualRight = pGlyph.visualLeft + ((float)tempFace->glyph->metrics.width / 64.0f);
+                    } else { pGlyph.visualLeft = 0; pGlyph.visualRight = pGlyph.xAdvance; }
+                } else { pGlyph.visualLeft = 0; pGlyph.visualRight = pGlyph.xAdvance; }
+
+                float glyph_draw_origin_x_in_run = current_hb_run_pen_x + pGlyph.xOffset;
+                float glyph_draw_origin_y_in_run = current_hb_run_pen_y - pGlyph.yOffset;
+                pGlyph.position = { penXOrigin + glyph_draw_origin_x_in_run, glyph_draw_origin_y_in_run };
+
+                outElements.push_back(pGlyph);
+                maxAscentInOut = std::max(maxAscentInOut, pGlyph.ascent - pGlyph.yOffset);
+                maxDescentInOut = std::max(maxDescentInOut, pGlyph.descent + pGlyph.yOffset);
+
+                current_hb_run_pen_x += pGlyph.xAdvance;
+                current_hb_run_pen_y += pGlyph.yAdvance;
+            }
+        }
+
+        // In RaylibSDFTextEx.cpp, within FTTextEngineImpl class
+
+        void finalizeCurrentLine(
+                TextBlock& textBlock,
+                std::pmr::vector<PositionedElementVariant>& pendingElements, // Moved from; the caller clears it afterwards
+                LineLayoutInfo& lineInfoTemplate, // Contains line number, byte start, etc. already set
+                float committedLineWidthNoIndent, // Visual width of elements in pendingElements
+                float lineMaxAscent,              // Max ascent from pendingElements
+                float lineMaxDescent,             // Max descent from pendingElements
+                float& currentLineBoxTopY,        // Y position for the top of this line box, updated for next line
+                bool isFirstLineOfPara,
+                const ParagraphStyle& pStyle,
+                const ScaledFontMetrics& defaultPStyleMetrics, // Correctly named parameter
+                float paraDefaultFontSize,                     // Correctly named parameter
+                uint32_t nextLineU8StartOffsetInFull, // Byte offset in full text where the next line would start, or end of text
+                float& overallMaxVisualLineWidthInOut,
+                std::u16string_view paragraphFullU16Text,   // Text paragraphBiDi was resolved on
+                UBiDi* paragraphBiDi,                       // Paragraph-level BiDi; the line map is a ubidi_setLine view of it (nullptr: simple LTR, identity map)
+                UBiDi* lineBiDiView,                        // Scratch UBiDi receiving the line view
+                UBiDiLevel paragraphBiDiLevelForLineMap,    // Resolved paragraph level, used only if the view cannot be derived
+                int32_t lineU16StartInFull,                 // UTF-16 range of this line in paragraphFullU16Text
+                int32_t nextLineU16StartInFull,
+                const UBiDiLevel* paragraphLevelsU16 = nullptr // Rewrap: stored paragraph levels used instead of paragraphBiDi
+        ) {
+            // Skip finalization if this segment didn't actually advance text position and wasn't the very first line attempt
+            if (pendingElements.empty() && !(textBlock.lines.empty() && textBlock.sourceTextConcatenated.empty() && lineInfoTemplate.sourceTextByteStartIndexInBlockText == 0)) {
+                if (lineInfoTemplate.sourceTextByteStartIndexInBlockText >= nextLineU8StartOffsetInFull && !textBlock.sourceTextConcatenated.empty() && lineInfoTemplate.sourceTextByteStartIndexInBlockText != 0) {
+                    // This case might occur if a line break happened exactly at a segment boundary without consuming the segment.
+                    // TraceLog(LOG_DEBUG, "finalizeCurrentLine: Skipping finalization of an empty segment that didn't advance text position.");
+                    return;
+                }
+            }
+
+            LineLayoutInfo finalizedLine = lineInfoTemplate; // Copy template info (like start byte index)
+            finalizedLine.lineWidth = committedLineWidthNoIndent;
+            finalizedLine.maxContentAscent = (lineMaxAscent > 0.001f || pendingElements.empty()) ? lineMaxAscent : defaultPStyleMetrics.ascent;
+            finalizedLine.maxContentDescent = (lineMaxDescent > 0.001f || pendingElements.empty()) ? lineMaxDescent : defaultPStyleMetrics.descent;
+            finalizedLine.sourceTextByteEndIndexInBlockText = nextLineU8StartOffsetInFull;
+
+            // Move pendingElements to textBlock.elements
+            finalizedLine.firstElementIndexInBlockElements = textBlock.elements.size();
+            for(auto& el : pendingElements) {
+                textBlock.elements.push_back(std::move(el));
+            }
+            finalizedLine.numElementsInLine = pendingElements.size();
+
+
+            // Line alignment calculation
+            float visualLineWidthWithIndentActual = 0.0f;
+            float lineShiftX = ComputeLineAlignmentShift(pStyle, isFirstLineOfPara, finalizedLine.lineWidth, visualLineWidthWithIndentActual);
+
+            // Apply alignment shift to elements of this line
+            if (fabsf(lineShiftX) > 0.001f) {
+                for(size_t i = 0; i < finalizedLine.numElementsInLine; ++i) {
+                    size_t el_idx = finalizedLine.firstElementIndexInBlockElements + i;
+                    if (el_idx < textBlock.elements.size()) { // Ensure element exists
+                        std::visit([lineShiftX](auto&& arg) { arg.position.x += lineShiftX; }, textBlock.elements[el_idx]);
+                    }
+                }
+            }
+            finalizedLine.lineExtentX = visualLineWidthWithIndentActual + (lineShiftX > 0 ? lineShiftX : 0.0f);
+            overallMaxVisualLineWidthInOut = std::max(overallMaxVisualLineWidthInOut, finalizedLine.lineExtentX);
+
+
+            // Line height and baseline calculation
+            finalizedLine.lineBoxHeight = calculateLineBoxHeight(pStyle, defaultPStyleMetrics, finalizedLine.maxContentAscent, finalizedLine.maxContentDescent, paraDefaultFontSize);
+            finalizedLine.baselineYInBox = finalizedLine.maxContentAscent; // Default baseline at max ascent
+            // Adjust baseline if line box is taller due to fixed line height settings (distribute extra space)
+            if (finalizedLine.lineBoxHeight > (finalizedLine.maxContentAscent + finalizedLine.maxContentDescent) + 0.001f &&
+                pStyle.lineHeightType != LineHeightType::CONTENT_SCALED) {
+                finalizedLine.baselineYInBox += (finalizedLine.lineBoxHeight - (finalizedLine.maxContentAscent + finalizedLine.maxContentDescent)) / 2.0f;
+            }
+            finalizedLine.lineBoxY = currentLineBoxTopY;
+
+
+            // --- Build VisualRun list for this line ---
+            finalizedLine.visualRuns.clear();
+            if (!pendingElements.empty()) {
+                size_t currentRunStartIdxInLine = 0; // Index within pendingElements for this line
+
+                // Initialize current run properties from the first element or paragraph defaults
+                PositionedGlyph::BiDiDirectionHint currentRunDir = PositionedGlyph::BiDiDirectionHint::UNSPECIFIED;
+                FontId currentRunFont = pStyle.defaultCharacterStyle.fontId;
+                if (!IsFontValid(currentRunFont)) currentRunFont = defaultFontId_; // Engine default
+                if (!IsFontValid(currentRunFont) && !loadedFonts_.empty()) currentRunFont = loadedFonts_.begin()->first; // Absolute fallback
+
+                float currentRunSize = pStyle.defaultCharacterStyle.fontSize;
+                if (currentRunSize <= 0) currentRunSize = paraDefaultFontSize;
+
+                // Views into element styles (stable: they live in textBlock.elements until this function returns) or literals
+                std::string_view currentRunScript = pStyle.defaultCharacterStyle.scriptTag;
+                if (currentRunScript.empty()) currentRunScript = "auto"; // Default for HarfBuzz if not specified
+                std::string_view currentRunLang = pStyle.defaultCharacterStyle.languageTag;
+                if (currentRunLang.empty()) currentRunLang = "und";
+
+
+                std::visit([&](const auto& el_v){ // Initialize from the first element's actual properties
+                    using T = std::decay_t<decltype(el_v)>;
+                    if constexpr (std::is_same_v<T, PositionedGlyph>) {
+                        currentRunDir = el_v.visualRunDirectionHint; // This was set in LayoutStyledText
+                        currentRunFont = el_v.sourceFont;
+                        currentRunSize = el_v.sourceSize;
                         currentRunScript = el_v.appliedStyle.scriptTag.empty() ? "auto" : el_v.appliedStyle.scriptTag;
                         currentRunLang = el_v.appliedStyle.languageTag.empty() ? "und" : el_v.appliedStyle.languageTag;
                     } else if constexpr (std::is_same_v<T, PositionedImage>) {
                         // Image run: direction is neutral, other properties can be inherited or default
                         currentRunDir = PositionedGlyph::BiDiDirectionHint::UNSPECIFIED;
                     }
-                }, pendingElements[0]);
+                }, textBlock.elements[finalizedLine.firstElementIndexInBlockElements]);
 
 
                 for (size_t i = 0; i < pendingElements.size(); ++i) {
                     bool splitRun = false;
                     PositionedGlyph::BiDiDirectionHint elemDir = PositionedGlyph::BiDiDirectionHint::UNSPECIFIED;
                     FontId elemFont = INVALID_FONT_ID; float elemSize = 0.f;
-                    std::string elemScript, elemLang;
+                    std::string_view elemScript, elemLang;
                     bool currentElementIsImage = false;
 
                     std::visit([&](const auto& el_v){
@@ -1541,7 +2884,7 @@ void main() {
                             elemDir = PositionedGlyph::BiDiDirectionHint::UNSPECIFIED;
                             currentElementIsImage = true;
                         }
-                    }, pendingElements[i]);
+                    }, textBlock.elements[finalizedLine.firstElementIndexInBlockElements + i]);
 
                     if (i > currentRunStartIdxInLine) {
                         bool prevElementWasImage = std::holds_alternative<PositionedImage>(textBlock.elements[finalizedLine.firstElementIndexInBlockElements + i -1]); // Check type of previous element in textBlock
@@ -1563,7 +2906,7 @@ void main() {
                             run.numElementsInRun = i - currentRunStartIdxInLine;
                             run.direction = currentRunDir;
                             run.runFont = currentRunFont; run.runFontSize = currentRunSize;
-                            run.scriptTagUsed = currentRunScript; run.languageTagUsed = currentRunLang;
+                            run.scriptTagUsed = std::string(currentRunScript); run.languageTagUsed = std::string(currentRunLang);
 
                             run.runVisualAdvanceX = 0;
                             for(size_t k=0; k < run.numElementsInRun; ++k){
@@ -1573,7 +2916,7 @@ void main() {
                                     else if constexpr (std::is_same_v<T_adv, PositionedImage>) run.runVisualAdvanceX += el_v_for_adv.penAdvanceX;
                                 }, textBlock.elements[finalizedLine.firstElementIndexInBlockElements + currentRunStartIdxInLine + k]);
                             }
-                            finalizedLine.visualRuns.push_back(run);
+                            finalizedLine.visualRuns.push_back(std::move(run));
                         }
                         currentRunStartIdxInLine = i;
                         currentRunDir = elemDir;
@@ -1595,7 +2938,7 @@ void main() {
                     run.numElementsInRun = pendingElements.size() - currentRunStartIdxInLine;
                     run.direction = currentRunDir;
                     run.runFont = currentRunFont; run.runFontSize = currentRunSize;
-                    run.scriptTagUsed = currentRunScript; run.languageTagUsed = currentRunLang;
+                    run.scriptTagUsed = std::string(currentRunScript); run.languageTagUsed = std::string(currentRunLang);
 
                     run.runVisualAdvanceX = 0;
                     for(size_t k=0; k < run.numElementsInRun; ++k){
@@ -1605,200 +2948,97 @@ void main() {
                             else if constexpr (std::is_same_v<T_adv, PositionedImage>) run.runVisualAdvanceX += el_v_for_adv.penAdvanceX;
                         }, textBlock.elements[finalizedLine.firstElementIndexInBlockElements + currentRunStartIdxInLine + k]);
                     }
-                    finalizedLine.visualRuns.push_back(run);
+                    finalizedLine.visualRuns.push_back(std::move(run));
                 }
             }
             // --- VisualRun 构建结束 ---
 
             // --- Line-level BiDi map population ---
-            uint32_t lineU8Len = finalizedLine.sourceTextByteEndIndexInBlockText - finalizedLine.sourceTextByteStartIndexInBlockText;
-            if (lineU8Len > 0 && finalizedLine.sourceTextByteEndIndexInBlockText <= textBlock.sourceTextConcatenated.length()) {
-                std::string lineU8_for_map = textBlock.sourceTextConcatenated.substr(finalizedLine.sourceTextByteStartIndexInBlockText, lineU8Len);
-                std::u16string lineU16_for_map = Utf8ToUtf16(lineU8_for_map);
-
-                if (!lineU16_for_map.empty()) {
-                    UErrorCode status_line_bidi = U_ZERO_ERROR;
-                    UBiDi* lineBiDiObj = ubidi_openSized(lineU16_for_map.length() + 1, 0, &status_line_bidi);
-                    if (U_SUCCESS(status_line_bidi)) {
-                        // Use paragraphBiDiLevelForLineMap which is the resolved paragraph level
-                        ubidi_setPara(lineBiDiObj, reinterpret_cast<const UChar*>(lineU16_for_map.data()), lineU16_for_map.length(), paragraphBiDiLevelForLineMap, nullptr, &status_line_bidi);
-                        if (U_SUCCESS(status_line_bidi)) {
-                            int32_t line_logical_len_for_map_icu = ubidi_getLength(lineBiDiObj);
-                            if (line_logical_len_for_map_icu > 0) {
-                                finalizedLine.visualToLogicalMap.resize(line_logical_len_for_map_icu);
-                                finalizedLine.logicalToVisualMap.resize(line_logical_len_for_map_icu);
-                                ubidi_getVisualMap(lineBiDiObj, finalizedLine.visualToLogicalMap.data(), &status_line_bidi);
-                                if(U_FAILURE(status_line_bidi)) TraceLog(LOG_WARNING, "ICU ubidi_getVisualMap failed: %s", u_errorName(status_line_bidi));
-                                status_line_bidi = U_ZERO_ERROR;
-                                ubidi_getLogicalMap(lineBiDiObj, finalizedLine.logicalToVisualMap.data(), &status_line_bidi);
-                                if(U_FAILURE(status_line_bidi)) TraceLog(LOG_WARNING, "ICU ubidi_getLogicalMap failed: %s", u_errorName(status_line_bidi));
-                            } else {
-                                finalizedLine.visualToLogicalMap.clear();
-                                finalizedLine.logicalToVisualMap.clear();
-                            }
-                        } else { TraceLog(LOG_WARNING, "ICU ubidi_setPara for line map failed: %s", u_errorName(status_line_bidi)); }
-                        ubidi_close(lineBiDiObj);
-                    } else { TraceLog(LOG_WARNING, "ICU ubidi_openSized for line map failed: %s", u_errorName(status_line_bidi)); }
+            if (!paragraphBiDi) { // Simple-LTR fast path: visual order is logical order
+                int32_t lineU16Len = std::max(0, nextLineU16StartInFull - lineU16StartInFull);
+                finalizedLine.visualToLogicalMap.resize(lineU16Len);
+                if (paragraphLevelsU16 && lineU16Len > 0) {
+                    std::pmr::vector<UBiDiLevel> lineLevels(&layout_arena_);
+                    ResolveLineLevels(paragraphLevelsU16, paragraphFullU16Text, lineU16StartInFull, nextLineU16StartInFull, paragraphBiDiLevelForLineMap, lineLevels);
+                    finalizedLine.logicalToVisualMap.resize(lineU16Len);
+                    ubidi_reorderVisual(lineLevels.data(), lineU16Len, finalizedLine.visualToLogicalMap.data());
+                    ubidi_reorderLogical(lineLevels.data(), lineU16Len, finalizedLine.logicalToVisualMap.data());
+                } else {
+                    for (int32_t k = 0; k < lineU16Len; ++k) finalizedLine.visualToLogicalMap[k] = k;
+                    finalizedLine.logicalToVisualMap = finalizedLine.visualToLogicalMap;
+                }
+                currentLineBoxTopY += finalizedLine.lineBoxHeight;
+                textBlock.lines.push_back(std::move(finalizedLine));
+                return;
+            }
+            int32_t lineU16Limit = std::min(nextLineU16StartInFull, (int32_t)paragraphFullU16Text.length());
+            if (lineU16StartInFull < lineU16Limit &&
+                setBiDiLineView(lineBiDiView, paragraphBiDi, paragraphFullU16Text, lineU16StartInFull, lineU16Limit, paragraphBiDiLevelForLineMap)) {
+                UErrorCode status_line_bidi = U_ZERO_ERROR;
+                int32_t line_logical_len_for_map_icu = ubidi_getLength(lineBiDiView);
+                if (line_logical_len_for_map_icu > 0) {
+                    finalizedLine.visualToLogicalMap.resize(line_logical_len_for_map_icu);
+                    finalizedLine.logicalToVisualMap.resize(line_logical_len_for_map_icu);
+                    ubidi_getVisualMap(lineBiDiView, finalizedLine.visualToLogicalMap.data(), &status_line_bidi);
+                    if(U_FAILURE(status_line_bidi)) TraceLog(LOG_WARNING, "ICU ubidi_getVisualMap failed: %s", u_errorName(status_line_bidi));
+                    status_line_bidi = U_ZERO_ERROR;
+                    ubidi_getLogicalMap(lineBiDiView, finalizedLine.logicalToVisualMap.data(), &status_line_bidi);
+                    if(U_FAILURE(status_line_bidi)) TraceLog(LOG_WARNING, "ICU ubidi_getLogicalMap failed: %s", u_errorName(status_line_bidi));
+                } else {
+                    finalizedLine.visualToLogicalMap.clear();
+                    finalizedLine.logicalToVisualMap.clear();
                 }
             }
 
-            textBlock.lines.push_back(finalizedLine);
             currentLineBoxTopY += finalizedLine.lineBoxHeight;
+            textBlock.lines.push_back(std::move(finalizedLine));
         }
 
 
-        // DrawTextBlock (remains mostly the same as your original, ensure it uses updated PositionedGlyph.sourceFont)
         void DrawTextBlock(const TextBlock& textBlock, const Matrix& transform, Color globalTint, const Rectangle* clipRect) override { //
+            if (!atlasStorage_->HasGpu()) return; // Headless: atlas textures are placeholders
             if (textBlock.elements.empty() && textBlock.lines.empty()) return; //
+            if (clipRect && (clipRect->width <= 0 || clipRect->height <= 0)) return; // Nothing visible
 
             bool useSDFShader = (sdfShader_.id > 0 && sdfShader_.id != rlGetShaderIdDefault());
+            if (useSDFShader && frameActive_) { // Between BeginTextFrame / EndTextFrame: record small blocks only, no flush
+                if (ensureDrawCache(textBlock)->vertices.positions.size() / 12 <= FRAME_BATCH_MAX_QUADS) {
+                    queueTextBlock(textBlock, transform, globalTint, clipRect);
+                    return;
+                }
+                flushQueuedTextBlocks(); // Large block: drawn from its own mesh below, after everything submitted before it
+            }
 
             rlDrawRenderBatchActive();
             rlPushMatrix();
             rlMultMatrixf(MatrixToFloat(transform));
 
+            // clipRect is in the space transform maps into (screen space unless a camera / render texture is active).
+            // The scissor keeps clipping exact; lines and runs outside its block-space bounds are not submitted at all.
             bool scissorActive = false;
+            size_t firstLine = 0, endLine = textBlock.lines.size();
+            Rectangle clipInBlock = {0, 0, 0, 0};
+            bool cullToClip = false;
             if (clipRect) { //
-                // For simplicity, this assumes clipRect is in the transformed space.
-                // Correct scissoring with arbitrary transforms is complex with Raylib's BeginScissorMode.
-                // Consider rlglScissor for more control if needed.
-                // BeginScissorMode((int)clipRect->x, (int)clipRect->y, (int)clipRect->width, (int)clipRect->height);
-                // scissorActive = true;
+                BeginScissorMode((int)floorf(clipRect->x), (int)floorf(clipRect->y),
+                                 (int)ceilf(clipRect->x + clipRect->width) - (int)floorf(clipRect->x),
+                                 (int)ceilf(clipRect->y + clipRect->height) - (int)floorf(clipRect->y));
+                scissorActive = true;
+                cullToClip = GetClipBoundsInBlockSpace(transform, *clipRect, clipInBlock);
+                if (cullToClip) FindLineRangeForYSpan(textBlock, clipInBlock.y, clipInBlock.y + clipInBlock.height, firstLine, endLine);
             }
 
             if (useSDFShader) {
-                BeginShaderMode(sdfShader_);
-                float sdfEdgeTexVal =  128.0f /  255.0f; // Default for FT_RENDER_MODE_SDF
-                if (uniform_sdfEdgeValue_loc_ != -1) {
-                    SetShaderValue(sdfShader_, uniform_sdfEdgeValue_loc_, &sdfEdgeTexVal, SHADER_UNIFORM_FLOAT);
-                }
-
-                BatchRenderState currentBatchState; //
-                bool isFirstElementInBatch = true;
-
-                for (size_t lineIdx = 0; lineIdx < textBlock.lines.size(); ++lineIdx) { //
-                    const auto& line = textBlock.lines[lineIdx]; //
-                    float lineVisualBaselineY = line.lineBoxY + line.baselineYInBox; //
-
-                    for (size_t i = 0; i < line.numElementsInLine; ++i) { //
-                        if ((line.firstElementIndexInBlockElements + i) >= textBlock.elements.size()) { //
-                            continue;
-                        }
-                        const auto& elementVariant = textBlock.elements[line.firstElementIndexInBlockElements + i]; //
-
-                        if (std::holds_alternative<PositionedGlyph>(elementVariant)) { //
-                            const auto& glyph = std::get<PositionedGlyph>(elementVariant); //
-
-                            if (glyph.renderInfo.atlasTexture.id == 0 || glyph.renderInfo.atlasRect.width == 0 || glyph.renderInfo.atlasRect.height == 0) { //
-                                continue;
-                            }
-
-                            if (!glyph.renderInfo.isSDF) { //
-                                if (!isFirstElementInBatch) rlDrawRenderBatchActive();
-                                EndShaderMode(); // Fallback to default shader for non-SDF
-
-                                float renderScaleFactor_alpha = 1.0f;
-                                if (IsFontValid(glyph.sourceFont) && loadedFonts_.count(glyph.sourceFont)) { //
-                                    const auto& fontData = loadedFonts_.at(glyph.sourceFont);
-                                    if (fontData.sdfPixelSizeHint > 0 && glyph.sourceSize > 0) { //
-                                        renderScaleFactor_alpha = glyph.sourceSize / (float)fontData.sdfPixelSizeHint; //
-                                    }
-                                }
-                                float finalDrawOffsetX_alpha = glyph.renderInfo.drawOffset.x * renderScaleFactor_alpha; //
-                                float finalDrawOffsetY_alpha = glyph.renderInfo.drawOffset.y * renderScaleFactor_alpha; //
-                                float finalRectWidth_alpha = glyph.renderInfo.atlasRect.width * renderScaleFactor_alpha; //
-                                float finalRectHeight_alpha = glyph.renderInfo.atlasRect.height * renderScaleFactor_alpha; //
-
-                                DrawTexturePro(glyph.renderInfo.atlasTexture, glyph.renderInfo.atlasRect, //
-                                               {glyph.position.x + glyph.xOffset + finalDrawOffsetX_alpha, //
-                                                lineVisualBaselineY + glyph.position.y + finalDrawOffsetY_alpha, // yOffset is negative up, position.y is -yOffset
-                                                finalRectWidth_alpha, finalRectHeight_alpha},
-                                               {0,0}, 0, ColorAlphaMultiply(glyph.appliedStyle.fill.solidColor, globalTint)); //
-
-                                BeginShaderMode(sdfShader_); // Restore SDF shader
-                                if (uniform_sdfEdgeValue_loc_ != -1) SetShaderValue(sdfShader_, uniform_sdfEdgeValue_loc_, &sdfEdgeTexVal, SHADER_UNIFORM_FLOAT);
-                                isFirstElementInBatch = true; // Force state re-check
-                                continue;
-                            }
-                            // SDF Path
-                            float currentSmoothness = 0.02f + dynamicSmoothnessAdd; //
-                            if (IsFontValid(glyph.sourceFont) && glyph.sourceSize > 0 && loadedFonts_.count(glyph.sourceFont)) { //
-                                const auto& fontData = loadedFonts_.at(glyph.sourceFont); // Use actual sourceFont
-                                if (fontData.sdfPixelSizeHint > 0) {
-                                    float sdfSizeHint = (float)fontData.sdfPixelSizeHint;
-                                    float scaleRatioRenderToSDFGen = glyph.sourceSize / sdfSizeHint; //
-                                    currentSmoothness = (0.02f / std::max(0.5f, sqrtf(std::max(0.25f, scaleRatioRenderToSDFGen)))) + dynamicSmoothnessAdd;
-                                    currentSmoothness = std::max(0.001f, std::min(currentSmoothness, 0.1f));
-                                }
-                            }
-                            BatchRenderState newState(glyph, currentSmoothness); //
-                            if (isFirstElementInBatch || newState.RequiresNewBatchComparedTo(currentBatchState)) {
-                                if (!isFirstElementInBatch) rlDrawRenderBatchActive();
-                                currentBatchState = newState; isFirstElementInBatch = false;
-                                rlSetTexture(currentBatchState.atlasTexture.id);
-                                Vector4 normFillColor = ColorNormalize(currentBatchState.fill.solidColor); //
-                                Vector4 finalFillColor = { normFillColor.x*globalTint.r/255.f, normFillColor.y*globalTint.g/255.f, normFillColor.z*globalTint.b/255.f, normFillColor.w*globalTint.a/255.f };
-                                if(uniform_textColor_loc_ != -1) SetShaderValue(sdfShader_, uniform_textColor_loc_, &finalFillColor, SHADER_UNIFORM_VEC4);
-                                if(uniform_sdfSmoothness_loc_ != -1) SetShaderValue(sdfShader_, uniform_sdfSmoothness_loc_, &currentBatchState.dynamicSmoothnessValue, SHADER_UNIFORM_FLOAT);
-                                int boldFlag = HasStyle(currentBatchState.basicStyle, FontStyle::Bold); //
-                                float boldStrengthVal = 0.03f;
-                                if(uniform_styleBold_loc_ != -1) SetShaderValue(sdfShader_, uniform_styleBold_loc_, &boldFlag, SHADER_UNIFORM_INT);
-                                if(uniform_boldStrength_loc_ != -1) SetShaderValue(sdfShader_, uniform_boldStrength_loc_, &boldStrengthVal, SHADER_UNIFORM_FLOAT);
-                                // Other effect uniforms (same as before)
-                                int effectFlag = currentBatchState.outlineEnabled; if(uniform_enableOutline_loc_ != -1) SetShaderValue(sdfShader_, uniform_enableOutline_loc_, &effectFlag, SHADER_UNIFORM_INT); if (effectFlag) { Vector4 oC=ColorNormalize(currentBatchState.outlineColor); Vector4 fOC={oC.x*globalTint.r/255.f, oC.y*globalTint.g/255.f, oC.z*globalTint.b/255.f, oC.w*globalTint.a/255.f}; if(uniform_outlineColor_loc_ != -1) SetShaderValue(sdfShader_, uniform_outlineColor_loc_, &fOC, SHADER_UNIFORM_VEC4); if(uniform_outlineWidth_loc_ != -1) SetShaderValue(sdfShader_, uniform_outlineWidth_loc_, &currentBatchState.outlineWidth, SHADER_UNIFORM_FLOAT); }
-                                effectFlag = currentBatchState.glowEnabled; if(uniform_enableGlow_loc_ != -1) SetShaderValue(sdfShader_, uniform_enableGlow_loc_, &effectFlag, SHADER_UNIFORM_INT); if (effectFlag) { Vector4 gC=ColorNormalize(currentBatchState.glowColor); Vector4 fGC={gC.x*globalTint.r/255.f, gC.y*globalTint.g/255.f, gC.z*globalTint.b/255.f, gC.w*globalTint.a/255.f}; if(uniform_glowColor_loc_ != -1) SetShaderValue(sdfShader_, uniform_glowColor_loc_, &fGC, SHADER_UNIFORM_VEC4); if(uniform_glowRange_loc_ != -1) SetShaderValue(sdfShader_, uniform_glowRange_loc_, &currentBatchState.glowRange, SHADER_UNIFORM_FLOAT); if(uniform_glowIntensity_loc_ != -1) SetShaderValue(sdfShader_, uniform_glowIntensity_loc_, &currentBatchState.glowIntensity, SHADER_UNIFORM_FLOAT); }
-                                effectFlag = currentBatchState.shadowEnabled; if(uniform_enableShadow_loc_ != -1) SetShaderValue(sdfShader_, uniform_enableShadow_loc_, &effectFlag, SHADER_UNIFORM_INT); if (effectFlag) { Vector4 sC=ColorNormalize(currentBatchState.shadowColor); Vector4 fSC={sC.x*globalTint.r/255.f, sC.y*globalTint.g/255.f, sC.z*globalTint.b/255.f, sC.w*globalTint.a/255.f}; Vector2 sTO={0,0}; if(currentBatchState.atlasTexture.width >0) sTO.x = currentBatchState.shadowOffset.x/(float)currentBatchState.atlasTexture.width; if(currentBatchState.atlasTexture.height>0) sTO.y = currentBatchState.shadowOffset.y/(float)currentBatchState.atlasTexture.height; if(uniform_shadowColor_loc_ != -1) SetShaderValue(sdfShader_, uniform_shadowColor_loc_, &fSC, SHADER_UNIFORM_VEC4); if(uniform_shadowTexCoordOffset_loc_ != -1) SetShaderValue(sdfShader_, uniform_shadowTexCoordOffset_loc_, &sTO, SHADER_UNIFORM_VEC2); if(uniform_shadowSdfSpread_loc_ != -1) SetShaderValue(sdfShader_, uniform_shadowSdfSpread_loc_, &currentBatchState.shadowSdfSpread, SHADER_UNIFORM_FLOAT); }
-                                effectFlag = currentBatchState.innerEffectEnabled; if(uniform_enableInnerEffect_loc_ != -1) SetShaderValue(sdfShader_, uniform_enableInnerEffect_loc_, &effectFlag, SHADER_UNIFORM_INT); if (effectFlag) { Vector4 ieC=ColorNormalize(currentBatchState.innerEffectColor); Vector4 fieC={ieC.x*globalTint.r/255.f, ieC.y*globalTint.g/255.f, ieC.z*globalTint.b/255.f, ieC.w*globalTint.a/255.f}; int ieIS = currentBatchState.innerEffectIsShadow; if(uniform_innerEffectColor_loc_ != -1) SetShaderValue(sdfShader_, uniform_innerEffectColor_loc_, &fieC, SHADER_UNIFORM_VEC4); if(uniform_innerEffectRange_loc_ != -1) SetShaderValue(sdfShader_, uniform_innerEffectRange_loc_, &currentBatchState.innerEffectRange, SHADER_UNIFORM_FLOAT); if(uniform_innerEffectIsShadow_loc_ != -1) SetShaderValue(sdfShader_, uniform_innerEffectIsShadow_loc_, &ieIS, SHADER_UNIFORM_INT); }
-
-                            }
-
-                            float renderScaleFactor = 1.0f; //
-                            if (IsFontValid(glyph.sourceFont) && loadedFonts_.count(glyph.sourceFont)) { //
-                                const auto& fontData = loadedFonts_.at(glyph.sourceFont);
-                                if (fontData.sdfPixelSizeHint > 0 && glyph.sourceSize > 0) { //
-                                    renderScaleFactor = glyph.sourceSize / (float)fontData.sdfPixelSizeHint; //
-                                }
-                            }
-                            // The glyph.position already includes HarfBuzz x_offset and y_offset (as -yOffset)
-                            float finalDrawX = glyph.position.x + glyph.renderInfo.drawOffset.x * renderScaleFactor; //
-                            float finalDrawY = lineVisualBaselineY + glyph.position.y + (glyph.renderInfo.drawOffset.y * renderScaleFactor) ; //
-
-                            Rectangle destRect = { finalDrawX, finalDrawY,
-                                                   glyph.renderInfo.atlasRect.width * renderScaleFactor, //
-                                                   glyph.renderInfo.atlasRect.height * renderScaleFactor //
-                            };
-                            Rectangle srcRect = glyph.renderInfo.atlasRect; //
-
-                            float shearAmount = HasStyle(glyph.appliedStyle.basicStyle, FontStyle::Italic) ? 0.2f * destRect.height : 0.0f; //
-                            rlCheckRenderBatchLimit(4); rlBegin(RL_QUADS); rlColor4ub(255,255,255,255);
-                            rlTexCoord2f(srcRect.x/currentBatchState.atlasTexture.width, srcRect.y/currentBatchState.atlasTexture.height); rlVertex2f(destRect.x+shearAmount, destRect.y);
-                            rlTexCoord2f(srcRect.x/currentBatchState.atlasTexture.width, (srcRect.y+srcRect.height)/currentBatchState.atlasTexture.height); rlVertex2f(destRect.x, destRect.y+destRect.height);
-                            rlTexCoord2f((srcRect.x+srcRect.width)/currentBatchState.atlasTexture.width, (srcRect.y+srcRect.height)/currentBatchState.atlasTexture.height); rlVertex2f(destRect.x+destRect.width, destRect.y+destRect.height);
-                            rlTexCoord2f((srcRect.x+srcRect.width)/currentBatchState.atlasTexture.width, srcRect.y/currentBatchState.atlasTexture.height); rlVertex2f(destRect.x+destRect.width+shearAmount, destRect.y);
-                            rlEnd();
-
-                        } else if (std::holds_alternative<PositionedImage>(elementVariant)) { //
-                            if (!isFirstElementInBatch) rlDrawRenderBatchActive(); EndShaderMode(); // Non-SDF
-                            const auto& img = std::get<PositionedImage>(elementVariant); //
-                            if (img.imageParams.texture.id > 0) { //
-                                Rectangle srcImgR = {0,0,(float)img.imageParams.texture.width, (float)img.imageParams.texture.height}; //
-                                Rectangle dstImgR = {img.position.x, lineVisualBaselineY + img.position.y, img.width, img.height}; //
-                                DrawTexturePro(img.imageParams.texture, srcImgR, dstImgR, {0,0},0.0f,globalTint); //
-                            }
-                            BeginShaderMode(sdfShader_); // Restore SDF shader
-                            if (uniform_sdfEdgeValue_loc_ != -1) SetShaderValue(sdfShader_, uniform_sdfEdgeValue_loc_, &sdfEdgeTexVal, SHADER_UNIFORM_FLOAT);
-                            isFirstElementInBatch = true; // Force state re-check
-                        }
-                    }
-                }
-                if (!isFirstElementInBatch) rlDrawRenderBatchActive();
-                EndShaderMode();
+                std::shared_ptr<TextBlockDrawCache> drawCache = ensureDrawCache(textBlock);
+                visibleQuadRanges_.clear();
+                collectVisibleQuads(*drawCache, cullToClip ? &clipInBlock : nullptr, firstLine, endLine, visibleQuadRanges_);
+                drawPreparedMesh(*drawCache, globalTint, visibleQuadRanges_);
             } else { // Fallback non-SDF drawing (same as before)
-                for (size_t lineIdx = 0; lineIdx < textBlock.lines.size(); ++lineIdx) { //
+                for (size_t lineIdx = firstLine; lineIdx < endLine; ++lineIdx) { //
                     const auto& line = textBlock.lines[lineIdx]; //
-                    float lineVisualBaselineY = line.lineBoxY + line.baselineYInBox; //
+                    float lineVisualBaselineY = GetLineTopY(textBlock, line) + line.baselineYInBox; //
                     for (size_t i = 0; i < line.numElementsInLine; ++i) { //
-                        const auto& elVar = textBlock.elements[line.firstElementIndexInBlockElements + i]; //
+                        const auto& elVar = textBlock.elements[GetLineFirstElementIndex(textBlock, line) + i]; //
                         if (std::holds_alternative<PositionedGlyph>(elVar)){ //
                             // Simplified non-SDF glyph drawing - this needs more robust handling for alpha bitmaps
                             const auto& glyph = std::get<PositionedGlyph>(elVar); //
@@ -1825,6 +3065,879 @@ void main() {
             rlSetTexture(0); // Reset texture binding
         }
 
+        // --- Prepared GPU mesh (TextBlock::drawCache) ---
+
+        // Built once per layout (and per engine / smoothness setting); each frame only binds and draws it
+        std::shared_ptr<TextBlockDrawCache> ensureDrawCache(const TextBlock& textBlock) {
+            releasePendingGpuObjects();
+            std::shared_ptr<TextBlockDrawCache> drawCache = textBlock.drawCache;
+            const bool instanced = (glyphRenderPath_ == GlyphRenderPath::INSTANCED);
+            if (!drawCache || drawCache->owner != this || drawCache->smoothnessAdd != dynamicSmoothnessAdd || drawCache->instanced != instanced) {
+                drawCache = buildDrawCache(textBlock);
+                textBlock.drawCache = drawCache;
+            }
+            return drawCache;
+        }
+
+        // Appends the global quad ranges to submit: everything without clipInBlock, else the runs of lines
+        // [firstLine, endLine) whose bounds meet clipInBlock, adjacent runs merged into one range.
+        static void collectVisibleQuads(const TextBlockDrawCache& cache, const Rectangle* clipInBlock, size_t firstLine, size_t endLine,
+                                        std::vector<std::pair<size_t, size_t>>& out) {
+            if (!clipInBlock) {
+                out.push_back({0, SIZE_MAX});
+                return;
+            }
+            const size_t firstOut = out.size();
+            endLine = std::min(endLine, cache.lineFirstCullSpan.empty() ? 0 : cache.lineFirstCullSpan.size() - 1);
+            size_t spanBegin = firstLine < endLine ? cache.lineFirstCullSpan[firstLine] : 0;
+            size_t spanEnd = firstLine < endLine ? cache.lineFirstCullSpan[endLine] : 0;
+            for (size_t spanIdx = spanBegin; spanIdx < spanEnd; ++spanIdx) {
+                const TextBlockDrawCache::CullSpan& span = cache.cullSpans[spanIdx];
+                if (span.quadCount == 0 ||
+                    span.bounds.x > clipInBlock->x + clipInBlock->width || span.bounds.x + span.bounds.width < clipInBlock->x ||
+                    span.bounds.y > clipInBlock->y + clipInBlock->height || span.bounds.y + span.bounds.height < clipInBlock->y) continue;
+                if (out.size() > firstOut && out.back().second == span.firstQuad) {
+                    out.back().second += span.quadCount; // Adjacent runs / lines: one range
+                } else {
+                    out.push_back({span.firstQuad, span.firstQuad + span.quadCount});
+                }
+            }
+        }
+
+        float glyphRenderScale(const PositionedGlyph& glyph) const {
+            auto fontIt = loadedFonts_.find(glyph.sourceFont);
+            if (fontIt != loadedFonts_.end() && fontIt->second.sdfPixelSizeHint > 0 && glyph.sourceSize > 0) {
+                return glyph.sourceSize / (float)fontIt->second.sdfPixelSizeHint;
+            }
+            return 1.0f;
+        }
+
+        float sdfSmoothnessFor(const PositionedGlyph& glyph) const {
+            float smoothness = 0.02f + dynamicSmoothnessAdd;
+            auto fontIt = loadedFonts_.find(glyph.sourceFont);
+            if (fontIt != loadedFonts_.end() && glyph.sourceSize > 0 && fontIt->second.sdfPixelSizeHint > 0) {
+                float scaleRatioRenderToSDFGen = glyph.sourceSize / (float)fontIt->second.sdfPixelSizeHint;
+                smoothness = (0.02f / std::max(0.5f, sqrtf(std::max(0.25f, scaleRatioRenderToSDFGen)))) + dynamicSmoothnessAdd;
+                smoothness = std::max(0.001f, std::min(smoothness, 0.1f));
+            }
+            return smoothness;
+        }
+
+        static TextBlockDrawCache::StyleRow makeStyleRow(const SdfStyleKey& state) {
+            using Cache = TextBlockDrawCache;
+            Cache::StyleRow row{};
+            auto putColor = [&row](int texel, Color color) {
+                Vector4 c = ColorNormalize(color);
+                row[texel * 4 + 0] = c.x; row[texel * 4 + 1] = c.y; row[texel * 4 + 2] = c.z; row[texel * 4 + 3] = c.w;
+            };
+            putColor(0, state.fill.solidColor);
+            int flags = HasStyle(state.basicStyle, FontStyle::Bold) ? Cache::STYLE_BOLD : 0;
+            if (state.outlineEnabled) { flags |= Cache::STYLE_OUTLINE; putColor(1, state.outlineColor); row[21] = state.outlineWidth; }
+            if (state.glowEnabled) {
+                flags |= Cache::STYLE_GLOW; putColor(2, state.glowColor);
+                row[22] = state.glowRange; row[23] = state.glowIntensity;
+            }
+            if (state.shadowEnabled) {
+                flags |= Cache::STYLE_SHADOW; putColor(3, state.shadowColor);
+                row[24] = state.shadowOffset.x; row[25] = state.shadowOffset.y; row[26] = state.shadowSdfSpread;
+            }
+            if (state.innerEffectEnabled) {
+                flags |= Cache::STYLE_INNER_EFFECT | (state.innerEffectIsShadow ? Cache::STYLE_INNER_EFFECT_IS_SHADOW : 0);
+                putColor(4, state.innerEffectColor); row[27] = state.innerEffectRange;
+            }
+            row[20] = state.dynamicSmoothnessValue;
+            row[28] = (float)flags;
+            if (state.fill.type == FillType::LINEAR_GRADIENT && !state.fill.gradientStops.empty()) {
+                std::vector<GradientStop> stops = state.fill.gradientStops;
+                std::stable_sort(stops.begin(), stops.end(), [](const GradientStop& a, const GradientStop& b) { return a.position < b.position; });
+                if (stops.size() > (size_t)Cache::MAX_GRADIENT_STOPS) {
+                    TraceLog(LOG_WARNING, "FTTextEngine: Gradient has %zu stops, only the first %d are used.", stops.size(), Cache::MAX_GRADIENT_STOPS);
+                    stops.resize(Cache::MAX_GRADIENT_STOPS);
+                }
+                row[29] = (float)stops.size();
+                row[32] = state.fill.linearGradientStart.x; row[33] = state.fill.linearGradientStart.y;
+                row[34] = state.fill.linearGradientEnd.x; row[35] = state.fill.linearGradientEnd.y;
+                for (size_t i = 0; i < stops.size(); ++i) {
+                    row[36 + i] = stops[i].position; // Texels 9 and 10
+                    putColor(11 + (int)i, stops[i].color);
+                }
+            }
+            return row;
+        }
+
+        static int styleTextureRows(size_t styleCount) {
+            return (int)((styleCount + TextBlockDrawCache::STYLES_PER_ROW - 1) / TextBlockDrawCache::STYLES_PER_ROW);
+        }
+
+        static void packStyleTexels(const std::vector<TextBlockDrawCache::StyleRow>& styles, int rows, std::vector<float>& texels) {
+            texels.assign((size_t)rows * TextBlockDrawCache::STYLES_PER_ROW * TextBlockDrawCache::STYLE_TEXELS * 4, 0.0f);
+            for (size_t i = 0; i < styles.size(); ++i) {
+                std::copy(styles[i].begin(), styles[i].end(), texels.begin() + i * styles[i].size());
+            }
+        }
+
+        // VAO over quads [firstQuad, firstQuad + quadCount) of vertices, with the shared TL-BL-BR / TL-BR-TR index pattern.
+        // dynamic: buffers are refilled with rlUpdateVertexBuffer (frame mesh) instead of written once.
+        static TextBlockDrawCache::Chunk loadQuadChunk(const TextBlockDrawCache::Vertices& vertices, size_t firstQuad, int quadCount, bool dynamic) {
+            std::vector<unsigned short> indices((size_t)quadCount * 6);
+            for (int q = 0; q < quadCount; ++q) {
+                unsigned short base = (unsigned short)(q * 4);
+                unsigned short* quadIndices = &indices[(size_t)q * 6];
+                quadIndices[0] = base; quadIndices[1] = base + 1; quadIndices[2] = base + 2;
+                quadIndices[3] = base; quadIndices[4] = base + 2; quadIndices[5] = base + 3;
+            }
+            const size_t firstVertex = firstQuad * 4, vertexCount = (size_t)quadCount * 4;
+            TextBlockDrawCache::Chunk chunk;
+            chunk.vao = rlLoadVertexArray();
+            rlEnableVertexArray(chunk.vao);
+            chunk.vbo[0] = rlLoadVertexBuffer(vertices.positions.data() + firstVertex * 3, (int)(vertexCount * 3 * sizeof(float)), dynamic);
+            rlSetVertexAttribute(RL_DEFAULT_SHADER_ATTRIB_LOCATION_POSITION, 3, RL_FLOAT, false, 0, 0);
+            rlEnableVertexAttribute(RL_DEFAULT_SHADER_ATTRIB_LOCATION_POSITION);
+            chunk.vbo[1] = rlLoadVertexBuffer(vertices.texcoords.data() + firstVertex * 2, (int)(vertexCount * 2 * sizeof(float)), dynamic);
+            rlSetVertexAttribute(RL_DEFAULT_SHADER_ATTRIB_LOCATION_TEXCOORD, 2, RL_FLOAT, false, 0, 0);
+            rlEnableVertexAttribute(RL_DEFAULT_SHADER_ATTRIB_LOCATION_TEXCOORD);
+            chunk.vbo[2] = rlLoadVertexBuffer(vertices.colors.data() + firstVertex * 4, (int)(vertexCount * 4), dynamic);
+            rlSetVertexAttribute(RL_DEFAULT_SHADER_ATTRIB_LOCATION_COLOR, 4, RL_UNSIGNED_BYTE, true, 0, 0);
+            rlEnableVertexAttribute(RL_DEFAULT_SHADER_ATTRIB_LOCATION_COLOR);
+            chunk.vbo[3] = rlLoadVertexBuffer(vertices.styleModes.data() + firstVertex * 2, (int)(vertexCount * 2 * sizeof(float)), dynamic);
+            rlSetVertexAttribute(RL_DEFAULT_SHADER_ATTRIB_LOCATION_TEXCOORD2, 2, RL_FLOAT, false, 0, 0);
+            rlEnableVertexAttribute(RL_DEFAULT_SHADER_ATTRIB_LOCATION_TEXCOORD2);
+            chunk.vbo[4] = rlLoadVertexBuffer(vertices.blockCoords.data() + firstVertex * 2, (int)(vertexCount * 2 * sizeof(float)), dynamic);
+            rlSetVertexAttribute(TextBlockDrawCache::BLOCK_COORD_ATTRIB_LOCATION, 2, RL_FLOAT, false, 0, 0);
+            rlEnableVertexAttribute(TextBlockDrawCache::BLOCK_COORD_ATTRIB_LOCATION);
+            chunk.ebo = rlLoadVertexBufferElement(indices.data(), (int)(indices.size() * sizeof(unsigned short)), false);
+            rlDisableVertexArray();
+            return chunk;
+        }
+
+        // One quad per drawable glyph / image, in line order. Consecutive quads with the same texture share a command,
+        // whatever their kind; SDF glyphs get their SdfStyleKey interned into cache->styles and carry the index per vertex.
+        // uploadToGpu = false builds only the CPU side (vertices, commands, styles) and touches no GL state.
+        std::shared_ptr<TextBlockDrawCache> buildDrawCache(const TextBlock& textBlock, bool uploadToGpu = true) {
+            using Command = TextBlockDrawCache::Command;
+            auto cache = std::make_shared<TextBlockDrawCache>();
+            cache->owner = this;
+            cache->smoothnessAdd = dynamicSmoothnessAdd;
+            if (uploadToGpu) cache->releaseList = gpu_release_list_;
+            cache->instanced = uploadToGpu && (glyphRenderPath_ == GlyphRenderPath::INSTANCED);
+            cache->blockBounds = textBlock.overallBounds;
+            if (cache->blockBounds.width <= 0.0f) cache->blockBounds.width = 1.0f;
+            if (cache->blockBounds.height <= 0.0f) cache->blockBounds.height = 1.0f;
+
+            TextBlockDrawCache::Vertices& vertices = cache->vertices; // Kept in both paths, EndTextFrame reads it
+            std::vector<TextBlockDrawCache::GlyphInstance> instances;
+            int chunkQuads = 0;
+            auto uploadChunk = [&]() {
+                if (chunkQuads == 0) return;
+                size_t firstQuad = cache->chunks.size() * TextBlockDrawCache::MAX_QUADS_PER_CHUNK;
+                // Instanced blocks keep the chunk numbering (global quad = chunk * MAX + quad) without vertex buffers
+                const bool vertexBuffers = uploadToGpu && !cache->instanced;
+                cache->chunks.push_back(vertexBuffers ? loadQuadChunk(vertices, firstQuad, chunkQuads, false) : TextBlockDrawCache::Chunk{});
+                chunkQuads = 0;
+            };
+            // corners: top-left, bottom-left, bottom-right, top-right (the order RL_QUADS used)
+            auto appendQuad = [&](TextBlockDrawCache::QuadMode mode, unsigned int textureId, size_t styleIndex, const Vector2 (&corners)[4],
+                                  float u0, float v0, float u1, float v1, Color color) {
+                if (chunkQuads == TextBlockDrawCache::MAX_QUADS_PER_CHUNK) uploadChunk();
+                Command* command = cache->commands.empty() ? nullptr : &cache->commands.back();
+                if (!command || command->chunk != cache->chunks.size() || command->textureId != textureId) {
+                    Command newCommand;
+                    newCommand.chunk = cache->chunks.size(); newCommand.firstQuad = chunkQuads;
+                    newCommand.textureId = textureId;
+                    cache->commands.push_back(newCommand);
+                    command = &cache->commands.back();
+                }
+                command->quadCount++;
+                TextBlockDrawCache::CullSpan& span = cache->cullSpans.back(); // Opened by the element loop
+                size_t globalQuad = cache->chunks.size() * TextBlockDrawCache::MAX_QUADS_PER_CHUNK + chunkQuads;
+                float minX = corners[0].x, maxX = corners[0].x, minY = corners[0].y, maxY = corners[0].y;
+                for (const Vector2& corner : corners) {
+                    minX = std::min(minX, corner.x); maxX = std::max(maxX, corner.x);
+                    minY = std::min(minY, corner.y); maxY = std::max(maxY, corner.y);
+                }
+                if (span.quadCount == 0) {
+                    span.firstQuad = globalQuad;
+                    span.bounds = {minX, minY, maxX - minX, maxY - minY};
+                } else {
+                    float spanMaxX = std::max(span.bounds.x + span.bounds.width, maxX), spanMaxY = std::max(span.bounds.y + span.bounds.height, maxY);
+                    span.bounds.x = std::min(span.bounds.x, minX); span.bounds.y = std::min(span.bounds.y, minY);
+                    span.bounds.width = spanMaxX - span.bounds.x; span.bounds.height = spanMaxY - span.bounds.y;
+                }
+                span.quadCount = globalQuad + 1 - span.firstQuad;
+                const float quadU[4] = {u0, u0, u1, u1};
+                const float quadV[4] = {v0, v1, v1, v0};
+                for (int c = 0; c < 4; ++c) {
+                    vertices.positions.insert(vertices.positions.end(), {corners[c].x, corners[c].y, 0.0f});
+                    vertices.texcoords.insert(vertices.texcoords.end(), {quadU[c], quadV[c]});
+                    vertices.colors.insert(vertices.colors.end(), {color.r, color.g, color.b, color.a});
+                    vertices.styleModes.insert(vertices.styleModes.end(), {(float)styleIndex, (float)mode});
+                    vertices.blockCoords.insert(vertices.blockCoords.end(), {(corners[c].x - cache->blockBounds.x) / cache->blockBounds.width,
+                                                                             (corners[c].y - cache->blockBounds.y) / cache->blockBounds.height});
+                }
+                if (cache->instanced) {
+                    TextBlockDrawCache::GlyphInstance instance = {
+                        {corners[1].x, corners[0].y, corners[2].x - corners[1].x, corners[1].y - corners[0].y},
+                        {u0, v0, u1, v1}, {(float)styleIndex, (float)mode, corners[0].x - corners[1].x, 0.0f},
+                        {color.r, color.g, color.b, color.a}};
+                    instances.push_back(instance);
+                }
+                ++chunkQuads;
+            };
+
+            SdfStyleKey currentSdfState;
+            size_t currentStyleIndex = 0;
+            std::vector<bool> runStarts;
+            cache->lineFirstCullSpan.reserve(textBlock.lines.size() + 1);
+            for (const auto& line : textBlock.lines) {
+                float lineVisualBaselineY = GetLineTopY(textBlock, line) + line.baselineYInBox;
+                cache->lineFirstCullSpan.push_back(cache->cullSpans.size());
+                runStarts.assign(line.numElementsInLine, false);
+                for (const auto& run : line.visualRuns) {
+                    if (run.firstElementIndexInLineElements < runStarts.size()) runStarts[run.firstElementIndexInLineElements] = true;
+                }
+                for (size_t i = 0; i < line.numElementsInLine; ++i) {
+                    if (i == 0 || runStarts[i]) cache->cullSpans.emplace_back();
+                    if ((GetLineFirstElementIndex(textBlock, line) + i) >= textBlock.elements.size()) continue;
+                    const auto& elementVariant = textBlock.elements[GetLineFirstElementIndex(textBlock, line) + i];
+                    if (const auto* glyph = std::get_if<PositionedGlyph>(&elementVariant)) {
+                        const Texture2D& atlas = glyph->renderInfo.atlasTexture;
+                        const Rectangle& srcRect = glyph->renderInfo.atlasRect;
+                        if (atlas.id == 0 || srcRect.width == 0 || srcRect.height == 0 || atlas.width <= 0 || atlas.height <= 0) continue;
+                        float renderScale = glyphRenderScale(*glyph);
+                        float u0 = srcRect.x / atlas.width, v0 = srcRect.y / atlas.height;
+                        float u1 = (srcRect.x + srcRect.width) / atlas.width, v1 = (srcRect.y + srcRect.height) / atlas.height;
+                        SdfStyleKey glyphState(*glyph, sdfSmoothnessFor(*glyph));
+                        if (cache->styles.empty() || glyphState.DiffersFrom(currentSdfState)) {
+                            currentSdfState = glyphState;
+                            TextBlockDrawCache::StyleRow row = makeStyleRow(currentSdfState);
+                            auto found = std::find(cache->styles.begin(), cache->styles.end(), row); // Few styles per block
+                            currentStyleIndex = (size_t)(found - cache->styles.begin());
+                            if (found == cache->styles.end()) cache->styles.push_back(row);
+                        }
+                        if (!glyph->renderInfo.isSDF) { // Alpha bitmap: coverage from the atlas, fill (solid or gradient) from the style
+                            Rectangle dest = {glyph->position.x + glyph->xOffset + glyph->renderInfo.drawOffset.x * renderScale,
+                                              lineVisualBaselineY + glyph->position.y + glyph->renderInfo.drawOffset.y * renderScale,
+                                              srcRect.width * renderScale, srcRect.height * renderScale};
+                            const Vector2 corners[4] = {{dest.x, dest.y}, {dest.x, dest.y + dest.height},
+                                                        {dest.x + dest.width, dest.y + dest.height}, {dest.x + dest.width, dest.y}};
+                            appendQuad(TextBlockDrawCache::QUAD_COVERAGE, atlas.id, currentStyleIndex, corners, u0, v0, u1, v1, WHITE);
+                            continue;
+                        }
+                        // glyph.position already includes HarfBuzz x_offset and y_offset (as -yOffset)
+                        Rectangle dest = {glyph->position.x + glyph->renderInfo.drawOffset.x * renderScale,
+                                          lineVisualBaselineY + glyph->position.y + glyph->renderInfo.drawOffset.y * renderScale,
+                                          srcRect.width * renderScale, srcRect.height * renderScale};
+                        float shearAmount = HasStyle(glyph->appliedStyle.basicStyle, FontStyle::Italic) ? 0.2f * dest.height : 0.0f;
+                        const Vector2 corners[4] = {{dest.x + shearAmount, dest.y}, {dest.x, dest.y + dest.height},
+                                                    {dest.x + dest.width, dest.y + dest.height}, {dest.x + dest.width + shearAmount, dest.y}};
+                        appendQuad(TextBlockDrawCache::QUAD_SDF, atlas.id, currentStyleIndex, corners, u0, v0, u1, v1, WHITE);
+                    } else if (const auto* img = std::get_if<PositionedImage>(&elementVariant)) {
+                        if (img->imageParams.texture.id == 0) continue;
+                        Rectangle dest = {img->position.x, lineVisualBaselineY + img->position.y, img->width, img->height};
+                        const Vector2 corners[4] = {{dest.x, dest.y}, {dest.x, dest.y + dest.height},
+                                                    {dest.x + dest.width, dest.y + dest.height}, {dest.x + dest.width, dest.y}};
+                        appendQuad(TextBlockDrawCache::QUAD_RGBA, img->imageParams.texture.id, 0, corners, 0.0f, 0.0f, 1.0f, 1.0f, WHITE);
+                    }
+                }
+            }
+            cache->lineFirstCullSpan.push_back(cache->cullSpans.size());
+            uploadChunk();
+            if (cache->instanced && !instances.empty()) {
+                cache->instanceVao = rlLoadVertexArray();
+                rlEnableVertexArray(cache->instanceVao);
+                rlEnableVertexBuffer(unitQuadVbo_);
+                rlSetVertexAttribute(0, 2, RL_FLOAT, false, 0, 0);
+                rlEnableVertexAttribute(0);
+                const unsigned short unitIndices[6] = {0, 1, 2, 0, 2, 3};
+                cache->instanceEbo = rlLoadVertexBufferElement(unitIndices, (int)sizeof(unitIndices), false);
+                cache->instanceVbo = rlLoadVertexBuffer(instances.data(), (int)(instances.size() * sizeof(TextBlockDrawCache::GlyphInstance)), false);
+                for (unsigned int attribute = 1; attribute <= 4; ++attribute) {
+                    rlEnableVertexAttribute(attribute);
+                    rlSetVertexAttributeDivisor(attribute, 1);
+                }
+                setInstanceAttributes(0);
+                rlDisableVertexArray();
+            }
+            if (uploadToGpu && !cache->styles.empty()) {
+                const int rows = styleTextureRows(cache->styles.size());
+                std::vector<float> texels;
+                packStyleTexels(cache->styles, rows, texels);
+                cache->styleTexture = rlLoadTexture(texels.data(), TextBlockDrawCache::STYLES_PER_ROW * TextBlockDrawCache::STYLE_TEXELS,
+                                                    rows, PIXELFORMAT_UNCOMPRESSED_R32G32B32A32, 1);
+                if (cache->styleTexture == 0) TraceLog(LOG_WARNING, "FTTextEngine: Failed to create SDF style texture (%zu styles).", cache->styles.size());
+            }
+            return cache;
+        }
+
+        // Binds sdfShader_ (or sdfInstancedShader_) for mesh drawing: matrices, constants, tint, and styleTexture on
+        // texture slot 1 (atlas / image on 0)
+        void bindMeshShader(const Matrix& mvp, const Vector4& tint, unsigned int styleTexture, bool instanced = false) {
+            const float sdfEdgeTexVal = SDF_EDGE_VALUE;
+            const float boldStrengthVal = SDF_BOLD_STRENGTH;
+            const int styleTextureSlot = 1;
+            const Shader& shader = instanced ? sdfInstancedShader_ : sdfShader_;
+            const int edgeLoc = instanced ? instanced_sdfEdgeValue_loc_ : uniform_sdfEdgeValue_loc_;
+            const int boldLoc = instanced ? instanced_boldStrength_loc_ : uniform_boldStrength_loc_;
+            const int tintLoc = instanced ? instanced_globalTint_loc_ : uniform_globalTint_loc_;
+            const int styleLoc = instanced ? instanced_styleTexture_loc_ : uniform_styleTexture_loc_;
+            rlEnableShader(shader.id);
+            if (shader.locs[SHADER_LOC_MATRIX_MVP] != -1) rlSetUniformMatrix(shader.locs[SHADER_LOC_MATRIX_MVP], mvp);
+            if (edgeLoc != -1) SetShaderValue(shader, edgeLoc, &sdfEdgeTexVal, SHADER_UNIFORM_FLOAT);
+            if (boldLoc != -1) SetShaderValue(shader, boldLoc, &boldStrengthVal, SHADER_UNIFORM_FLOAT);
+            if (tintLoc != -1) SetShaderValue(shader, tintLoc, &tint, SHADER_UNIFORM_VEC4);
+            if (styleLoc != -1) SetShaderValue(shader, styleLoc, &styleTextureSlot, SHADER_UNIFORM_INT);
+            rlActiveTextureSlot(1);
+            if (styleTexture != 0) rlEnableTexture(styleTexture); else rlDisableTexture();
+            rlActiveTextureSlot(0);
+        }
+
+        // Points the per-instance attributes of the bound instance VAO at record firstInstance. GL 3.3 has no base-instance
+        // draw, so commands that start mid-buffer re-point the attributes instead.
+        static void setInstanceAttributes(size_t firstInstance) {
+            using GlyphInstance = TextBlockDrawCache::GlyphInstance;
+            const int stride = (int)sizeof(GlyphInstance);
+            const int base = (int)(firstInstance * sizeof(GlyphInstance));
+            rlSetVertexAttribute(1, 4, RL_FLOAT, false, stride, base + (int)offsetof(GlyphInstance, rect));
+            rlSetVertexAttribute(2, 4, RL_FLOAT, false, stride, base + (int)offsetof(GlyphInstance, uvRect));
+            rlSetVertexAttribute(3, 4, RL_FLOAT, false, stride, base + (int)offsetof(GlyphInstance, params));
+            rlSetVertexAttribute(4, 4, RL_UNSIGNED_BYTE, true, stride, base + (int)offsetof(GlyphInstance, color));
+        }
+
+        void unbindMeshShader() {
+            rlDisableVertexArray();
+            rlDisableTexture();
+            rlActiveTextureSlot(1);
+            rlDisableTexture();
+            rlActiveTextureSlot(0);
+            rlDisableShader();
+        }
+
+        // Draws a prepared mesh with the current rlgl matrix stack (DrawTextBlock has pushed the block transform).
+        // One shader for the whole block; commands only rebind the texture.
+        // visibleQuads: sorted, disjoint [begin, end) global quad ranges to submit; commands are clipped to them.
+        void drawPreparedMesh(const TextBlockDrawCache& cache, Color globalTint, const std::vector<std::pair<size_t, size_t>>& visibleQuads) {
+            if (cache.commands.empty() || visibleQuads.empty()) return;
+            using Command = TextBlockDrawCache::Command;
+            const Matrix mvp = MatrixMultiply(MatrixMultiply(rlGetMatrixTransform(), rlGetMatrixModelview()), rlGetMatrixProjection());
+            bindMeshShader(mvp, ColorNormalize(globalTint), cache.styleTexture, cache.instanced);
+            if (cache.instanced) {
+                const Vector4 bounds = {cache.blockBounds.x, cache.blockBounds.y, cache.blockBounds.width, cache.blockBounds.height};
+                if (instanced_blockBounds_loc_ != -1) SetShaderValue(sdfInstancedShader_, instanced_blockBounds_loc_, &bounds, SHADER_UNIFORM_VEC4);
+                rlEnableVertexArray(cache.instanceVao);
+            }
+
+            size_t boundChunk = SIZE_MAX;
+            size_t rangeIdx = 0;
+            for (const Command& command : cache.commands) {
+                const size_t commandBegin = command.chunk * TextBlockDrawCache::MAX_QUADS_PER_CHUNK + command.firstQuad;
+                const size_t commandEnd = commandBegin + command.quadCount;
+                while (rangeIdx < visibleQuads.size() && visibleQuads[rangeIdx].second <= commandBegin) ++rangeIdx;
+                if (rangeIdx == visibleQuads.size()) break;
+                if (visibleQuads[rangeIdx].first >= commandEnd) continue; // Command entirely culled
+                rlEnableTexture(command.textureId);
+                if (!cache.instanced && boundChunk != command.chunk) {
+                    rlEnableVertexArray(cache.chunks[command.chunk].vao);
+                    boundChunk = command.chunk;
+                }
+                for (size_t r = rangeIdx; r < visibleQuads.size() && visibleQuads[r].first < commandEnd; ++r) {
+                    size_t first = std::max(visibleQuads[r].first, commandBegin) - commandBegin;
+                    size_t last = std::min(visibleQuads[r].second, commandEnd) - commandBegin;
+                    if (cache.instanced) {
+                        rlEnableVertexBuffer(cache.instanceVbo);
+                        setInstanceAttributes(commandBegin + first);
+                        rlDrawVertexArrayElementsInstanced(0, 6, nullptr, (int)(last - first));
+                    } else {
+                        rlDrawVertexArrayElements((int)(command.firstQuad + first) * 6, (int)(last - first) * 6, nullptr);
+                    }
+                }
+            }
+            unbindMeshShader();
+        }
+
+        void releasePendingGpuObjects() {
+            for (unsigned int vao : gpu_release_list_->vertexArrays) if (vao > 0) rlUnloadVertexArray(vao);
+            for (unsigned int buffer : gpu_release_list_->buffers) if (buffer > 0) rlUnloadVertexBuffer(buffer);
+            for (unsigned int texture : gpu_release_list_->textures) if (texture > 0) rlUnloadTexture(texture);
+            gpu_release_list_->vertexArrays.clear();
+            gpu_release_list_->buffers.clear();
+            gpu_release_list_->textures.clear();
+        }
+
+        // --- Frame-level batching (BeginTextFrame / EndTextFrame) ---
+
+        void BeginTextFrame() override {
+            if (frameActive_) { TraceLog(LOG_WARNING, "FTTextEngine: BeginTextFrame called twice without EndTextFrame."); return; }
+            frameActive_ = true;
+            frameItems_.clear();
+            frameVisibleQuads_.clear();
+            frameScissors_.clear();
+            frameViewProjections_.clear();
+        }
+
+        void queueTextBlock(const TextBlock& textBlock, const Matrix& transform, Color globalTint, const Rectangle* clipRect) {
+            QueuedTextBlock item;
+            item.cache = ensureDrawCache(textBlock);
+            if (item.cache->commands.empty()) return;
+            item.world = MatrixMultiply(transform, rlGetMatrixTransform());
+            item.tint = globalTint;
+            const Matrix viewProjection = MatrixMultiply(rlGetMatrixModelview(), rlGetMatrixProjection()); // Camera in effect now, not at EndTextFrame
+            auto sameMatrix = [&viewProjection](const Matrix& m) { return std::memcmp(&m, &viewProjection, sizeof(Matrix)) == 0; };
+            auto foundViewProjection = std::find_if(frameViewProjections_.begin(), frameViewProjections_.end(), sameMatrix);
+            item.viewProjection = (int)(foundViewProjection - frameViewProjections_.begin());
+            if (foundViewProjection == frameViewProjections_.end()) frameViewProjections_.push_back(viewProjection);
+            item.firstRange = frameVisibleQuads_.size();
+            Rectangle clipInBlock = {0, 0, 0, 0};
+            bool cullToClip = false;
+            size_t firstLine = 0, endLine = textBlock.lines.size();
+            if (clipRect) {
+                Rectangle scissor = {floorf(clipRect->x), floorf(clipRect->y), 0, 0};
+                scissor.width = ceilf(clipRect->x + clipRect->width) - scissor.x;
+                scissor.height = ceilf(clipRect->y + clipRect->height) - scissor.y;
+                auto found = std::find_if(frameScissors_.begin(), frameScissors_.end(), [&scissor](const Rectangle& r) {
+                    return r.x == scissor.x && r.y == scissor.y && r.width == scissor.width && r.height == scissor.height;
+                });
+                item.scissor = (int)(found - frameScissors_.begin());
+                if (found == frameScissors_.end()) frameScissors_.push_back(scissor);
+                cullToClip = GetClipBoundsInBlockSpace(transform, *clipRect, clipInBlock);
+                if (cullToClip) FindLineRangeForYSpan(textBlock, clipInBlock.y, clipInBlock.y + clipInBlock.height, firstLine, endLine);
+            }
+            collectVisibleQuads(*item.cache, cullToClip ? &clipInBlock : nullptr, firstLine, endLine, frameVisibleQuads_);
+            item.rangeCount = frameVisibleQuads_.size() - item.firstRange;
+            if (item.rangeCount > 0) frameItems_.push_back(std::move(item));
+        }
+
+        void EndTextFrame() override {
+            if (!frameActive_) { TraceLog(LOG_WARNING, "FTTextEngine: EndTextFrame called without BeginTextFrame."); return; }
+            flushQueuedTextBlocks();
+            frameActive_ = false;
+        }
+
+        bool IsTextFrameActive() const override { return frameActive_; }
+
+        // Streams every queued command piece, in submission order, into one dynamic mesh: block transforms and tints are
+        // applied on the CPU, and the styles of all blocks are merged into a single style texture. Adjacent pieces with the
+        // same (scissor, camera, texture) share a draw call, so N labels sharing an atlas cost one; pieces are never
+        // reordered, so overlapping blocks keep their submission order.
+        void flushQueuedTextBlocks() {
+            if (frameItems_.empty()) return;
+            using Command = TextBlockDrawCache::Command;
+            using StyleRow = TextBlockDrawCache::StyleRow;
+
+            // 1. Styles: every (block style, tint) pair once
+            frameStyles_.clear();
+            frameStyleRemap_.clear();
+            std::map<StyleRow, size_t> frameStyleIds;
+            for (QueuedTextBlock& item : frameItems_) {
+                item.styleRemapBase = frameStyleRemap_.size();
+                const Vector4 tint = ColorNormalize(item.tint);
+                for (StyleRow row : item.cache->styles) {
+                    for (int texel = 0; texel < TextBlockDrawCache::STYLE_TEXELS; ++texel) {
+                        if (texel >= 5 && (texel < 11 || texel >= 11 + TextBlockDrawCache::MAX_GRADIENT_STOPS)) continue; // Not a color (see StyleRow)
+                        row[texel * 4 + 0] *= tint.x; row[texel * 4 + 1] *= tint.y; row[texel * 4 + 2] *= tint.z; row[texel * 4 + 3] *= tint.w;
+                    }
+                    auto inserted = frameStyleIds.emplace(row, frameStyles_.size());
+                    if (inserted.second) frameStyles_.push_back(row);
+                    frameStyleRemap_.push_back(inserted.first->second);
+                }
+            }
+            if (!frameStyles_.empty()) {
+                const int rows = styleTextureRows(frameStyles_.size());
+                const int width = TextBlockDrawCache::STYLES_PER_ROW * TextBlockDrawCache::STYLE_TEXELS;
+                std::vector<float> texels;
+                packStyleTexels(frameStyles_, rows, texels);
+                if (rows > frameStyleTextureRows_) {
+                    if (frameStyleTexture_ > 0) rlUnloadTexture(frameStyleTexture_);
+                    frameStyleTextureRows_ = std::max(rows, frameStyleTextureRows_ * 2);
+                    texels.resize((size_t)frameStyleTextureRows_ * width * 4, 0.0f);
+                    frameStyleTexture_ = rlLoadTexture(texels.data(), width, frameStyleTextureRows_, PIXELFORMAT_UNCOMPRESSED_R32G32B32A32, 1);
+                    if (frameStyleTexture_ == 0) frameStyleTextureRows_ = 0;
+                } else {
+                    rlUpdateTexture(frameStyleTexture_, 0, 0, width, rows, PIXELFORMAT_UNCOMPRESSED_R32G32B32A32, texels.data());
+                }
+            }
+
+            // 2. Pieces: each command clipped to its block's visible ranges, in submission order
+            struct Piece { int scissor; int viewProjection; unsigned int textureId; size_t item; size_t quadBegin, quadEnd; };
+            std::vector<Piece> pieces;
+            for (size_t itemIdx = 0; itemIdx < frameItems_.size(); ++itemIdx) {
+                const QueuedTextBlock& item = frameItems_[itemIdx];
+                for (const Command& command : item.cache->commands) {
+                    const size_t commandBegin = command.chunk * TextBlockDrawCache::MAX_QUADS_PER_CHUNK + command.firstQuad;
+                    const size_t commandEnd = commandBegin + command.quadCount;
+                    for (size_t r = item.firstRange; r < item.firstRange + item.rangeCount; ++r) {
+                        size_t begin = std::max(frameVisibleQuads_[r].first, commandBegin), end = std::min(frameVisibleQuads_[r].second, commandEnd);
+                        if (begin < end) pieces.push_back({item.scissor, item.viewProjection, command.textureId, itemIdx, begin, end});
+                    }
+                }
+            }
+
+            // 3. Stream into the frame chunk, one draw per state run per chunk
+            if (frameChunk_.vao == 0) {
+                const size_t maxVertices = (size_t)TextBlockDrawCache::MAX_QUADS_PER_CHUNK * 4;
+                frameVertices_.positions.assign(maxVertices * 3, 0.0f);
+                frameVertices_.texcoords.assign(maxVertices * 2, 0.0f);
+                frameVertices_.colors.assign(maxVertices * 4, 0);
+                frameVertices_.styleModes.assign(maxVertices * 2, 0.0f);
+                frameVertices_.blockCoords.assign(maxVertices * 2, 0.0f);
+                frameChunk_ = loadQuadChunk(frameVertices_, 0, TextBlockDrawCache::MAX_QUADS_PER_CHUNK, true);
+            }
+            std::vector<FrameRun> runs;
+            int chunkQuads = 0;
+            FrameDrawState drawState;
+            rlDrawRenderBatchActive();
+            for (const Piece& piece : pieces) {
+                const QueuedTextBlock& item = frameItems_[piece.item];
+                const TextBlockDrawCache::Vertices& source = item.cache->vertices;
+                const Matrix& m = item.world;
+                for (size_t quad = piece.quadBegin; quad < piece.quadEnd; ++quad) {
+                    if (chunkQuads == TextBlockDrawCache::MAX_QUADS_PER_CHUNK) {
+                        flushFrameChunk(runs, chunkQuads, drawState);
+                        runs.clear();
+                        chunkQuads = 0;
+                    }
+                    if (runs.empty() || runs.back().scissor != piece.scissor || runs.back().viewProjection != piece.viewProjection ||
+                        runs.back().textureId != piece.textureId) {
+                        runs.push_back({piece.scissor, piece.viewProjection, piece.textureId, chunkQuads, 0});
+                    }
+                    runs.back().quadCount++;
+                    for (size_t v = quad * 4; v < quad * 4 + 4; ++v) {
+                        const size_t dst = (size_t)chunkQuads * 4 + (v - quad * 4);
+                        float x = source.positions[v * 3], y = source.positions[v * 3 + 1], z = source.positions[v * 3 + 2];
+                        frameVertices_.positions[dst * 3 + 0] = m.m0 * x + m.m4 * y + m.m8 * z + m.m12;
+                        frameVertices_.positions[dst * 3 + 1] = m.m1 * x + m.m5 * y + m.m9 * z + m.m13;
+                        frameVertices_.positions[dst * 3 + 2] = m.m2 * x + m.m6 * y + m.m10 * z + m.m14;
+                        frameVertices_.texcoords[dst * 2 + 0] = source.texcoords[v * 2];
+                        frameVertices_.texcoords[dst * 2 + 1] = source.texcoords[v * 2 + 1];
+                        frameVertices_.blockCoords[dst * 2 + 0] = source.blockCoords[v * 2];
+                        frameVertices_.blockCoords[dst * 2 + 1] = source.blockCoords[v * 2 + 1];
+                        const unsigned char* color = &source.colors[v * 4];
+                        unsigned char* outColor = &frameVertices_.colors[dst * 4];
+                        const float mode = source.styleModes[v * 2 + 1];
+                        frameVertices_.styleModes[dst * 2 + 1] = mode;
+                        if (mode != (float)TextBlockDrawCache::QUAD_RGBA) {
+                            std::copy(color, color + 4, outColor); // Tint lives in the frame style rows
+                            frameVertices_.styleModes[dst * 2] = (float)frameStyleRemap_[item.styleRemapBase + (size_t)source.styleModes[v * 2]];
+                        } else {
+                            outColor[0] = (unsigned char)(color[0] * item.tint.r / 255); outColor[1] = (unsigned char)(color[1] * item.tint.g / 255);
+                            outColor[2] = (unsigned char)(color[2] * item.tint.b / 255); outColor[3] = (unsigned char)(color[3] * item.tint.a / 255);
+                            frameVertices_.styleModes[dst * 2] = 0.0f;
+                        }
+                    }
+                    ++chunkQuads;
+                }
+            }
+            flushFrameChunk(runs, chunkQuads, drawState);
+            if (drawState.scissor >= 0) EndScissorMode();
+            unbindMeshShader();
+            frameItems_.clear(); // Releases the meshes of blocks that were dropped during the frame
+            frameVisibleQuads_.clear();
+        }
+
+        void flushFrameChunk(const std::vector<FrameRun>& runs, int quadCount, FrameDrawState& state) {
+            if (quadCount == 0) return;
+            const size_t vertexCount = (size_t)quadCount * 4;
+            rlUpdateVertexBuffer(frameChunk_.vbo[0], frameVertices_.positions.data(), (int)(vertexCount * 3 * sizeof(float)), 0);
+            rlUpdateVertexBuffer(frameChunk_.vbo[1], frameVertices_.texcoords.data(), (int)(vertexCount * 2 * sizeof(float)), 0);
+            rlUpdateVertexBuffer(frameChunk_.vbo[2], frameVertices_.colors.data(), (int)(vertexCount * 4), 0);
+            rlUpdateVertexBuffer(frameChunk_.vbo[3], frameVertices_.styleModes.data(), (int)(vertexCount * 2 * sizeof(float)), 0);
+            rlUpdateVertexBuffer(frameChunk_.vbo[4], frameVertices_.blockCoords.data(), (int)(vertexCount * 2 * sizeof(float)), 0);
+
+            const Vector4 white = {1.0f, 1.0f, 1.0f, 1.0f}; // Block transforms and tints are baked into the vertices
+            for (const FrameRun& run : runs) {
+                if (run.scissor != state.scissor) {
+                    if (state.scissor >= 0) EndScissorMode();
+                    if (run.scissor >= 0) {
+                        const Rectangle& r = frameScissors_[run.scissor];
+                        BeginScissorMode((int)r.x, (int)r.y, (int)r.width, (int)r.height);
+                    }
+                    state.scissor = run.scissor;
+                    state.viewProjection = -1; // The scissor calls flush rlgl's batch, which may rebind its own state
+                }
+                if (run.viewProjection != state.viewProjection) {
+                    bindMeshShader(frameViewProjections_[run.viewProjection], white, frameStyleTexture_);
+                    state.viewProjection = run.viewProjection;
+                }
+                rlEnableTexture(run.textureId);
+                rlEnableVertexArray(frameChunk_.vao);
+                rlDrawVertexArrayElements(run.firstQuad * 6, run.quadCount * 6, nullptr);
+            }
+        }
+
+        // --- CPU rasterizer (RenderTextBlockToImage) ---
+
+        // A grayscale atlas page as the CPU sees it (atlas_images_ mirrors every atlas texture)
+        struct CpuAtlasPage { unsigned int textureId; const unsigned char* pixels; int width, height; };
+
+        // TextBlockDrawCache::StyleRow decoded, colors multiplied by the tint the way loadStyle() does
+        struct CpuGlyphStyle {
+            Vector4 text, outline, glow, shadow, inner;
+            float smoothness, outlineWidth, glowRange, glowIntensity;
+            Vector2 shadowOffset; // Atlas pixels
+            float shadowSpread, innerRange;
+            int flags, stopCount;
+            Vector4 gradientLine; // start.xy, end.xy in block coordinates
+            float stopPositions[TextBlockDrawCache::MAX_GRADIENT_STOPS];
+            Vector4 stopColors[TextBlockDrawCache::MAX_GRADIENT_STOPS];
+        };
+
+        // One quad mapped into the image: pixel-space bounds and the affine map pixel centre -> (s, t) across the
+        // parallelogram spanned from the bottom-left corner (s towards bottom-right, t towards top-left)
+        struct CpuQuad {
+            size_t quad;
+            int minX, minY, maxX, maxY; // [min, max) in image pixels
+            float s0, sx, sy, t0, tx, ty;
+            const CpuAtlasPage* page;
+        };
+
+        static CpuGlyphStyle decodeStyleRow(const TextBlockDrawCache::StyleRow& row, const Vector4& tint) {
+            auto color = [&row, &tint](int texel) {
+                return Vector4{row[texel * 4] * tint.x, row[texel * 4 + 1] * tint.y, row[texel * 4 + 2] * tint.z, row[texel * 4 + 3] * tint.w};
+            };
+            CpuGlyphStyle style{};
+            style.text = color(0); style.outline = color(1); style.glow = color(2); style.shadow = color(3); style.inner = color(4);
+            style.smoothness = row[20]; style.outlineWidth = row[21]; style.glowRange = row[22]; style.glowIntensity = row[23];
+            style.shadowOffset = {row[24], row[25]}; style.shadowSpread = row[26]; style.innerRange = row[27];
+            style.flags = (int)(row[28] + 0.5f);
+            style.stopCount = std::min((int)(row[29] + 0.5f), TextBlockDrawCache::MAX_GRADIENT_STOPS);
+            style.gradientLine = {row[32], row[33], row[34], row[35]};
+            for (int i = 0; i < style.stopCount; ++i) {
+                style.stopPositions[i] = row[36 + i];
+                style.stopColors[i] = color(11 + i);
+            }
+            return style;
+        }
+
+        static float cpuSmoothstep(float edge0, float edge1, float x) {
+            if (edge1 <= edge0) return x < edge0 ? 0.0f : 1.0f;
+            float t = Clamp((x - edge0) / (edge1 - edge0), 0.0f, 1.0f);
+            return t * t * (3.0f - 2.0f * t);
+        }
+
+        static Vector4 cpuMix(const Vector4& a, const Vector4& b, float t) {
+            return {a.x + (b.x - a.x) * t, a.y + (b.y - a.y) * t, a.z + (b.z - a.z) * t, a.w + (b.w - a.w) * t};
+        }
+
+        // alphaBlend() of the fragment shader
+        static Vector4 cpuAlphaBlend(const Vector4& newColor, const Vector4& oldColor) {
+            float outAlpha = newColor.w + oldColor.w * (1.0f - newColor.w);
+            if (outAlpha < 0.0001f) return {0.0f, 0.0f, 0.0f, 0.0f};
+            float keep = oldColor.w * (1.0f - newColor.w);
+            return {(newColor.x * newColor.w + oldColor.x * keep) / outAlpha, (newColor.y * newColor.w + oldColor.y * keep) / outAlpha,
+                    (newColor.z * newColor.w + oldColor.z * keep) / outAlpha, outAlpha};
+        }
+
+        // Bilinear read like the GPU's TEXTURE_FILTER_BILINEAR; x / y in atlas pixels (texel centres at +0.5), clamped to the page
+        static float sampleAtlasBilinear(const CpuAtlasPage& page, float x, float y) {
+            x -= 0.5f; y -= 0.5f;
+            const float fx = floorf(x), fy = floorf(y);
+            const float ax = x - fx, ay = y - fy;
+            const int x0 = std::clamp((int)fx, 0, page.width - 1), x1 = std::clamp((int)fx + 1, 0, page.width - 1);
+            const int y0 = std::clamp((int)fy, 0, page.height - 1), y1 = std::clamp((int)fy + 1, 0, page.height - 1);
+            const unsigned char* row0 = page.pixels + (size_t)y0 * page.width;
+            const unsigned char* row1 = page.pixels + (size_t)y1 * page.width;
+            float top = row0[x0] + (row0[x1] - row0[x0]) * ax;
+            float bottom = row1[x0] + (row1[x1] - row1[x0]) * ax;
+            return (top + (bottom - top) * ay) * (1.0f / 255.0f);
+        }
+
+        static Vector4 cpuGradientColor(const CpuGlyphStyle& style, float blockX, float blockY) {
+            const Vector4& line = style.gradientLine;
+            float dx = line.z - line.x, dy = line.w - line.y;
+            float t = ((blockX - line.x) * dx + (blockY - line.y) * dy) / std::max(dx * dx + dy * dy, 1e-6f);
+            Vector4 color = style.stopColors[0];
+            for (int i = 1; i < style.stopCount; ++i) {
+                if (t <= style.stopPositions[i - 1]) break;
+                float f = Clamp((t - style.stopPositions[i - 1]) / std::max(style.stopPositions[i] - style.stopPositions[i - 1], 1e-6f), 0.0f, 1.0f);
+                color = cpuMix(style.stopColors[i - 1], style.stopColors[i], f);
+            }
+            return color;
+        }
+
+        // The QUAD_SDF branch of ftSdfMasterFragmentShaderSrc main(); keep the two in step
+        static Vector4 shadeSdfFragment(const CpuGlyphStyle& style, const Vector4& textColor, float mainDistance, float shadowDistance) {
+            using Cache = TextBlockDrawCache;
+            Vector4 accumulated = {0.0f, 0.0f, 0.0f, 0.0f};
+            float effectiveSdfEdge = SDF_EDGE_VALUE - ((style.flags & Cache::STYLE_BOLD) ? SDF_BOLD_STRENGTH : 0.0f);
+            const bool outline = (style.flags & Cache::STYLE_OUTLINE) != 0;
+            if (style.flags & Cache::STYLE_SHADOW) {
+                float shadowAlpha = cpuSmoothstep(SDF_EDGE_VALUE - style.shadowSpread, SDF_EDGE_VALUE + style.shadowSpread, shadowDistance);
+                accumulated = cpuAlphaBlend({style.shadow.x, style.shadow.y, style.shadow.z, shadowAlpha * style.shadow.w}, accumulated);
+            }
+            if ((style.flags & Cache::STYLE_GLOW) && style.glowRange > 0.0f) {
+                float distanceFromEdge = effectiveSdfEdge - (outline ? style.outlineWidth : 0.0f) - mainDistance;
+                float rawGlowAlpha = 0.0f;
+                if (distanceFromEdge > 0.0f) {
+                    float falloff = 1.0f - Clamp(distanceFromEdge / style.glowRange, 0.0f, 1.0f);
+                    rawGlowAlpha = falloff * falloff;
+                }
+                accumulated = cpuAlphaBlend({style.glow.x, style.glow.y, style.glow.z, rawGlowAlpha * style.glowIntensity * style.glow.w}, accumulated);
+            }
+            if (outline && style.outlineWidth > 0.0f) {
+                float outerEdge = effectiveSdfEdge - style.outlineWidth;
+                float alphaOuter = cpuSmoothstep(outerEdge - style.smoothness, outerEdge + style.smoothness, mainDistance);
+                float alphaInner = cpuSmoothstep(effectiveSdfEdge - style.smoothness, effectiveSdfEdge + style.smoothness, mainDistance);
+                float outlineAlpha = Clamp(alphaOuter - alphaInner, 0.0f, 1.0f) * style.outline.w;
+                accumulated = cpuAlphaBlend({style.outline.x, style.outline.y, style.outline.z, outlineAlpha}, accumulated);
+            }
+            float fillAlphaFactor = cpuSmoothstep(effectiveSdfEdge - style.smoothness, effectiveSdfEdge + style.smoothness, mainDistance);
+            Vector4 fill = {textColor.x, textColor.y, textColor.z, textColor.w * fillAlphaFactor};
+            if ((style.flags & Cache::STYLE_INNER_EFFECT) && style.innerRange > 0.0f && fillAlphaFactor > 0.001f) {
+                float targetEdge = effectiveSdfEdge + style.innerRange;
+                float alphaAtTarget = cpuSmoothstep(targetEdge - style.smoothness, targetEdge + style.smoothness, mainDistance);
+                float innerAlpha = Clamp(fillAlphaFactor - alphaAtTarget, 0.0f, 1.0f) * style.inner.w;
+                Vector4 target = (style.flags & Cache::STYLE_INNER_EFFECT_IS_SHADOW)
+                                 ? Vector4{fill.x * style.inner.x, fill.y * style.inner.y, fill.z * style.inner.z, 0.0f}
+                                 : style.inner;
+                fill.x += (target.x - fill.x) * innerAlpha; fill.y += (target.y - fill.y) * innerAlpha; fill.z += (target.z - fill.z) * innerAlpha;
+            }
+            return cpuAlphaBlend(fill, accumulated);
+        }
+
+        // BLEND_ALPHA on an 8-bit target: src * srcAlpha + dst * (1 - srcAlpha) on every channel, alpha included
+        static void blendIntoPixel(unsigned char* dst, const Vector4& src) {
+            const float a = Clamp(src.w, 0.0f, 1.0f);
+            if (a <= 0.0f) return;
+            const float keep = 1.0f - a;
+            const float channels[4] = {Clamp(src.x, 0.0f, 1.0f), Clamp(src.y, 0.0f, 1.0f), Clamp(src.z, 0.0f, 1.0f), a};
+            for (int c = 0; c < 4; ++c) {
+                dst[c] = (unsigned char)(Clamp(channels[c] * a + dst[c] * (1.0f / 255.0f) * keep, 0.0f, 1.0f) * 255.0f + 0.5f);
+            }
+        }
+
+        // Same quads, styles and fragment math as DrawTextBlock, evaluated at pixel centres. The image is cut into
+        // horizontal bands, one per thread; a band walks every quad in submission order, so overlaps blend exactly as on the GPU.
+        void RenderTextBlockToImage(const TextBlock& textBlock, Image& image, const Matrix& transform, Color globalTint) override {
+            if (textBlock.lines.empty() || !image.data || image.width <= 0 || image.height <= 0) return;
+            if (image.format != PIXELFORMAT_UNCOMPRESSED_R8G8B8A8) {
+                TraceLog(LOG_WARNING, "FTTextEngine: RenderTextBlockToImage needs an R8G8B8A8 image (got format %d).", image.format);
+                return;
+            }
+            const Matrix& m = transform;
+            if (m.m3 != 0.0f || m.m7 != 0.0f || m.m15 != 1.0f) {
+                TraceLog(LOG_WARNING, "FTTextEngine: RenderTextBlockToImage only supports 2D affine transforms.");
+                return;
+            }
+            const float det = m.m0 * m.m5 - m.m4 * m.m1;
+            if (fabsf(det) < 1e-12f) return; // Block collapsed to a line: nothing covers a pixel centre
+
+            std::shared_ptr<TextBlockDrawCache> cache = buildDrawCache(textBlock, false);
+            if (cache->commands.empty()) return;
+            std::vector<CpuAtlasPage> pages;
+            for (size_t i = 0; i < atlas_textures_.size() && i < atlas_images_.size(); ++i) {
+                if (atlas_images_[i].data && atlas_images_[i].format == PIXELFORMAT_UNCOMPRESSED_GRAYSCALE) {
+                    pages.push_back({atlas_textures_[i].id, (const unsigned char*)atlas_images_[i].data, atlas_images_[i].width, atlas_images_[i].height});
+                }
+            }
+            const Vector4 tint = ColorNormalize(globalTint);
+            std::vector<CpuGlyphStyle> styles;
+            styles.reserve(cache->styles.size());
+            for (const TextBlockDrawCache::StyleRow& row : cache->styles) styles.push_back(decodeStyleRow(row, tint));
+
+            // Pixel centre (px, py) -> block space: inverse of the 2D part of transform
+            const float invA = m.m5 / det, invB = -m.m4 / det, invC = -m.m1 / det, invD = m.m0 / det;
+            const TextBlockDrawCache::Vertices& vertices = cache->vertices;
+            std::vector<CpuQuad> quads;
+            size_t skippedImages = 0;
+            for (const TextBlockDrawCache::Command& command : cache->commands) {
+                auto pageIt = std::find_if(pages.begin(), pages.end(), [&command](const CpuAtlasPage& page) { return page.textureId == command.textureId; });
+                const size_t commandBegin = command.chunk * TextBlockDrawCache::MAX_QUADS_PER_CHUNK + command.firstQuad;
+                for (size_t quad = commandBegin; quad < commandBegin + command.quadCount; ++quad) {
+                    if (vertices.styleModes[quad * 8 + 1] == (float)TextBlockDrawCache::QUAD_RGBA) { ++skippedImages; continue; }
+                    if (pageIt == pages.end()) continue;
+                    const float* p = &vertices.positions[quad * 12]; // TL, BL, BR, TR
+                    float minX = FLT_MAX, minY = FLT_MAX, maxX = -FLT_MAX, maxY = -FLT_MAX;
+                    for (int c = 0; c < 4; ++c) {
+                        float x = m.m0 * p[c * 3] + m.m4 * p[c * 3 + 1] + m.m12, y = m.m1 * p[c * 3] + m.m5 * p[c * 3 + 1] + m.m13;
+                        minX = std::min(minX, x); maxX = std::max(maxX, x); minY = std::min(minY, y); maxY = std::max(maxY, y);
+                    }
+                    CpuQuad cpuQuad;
+                    cpuQuad.quad = quad;
+                    cpuQuad.page = &*pageIt;
+                    cpuQuad.minX = std::max(0, (int)floorf(minX)); cpuQuad.maxX = std::min(image.width, (int)ceilf(maxX));
+                    cpuQuad.minY = std::max(0, (int)floorf(minY)); cpuQuad.maxY = std::min(image.height, (int)ceilf(maxY));
+                    if (cpuQuad.minX >= cpuQuad.maxX || cpuQuad.minY >= cpuQuad.maxY) continue;
+                    const float originX = p[3], originY = p[4];                 // Bottom-left
+                    const float e1x = p[6] - originX, e1y = p[7] - originY;     // -> bottom-right
+                    const float e2x = p[0] - originX, e2y = p[1] - originY;     // -> top-left
+                    const float quadDet = e1x * e2y - e2x * e1y;
+                    if (fabsf(quadDet) < 1e-12f) continue;
+                    // s / t as affine functions of the pixel position: block = inv * (pixel - translation), then the quad basis
+                    auto st = [&](float px, float py, float& s, float& t) {
+                        float bx = invA * (px - m.m12) + invB * (py - m.m13) - originX;
+                        float by = invC * (px - m.m12) + invD * (py - m.m13) - originY;
+                        s = (bx * e2y - by * e2x) / quadDet;
+                        t = (e1x * by - e1y * bx) / quadDet;
+                    };
+                    float s00, t00, s10, t10, s01, t01;
+                    st(0.5f, 0.5f, s00, t00); st(1.5f, 0.5f, s10, t10); st(0.5f, 1.5f, s01, t01);
+                    cpuQuad.s0 = s00; cpuQuad.sx = s10 - s00; cpuQuad.sy = s01 - s00;
+                    cpuQuad.t0 = t00; cpuQuad.tx = t10 - t00; cpuQuad.ty = t01 - t00;
+                    quads.push_back(cpuQuad);
+                }
+            }
+            if (skippedImages > 0) TraceLog(LOG_WARNING, "FTTextEngine: RenderTextBlockToImage skipped %zu inline image(s) (GPU textures only).", skippedImages);
+            if (quads.empty()) return;
+
+            unsigned char* pixels = (unsigned char*)image.data;
+            auto rasterBand = [&](int bandY0, int bandY1) {
+                std::vector<float> spanS, spanT; // Per-span interpolants, filled by branch-free loops the compiler can vectorise
+                for (const CpuQuad& q : quads) {
+                    const int rowBegin = std::max(q.minY, bandY0), rowEnd = std::min(q.maxY, bandY1);
+                    if (rowBegin >= rowEnd) continue;
+                    const size_t v = q.quad * 4; // Vertex index of TL; BL = v + 1, BR = v + 2
+                    const bool isSdf = vertices.styleModes[v * 2 + 1] == (float)TextBlockDrawCache::QUAD_SDF;
+                    const CpuGlyphStyle& style = styles[(size_t)vertices.styleModes[v * 2]];
+                    const float* uv = &vertices.texcoords[v * 2];
+                    const float* bc = &vertices.blockCoords[v * 2];
+                    const float pageW = (float)q.page->width, pageH = (float)q.page->height;
+                    // Attribute = BL + s * (BR - BL) + t * (TL - BL); texcoords scaled to atlas pixels
+                    const float u0 = uv[2] * pageW, uS = (uv[4] - uv[2]) * pageW, uT = (uv[0] - uv[2]) * pageW;
+                    const float v0 = uv[3] * pageH, vS = (uv[5] - uv[3]) * pageH, vT = (uv[1] - uv[3]) * pageH;
+                    const float b0x = bc[2], bSx = bc[4] - bc[2], bTx = bc[0] - bc[2];
+                    const float b0y = bc[3], bSy = bc[5] - bc[3], bTy = bc[1] - bc[3];
+                    const int spanWidth = q.maxX - q.minX;
+                    spanS.resize((size_t)spanWidth); spanT.resize((size_t)spanWidth);
+                    for (int py = rowBegin; py < rowEnd; ++py) {
+                        const float rowS = q.s0 + q.sx * q.minX + q.sy * py, rowT = q.t0 + q.tx * q.minX + q.ty * py;
+                        for (int i = 0; i < spanWidth; ++i) { spanS[i] = rowS + q.sx * i; spanT[i] = rowT + q.tx * i; }
+                        unsigned char* row = pixels + ((size_t)py * image.width + q.minX) * 4;
+                        for (int i = 0; i < spanWidth; ++i) {
+                            const float s = spanS[i], t = spanT[i];
+                            if (s < 0.0f || s >= 1.0f || t < 0.0f || t >= 1.0f) continue; // Pixel centre outside the quad
+                            const float texX = u0 + uS * s + uT * t, texY = v0 + vS * s + vT * t;
+                            Vector4 textColor = style.text;
+                            if (style.stopCount > 0) textColor = cpuGradientColor(style, b0x + bSx * s + bTx * t, b0y + bSy * s + bTy * t);
+                            Vector4 color;
+                            if (isSdf) {
+                                float shadowDistance = (style.flags & TextBlockDrawCache::STYLE_SHADOW)
+                                                       ? sampleAtlasBilinear(*q.page, texX - style.shadowOffset.x, texY - style.shadowOffset.y) : 0.0f;
+                                color = shadeSdfFragment(style, textColor, sampleAtlasBilinear(*q.page, texX, texY), shadowDistance);
+                            } else {
+                                color = {textColor.x, textColor.y, textColor.z, textColor.w * sampleAtlasBilinear(*q.page, texX, texY)};
+                            }
+                            blendIntoPixel(row + (size_t)i * 4, color);
+                        }
+                    }
+                }
+            };
+
+            // Each band is a thread started for this call: only split images big enough to amortize that, and never
+            // beyond MAX_BANDS threads however many cores the machine reports
+            constexpr int MIN_BAND_ROWS = 32;
+            constexpr long long MIN_BAND_PIXELS = 64 * 1024;
+            constexpr int MAX_BANDS = 8;
+            const int hardwareThreads = (int)std::max(1u, std::thread::hardware_concurrency());
+            const int bandsBySize = (int)std::min<long long>(image.height / MIN_BAND_ROWS, (long long)image.width * image.height / MIN_BAND_PIXELS);
+            const int bandCount = std::clamp(bandsBySize, 1, std::min(hardwareThreads, MAX_BANDS));
+            const int bandRows = (image.height + bandCount - 1) / bandCount;
+            std::vector<std::thread> workers;
+            for (int band = 1; band < bandCount; ++band) {
+                workers.emplace_back(rasterBand, band * bandRows, std::min(image.height, (band + 1) * bandRows));
+            }
+            rasterBand(0, std::min(image.height, bandRows));
+            for (std::thread& worker : workers) worker.join();
+        }
+
         // **NEWLY IMPLEMENTED**
         std::vector<Rectangle> GetTextRangeBounds(const TextBlock& textBlock, uint32_t byteOffsetStart, uint32_t byteOffsetEnd) const override {
             std::vector<Rectangle> boundsList;
@@ -1832,9 +3945,12 @@ void main() {
                 return boundsList;
             }
 
-            for (const auto& line : textBlock.lines) { //
-                uint32_t lineByteStart = line.sourceTextByteStartIndexInBlockText; //
-                uint32_t lineByteEnd = line.sourceTextByteEndIndexInBlockText; //
+            // 从包含 byteOffsetStart 的行开始，遇到起始字节 >= byteOffsetEnd 的行即停
+            for (size_t lineIdx = FindLineIndexForByteOffset(textBlock, byteOffsetStart); lineIdx < textBlock.lines.size(); ++lineIdx) {
+                const auto& line = textBlock.lines[lineIdx];
+                uint32_t lineByteStart = GetLineByteStart(textBlock, line); //
+                uint32_t lineByteEnd = GetLineByteEnd(textBlock, line); //
+                if (lineByteStart >= byteOffsetEnd) break;
 
                 // Determine overlap between query range and line range
                 uint32_t effectiveRangeStart = std::max(byteOffsetStart, lineByteStart);
@@ -1844,25 +3960,17 @@ void main() {
                     continue; // No overlap with this line
                 }
 
-                float lineVisualBaselineY = line.lineBoxY + line.baselineYInBox; //
+                float lineVisualBaselineY = GetLineTopY(textBlock, line) + line.baselineYInBox; //
                 float currentRunMinX = -1.0f; // Use -1 to indicate no active run on this line yet
                 float currentRunMaxX = 0.0f;
                 float currentRunMaxAscent = 0.0f;
                 float currentRunMaxDescent = 0.0f;
 
                 for (size_t i = 0; i < line.numElementsInLine; ++i) { //
-                    const auto& elementVariant = textBlock.elements[line.firstElementIndexInBlockElements + i]; //
-
-                    uint32_t elGlobalByteStart = 0;
-                    uint16_t elNumBytes = 0;
-                    std::visit([&](const auto& el_v){ //
-                        uint32_t span_start_offset = 0;
-                        for(size_t k=0; k < el_v.sourceSpanIndex; ++k) { //
-                            span_start_offset += textBlock.sourceSpansCopied[k].text.empty() && textBlock.sourceSpansCopied[k].style.isImage ? 3 : textBlock.sourceSpansCopied[k].text.length(); //
-                        }
-                        elGlobalByteStart = span_start_offset + el_v.sourceCharByteOffsetInSpan; //
-                        elNumBytes = el_v.numSourceCharBytesInSpan; //
-                    }, elementVariant);
+                    const auto& elementVariant = textBlock.elements[GetLineFirstElementIndex(textBlock, line) + i]; //
+
+                    uint32_t elGlobalByteStart = GetElementSourceByteStart(textBlock, elementVariant);
+                    uint16_t elNumBytes = std::visit([](const auto& el_v) { return el_v.numSourceCharBytesInSpan; }, elementVariant);
                     uint32_t elGlobalByteEnd = elGlobalByteStart + elNumBytes;
 
                     // Check if this element is part of the effective range for this line
@@ -1929,6 +4037,7 @@ void main() {
                                         Color highlightColor,
                                         const Matrix& worldTransform
         ) const override {
+            if (!atlasStorage_->HasGpu()) return;
             if (selectionStartByte >= selectionEndByte || textBlock.lines.empty()) return; //
 
             std::vector<Rectangle> selectionRects = GetTextRangeBounds(textBlock, selectionStartByte, selectionEndByte);
@@ -1969,14 +4078,34 @@ void main() {
                 TraceLog(LOG_WARNING, "FTTextEngine: Unsupported GlyphAtlasType. Defaulting to SDF."); atlas_type_hint_ = GlyphAtlasType::SDF_BITMAP; //
             }
         }
+        void SetGlyphRenderPath(GlyphRenderPath path) override {
+            if (path == GlyphRenderPath::INSTANCED && sdfInstancedShader_.id == 0) {
+                if (sdfShader_.id == 0 || sdfShader_.id == rlGetShaderIdDefault()) {
+                    TraceLog(LOG_WARNING, "FTTextEngine: Instanced glyph rendering needs the SDF shader, keeping the vertex path.");
+                    return;
+                }
+                sdfInstancedShader_ = LoadShaderFromMemory(ftSdfInstancedVertexShaderSrc, ftSdfMasterFragmentShaderSrc);
+                if (sdfInstancedShader_.id == 0 || sdfInstancedShader_.id == rlGetShaderIdDefault()) {
+                    TraceLog(LOG_WARNING, "FTTextEngine: Instanced SDF shader failed to load, keeping the vertex path.");
+                    sdfInstancedShader_ = Shader{};
+                    return;
+                }
+                instanced_sdfEdgeValue_loc_ = GetShaderLocation(sdfInstancedShader_, "sdfEdgeValue");
+                instanced_boldStrength_loc_ = GetShaderLocation(sdfInstancedShader_, "boldStrength");
+                instanced_styleTexture_loc_ = GetShaderLocation(sdfInstancedShader_, "styleTexture");
+                instanced_globalTint_loc_ = GetShaderLocation(sdfInstancedShader_, "globalTint");
+                instanced_blockBounds_loc_ = GetShaderLocation(sdfInstancedShader_, "blockBounds");
+                const float unitCorners[8] = {0, 0, 0, 1, 1, 1, 1, 0};
+                unitQuadVbo_ = rlLoadVertexBuffer(unitCorners, (int)sizeof(unitCorners), false);
+            }
+            glyphRenderPath_ = path; // Cached meshes built for the other path are rebuilt on their next draw
+        }
+        GlyphRenderPath GetGlyphRenderPath() const override { return glyphRenderPath_; }
+
         Texture2D GetAtlasTextureForDebug(int atlasIndex = 0) const override { if (atlasIndex >= 0 && static_cast<size_t>(atlasIndex) < atlas_textures_.size()) return atlas_textures_[atlasIndex]; return {0}; } //
 
         // --- Cursor and Hit-Testing ---
-        // GetCursorInfoFromByteOffset and GetByteOffsetFromVisualPosition remain largely the same logic
-        // as in your original RaylibSDFTextEx.cpp, but should be reviewed for BiDi correctness
-        // if the LineLayoutInfo's BiDi maps are populated and used.
-        // For brevity here, I'm including the existing logic structure.
-        // They will benefit from the BiDi maps for more precise LTR/RTL boundary handling.
+        // Both walk the line's visual runs; the per-line BiDi maps are not consulted yet.
         CursorLocationInfo GetCursorInfoFromByteOffset(
                 const TextBlock& textBlock, //
                 uint32_t byteOffsetInConcatenatedText,
@@ -2005,25 +4134,27 @@ void main() {
                 return cInfo;
             }
 
+            // 行索引二分得到唯一的候选行 (起始字节 <= byteOffset 的最后一行)，再按原规则确认
             int targetLineIdx = -1;
-            for (size_t i = 0; i < textBlock.lines.size(); ++i) { //
+            {
+                size_t i = FindLineIndexForByteOffset(textBlock, cInfo.byteOffset);
                 const auto& line = textBlock.lines[i]; //
-                if ((cInfo.byteOffset >= line.sourceTextByteStartIndexInBlockText && cInfo.byteOffset < line.sourceTextByteEndIndexInBlockText) || //
-                    (cInfo.byteOffset == line.sourceTextByteEndIndexInBlockText && (i == textBlock.lines.size() - 1 || cInfo.byteOffset < textBlock.lines[i + 1].sourceTextByteStartIndexInBlockText)) || //
+                if ((cInfo.byteOffset >= GetLineByteStart(textBlock, line) && cInfo.byteOffset < GetLineByteEnd(textBlock, line)) || //
+                    (cInfo.byteOffset == GetLineByteEnd(textBlock, line) && (i == textBlock.lines.size() - 1 || cInfo.byteOffset < GetLineByteStart(textBlock, textBlock.lines[i + 1]))) || //
                     (cInfo.byteOffset == textBlock.sourceTextConcatenated.length() && i == textBlock.lines.size() - 1) ) { //
-                    targetLineIdx = i; break;
+                    targetLineIdx = (int)i;
                 }
             }
-            if (targetLineIdx == -1) { targetLineIdx = textBlock.lines.size() - 1; cInfo.byteOffset = textBlock.lines[targetLineIdx].sourceTextByteEndIndexInBlockText; } //
+            if (targetLineIdx == -1) { targetLineIdx = textBlock.lines.size() - 1; cInfo.byteOffset = GetLineByteEnd(textBlock, textBlock.lines[targetLineIdx]); } //
             if (targetLineIdx < 0) targetLineIdx = 0;
 
             const auto& line = textBlock.lines[targetLineIdx]; //
             cInfo.lineIndex = targetLineIdx; //
-            cInfo.visualPosition.y = line.lineBoxY + line.baselineYInBox; // Y is baseline
-            cInfo.isAtLogicalLineEnd = (cInfo.byteOffset == line.sourceTextByteEndIndexInBlockText); //
+            cInfo.visualPosition.y = GetLineTopY(textBlock, line) + line.baselineYInBox; // Y is baseline
+            cInfo.isAtLogicalLineEnd = (cInfo.byteOffset == GetLineByteEnd(textBlock, line)); //
 
             float lineDrawStartX = 0.0f;
-            bool isThisLineFirstInParagraph = (line.sourceTextByteStartIndexInBlockText == 0) || (line.sourceTextByteStartIndexInBlockText > 0 && !textBlock.sourceTextConcatenated.empty() && textBlock.sourceTextConcatenated[line.sourceTextByteStartIndexInBlockText-1] == '\n'); //
+            bool isThisLineFirstInParagraph = (GetLineByteStart(textBlock, line) == 0) || (GetLineByteStart(textBlock, line) > 0 && !textBlock.sourceTextConcatenated.empty() && textBlock.sourceTextConcatenated[GetLineByteStart(textBlock, line)-1] == '\n'); //
             if (isThisLineFirstInParagraph) lineDrawStartX += textBlock.paragraphStyleUsed.firstLineIndent; //
             float lineShiftX = 0; float visualLineWidthWithIndent = lineDrawStartX + line.lineWidth; //
             float effectiveWrapWidth = textBlock.paragraphStyleUsed.wrapWidth > 0 ? textBlock.paragraphStyleUsed.wrapWidth : visualLineWidthWithIndent; //
@@ -2043,24 +4174,21 @@ void main() {
                 // For simplicity, the BiDi map usage is omitted here but would be an enhancement.
                 bool cursorPositionFound = false;
                 // Iterate through visual runs and then elements within those runs
-                // (same logic as your original RaylibSDFTextEx.cpp for finding the element)
                 // When an element is found, its pGlyph.position.x is already relative to the unaligned line start.
                 // We just need to add lineDrawStartX to it.
                 for (const auto& visualRun : line.visualRuns) { //
                     if (cursorPositionFound) break;
                     for (size_t i_el_in_run = 0; i_el_in_run < visualRun.numElementsInRun; ++i_el_in_run) { //
                         size_t elementIdxInLine = visualRun.firstElementIndexInLineElements + i_el_in_run; //
-                        size_t currentElementGlobalIdx = line.firstElementIndexInBlockElements + elementIdxInLine; //
+                        size_t currentElementGlobalIdx = GetLineFirstElementIndex(textBlock, line) + elementIdxInLine; //
                         const auto& elementVariant = textBlock.elements[currentElementGlobalIdx]; //
 
                         uint32_t el_byte_start_in_block = 0; uint16_t el_num_bytes = 0;
                         float el_pos_x_in_line = 0, el_advance = 0; // el_pos_x_in_line is before line alignment
                         float el_ascent = defaultMetrics.ascent, el_descent = defaultMetrics.descent;
 
+                        el_byte_start_in_block = GetElementSourceByteStart(textBlock, elementVariant);
                         std::visit([&](const auto& el_v){ //
-                            uint32_t current_byte_offset_for_span = 0;
-                            for(size_t k=0; k < el_v.sourceSpanIndex; ++k) current_byte_offset_for_span += textBlock.sourceSpansCopied[k].text.empty() && textBlock.sourceSpansCopied[k].style.isImage ? 3 : textBlock.sourceSpansCopied[k].text.length(); //
-                            el_byte_start_in_block = current_byte_offset_for_span + el_v.sourceCharByteOffsetInSpan; //
                             el_num_bytes = el_v.numSourceCharBytesInSpan; //
                             el_pos_x_in_line = el_v.position.x; // This is element's X relative to unaligned line start
                             el_ascent = el_v.ascent; el_descent = el_v.descent; //
@@ -2126,10 +4254,12 @@ void main() {
             float minDistYToLineCenter = 1e9f;
             bool clickIsDirectlyOnLine = false;
 
-            for (size_t i = 0; i < textBlock.lines.size(); ++i) {
+            // 行按 y 有序且互不重叠：只需看行顶 <= y 的最后一行和它的下一行
+            const size_t lineAtOrAboveY = FindLineIndexForY(textBlock, positionInBlockLocalCoords.y);
+            for (size_t i = lineAtOrAboveY; i < std::min(lineAtOrAboveY + 2, textBlock.lines.size()); ++i) {
                 const auto& line = textBlock.lines[i];
-                float lineTopY = line.lineBoxY;
-                float lineBottomY = line.lineBoxY + line.lineBoxHeight;
+                float lineTopY = GetLineTopY(textBlock, line);
+                float lineBottomY = GetLineTopY(textBlock, line) + line.lineBoxHeight;
                 if (positionInBlockLocalCoords.y >= lineTopY && positionInBlockLocalCoords.y < lineBottomY) {
                     targetLineIdx = i;
                     clickIsDirectlyOnLine = true; // Click is within the Y-bounds of this line
@@ -2145,12 +4275,12 @@ void main() {
             }
             const auto& line = textBlock.lines[targetLineIdx];
             TraceLog(LOG_INFO, "GetByteOffset: TargetLine Index: %d (YBox: %.1f, Height: %.1f, ClickDirectlyOnLine: %s, MinDistY: %.2f)",
-                     targetLineIdx, line.lineBoxY, line.lineBoxHeight, clickIsDirectlyOnLine ? "Yes" : "No", minDistYToLineCenter);
+                     targetLineIdx, GetLineTopY(textBlock, line), line.lineBoxHeight, clickIsDirectlyOnLine ? "Yes" : "No", minDistYToLineCenter);
 
             // 2. Get the UTF-16 representation of the current line's text for BiDi maps
             std::u16string lineU16;
-            uint32_t lineU8StartInBlock = line.sourceTextByteStartIndexInBlockText;
-            uint32_t lineU8EndInBlock = line.sourceTextByteEndIndexInBlockText; // Exclusive
+            uint32_t lineU8StartInBlock = GetLineByteStart(textBlock, line);
+            uint32_t lineU8EndInBlock = GetLineByteEnd(textBlock, line); // Exclusive
             if (lineU8EndInBlock > lineU8StartInBlock && lineU8EndInBlock <= textBlock.sourceTextConcatenated.length()) {
                 lineU16 = Utf8ToUtf16(textBlock.sourceTextConcatenated.substr(lineU8StartInBlock, lineU8EndInBlock - lineU8StartInBlock));
             }
@@ -2159,11 +4289,11 @@ void main() {
 
             // 3. Calculate lineVisualContentStartX and handle clicks outside horizontal bounds or on empty lines
             float lineVisualContentStartX = 0.0f; // X where content visually starts in block coordinates
-            bool isThisLineFirstInParagraph = (line.sourceTextByteStartIndexInBlockText == 0) ||
-                                              (line.sourceTextByteStartIndexInBlockText > 0 &&
+            bool isThisLineFirstInParagraph = (GetLineByteStart(textBlock, line) == 0) ||
+                                              (GetLineByteStart(textBlock, line) > 0 &&
                                                !textBlock.sourceTextConcatenated.empty() &&
-                                               line.sourceTextByteStartIndexInBlockText <= textBlock.sourceTextConcatenated.length() &&
-                                               textBlock.sourceTextConcatenated[line.sourceTextByteStartIndexInBlockText - 1] == '\n');
+                                               GetLineByteStart(textBlock, line) <= textBlock.sourceTextConcatenated.length() &&
+                                               textBlock.sourceTextConcatenated[GetLineByteStart(textBlock, line) - 1] == '\n');
             if (isThisLineFirstInParagraph) {
                 lineVisualContentStartX += textBlock.paragraphStyleUsed.firstLineIndent;
             }
@@ -2187,8 +4317,8 @@ void main() {
             if (lineU16.empty() || line.numElementsInLine == 0) {
                 if (isTrailingEdgeOut) *isTrailingEdgeOut = (positionInBlockLocalCoords.x > lineVisualContentStartX + line.lineWidth / 2.0f);
                 if (distanceToClosestEdgeOut) *distanceToClosestEdgeOut = fabsf(positionInBlockLocalCoords.x - (lineVisualContentStartX + ((*isTrailingEdgeOut) ? line.lineWidth : 0.0f)));
-                TraceLog(LOG_INFO, "GetByteOffset: Empty or No-Element Line. ByteOffset: %u. Trailing: %s", line.sourceTextByteStartIndexInBlockText, (*isTrailingEdgeOut ? "Y":"N"));
-                return line.sourceTextByteStartIndexInBlockText;
+                TraceLog(LOG_INFO, "GetByteOffset: Empty or No-Element Line. ByteOffset: %u. Trailing: %s", GetLineByteStart(textBlock, line), (*isTrailingEdgeOut ? "Y":"N"));
+                return GetLineByteStart(textBlock, line);
             }
 
             if (positionInBlockLocalCoords.x < lineVisualContentStartX && !line.visualToLogicalMap.empty()) {
@@ -2221,7 +4351,7 @@ void main() {
 
                 for (size_t i_el_in_run = 0; i_el_in_run < visualRun.numElementsInRun; ++i_el_in_run) {
                     size_t elementIdxInLineElements = visualRun.firstElementIndexInLineElements + i_el_in_run;
-                    size_t currentElementGlobalIdx = line.firstElementIndexInBlockElements + elementIdxInLineElements;
+                    size_t currentElementGlobalIdx = GetLineFirstElementIndex(textBlock, line) + elementIdxInLineElements;
 
                     if (currentElementGlobalIdx >= textBlock.elements.size()) {
                         TraceLog(LOG_WARNING, "GetByteOffset: Element index %zu out of bounds (Total elements: %zu)", currentElementGlobalIdx, textBlock.elements.size());
@@ -2231,7 +4361,7 @@ void main() {
 
                     float el_block_x = 0.0f;
                     float el_visual_width = 0.0f;
-                    uint32_t el_u8_start_in_block_abs = 0;
+                    uint32_t el_u8_start_in_block_abs = GetElementSourceByteStart(textBlock, elementVariant);
                     uint16_t el_u8_num_bytes_in_span_for_el = 0;
                     uint32_t current_el_source_span_idx = 0;
 
@@ -2240,16 +4370,6 @@ void main() {
                         el_u8_num_bytes_in_span_for_el = el_v.numSourceCharBytesInSpan;
                         current_el_source_span_idx = el_v.sourceSpanIndex;
 
-                        uint32_t span_start_offset_in_block = 0;
-                        for(size_t k=0; k < el_v.sourceSpanIndex; ++k) {
-                            if (k < textBlock.sourceSpansCopied.size()) {
-                                const auto& prev_span_style = textBlock.sourceSpansCopied[k].style;
-                                const auto& prev_span_text = textBlock.sourceSpansCopied[k].text;
-                                span_start_offset_in_block += (prev_span_style.isImage && prev_span_text.empty() ? 3 : prev_span_text.length());
-                            }
-                        }
-                        el_u8_start_in_block_abs = span_start_offset_in_block + el_v.sourceCharByteOffsetInSpan;
-
                         using T = std::decay_t<decltype(el_v)>;
                         if constexpr (std::is_same_v<T, PositionedGlyph>) el_visual_width = el_v.xAdvance;
                         else if constexpr (std::is_same_v<T, PositionedImage>) el_visual_width = el_v.width;
@@ -2481,5 +4601,9 @@ void main() {
 } // anonymous namespace end
 
 std::unique_ptr<ITextEngine> CreateTextEngine() { //
-    return std::make_unique<FTTextEngineImpl>(); //
+    return std::make_unique<FTTextEngineImpl>(nullptr); //
+}
+
+std::unique_ptr<ITextEngine> CreateTextEngine(std::unique_ptr<IAtlasStorage> atlasStorage) {
+    return std::make_unique<FTTextEngineImpl>(std::move(atlasStorage));
 }
\ No newline at end of file
@@ -2,6 +2,8 @@
 #include "raylib.h"
 #include "raymath.h"     // 用于矩阵操作, Vector2 等
 #include "text_engine.h" // 我们的文本引擎头文件
+#include "text_model.h"  // 编辑用的 piece table 文本模型
+#include "text_document.h" // 按视口虚拟化的多段落文档 (TextDocument)
 #include <string>
 #include <vector>
 #include <algorithm> // 用于 std::min/max
@@ -263,19 +265,93 @@ int main(void) {
     // --- End of HTML content mapping ---
 
 
-    TextBlock currentTextBlock;
+    // 编辑区按段落 ('\n' 分隔，不含 '\n') 分别布局：编辑只重新布局 TextChange 涉及的段落，其余段落的 TextBlock 原样保留
+    struct EditorParagraph {
+        size_t byteStart = 0, byteLength = 0;
+        float top = 0.0f;                                  // 段落原点 (编辑区坐标)
+        std::shared_ptr<const TextBlock> block;            // 为空表示待布局
+        std::unique_ptr<TextBlockRenderCache> renderCache; // F8：整段渲染到纹理，按需创建
+    };
+    std::vector<EditorParagraph> paragraphs;
+    bool paragraphsDirty = true;
+    Rectangle editorBounds = {0, 0, 0, 0};
+    size_t totalElements = 0, totalLines = 0;
+    size_t cursorParagraph = 0;
     CursorLocationInfo cursorInfo;
-    bool needsRelayout = true;
-    uint32_t textEditCursorBytePosition = 0;
 
-    // Calculate initial cursor position to be at the end of the text
-    for(const auto& s : spans) {
-        if (s.style.isImage && s.text.empty()) { // Images are represented by a placeholder in text
-            textEditCursorBytePosition += 3; // Assuming U+FFFC (Object Replacement Character) or similar
-        } else {
-            textEditCursorBytePosition += s.text.length();
+    // 编辑用的文本模型：按字节偏移查找/插入/删除都是 O(log n)
+    StyledTextModel textModel(spans);
+
+    // 从段落开头 start 起按 '\n' 切分，直到包含 coverEnd 的段落为止 (至少返回一个段落)
+    auto splitParagraphs = [&textModel](size_t start, size_t coverEnd) {
+        std::vector<EditorParagraph> result;
+        size_t pos = start;
+        for (;;) {
+            auto [paraStart, paraEnd] = textModel.GetParagraphRange(pos);
+            bool endsWithNewline = paraEnd > paraStart && textModel.GetText(paraEnd - 1, 1) == "\n";
+            EditorParagraph paragraph;
+            paragraph.byteStart = paraStart;
+            paragraph.byteLength = paraEnd - paraStart - (endsWithNewline ? 1 : 0);
+            result.push_back(std::move(paragraph));
+            if (!endsWithNewline || paraEnd > coverEnd) break;
+            pos = paraEnd;
         }
-    }
+        return result;
+    };
+    // 包含 byteOffset 的段落下标 (段落末尾 '\n' 之前的位置属于该段落)
+    auto findParagraph = [&paragraphs](size_t byteOffset) -> size_t {
+        auto it = std::upper_bound(paragraphs.begin(), paragraphs.end(), byteOffset,
+                                   [](size_t offset, const EditorParagraph& p) { return offset < p.byteStart; });
+        return it == paragraphs.begin() ? 0 : (size_t)(it - paragraphs.begin()) - 1;
+    };
+    paragraphs = splitParagraphs(0, textModel.Length());
+
+    // 修改前 [offset, offset + removedLength] 涉及的段落换成修改后 [offset, offset + insertedLength] 重新切分出的段落 (待布局)，之后的段落只平移字节偏移
+    textModel.AddChangeListener([&](const TextChange& change) {
+        size_t first = findParagraph(change.offset);
+        size_t last = findParagraph(change.offset + change.removedLength);
+        std::vector<EditorParagraph> replacement = splitParagraphs(paragraphs[first].byteStart, change.offset + change.insertedLength);
+        for (size_t i = last + 1; i < paragraphs.size(); ++i) paragraphs[i].byteStart = paragraphs[i].byteStart + change.insertedLength - change.removedLength;
+        paragraphs.erase(paragraphs.begin() + first, paragraphs.begin() + last + 1);
+        paragraphs.insert(paragraphs.begin() + first, std::make_move_iterator(replacement.begin()), std::make_move_iterator(replacement.end()));
+        paragraphsDirty = true;
+    });
+
+    // 布局待布局的段落并重新排列段落原点；未修改的段落不会重新布局
+    auto layoutDirtyParagraphs = [&]() {
+        if (!paragraphsDirty) return;
+        float y = 0.0f;
+        editorBounds = {0, 0, 0, 0};
+        totalElements = totalLines = 0;
+        for (auto& paragraph : paragraphs) {
+            if (!paragraph.block) paragraph.block = textEngine->LayoutStyledTextCached(textModel.GetSpans(paragraph.byteStart, paragraph.byteLength), paraStyle);
+            paragraph.top = y;
+            y += paragraph.block->overallBounds.height;
+            editorBounds.width = std::max(editorBounds.width, paragraph.block->overallBounds.x + paragraph.block->overallBounds.width);
+            totalElements += paragraph.block->elements.size();
+            totalLines += paragraph.block->lines.size();
+        }
+        editorBounds.height = y;
+        paragraphsDirty = false;
+    };
+    // 编辑区坐标 -> 整篇文本的字节偏移
+    auto byteOffsetAtEditorPosition = [&](Vector2 position) -> uint32_t {
+        auto it = std::upper_bound(paragraphs.begin(), paragraphs.end(), position.y,
+                                   [](float y, const EditorParagraph& p) { return y < p.top; });
+        const EditorParagraph& paragraph = *(it == paragraphs.begin() ? it : it - 1);
+        Vector2 local = {position.x, position.y - paragraph.top};
+        return (uint32_t)(paragraph.byteStart + textEngine->GetByteOffsetFromVisualPosition(*paragraph.block, local, nullptr, nullptr));
+    };
+
+    // Initial cursor position is at the end of the text
+    uint32_t textEditCursorBytePosition = (uint32_t)textModel.Length();
+    auto updateCursorInfo = [&]() {
+        textEditCursorBytePosition = (uint32_t)std::min<size_t>(textEditCursorBytePosition, textModel.Length());
+        cursorParagraph = findParagraph(textEditCursorBytePosition);
+        const EditorParagraph& paragraph = paragraphs[cursorParagraph];
+        cursorInfo = textEngine->GetCursorInfoFromByteOffset(*paragraph.block, (uint32_t)(textEditCursorBytePosition - paragraph.byteStart), true);
+        cursorInfo.visualPosition.y += paragraph.top;
+    };
 
     Vector2 textBlockScreenPosition = { 50, 60 };
     float textBlockRotation = 0.0f;
@@ -288,6 +364,8 @@ int main(void) {
     const float blinkInterval = 0.53f;
     bool animateScale = false;
     bool showDebugAtlas = false;
+    bool useInstancedGlyphs = false;
+    bool useRenderCache = false;
 
     SetTargetFPS(60);
 
@@ -301,221 +379,75 @@ int main(void) {
         // --- 简单文本编辑逻辑 ---
         int charCodePoint = GetCharPressed();
         while (charCodePoint > 0) {
-            uint32_t currentGlobalOffset = 0;
-            int targetSpanIdx = -1;
-            uint32_t relativeInsertOffsetInSpanBytes = 0;
-
-            if (spans.empty()) {
-                TextSpan newSpan;
-                newSpan.style = paraStyle.defaultCharacterStyle;
-                spans.push_back(newSpan);
-                targetSpanIdx = 0;
-                relativeInsertOffsetInSpanBytes = 0;
-            } else {
-                for (size_t i = 0; i < spans.size(); ++i) {
-                    const auto& s = spans[i];
-                    size_t spanByteLength = s.style.isImage && s.text.empty() ? 3 : s.text.length();
-                    if (textEditCursorBytePosition >= currentGlobalOffset && textEditCursorBytePosition <= currentGlobalOffset + spanByteLength) {
-                        if (s.style.isImage) {
-                            // Prefer inserting into adjacent text span or create new one
-                            if (textEditCursorBytePosition == currentGlobalOffset && i > 0 && !spans[i-1].style.isImage) {
-                                targetSpanIdx = i - 1;
-                                relativeInsertOffsetInSpanBytes = spans[i-1].text.length();
-                            } else if (textEditCursorBytePosition == currentGlobalOffset + spanByteLength && i < spans.size() -1 && !spans[i+1].style.isImage){
-                                targetSpanIdx = i + 1;
-                                relativeInsertOffsetInSpanBytes = 0;
-                            }
-                            else { // Insert new span for text
-                                TextSpan newCharSpan; newCharSpan.style = paraStyle.defaultCharacterStyle;
-                                spans.insert(spans.begin() + i + (textEditCursorBytePosition > currentGlobalOffset ? 1:0), newCharSpan);
-                                targetSpanIdx = i + (textEditCursorBytePosition > currentGlobalOffset ? 1:0);
-                                if(targetSpanIdx < 0) targetSpanIdx = 0;
-                                if(targetSpanIdx >= (int)spans.size()) targetSpanIdx = spans.size() -1;
-                                relativeInsertOffsetInSpanBytes = 0;
-                            }
-                        } else { // It's a text span
-                            targetSpanIdx = i;
-                            relativeInsertOffsetInSpanBytes = textEditCursorBytePosition - currentGlobalOffset;
-                        }
-                        break;
-                    }
-                    currentGlobalOffset += spanByteLength;
-                }
-                if (targetSpanIdx == -1 && textEditCursorBytePosition >= currentGlobalOffset) {
-                    // Cursor is at the very end of all spans
-                    if (!spans.empty() && !spans.back().style.isImage) {
-                        targetSpanIdx = spans.size() - 1;
-                        relativeInsertOffsetInSpanBytes = spans.back().text.length();
-                    } else { // Last span is image or spans is empty (though handled), create new text span
-                        TextSpan newSpan; newSpan.style = paraStyle.defaultCharacterStyle;
-                        spans.push_back(newSpan);
-                        targetSpanIdx = spans.size() - 1;
-                        relativeInsertOffsetInSpanBytes = 0;
-                    }
-                }
-            }
-
-            if (targetSpanIdx != -1 && targetSpanIdx < (int)spans.size() && !spans[targetSpanIdx].style.isImage) {
-                int utf8Len = 0;
-                const char* utf8Bytes = CodepointToUTF8(charCodePoint, &utf8Len);
-                if (utf8Len > 0) {
-                    if (relativeInsertOffsetInSpanBytes > spans[targetSpanIdx].text.length()) {
-                        relativeInsertOffsetInSpanBytes = spans[targetSpanIdx].text.length();
-                    }
-                    spans[targetSpanIdx].text.insert(relativeInsertOffsetInSpanBytes, utf8Bytes, utf8Len);
-                    textEditCursorBytePosition += utf8Len;
-                    needsRelayout = true;
-                }
+            int utf8Len = 0;
+            const char* utf8Bytes = CodepointToUTF8(charCodePoint, &utf8Len);
+            if (utf8Len > 0) {
+                // 新字符沿用光标前一个字符的样式 (在开头时看光标后的字符)；相邻的是图片或文本为空时用段落默认样式
+                const CharacterStyle* neighbourStyle = textModel.GetStyleAt(textEditCursorBytePosition > 0 ? textEditCursorBytePosition - 1 : 0);
+                const CharacterStyle& insertStyle = (neighbourStyle && !neighbourStyle->isImage) ? *neighbourStyle : paraStyle.defaultCharacterStyle;
+                textModel.Insert(textEditCursorBytePosition, std::string_view(utf8Bytes, utf8Len), insertStyle);
+                textEditCursorBytePosition += utf8Len;
             }
             charCodePoint = GetCharPressed();
         }
 
         if (IsKeyPressedRepeat(KEY_BACKSPACE) || IsKeyPressed(KEY_BACKSPACE)) {
-            if (textEditCursorBytePosition > 0 && !spans.empty()) {
-                uint32_t currentGlobalOffset = 0;
-                int targetSpanIdx = -1;
-                uint32_t relativeByteOffsetInSpanEnd = 0; // Byte offset from start of span to cursor
-
-                for (size_t i = 0; i < spans.size(); ++i) {
-                    const auto& s = spans[i];
-                    size_t spanByteLength = s.style.isImage && s.text.empty() ? 3 : s.text.length();
-                    if (textEditCursorBytePosition > currentGlobalOffset && textEditCursorBytePosition <= currentGlobalOffset + spanByteLength) {
-                        targetSpanIdx = i;
-                        relativeByteOffsetInSpanEnd = textEditCursorBytePosition - currentGlobalOffset;
-                        break;
-                    }
-                    currentGlobalOffset += spanByteLength;
-                }
-
-                if (targetSpanIdx != -1) {
-                    if (spans[targetSpanIdx].style.isImage && relativeByteOffsetInSpanEnd > 0) { // Cursor is after image or inside its placeholder
-                        size_t imagePlaceholderLen = spans[targetSpanIdx].text.empty() ? 3 : spans[targetSpanIdx].text.length();
-                        textEditCursorBytePosition -= imagePlaceholderLen;
-                        spans.erase(spans.begin() + targetSpanIdx);
-                        if (spans.empty()) { // Ensure there's always a span if everything is deleted
-                            TextSpan emptySpan; emptySpan.style = paraStyle.defaultCharacterStyle;
-                            spans.push_back(emptySpan);
-                            textEditCursorBytePosition = 0;
-                        }
-                        needsRelayout = true;
-                    } else if (!spans[targetSpanIdx].style.isImage) { // Text span
-                        std::string& textToEdit = spans[targetSpanIdx].text;
-                        if (relativeByteOffsetInSpanEnd > 0 && relativeByteOffsetInSpanEnd <= textToEdit.length()) {
-                            uint32_t charToDeleteStartOffset = 0;
-                            int charToDeleteByteLength = 0;
-
-                            // Find the start of the UTF-8 character before relativeByteOffsetInSpanEnd
-                            const char* ptr = textToEdit.c_str();
-                            const char* endPtr = ptr + relativeByteOffsetInSpanEnd;
-                            const char* lastCharStartPtr = ptr;
-                            const char* prevLastCharStartPtr = ptr;
-
-                            while(ptr < endPtr) {
-                                prevLastCharStartPtr = lastCharStartPtr;
-                                lastCharStartPtr = ptr;
-                                int currentCharlen = 0;
-                                GetNextCodepointFromUTF8(&ptr, &currentCharlen);
-                                if(currentCharlen == 0) break; // Should not happen with valid UTF-8
-                                charToDeleteByteLength = currentCharlen;
-                            }
-                            charToDeleteStartOffset = lastCharStartPtr - textToEdit.c_str();
-
-                            if (charToDeleteByteLength > 0 && charToDeleteStartOffset < textToEdit.length()) {
-                                textToEdit.erase(charToDeleteStartOffset, charToDeleteByteLength);
-                                textEditCursorBytePosition -= charToDeleteByteLength;
-                                needsRelayout = true;
-                                // If a text span becomes empty and it's not the only span, consider removing it
-                                // or merging with an adjacent text span if styles match. For simplicity, leaving it.
-                            }
-                        }
-                    }
-                }
+            if (textEditCursorBytePosition > 0) {
+                // 图片占位符 U+FFFC 也是一个码点，按码点删除即可整体删掉图片
+                size_t prevCharStart = textModel.PrevCodepointStart(textEditCursorBytePosition);
+                textModel.Erase(prevCharStart, textEditCursorBytePosition - prevCharStart);
+                textEditCursorBytePosition = (uint32_t)prevCharStart;
             }
         }
 
+        layoutDirtyParagraphs(); // 本帧的输入可能刚修改了段落，导航前先补齐布局
+        updateCursorInfo();
+
         bool cursorMovedByKey = false;
         if (IsKeyPressedRepeat(KEY_LEFT) || IsKeyPressed(KEY_LEFT)){
-            if (textEditCursorBytePosition > 0) {
-                // This logic needs to be robust across multiple spans if currentTextBlock.sourceTextConcatenated is used.
-                // For simplicity, we use sourceTextConcatenated from the last layout.
-                // A more robust solution would map global byte offset to span and local offset.
-                if (!currentTextBlock.sourceTextConcatenated.empty()) {
-                    uint32_t prevCharStartOffset = 0;
-                    uint32_t currentSearchOffset = 0;
-                    const char* textPtr = currentTextBlock.sourceTextConcatenated.c_str();
-                    while(currentSearchOffset < textEditCursorBytePosition) {
-                        prevCharStartOffset = currentSearchOffset;
-                        int bc = 0;
-                        GetNextCodepointFromUTF8(&textPtr, &bc);
-                        if(bc == 0) break; // End of string or invalid
-                        currentSearchOffset += bc;
-                        if(currentSearchOffset >= textEditCursorBytePosition) break;
-                    }
-                    textEditCursorBytePosition = prevCharStartOffset;
-                } else if (textEditCursorBytePosition > 0) { // Fallback if no layout yet, just decrement (not UTF-8 safe)
-                    textEditCursorBytePosition--;
-                }
-            }
+            if (textEditCursorBytePosition > 0) textEditCursorBytePosition = (uint32_t)textModel.PrevCodepointStart(textEditCursorBytePosition);
             cursorMovedByKey=true;
         }
         if (IsKeyPressedRepeat(KEY_RIGHT) || IsKeyPressed(KEY_RIGHT)){
-            if (!currentTextBlock.sourceTextConcatenated.empty() && textEditCursorBytePosition < currentTextBlock.sourceTextConcatenated.length()) {
-                const char* textPtr = currentTextBlock.sourceTextConcatenated.c_str() + textEditCursorBytePosition;
-                int bc = 0;
-                GetNextCodepointFromUTF8(&textPtr, &bc);
-                if (bc > 0) textEditCursorBytePosition += bc;
-            } else if (textEditCursorBytePosition < 1000000) { // Arbitrary large number, if no layout yet (not UTF-8 safe)
-                // This branch is problematic if sourceTextConcatenated is empty.
-                // The cursor should not move beyond the logical end determined by spans.
-            }
+            if (textEditCursorBytePosition < textModel.Length()) textEditCursorBytePosition = (uint32_t)textModel.NextCodepointEnd(textEditCursorBytePosition);
             cursorMovedByKey=true;
         }
-        if (IsKeyPressed(KEY_HOME)) {
-            if (cursorInfo.lineIndex != -1 && cursorInfo.lineIndex < (int)currentTextBlock.lines.size()) {
-                textEditCursorBytePosition = currentTextBlock.lines[cursorInfo.lineIndex].sourceTextByteStartIndexInBlockText;
-            } else { // Fallback or if no lines
-                textEditCursorBytePosition = 0;
+        { // 按行导航：cursorInfo.lineIndex 是光标所在段落内的行号
+            const EditorParagraph& cursorPara = paragraphs[cursorParagraph];
+            const TextBlock& cursorBlock = *cursorPara.block;
+            bool cursorLineValid = cursorInfo.lineIndex >= 0 && cursorInfo.lineIndex < (int)cursorBlock.lines.size();
+            if (IsKeyPressed(KEY_HOME)) {
+                textEditCursorBytePosition = (uint32_t)(cursorPara.byteStart + (cursorLineValid ? GetLineByteStart(cursorBlock, cursorBlock.lines[cursorInfo.lineIndex]) : 0));
+                cursorMovedByKey = true;
             }
-            cursorMovedByKey = true;
-        }
-        if (IsKeyPressed(KEY_END)) {
-            if (cursorInfo.lineIndex != -1 && cursorInfo.lineIndex < (int)currentTextBlock.lines.size()) {
-                textEditCursorBytePosition = currentTextBlock.lines[cursorInfo.lineIndex].sourceTextByteEndIndexInBlockText;
-                // Adjust if it's a trailing newline placeholder that shouldn't be selected
-                if (textEditCursorBytePosition > 0 && cursorInfo.isTrailingEdge &&
-                    currentTextBlock.sourceTextConcatenated[textEditCursorBytePosition-1] == '\n') {
-                    // This might need more nuance depending on how line endings are handled.
-                }
-            } else { // Fallback or if no lines
-                // Recalculate total length from spans if currentTextBlock is stale
-                uint32_t totalLen = 0;
-                for(const auto& s : spans) totalLen += (s.style.isImage && s.text.empty() ? 3 : s.text.length());
-                textEditCursorBytePosition = totalLen;
+            if (IsKeyPressed(KEY_END)) {
+                textEditCursorBytePosition = (uint32_t)(cursorPara.byteStart + (cursorLineValid ? GetLineByteEnd(cursorBlock, cursorBlock.lines[cursorInfo.lineIndex]) : cursorPara.byteLength));
+                cursorMovedByKey = true;
             }
-            cursorMovedByKey = true;
-        }
 
-        if (IsKeyPressedRepeat(KEY_UP) || IsKeyPressed(KEY_UP)) {
-            if (cursorInfo.lineIndex > 0 && !currentTextBlock.lines.empty()) {
-                Vector2 targetPos = {cursorInfo.visualPosition.x, cursorInfo.visualPosition.y - cursorInfo.cursorHeight * 0.9f}; // Go up one line
-                textEditCursorBytePosition = textEngine->GetByteOffsetFromVisualPosition(currentTextBlock, targetPos, nullptr, nullptr);
-            } else if (cursorInfo.lineIndex == 0 && !currentTextBlock.lines.empty()){ // Already at the first line
-                textEditCursorBytePosition = currentTextBlock.lines[0].sourceTextByteStartIndexInBlockText;
+            bool onFirstLine = cursorParagraph == 0 && cursorInfo.lineIndex <= 0;
+            bool onLastLine = cursorParagraph + 1 == paragraphs.size() && (!cursorLineValid || cursorInfo.lineIndex + 1 == (int)cursorBlock.lines.size());
+            if (IsKeyPressedRepeat(KEY_UP) || IsKeyPressed(KEY_UP)) {
+                if (!onFirstLine) { // 上一行可能在上一段落：按编辑区坐标命中测试
+                    Vector2 targetPos = {cursorInfo.visualPosition.x, cursorInfo.visualPosition.y - cursorInfo.cursorHeight * 0.9f}; // Go up one line
+                    textEditCursorBytePosition = byteOffsetAtEditorPosition(targetPos);
+                } else { // Already at the first line
+                    textEditCursorBytePosition = 0;
+                }
+                cursorMovedByKey = true;
             }
-            cursorMovedByKey = true;
-        }
-        if (IsKeyPressedRepeat(KEY_DOWN) || IsKeyPressed(KEY_DOWN)) {
-            if (cursorInfo.lineIndex != -1 && cursorInfo.lineIndex < (int)currentTextBlock.lines.size() - 1 && !currentTextBlock.lines.empty()) {
-                Vector2 targetPos = {cursorInfo.visualPosition.x, cursorInfo.visualPosition.y + cursorInfo.cursorHeight * 1.1f}; // Go down one line
-                textEditCursorBytePosition = textEngine->GetByteOffsetFromVisualPosition(currentTextBlock, targetPos, nullptr, nullptr);
-            } else if (cursorInfo.lineIndex != -1 && cursorInfo.lineIndex == (int)currentTextBlock.lines.size() -1 && !currentTextBlock.lines.empty()){ // Already at the last line
-                textEditCursorBytePosition = currentTextBlock.lines.back().sourceTextByteEndIndexInBlockText;
+            if (IsKeyPressedRepeat(KEY_DOWN) || IsKeyPressed(KEY_DOWN)) {
+                if (!onLastLine) {
+                    Vector2 targetPos = {cursorInfo.visualPosition.x, cursorInfo.visualPosition.y + cursorInfo.cursorHeight * 1.1f}; // Go down one line
+                    textEditCursorBytePosition = byteOffsetAtEditorPosition(targetPos);
+                } else { // Already at the last line
+                    textEditCursorBytePosition = (uint32_t)textModel.Length();
+                }
+                cursorMovedByKey = true;
             }
-            cursorMovedByKey = true;
         }
 
-
-        if (cursorMovedByKey) { needsRelayout = true; blinkTimer = 0.0f; showCursor = true; }
+        if (cursorMovedByKey) { blinkTimer = 0.0f; showCursor = true; }
 
         if (IsMouseButtonPressed(MOUSE_BUTTON_LEFT)) {
             Vector2 mousePos = GetMousePosition();
@@ -548,51 +480,43 @@ int main(void) {
             Vector2 relativeMousePos = Vector2Transform(mousePos, matScreenToTextBlock);
 
 
-            if (needsRelayout || (currentTextBlock.sourceTextConcatenated.empty() && !spans.empty())) {
-                currentTextBlock = textEngine->LayoutStyledText(spans, paraStyle);
-            }
-            textEditCursorBytePosition = textEngine->GetByteOffsetFromVisualPosition(currentTextBlock, relativeMousePos, nullptr, nullptr);
-            needsRelayout = true; showCursor = true; blinkTimer = 0.0f;
+            textEditCursorBytePosition = byteOffsetAtEditorPosition(relativeMousePos);
+            showCursor = true; blinkTimer = 0.0f;
         }
 
 
         // 调试按键
         if (IsKeyPressed(KEY_F1)) {
-            bool anyOutline = false;
-            if (!spans.empty()) anyOutline = spans[0].style.outline.enabled;
-            for(auto& s : spans) { if(!s.style.isImage) s.style.outline.enabled = !anyOutline; }
-            needsRelayout = true;
+            const CharacterStyle* firstStyle = textModel.GetStyleAt(0);
+            bool anyOutline = firstStyle && firstStyle->outline.enabled;
+            textModel.TransformTextStyles([anyOutline](CharacterStyle& style) { style.outline.enabled = !anyOutline; });
         }
         if (IsKeyPressed(KEY_F2)) {
-            bool anyGlow = false;
-            if (!spans.empty()) anyGlow = spans[0].style.glow.enabled;
-            for(auto& s : spans) { if(!s.style.isImage) s.style.glow.enabled = !anyGlow; }
-            needsRelayout = true;
+            const CharacterStyle* firstStyle = textModel.GetStyleAt(0);
+            bool anyGlow = firstStyle && firstStyle->glow.enabled;
+            textModel.TransformTextStyles([anyGlow](CharacterStyle& style) { style.glow.enabled = !anyGlow; });
         }
         if (IsKeyPressed(KEY_F5)) animateScale = !animateScale;
         if (IsKeyPressed(KEY_F6)) showDebugAtlas = !showDebugAtlas;
-        if (IsKeyDown(KEY_PAGE_UP)) { dynamicSmoothnessAdd -= 0.0005f; dynamicSmoothnessAdd = std::max(-0.04f, dynamicSmoothnessAdd); needsRelayout = true;}
-        if (IsKeyDown(KEY_PAGE_DOWN)) { dynamicSmoothnessAdd += 0.0005f; dynamicSmoothnessAdd = std::min(0.2f, dynamicSmoothnessAdd); needsRelayout = true;}
+        if (IsKeyPressed(KEY_F7)) {
+            useInstancedGlyphs = !useInstancedGlyphs;
+            textEngine->SetGlyphRenderPath(useInstancedGlyphs ? GlyphRenderPath::INSTANCED : GlyphRenderPath::VERTEX_MESH);
+        }
+        if (IsKeyPressed(KEY_F8)) useRenderCache = !useRenderCache;
+        if (IsKeyDown(KEY_PAGE_UP)) { dynamicSmoothnessAdd -= 0.0005f; dynamicSmoothnessAdd = std::max(-0.04f, dynamicSmoothnessAdd); }
+        if (IsKeyDown(KEY_PAGE_DOWN)) { dynamicSmoothnessAdd += 0.0005f; dynamicSmoothnessAdd = std::min(0.2f, dynamicSmoothnessAdd); }
 
 
         // --- 布局与光标更新 ---
-        if (needsRelayout) {
-            currentTextBlock = textEngine->LayoutStyledText(spans, paraStyle);
-            needsRelayout = false;
-
-            // Recalculate transform origin based on the new layout's bounds
-            if (currentTextBlock.overallBounds.width > 0 || currentTextBlock.overallBounds.height > 0) {
-                textBlockTransformOrigin.x = currentTextBlock.overallBounds.x + currentTextBlock.overallBounds.width / 2.0f;
-                textBlockTransformOrigin.y = currentTextBlock.overallBounds.y + currentTextBlock.overallBounds.height / 2.0f;
-            } else {
-                textBlockTransformOrigin = {0,0}; // Default if no content or zero size
-            }
+        layoutDirtyParagraphs();
+        updateCursorInfo();
+        // 缩放 / 旋转以编辑区的中心为轴
+        if (editorBounds.width > 0 || editorBounds.height > 0) {
+            textBlockTransformOrigin = {editorBounds.x + editorBounds.width / 2.0f, editorBounds.y + editorBounds.height / 2.0f};
+        } else {
+            textBlockTransformOrigin = {0,0}; // Default if no content or zero size
         }
 
-        uint32_t totalConcatenatedLength = currentTextBlock.sourceTextConcatenated.length();
-        textEditCursorBytePosition = std::min(textEditCursorBytePosition, totalConcatenatedLength);
-        cursorInfo = textEngine->GetCursorInfoFromByteOffset(currentTextBlock, textEditCursorBytePosition, true);
-
 
         // 绘制
         //----------------------------------------------------------------------------------
@@ -611,7 +535,21 @@ int main(void) {
         finalTransform = MatrixMultiply(MatrixTranslate(textBlockTransformOrigin.x + textBlockScreenPosition.x,
                                                         textBlockTransformOrigin.y + textBlockScreenPosition.y, 0), finalTransform);
 
-        textEngine->DrawTextBlock(currentTextBlock, finalTransform, WHITE);
+        if (useRenderCache) { // 段落的布局、样式或缩放 (F5) 变化时才重新渲染进纹理；先全部更新再绘制，避免在绘制之间切换渲染目标
+            for (auto& paragraph : paragraphs) {
+                if (!paragraph.renderCache) paragraph.renderCache = std::make_unique<TextBlockRenderCache>();
+                paragraph.renderCache->Update(*textEngine, *paragraph.block, textBlockScale);
+            }
+            for (const auto& paragraph : paragraphs) {
+                paragraph.renderCache->Draw(MatrixMultiply(MatrixTranslate(0.0f, paragraph.top, 0.0f), finalTransform), WHITE);
+            }
+        } else {
+            textEngine->BeginTextFrame(); // 短段落排队到 EndTextFrame 合批绘制，长段落直接用各自的常驻网格
+            for (const auto& paragraph : paragraphs) {
+                textEngine->DrawTextBlock(*paragraph.block, MatrixMultiply(MatrixTranslate(0.0f, paragraph.top, 0.0f), finalTransform), WHITE);
+            }
+            textEngine->EndTextFrame();
+        }
 
         if (showCursor) {
             float cursorTopY = cursorInfo.visualPosition.y - cursorInfo.cursorAscent;
@@ -633,15 +571,19 @@ int main(void) {
         }
 
         // Debug Text
-        DrawText(TextFormat("Spans: %zu, Glyphs: %zu, Lines: %zu, TextBytes: %u",
-                            spans.size(), currentTextBlock.elements.size(), currentTextBlock.lines.size(), (unsigned int)currentTextBlock.sourceTextConcatenated.length()),
+        DrawText(TextFormat("Paragraphs: %zu, Glyphs: %zu, Lines: %zu, TextBytes: %zu",
+                            paragraphs.size(), totalElements, totalLines, textModel.Length()),
                  10, 10, 10, GRAY);
         DrawText(TextFormat("CursorByte: %u (Line: %d, Trail: %s, X:%.1f Y:%.1f H:%.1f)",
                             textEditCursorBytePosition, cursorInfo.lineIndex,
                             cursorInfo.isTrailingEdge ? "T":"F", cursorInfo.visualPosition.x, cursorInfo.visualPosition.y, cursorInfo.cursorHeight),
                  10, 25, 10, GRAY);
         DrawText(TextFormat("SmoothnessAdd (PgUp/PgDn): %.4f", dynamicSmoothnessAdd), 10, screenHeight - 20, 10, GRAY);
-        DrawText("F1:TglOutline F2:TglGlow F5:AnimScale F6:DebugAtlas", 10, 40, 10, GRAY);
+        DrawText("F1:TglOutline F2:TglGlow F5:AnimScale F6:DebugAtlas F7:Instanced F8:RenderCache", 10, 40, 10, GRAY);
+        LayoutCacheStats layoutCacheStats = textEngine->GetLayoutCacheStats();
+        DrawText(TextFormat("LayoutCache: %zu/%zu entries, hits %zu, misses %zu",
+                            layoutCacheStats.entries, layoutCacheStats.capacity, layoutCacheStats.hits, layoutCacheStats.misses),
+                 10, 55, 10, GRAY);
 
         if (showDebugAtlas) {
             Texture2D atlasToDraw = textEngine->GetAtlasTextureForDebug(0);
@@ -659,6 +601,7 @@ int main(void) {
     // 清理
     //--------------------------------------------------------------------------------------
     if (inlineTestImage.id > 0) UnloadTexture(inlineTestImage);
+    paragraphs.clear(); // 释放各段落的渲染缓存纹理 (须在 CloseWindow 之前)
     textEngine.reset();
 
     CloseWindow();
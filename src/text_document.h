@@ -0,0 +1,309 @@
+// text_document.h - 按视口虚拟化的多段落文档布局
+#ifndef TEXT_DOCUMENT_H
+#define TEXT_DOCUMENT_H
+
+#include "text_engine.h"
+#include "raymath.h" // MatrixTranslate
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+/**
+ * @brief 持有大量段落 (以 '\n' 分隔) 的文档，只对与视口 (加上上下边距) 相交的段落做整形和布局。
+ * 未布局的段落使用按字节数估算的高度；段落被布局后换成真实高度，并通过滚动锚点保持视图不跳动。
+ * 估算参数 (每字节宽度、行高) 随已布局段落修正，明显偏离时全部未布局段落按新参数重新估算 (同样保持锚点)。
+ * 段落高度保存在 Fenwick 树中，按 y 查找段落与求段落顶部都是 O(log n)。
+ * 离开保留范围的段落会释放其 TextBlock，内存只与视口附近的内容成正比。
+ *
+ * 坐标：文档 y (段落原点、滚动位置) 一律为 double；TextBlock 内部仍是 float，但只相对所在段落。
+ * 绘制和命中测试都先在 double 中减去 scrollY 再转成 float，因此任意滚动位置下精度都与文档开头相同。
+ */
+class TextDocument {
+public:
+    /** @brief 文档中的文本位置：段落下标 + 段落内 UTF-8 字节偏移。 */
+    struct Position {
+        size_t paragraph = 0;
+        uint32_t byteOffset = 0;
+    };
+
+    TextDocument(ITextEngine& engine, const ParagraphStyle& paragraphStyle)
+        : engine_(engine), paragraphStyle_(paragraphStyle) {
+        float fontSize = paragraphStyle_.defaultCharacterStyle.fontSize > 0 ? paragraphStyle_.defaultCharacterStyle.fontSize : 16.0f;
+        FontId fontId = paragraphStyle_.defaultCharacterStyle.fontId;
+        if (!engine_.IsFontValid(fontId)) fontId = engine_.GetDefaultFont();
+        if (engine_.IsFontValid(fontId)) {
+            estimatedLineHeight_ = engine_.GetScaledFontMetrics(fontId, fontSize).recommendedLineHeight;
+        }
+        if (estimatedLineHeight_ <= 0.0f) estimatedLineHeight_ = fontSize * 1.2f;
+        estimatedAdvancePerByte_ = fontSize * 0.5f; // 之后用已布局段落的实际宽度修正
+    }
+
+    /** @brief 替换全部文本。只切分段落并估算高度，不做任何布局。 */
+    void SetText(std::string utf8Text) {
+        text_ = std::move(utf8Text);
+        paragraphs_.clear();
+        const char* data = text_.data();
+        size_t pos = 0, len = text_.length();
+        while (true) {
+            const void* newline = (pos < len) ? memchr(data + pos, '\n', len - pos) : nullptr;
+            size_t end = newline ? (size_t)(static_cast<const char*>(newline) - data) : len;
+            Paragraph paragraph;
+            paragraph.byteStart = pos;
+            paragraph.byteLength = end - pos;
+            paragraphs_.push_back(std::move(paragraph));
+            if (!newline) break;
+            pos = end + 1;
+        }
+        residentList_.clear();
+        residentCount_ = 0;
+        rebuildHeights();
+        scrollY_ = 0.0;
+        anchorParagraph_ = 0; anchorOffset_ = 0.0;
+    }
+
+    /** @brief 修改换行宽度：常驻段落用 Rewrap 重新断行，其余段落回到估算高度。 */
+    void SetWrapWidth(float wrapWidth) {
+        if (wrapWidth == paragraphStyle_.wrapWidth) return;
+        paragraphStyle_.wrapWidth = wrapWidth;
+        for (auto& paragraph : paragraphs_) {
+            if (paragraph.block) {
+                engine_.Rewrap(*paragraph.block, wrapWidth, paragraphStyle_.alignment);
+                paragraph.height = paragraph.block->overallBounds.height;
+            } else {
+                paragraph.heightIsExact = false;
+            }
+        }
+        rebuildHeights();
+        restoreAnchor();
+    }
+
+    void SetViewportHeight(float height) { viewportHeight_ = std::max(0.0f, height); }
+    void SetOverscan(float margin) { overscan_ = std::max(0.0f, margin); } // 视口上下额外布局的距离
+    void SetScrollY(double scrollY) { scrollY_ = std::clamp(scrollY, 0.0, std::max(0.0, GetContentHeight() - viewportHeight_)); captureAnchor(); }
+    void ScrollBy(double deltaY) { SetScrollY(scrollY_ + deltaY); }
+    double GetScrollY() const { return scrollY_; }
+    double GetContentHeight() const { return heightTree_.Total(); }
+    size_t GetParagraphCount() const { return paragraphs_.size(); }
+    size_t GetResidentParagraphCount() const { return residentCount_; }
+    double GetParagraphTop(size_t index) const { return heightTree_.Prefix(index); } // 段落原点 (文档坐标)
+    float GetParagraphHeight(size_t index) const { return paragraphs_[index].height; }
+    bool IsParagraphHeightExact(size_t index) const { return paragraphs_[index].heightIsExact; }
+    const TextBlock* GetParagraphBlock(size_t index) const { return paragraphs_[index].block.get(); }
+    std::string_view GetParagraphText(size_t index) const {
+        return std::string_view(text_).substr(paragraphs_[index].byteStart, paragraphs_[index].byteLength);
+    }
+    /** @brief 段落块内坐标到视口坐标的变换 (origin 为视口左上角的屏幕坐标)；平移量在 double 中相对 scrollY 求出。 */
+    Matrix GetParagraphTransform(size_t index, Vector2 origin = {0, 0}) const {
+        return MatrixTranslate(origin.x, origin.y + (float)(GetParagraphTop(index) - scrollY_), 0.0f);
+    }
+
+    /**
+     * @brief 视口坐标 -> 文档位置。目标段落必须已布局 (在 Update 保留的范围内)，否则返回 false。
+     */
+    bool HitTest(Vector2 viewportPoint, Position& outPosition, bool* isTrailingEdge = nullptr) const {
+        if (paragraphs_.empty()) return false;
+        double documentY = scrollY_ + (double)viewportPoint.y;
+        size_t index = FindParagraphAt(documentY);
+        const TextBlock* block = paragraphs_[index].block.get();
+        if (!block) return false;
+        Vector2 local = {viewportPoint.x, (float)(documentY - GetParagraphTop(index))};
+        outPosition.paragraph = index;
+        outPosition.byteOffset = engine_.GetByteOffsetFromVisualPosition(*block, local, isTrailingEdge);
+        return true;
+    }
+
+    /** @brief 文档位置 -> 视口坐标中的光标信息。段落未布局时返回 false。 */
+    bool GetCursorInfo(const Position& position, CursorLocationInfo& outInfo, bool preferLeadingEdge = true) const {
+        if (position.paragraph >= paragraphs_.size() || !paragraphs_[position.paragraph].block) return false;
+        outInfo = engine_.GetCursorInfoFromByteOffset(*paragraphs_[position.paragraph].block, position.byteOffset, preferLeadingEdge);
+        outInfo.visualPosition.y += (float)(GetParagraphTop(position.paragraph) - scrollY_);
+        return true;
+    }
+
+    /** @brief 文档位置与整篇文本字节偏移之间的转换 (段落分隔符 '\n' 计入字节偏移)。 */
+    size_t GetDocumentByteOffset(const Position& position) const {
+        return position.paragraph < paragraphs_.size() ? paragraphs_[position.paragraph].byteStart + position.byteOffset : text_.length();
+    }
+    Position GetPositionFromDocumentByteOffset(size_t byteOffset) const {
+        Position position;
+        if (paragraphs_.empty()) return position;
+        auto it = std::upper_bound(paragraphs_.begin(), paragraphs_.end(), byteOffset,
+                                   [](size_t offset, const Paragraph& p) { return offset < p.byteStart; });
+        position.paragraph = (size_t)(it - paragraphs_.begin()) - 1;
+        position.byteOffset = (uint32_t)std::min(byteOffset - paragraphs_[position.paragraph].byteStart, paragraphs_[position.paragraph].byteLength);
+        return position;
+    }
+
+    /** @brief 包含文档坐标 y 的段落下标。 */
+    size_t FindParagraphAt(double y) const { return paragraphs_.empty() ? 0 : std::min(heightTree_.FindIndex(y), paragraphs_.size() - 1); }
+
+    /**
+     * @brief 布局与视口 (含 overscan) 相交的段落，用真实高度替换估算值并保持滚动锚点，
+     * 然后释放远离视口 (超出 overscan 的两倍) 的段落。每帧调用一次。
+     */
+    void Update() {
+        if (paragraphs_.empty()) return;
+        // 替换估算高度会移动视口，反复直到范围内全部布局完成 (每轮至少布局一个段落)
+        for (;;) {
+            auto [first, last] = paragraphRange(scrollY_ - overscan_, scrollY_ + viewportHeight_ + overscan_);
+            bool laidOutAny = false;
+            for (size_t i = first; i <= last; ++i) {
+                if (paragraphs_[i].block) continue;
+                layoutParagraph(i);
+                laidOutAny = true;
+            }
+            if (!laidOutAny) break;
+            if (estimatesDrifted()) rebuildHeights();
+            restoreAnchor();
+        }
+        auto [keepFirst, keepLast] = paragraphRange(scrollY_ - 2.0 * overscan_, scrollY_ + viewportHeight_ + 2.0 * overscan_);
+        for (size_t i : residentList_) {
+            if ((i < keepFirst || i > keepLast) && paragraphs_[i].block) { paragraphs_[i].block.reset(); --residentCount_; }
+        }
+        residentList_.erase(std::remove_if(residentList_.begin(), residentList_.end(),
+                                           [this](size_t i) { return !paragraphs_[i].block; }), residentList_.end());
+    }
+
+    /** @brief 绘制视口内已布局的段落；origin 为视口左上角的屏幕坐标。 */
+    void Draw(Vector2 origin, Color tint = WHITE) {
+        if (paragraphs_.empty()) return;
+        auto [first, last] = paragraphRange(scrollY_, scrollY_ + viewportHeight_);
+        for (size_t i = first; i <= last; ++i) {
+            if (!paragraphs_[i].block) continue;
+            engine_.DrawTextBlock(*paragraphs_[i].block, GetParagraphTransform(i, origin), tint);
+        }
+    }
+
+private:
+    struct Paragraph {
+        size_t byteStart = 0, byteLength = 0;
+        float height = 0.0f;
+        bool heightIsExact = false;
+        std::unique_ptr<TextBlock> block; // 仅视口附近的段落常驻
+    };
+
+    // 段落高度的 Fenwick 树 (树状数组)
+    class HeightTree {
+    public:
+        void Build(const std::vector<Paragraph>& paragraphs) {
+            tree_.assign(paragraphs.size() + 1, 0.0);
+            for (size_t i = 0; i < paragraphs.size(); ++i) {
+                tree_[i + 1] += paragraphs[i].height;
+                size_t parent = (i + 1) + ((i + 1) & (~(i + 1) + 1));
+                if (parent < tree_.size()) tree_[parent] += tree_[i + 1];
+            }
+            total_ = Prefix(paragraphs.size());
+        }
+        void Add(size_t index, double delta) {
+            for (size_t i = index + 1; i < tree_.size(); i += i & (~i + 1)) tree_[i] += delta;
+            total_ += delta;
+        }
+        double Prefix(size_t count) const { // 前 count 个段落的高度和
+            double sum = 0.0;
+            for (size_t i = std::min(count, tree_.size() - 1); i > 0; i -= i & (~i + 1)) sum += tree_[i];
+            return sum;
+        }
+        size_t FindIndex(double y) const { // 最大的 i 使得 Prefix(i) <= y
+            size_t pos = 0; double remaining = y;
+            size_t step = 1;
+            while (step * 2 < tree_.size()) step *= 2;
+            for (; step > 0; step /= 2) {
+                if (pos + step < tree_.size() && tree_[pos + step] <= remaining) { pos += step; remaining -= tree_[pos]; }
+            }
+            return pos;
+        }
+        double Total() const { return total_; }
+    private:
+        std::vector<double> tree_{0.0};
+        double total_ = 0.0;
+    };
+
+    float estimateHeight(const Paragraph& paragraph) const {
+        float lines = 1.0f;
+        if (paragraphStyle_.wrapWidth > 0) {
+            lines = std::max(1.0f, std::ceil((float)paragraph.byteLength * estimatedAdvancePerByte_ / paragraphStyle_.wrapWidth));
+        }
+        return lines * estimatedLineHeight_;
+    }
+
+    void rebuildHeights() {
+        for (auto& paragraph : paragraphs_) {
+            if (!paragraph.heightIsExact) paragraph.height = estimateHeight(paragraph);
+        }
+        heightTree_.Build(paragraphs_);
+        estimatedAdvanceUsed_ = estimatedAdvancePerByte_;
+        estimatedLineHeightUsed_ = estimatedLineHeight_;
+    }
+
+    // 估算参数与现有估算所用的参数相差超过 2% 时才重新估算 (O(n))；参数随布局的段落增多而收敛，之后很少触发
+    bool estimatesDrifted() const {
+        auto drifted = [](float current, float used) { return std::fabs(current - used) > 0.02f * std::max(used, 1e-6f); };
+        return drifted(estimatedAdvancePerByte_, estimatedAdvanceUsed_) || drifted(estimatedLineHeight_, estimatedLineHeightUsed_);
+    }
+
+    std::pair<size_t, size_t> paragraphRange(double top, double bottom) const {
+        return {FindParagraphAt(std::max(0.0, top)), FindParagraphAt(std::max(0.0, bottom))};
+    }
+
+    void layoutParagraph(size_t index) {
+        Paragraph& paragraph = paragraphs_[index];
+        std::vector<TextSpan> spans(1);
+        spans[0].text.assign(text_, paragraph.byteStart, paragraph.byteLength);
+        spans[0].style = paragraphStyle_.defaultCharacterStyle;
+        paragraph.block = std::make_unique<TextBlock>(engine_.LayoutStyledText(std::move(spans), paragraphStyle_));
+        ++residentCount_;
+        residentList_.push_back(index);
+
+        const TextBlock& block = *paragraph.block;
+        if (!paragraph.heightIsExact && paragraph.byteLength > 0) { // 用实际结果修正估算参数 (Update 据此重新估算尚未布局的段落)
+            float totalLineWidth = 0.0f;
+            for (const auto& line : block.lines) totalLineWidth += line.lineWidth;
+            measuredBytes_ += paragraph.byteLength;
+            measuredAdvance_ += totalLineWidth;
+            estimatedAdvancePerByte_ = (float)(measuredAdvance_ / (double)measuredBytes_);
+            if (!block.lines.empty()) estimatedLineHeight_ = block.overallBounds.height / (float)block.lines.size();
+        }
+        heightTree_.Add(index, (double)block.overallBounds.height - paragraph.height);
+        paragraph.height = block.overallBounds.height;
+        paragraph.heightIsExact = true;
+    }
+
+    // 滚动锚点：视口顶部所在段落及其内部偏移。高度变化后按锚点恢复 scrollY，视图内容不跳动。
+    void captureAnchor() {
+        anchorParagraph_ = FindParagraphAt(scrollY_);
+        anchorOffset_ = paragraphs_.empty() ? 0.0 : scrollY_ - GetParagraphTop(anchorParagraph_);
+    }
+    void restoreAnchor() {
+        if (paragraphs_.empty()) { scrollY_ = 0.0; return; }
+        anchorParagraph_ = std::min(anchorParagraph_, paragraphs_.size() - 1);
+        double offset = std::min(anchorOffset_, (double)paragraphs_[anchorParagraph_].height);
+        scrollY_ = std::clamp(GetParagraphTop(anchorParagraph_) + offset, 0.0, std::max(0.0, GetContentHeight() - viewportHeight_));
+    }
+
+    ITextEngine& engine_;
+    ParagraphStyle paragraphStyle_;
+    std::string text_;
+    std::vector<Paragraph> paragraphs_;
+    HeightTree heightTree_;
+    std::vector<size_t> residentList_; // 持有 TextBlock 的段落下标
+    size_t residentCount_ = 0;
+
+    float viewportHeight_ = 0.0f;
+    float overscan_ = 200.0f;
+    double scrollY_ = 0.0;
+    size_t anchorParagraph_ = 0;
+    double anchorOffset_ = 0.0;
+
+    float estimatedLineHeight_ = 0.0f;
+    float estimatedAdvancePerByte_ = 0.0f;
+    float estimatedLineHeightUsed_ = 0.0f; // 当前估算高度所用的参数
+    float estimatedAdvanceUsed_ = 0.0f;
+    double measuredAdvance_ = 0.0;
+    size_t measuredBytes_ = 0;
+};
+
+#endif // TEXT_DOCUMENT_H
@@ -0,0 +1,316 @@
+// text_engine.cpp: 与后端无关的 TextBlock 辅助实现 (源 span 列表、流式追加 / 丢行)
+#include "text_engine.h"
+#include "rlgl.h" // TextBlockRenderCache (rlMultMatrixf / RL_QUADS, blend factors)
+
+// 编辑器里由 PgUp/PgDn 调整 (定义在 main.cpp)；渲染缓存的指纹包含它
+extern float dynamicSmoothnessAdd;
+
+// --- SourceSpanList ---
+std::shared_ptr<const std::vector<TextSpan>> SourceSpanList::Snapshot() const {
+    if (chunks_.size() == 1 && IsWholeSnapshot(*chunks_.front())) return chunks_.front();
+    auto spans = std::make_shared<std::vector<TextSpan>>();
+    spans->reserve(size());
+    for (const TextSpan& span : *this) spans->push_back(span);
+    return spans;
+}
+
+void SourceSpanList::Append(std::shared_ptr<const std::vector<TextSpan>> snapshot) {
+    if (!snapshot) return;
+    hasSnapshot_ = true;
+    end_ += snapshot->size();
+    chunks_.push_back(std::move(snapshot));
+    chunkEnds_.push_back(end_);
+}
+
+void SourceSpanList::DropFront(size_t spanCount, uint32_t trimBytes) {
+    spanCount = std::min(spanCount, size());
+    if (spanCount > 0) trimmedFront_.reset(); // 被截断的 span 本身也被丢弃了
+    first_ += spanCount;
+    size_t deadChunks = 0;
+    while (deadChunks < chunkEnds_.size() && chunkEnds_[deadChunks] <= first_) ++deadChunks;
+    chunks_.erase_front(deadChunks);
+    chunkEnds_.erase_front(deadChunks);
+    if (trimBytes > 0 && !empty()) {
+        auto trimmed = std::make_shared<TextSpan>(front());
+        trimmed->text.erase(0, trimBytes);
+        trimmedFront_ = std::move(trimmed);
+    }
+}
+
+bool SourceSpanList::SharesSnapshotsWith(const SourceSpanList& other) const {
+    if (first_ != other.first_ || end_ != other.end_ || trimmedFront_ != other.trimmedFront_ ||
+        hasSnapshot_ != other.hasSnapshot_ || chunks_.size() != other.chunks_.size()) return false;
+    return chunks_.empty() || (chunks_.front() == other.chunks_.front() && chunks_.back() == other.chunks_.back());
+}
+
+// --- Streaming Layout ---
+void AssignElementSourceByteOffsets(TextBlock& textBlock) {
+    const SourceSpanList& spans = textBlock.GetSourceSpans();
+    std::vector<uint32_t> spanStarts(spans.size() + 1, 0);
+    size_t k = 0;
+    for (const TextSpan& span : spans) { spanStarts[k + 1] = spanStarts[k] + SourceSpanByteLength(span); ++k; }
+    for (auto& element : textBlock.elements) {
+        std::visit([&](auto& el) {
+            size_t spanIdx = std::min<size_t>(el.sourceSpanIndex - textBlock.sourceSpanIndexBase, spans.size());
+            el.sourceByteOffsetInBlockText = textBlock.sourceByteOffsetBase + spanStarts[spanIdx] + el.sourceCharByteOffsetInSpan;
+        }, element);
+    }
+}
+
+namespace {
+
+// widestLines 的队尾压入第 streamLine 行：比它窄或一样宽的更早的行不可能再成为最宽行
+void PushWidestLine(TextBlock& textBlock, size_t streamLine, float extentX) {
+    while (!textBlock.widestLines.empty() && textBlock.widestLines.back().second <= extentX) textBlock.widestLines.pop_back();
+    textBlock.widestLines.push_back({streamLine, extentX});
+}
+
+void EnsureWidestLines(TextBlock& textBlock) {
+    if (!textBlock.widestLines.empty() || textBlock.lines.empty()) return;
+    for (size_t i = 0; i < textBlock.lines.size(); ++i) PushWidestLine(textBlock, textBlock.droppedLineCount + i, textBlock.lines[i].lineExtentX);
+}
+
+float WidestRemainingLine(const TextBlock& textBlock) {
+    return textBlock.widestLines.empty() ? 0.0f : textBlock.widestLines.front().second;
+}
+
+} // namespace
+
+void ITextEngine::AppendSpans(TextBlock& textBlock, const std::vector<TextSpan>& newSpans) {
+    if (newSpans.empty()) return;
+    const SourceSpanList& oldSpans = textBlock.GetSourceSpans();
+    std::pmr::memory_resource* resource = textBlock.elements.get_allocator().resource();
+    const ParagraphStyle paragraphStyle = textBlock.paragraphStyleUsed;
+    auto appended = std::make_shared<const std::vector<TextSpan>>(newSpans); // 只复制新 spans，已有快照原样共享
+
+    if (textBlock.lines.empty() || oldSpans.empty()) { // 没有可接续的行：直接布局全部内容
+        auto allSpans = std::make_shared<std::vector<TextSpan>>(oldSpans.begin(), oldSpans.end());
+        allSpans->insert(allSpans->end(), newSpans.begin(), newSpans.end());
+        ParagraphStyle style = paragraphStyle;
+        if (textBlock.droppedLineCount > 0) style.firstLineIndent = 0.0f; // 只有整个流的第一行缩进
+        size_t droppedLines = textBlock.droppedLineCount;
+        textBlock = LayoutStyledText(std::shared_ptr<const std::vector<TextSpan>>(std::move(allSpans)), style, resource);
+        textBlock.paragraphStyleUsed = paragraphStyle;
+        textBlock.droppedLineCount = droppedLines;
+        return;
+    }
+    EnsureWidestLines(textBlock);
+
+    // 从最后一个 BiDi 段落的首行接续：'\n' 之后段落方向重新确定，更早的行不受新内容影响
+    size_t resumeLineIdx = textBlock.lines.size() - 1;
+    while (resumeLineIdx > 0) {
+        uint32_t lineStart = GetLineByteStart(textBlock, textBlock.lines[resumeLineIdx]);
+        if (lineStart == 0 || textBlock.sourceTextConcatenated[lineStart - 1] == '\n') break;
+        --resumeLineIdx;
+    }
+    const LineLayoutInfo& resumeLine = textBlock.lines[resumeLineIdx];
+    const uint32_t resumeByte = GetLineByteStart(textBlock, resumeLine);
+    const size_t resumeElement = GetLineFirstElementIndex(textBlock, resumeLine);
+    const float resumeY = GetLineTopY(textBlock, resumeLine);
+    // 尾部行接到 resumeLine 的位置：行字段保持与已有行相同的 (未减基准的) 坐标
+    const size_t streamElementShift = resumeLine.firstElementIndexInBlockElements;
+    const uint32_t streamByteShift = resumeLine.sourceTextByteStartIndexInBlockText;
+    const float streamYShift = resumeLine.lineBoxY;
+
+    // resumeByte 所在的 span：从末尾往前找，只触及尾部
+    size_t resumeSpan = oldSpans.size();
+    uint32_t resumeSpanStart = (uint32_t)textBlock.sourceTextConcatenated.length();
+    while (resumeSpan > 0 && resumeSpanStart > resumeByte) resumeSpanStart -= SourceSpanByteLength(oldSpans[--resumeSpan]);
+    const uint32_t offsetInResumeSpan = resumeByte - resumeSpanStart;
+
+    std::vector<TextSpan> tailSpans;
+    tailSpans.reserve(oldSpans.size() - resumeSpan + newSpans.size());
+    for (size_t k = resumeSpan; k < oldSpans.size(); ++k) tailSpans.push_back(oldSpans[k]);
+    tailSpans.insert(tailSpans.end(), newSpans.begin(), newSpans.end());
+    if (offsetInResumeSpan > 0) tailSpans.front().text.erase(0, offsetInResumeSpan);
+    ParagraphStyle tailStyle = paragraphStyle;
+    if (resumeByte > 0 || textBlock.droppedLineCount > 0) tailStyle.firstLineIndent = 0.0f;
+    TextBlock tail = LayoutStyledText(std::move(tailSpans), tailStyle, resource);
+
+    // 接到 resumeLineIdx 之前的行后面：尾部的 span 下标、字节偏移和行位置整体平移
+    const uint32_t spanIndexShift = textBlock.sourceSpanIndexBase + (uint32_t)resumeSpan;
+    const uint32_t elementByteShift = textBlock.sourceByteOffsetBase + resumeByte;
+    const size_t resumeStreamLine = textBlock.droppedLineCount + resumeLineIdx;
+    textBlock.elements.erase(textBlock.elements.begin() + resumeElement, textBlock.elements.end());
+    textBlock.lines.erase(textBlock.lines.begin() + resumeLineIdx, textBlock.lines.end());
+    textBlock.lineStartBytes.resize(resumeLineIdx);
+    textBlock.lineTopYs.resize(resumeLineIdx);
+    textBlock.sourceTextConcatenated.resize(resumeByte);
+    textBlock.sourceTextConcatenated += tail.sourceTextConcatenated;
+    for (auto& element : tail.elements) {
+        std::visit([&](auto& el) {
+            if (el.sourceSpanIndex == 0) el.sourceCharByteOffsetInSpan += offsetInResumeSpan;
+            el.sourceSpanIndex += spanIndexShift;
+            el.sourceByteOffsetInBlockText += elementByteShift;
+        }, element);
+        textBlock.elements.push_back(std::move(element));
+    }
+
+    // 被重新布局的行移出宽度队列；它们之前被这些行压掉的更早的行重新入队
+    while (!textBlock.widestLines.empty() && textBlock.widestLines.back().first >= resumeStreamLine) textBlock.widestLines.pop_back();
+    size_t rescanFrom = textBlock.widestLines.empty() ? 0 : textBlock.widestLines.back().first + 1 - textBlock.droppedLineCount;
+    for (size_t i = rescanFrom; i < resumeLineIdx; ++i) PushWidestLine(textBlock, textBlock.droppedLineCount + i, textBlock.lines[i].lineExtentX);
+    for (auto& line : tail.lines) {
+        line.firstElementIndexInBlockElements += streamElementShift;
+        line.sourceTextByteStartIndexInBlockText += streamByteShift;
+        line.sourceTextByteEndIndexInBlockText += streamByteShift;
+        line.lineBoxY += streamYShift;
+        textBlock.lineStartBytes.push_back(line.sourceTextByteStartIndexInBlockText);
+        textBlock.lineTopYs.push_back(line.lineBoxY);
+        PushWidestLine(textBlock, textBlock.droppedLineCount + textBlock.lines.size(), line.lineExtentX);
+        textBlock.lines.push_back(std::move(line));
+    }
+    textBlock.sourceSpans.Append(std::move(appended));
+    textBlock.overallBounds.width = WidestRemainingLine(textBlock);
+    textBlock.overallBounds.height = resumeY + tail.overallBounds.height - textBlock.overallBounds.y;
+    textBlock.shapingCache.reset();
+    textBlock.drawCache.reset();
+}
+
+void ITextEngine::DropFrontLines(TextBlock& textBlock, size_t lineCount) {
+    lineCount = std::min(lineCount, textBlock.lines.size());
+    if (lineCount == 0) return;
+    EnsureWidestLines(textBlock);
+    const SourceSpanList& oldSpans = textBlock.GetSourceSpans();
+    const bool dropAll = (lineCount == textBlock.lines.size());
+    const uint32_t droppedBytes = dropAll ? (uint32_t)textBlock.sourceTextConcatenated.length() : GetLineByteStart(textBlock, textBlock.lines[lineCount]);
+    const size_t droppedElements = dropAll ? textBlock.elements.size() : GetLineFirstElementIndex(textBlock, textBlock.lines[lineCount]);
+    const float droppedHeight = dropAll ? textBlock.overallBounds.height
+                                        : GetLineTopY(textBlock, textBlock.lines[lineCount]) - GetLineTopY(textBlock, textBlock.lines.front());
+
+    // 完全落在被丢弃文本里的 span 整个移除；跨越边界的那个 span 只截掉前半部分
+    size_t droppedSpans = 0;
+    uint32_t keptSpanStart = 0;
+    while (droppedSpans < oldSpans.size() && keptSpanStart + SourceSpanByteLength(oldSpans[droppedSpans]) <= droppedBytes) {
+        keptSpanStart += SourceSpanByteLength(oldSpans[droppedSpans++]);
+    }
+    const uint32_t trimInSpan = droppedBytes - keptSpanStart;
+    textBlock.sourceSpans.DropFront(droppedSpans, trimInSpan);
+
+    // 剩余的行与元素原地不动：只前移容器起点并累加基准。文本仍是一次 memmove (sourceTextConcatenated 是连续字符串)
+    textBlock.elements.erase_front(droppedElements);
+    textBlock.lines.erase_front(lineCount);
+    textBlock.lineStartBytes.erase_front(lineCount);
+    textBlock.lineTopYs.erase_front(lineCount);
+    textBlock.sourceTextConcatenated.erase(0, droppedBytes);
+    textBlock.sourceSpanIndexBase += (uint32_t)droppedSpans;
+    textBlock.sourceByteOffsetBase += droppedBytes;
+    textBlock.elementIndexBase += droppedElements;
+    textBlock.lineBoxYBase += droppedHeight;
+    textBlock.droppedLineCount += lineCount;
+    if (trimInSpan > 0 && !textBlock.sourceSpans.empty()) { // 只有被截断 span 内的元素需要调整，它们都在最前面的几行里
+        const uint32_t trimmedSpanIndex = textBlock.sourceSpanIndexBase;
+        const uint32_t trimmedSpanEnd = SourceSpanByteLength(textBlock.sourceSpans.front());
+        for (const auto& line : textBlock.lines) {
+            if (GetLineByteStart(textBlock, line) >= trimmedSpanEnd) break;
+            const size_t firstElement = GetLineFirstElementIndex(textBlock, line);
+            for (size_t i = 0; i < line.numElementsInLine; ++i) {
+                std::visit([&](auto& el) {
+                    if (el.sourceSpanIndex == trimmedSpanIndex) el.sourceCharByteOffsetInSpan -= trimInSpan;
+                }, textBlock.elements[firstElement + i]);
+            }
+        }
+    }
+    // 丢弃的累计高度超过剩余高度时把 y 折算回块坐标 (均摊到被丢弃的行上)
+    textBlock.overallBounds.height = std::max(0.0f, textBlock.overallBounds.height - droppedHeight);
+    if (textBlock.lines.empty() || textBlock.lineBoxYBase > textBlock.overallBounds.height) {
+        for (auto& line : textBlock.lines) line.lineBoxY -= textBlock.lineBoxYBase;
+        for (float& top : textBlock.lineTopYs) top -= textBlock.lineBoxYBase;
+        textBlock.lineBoxYBase = 0.0f;
+    }
+
+    while (!textBlock.widestLines.empty() && textBlock.widestLines.front().first < textBlock.droppedLineCount) textBlock.widestLines.erase_front(1);
+    textBlock.overallBounds.width = WidestRemainingLine(textBlock);
+    textBlock.shapingCache.reset();
+    textBlock.drawCache.reset();
+}
+
+// --- TextBlockRenderCache ---
+bool TextBlockRenderCache::Update(ITextEngine& engine, const TextBlock& textBlock, float effectiveScale) {
+    if (engine.IsTextFrameActive()) { // DrawTextBlock would only queue the block, leaving the texture empty
+        TraceLog(LOG_WARNING, "TextBlockRenderCache: Update called inside BeginTextFrame / EndTextFrame, skipped.");
+        return false;
+    }
+    if (effectiveScale <= 0.0f || textBlock.lines.empty()) { valid_ = false; return false; }
+    const Rectangle& ob = textBlock.overallBounds;
+    const bool sameInput = valid_ && block_ == &textBlock && blockSpans_.SharesSnapshotsWith(textBlock.sourceSpans) && blockDrawCache_ == textBlock.drawCache &&
+                            elementCount_ == textBlock.elements.size() && lineCount_ == textBlock.lines.size() &&
+                            blockBounds_.x == ob.x && blockBounds_.y == ob.y && blockBounds_.width == ob.width && blockBounds_.height == ob.height &&
+                            smoothnessAdd_ == dynamicSmoothnessAdd && renderPath_ == engine.GetGlyphRenderPath();
+    if (sameInput) {
+        const float ratio = effectiveScale / scale_;
+        if (ratio <= 1.0f + scaleTolerance && ratio * (1.0f + scaleTolerance) >= 1.0f) return false;
+    }
+
+    const Rectangle bounds = {ob.x - padding, ob.y - padding, ob.width + 2.0f * padding, ob.height + 2.0f * padding};
+    const float maxSide = std::max(bounds.width, bounds.height);
+    const float renderScale = std::min(effectiveScale, (float)MAX_TEXTURE_SIZE / std::max(maxSide, 1.0f));
+    const int width = std::max(1, (int)(bounds.width * renderScale + 0.999f));
+    const int height = std::max(1, (int)(bounds.height * renderScale + 0.999f));
+    if (target_.id == 0 || target_.texture.width != width || target_.texture.height != height) {
+        Release();
+        target_ = LoadRenderTexture(width, height);
+        if (target_.id == 0) {
+            TraceLog(LOG_WARNING, "TextBlockRenderCache: Failed to create a %dx%d render texture.", width, height);
+            return false;
+        }
+        SetTextureFilter(target_.texture, TEXTURE_FILTER_BILINEAR);
+    }
+
+    // Block space -> texture pixels. The text shaders output straight alpha; blending alpha with ONE / ONE_MINUS_SRC_ALPHA
+    // leaves a premultiplied texture that composites correctly over any background in Draw.
+    const Matrix toTexture = {renderScale, 0.0f, 0.0f, -bounds.x * renderScale,
+                              0.0f, renderScale, 0.0f, -bounds.y * renderScale,
+                              0.0f, 0.0f, 1.0f, 0.0f,
+                              0.0f, 0.0f, 0.0f, 1.0f};
+    BeginTextureMode(target_);
+    ClearBackground(BLANK);
+    rlSetBlendFactorsSeparate(RL_SRC_ALPHA, RL_ONE_MINUS_SRC_ALPHA, RL_ONE, RL_ONE_MINUS_SRC_ALPHA, RL_FUNC_ADD, RL_FUNC_ADD);
+    BeginBlendMode(BLEND_CUSTOM_SEPARATE);
+    engine.DrawTextBlock(textBlock, toTexture, WHITE);
+    EndBlendMode();
+    EndTextureMode();
+
+    valid_ = true;
+    scale_ = effectiveScale;
+    bounds_ = bounds;
+    block_ = &textBlock;
+    blockSpans_ = textBlock.sourceSpans;
+    blockDrawCache_ = textBlock.drawCache; // Filled by the draw above (FT backend)
+    blockBounds_ = ob;
+    elementCount_ = textBlock.elements.size();
+    lineCount_ = textBlock.lines.size();
+    smoothnessAdd_ = dynamicSmoothnessAdd;
+    renderPath_ = engine.GetGlyphRenderPath();
+    return true;
+}
+
+void TextBlockRenderCache::Draw(const Matrix& transform, Color tint) const {
+    if (!valid_ || target_.id == 0) return;
+    const Matrix& m = transform;
+    const float matrix[16] = {m.m0, m.m1, m.m2, m.m3, m.m4, m.m5, m.m6, m.m7, m.m8, m.m9, m.m10, m.m11, m.m12, m.m13, m.m14, m.m15};
+    const Rectangle& b = bounds_;
+    BeginBlendMode(BLEND_ALPHA_PREMULTIPLY);
+    rlPushMatrix();
+    rlMultMatrixf(matrix);
+    rlSetTexture(target_.texture.id);
+    rlBegin(RL_QUADS);
+    rlColor4ub((unsigned char)(tint.r * tint.a / 255), (unsigned char)(tint.g * tint.a / 255), (unsigned char)(tint.b * tint.a / 255), tint.a);
+    // Render textures are stored bottom-up: the top edge of the block samples v = 1
+    rlTexCoord2f(0.0f, 1.0f); rlVertex2f(b.x, b.y);
+    rlTexCoord2f(0.0f, 0.0f); rlVertex2f(b.x, b.y + b.height);
+    rlTexCoord2f(1.0f, 0.0f); rlVertex2f(b.x + b.width, b.y + b.height);
+    rlTexCoord2f(1.0f, 1.0f); rlVertex2f(b.x + b.width, b.y);
+    rlEnd();
+    rlSetTexture(0);
+    rlPopMatrix();
+    EndBlendMode();
+}
+
+void TextBlockRenderCache::Release() {
+    if (target_.id > 0) UnloadRenderTexture(target_);
+    target_ = RenderTexture2D{};
+    valid_ = false;
+    blockSpans_ = SourceSpanList();
+    blockDrawCache_.reset();
+}
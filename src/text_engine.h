@@ -8,6 +8,10 @@
 #include <cstdint> // For uint8_t, uint32_t etc.
 #include <memory>  // For std::unique_ptr
 #include <variant> // For PositionedElementVariant (C++17)
+#include <functional> // For std::hash (layout cache key)
+#include <memory_resource> // For std::pmr (TextBlock storage)
+#include <algorithm> // For std::min/std::max/std::upper_bound (streaming layout, line index)
+#include <iterator>  // For std::forward_iterator_tag (SourceSpanList)
 
 // --- 配置与常量 ---
 using FontId = int;
@@ -58,7 +62,8 @@ enum class TextDirection {
 enum class LineBreakStrategy {
     SIMPLE_BY_WIDTH,
     ICU_WORD_BOUNDARIES,
-    ICU_CHARACTER_BOUNDARIES
+    ICU_CHARACTER_BOUNDARIES,
+    ICU_LINE_BOUNDARIES_SHAPE_FIRST // 先按样式 run 整段整形, 再按 UBRK_LINE 断行; 仅在 HB_GLYPH_FLAG_UNSAFE_TO_BREAK 处重新整形 (FreeType 后端)
 };
 
 /**
@@ -79,6 +84,14 @@ enum class GlyphAtlasType {
     SDF_BITMAP
 };
 
+/**
+ * @brief DrawTextBlock 提交字形的方式 (见 ITextEngine::SetGlyphRenderPath)。
+ */
+enum class GlyphRenderPath {
+    VERTEX_MESH, // 每个字形 4 个顶点 (默认)
+    INSTANCED    // 每个字形一条实例记录 (位置、尺寸、图集 UV、样式、斜体错切)，单位四边形在顶点着色器中展开；需要 OpenGL 3.3
+};
+
 
 // --- 效果参数结构体 ---
 struct EffectParameters {
@@ -112,9 +125,9 @@ struct GradientStop { Color color; float position; };
 struct FillStyle {
     FillType type = FillType::SOLID_COLOR;
     Color solidColor = {0, 0, 0, 255}; // BLACK
-    Vector2 linearGradientStart = {0.0f, 0.0f};
+    Vector2 linearGradientStart = {0.0f, 0.0f}; // 相对 TextBlock::overallBounds 归一化的坐标 (0..1)
     Vector2 linearGradientEnd = {0.0f, 1.0f};
-    std::vector<GradientStop> gradientStops;
+    std::vector<GradientStop> gradientStops; // 按 position 排序使用；FT 后端最多 8 个
 };
 
 struct TabStop {
@@ -217,6 +230,7 @@ struct PositionedGlyph {
     uint32_t sourceSpanIndex = 0;
     uint32_t sourceCharByteOffsetInSpan = 0;
     uint16_t numSourceCharBytesInSpan = 0;
+    uint32_t sourceByteOffsetInBlockText = 0; // 布局时算好的绝对字节偏移 (减去 TextBlock::sourceByteOffsetBase)，见 GetElementSourceByteStart
 
     CharacterStyle appliedStyle;
 
@@ -238,6 +252,7 @@ struct PositionedImage {
     uint32_t sourceSpanIndex = 0;
     uint32_t sourceCharByteOffsetInSpan = 0;
     uint16_t numSourceCharBytesInSpan = 0;
+    uint32_t sourceByteOffsetInBlockText = 0; // 布局时算好的绝对字节偏移 (减去 TextBlock::sourceByteOffsetBase)，见 GetElementSourceByteStart
     float ascent = 0.0f;
     float descent = 0.0f;
 };
@@ -269,12 +284,15 @@ struct VisualRun {
 };
 
 
+// firstElementIndexInBlockElements / lineBoxY / sourceTextByte*IndexInBlockText 在流式块 (AppendSpans / DropFrontLines) 中
+// 是整个流的坐标，要减去 TextBlock 的对应基准：读取时请用 GetLineFirstElementIndex / GetLineTopY / GetLineByteStart / GetLineByteEnd
 struct LineLayoutInfo {
     size_t firstElementIndexInBlockElements = 0;
     size_t numElementsInLine = 0;
     float lineBoxY = 0.0f;
     float baselineYInBox = 0.0f;
     float lineWidth = 0.0f;
+    float lineExtentX = 0.0f; // 行内容右边界 (含首行缩进与对齐偏移)；overallBounds.width 是各行 lineExtentX 的最大值
     float lineBoxHeight = 0.0f;
     float maxContentAscent = 0.0f;
     float maxContentDescent = 0.0f;
@@ -293,15 +311,301 @@ struct LineLayoutInfo {
     LineLayoutInfo() = default;
 };
 
+/**
+ * @brief 可从头部删除的 pmr 连续容器，接口是 std::pmr::vector 常用操作的子集。
+ * erase_front 只前移起点，已删除的前缀超过剩余元素数时才整体搬移一次，因此删除开头 n 个元素均摊 O(n)。
+ */
+template <typename T>
+class FrontErasableVector {
+public:
+    using value_type = T;
+    using size_type = size_t;
+    using iterator = T*;
+    using const_iterator = const T*;
+    using allocator_type = std::pmr::polymorphic_allocator<T>;
+
+    FrontErasableVector() = default;
+    explicit FrontErasableVector(std::pmr::memory_resource* resource) : storage_(resource) {}
+    FrontErasableVector(const FrontErasableVector& other) : storage_(other.begin(), other.end()) {} // 与 pmr::vector 一样，副本使用默认资源
+    FrontErasableVector(FrontErasableVector&& other) noexcept : storage_(std::move(other.storage_)), head_(other.head_) { other.clear(); }
+    FrontErasableVector& operator=(const FrontErasableVector& other) {
+        if (this != &other) { storage_.assign(other.begin(), other.end()); head_ = 0; }
+        return *this;
+    }
+    FrontErasableVector& operator=(FrontErasableVector&& other) {
+        if (this != &other) { storage_ = std::move(other.storage_); head_ = other.head_; other.clear(); }
+        return *this;
+    }
+
+    iterator begin() { return storage_.data() + head_; }
+    const_iterator begin() const { return storage_.data() + head_; }
+    iterator end() { return storage_.data() + storage_.size(); }
+    const_iterator end() const { return storage_.data() + storage_.size(); }
+    size_t size() const { return storage_.size() - head_; }
+    bool empty() const { return storage_.size() == head_; }
+    T& operator[](size_t i) { return storage_[head_ + i]; }
+    const T& operator[](size_t i) const { return storage_[head_ + i]; }
+    T& front() { return storage_[head_]; }
+    const T& front() const { return storage_[head_]; }
+    T& back() { return storage_.back(); }
+    const T& back() const { return storage_.back(); }
+    T* data() { return storage_.data() + head_; }
+    const T* data() const { return storage_.data() + head_; }
+    allocator_type get_allocator() const { return storage_.get_allocator(); }
+
+    void reserve(size_t count) { storage_.reserve(head_ + count); }
+    void resize(size_t count) { storage_.resize(head_ + count); }
+    void clear() { storage_.clear(); head_ = 0; }
+    void push_back(const T& value) { storage_.push_back(value); }
+    void push_back(T&& value) { storage_.push_back(std::move(value)); }
+    template <typename... Args>
+    T& emplace_back(Args&&... args) { return storage_.emplace_back(std::forward<Args>(args)...); }
+    void pop_back() { storage_.pop_back(); if (storage_.size() == head_) clear(); }
+    iterator erase(const_iterator first, const_iterator last) {
+        const size_t from = (size_t)(first - begin()), to = (size_t)(last - begin());
+        if (from == 0) { erase_front(to); return begin(); }
+        auto next = storage_.erase(storage_.begin() + (head_ + from), storage_.begin() + (head_ + to));
+        return storage_.data() + (next - storage_.begin());
+    }
+    /** @brief 删除开头的 count 个元素 (均摊 O(count))。 */
+    void erase_front(size_t count) {
+        head_ += std::min(count, size());
+        if (head_ == storage_.size()) clear();
+        else if (head_ > size()) { storage_.erase(storage_.begin(), storage_.begin() + head_); head_ = 0; }
+    }
+
+private:
+    std::pmr::vector<T> storage_; // [0, head_) 是已删除、尚未搬移的前缀
+    size_t head_ = 0;
+};
+
+/**
+ * @brief TextBlock 的源 spans：若干只读共享快照首尾相接，按下标访问 (快照多于一个时 O(log 快照数))。
+ * LayoutStyledText 的块只引用调用者的一个快照；AppendSpans 只为新 spans 追加一个快照，DropFrontLines 只前移起点
+ * (被截断的那个 span 另存一份截断后的副本)。快照本身从不修改，可以在调用者、布局缓存和块的副本之间共享。
+ */
+class SourceSpanList {
+public:
+    class const_iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = TextSpan;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const TextSpan*;
+        using reference = const TextSpan&;
+
+        const_iterator() = default;
+        const_iterator(const SourceSpanList* list, size_t index) : list_(list), index_(index) {}
+        reference operator*() const { return (*list_)[index_]; }
+        pointer operator->() const { return &(*list_)[index_]; }
+        const_iterator& operator++() { ++index_; return *this; }
+        const_iterator operator++(int) { const_iterator old = *this; ++index_; return old; }
+        bool operator==(const const_iterator& other) const { return list_ == other.list_ && index_ == other.index_; }
+        bool operator!=(const const_iterator& other) const { return !(*this == other); }
+
+    private:
+        const SourceSpanList* list_ = nullptr;
+        size_t index_ = 0;
+    };
+
+    SourceSpanList() = default;
+    SourceSpanList(std::shared_ptr<const std::vector<TextSpan>> snapshot) { Append(std::move(snapshot)); } // 后端: block.sourceSpans = snapshot
+
+    size_t size() const { return end_ - first_; }
+    bool empty() const { return end_ == first_; }
+    /** @brief 是否引用了输入快照 (测量结果与默认构造的块没有，无法重新布局)。 */
+    explicit operator bool() const { return hasSnapshot_; }
+    const TextSpan& operator[](size_t index) const {
+        if (index == 0 && trimmedFront_) return *trimmedFront_;
+        const size_t streamIndex = first_ + index;
+        size_t chunk = 0;
+        if (chunks_.size() > 1) chunk = (size_t)(std::upper_bound(chunkEnds_.begin(), chunkEnds_.end(), streamIndex) - chunkEnds_.begin());
+        const std::vector<TextSpan>& spans = *chunks_[chunk];
+        return spans[streamIndex - (chunkEnds_[chunk] - spans.size())];
+    }
+    const TextSpan& front() const { return (*this)[0]; }
+    const TextSpan& back() const { return (*this)[size() - 1]; }
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end() const { return const_iterator(this, size()); }
+
+    /** @brief 全部 spans 的连续快照：恰好是一个完整快照时直接共享它，否则拼接一份 (完整重新布局时使用)。 */
+    std::shared_ptr<const std::vector<TextSpan>> Snapshot() const;
+    /** @brief 在末尾接上一个快照，不复制已有 spans。 */
+    void Append(std::shared_ptr<const std::vector<TextSpan>> snapshot);
+    /** @brief 丢弃开头的 spanCount 个 span，再截掉新的首个 span 文本的前 trimBytes 字节。 */
+    void DropFront(size_t spanCount, uint32_t trimBytes);
+    /** @brief 是否恰好就是 spans 这一个完整快照 (没有追加、丢弃或截断)。 */
+    bool IsWholeSnapshot(const std::vector<TextSpan>& spans) const {
+        return chunks_.size() == 1 && chunks_.front().get() == &spans && !trimmedFront_ && size() == spans.size();
+    }
+    /** @brief 是否引用同一批快照的同一范围 (O(1)：快照只追加不修改，首尾快照和范围相同即内容相同)。 */
+    bool SharesSnapshotsWith(const SourceSpanList& other) const;
+
+private:
+    FrontErasableVector<std::shared_ptr<const std::vector<TextSpan>>> chunks_;
+    FrontErasableVector<size_t> chunkEnds_; // chunks_[i] 末尾在整个流中的 span 序号 (前缀和)
+    size_t first_ = 0; // 第一个保留的 span 在整个流中的序号
+    size_t end_ = 0;
+    std::shared_ptr<const TextSpan> trimmedFront_; // 非空时代替第一个保留的 span (DropFrontLines 截断了它)
+    bool hasSnapshot_ = false;
+};
+
+struct TextBlockShapingCache; // 后端私有：与换行宽度无关的整形结果，供 ITextEngine::Rewrap 复用
+struct TextBlockDrawCache;    // 后端私有：首次绘制时生成的 GPU 网格 (顶点/索引缓冲 + 按渲染状态分段的绘制命令)
+
 struct TextBlock {
-    std::vector<PositionedElementVariant> elements;
-    std::vector<LineLayoutInfo> lines;
-    Rectangle overallBounds = {0,0,0,0};
+    // elements / lines / sourceTextConcatenated 从构造时指定的 memory_resource 分配 (默认为全局默认资源)；
+    // elements / lines 可从头部廉价删除，DropFrontLines 不搬移剩余的元素和行
+    FrontErasableVector<PositionedElementVariant> elements;
+    FrontErasableVector<LineLayoutInfo> lines;
+    Rectangle overallBounds = {0,0,0,0}; // 与 lineBoxY、元素 position 一样是块内 float 坐标；超长文档请用 TextDocument 的 double 段落原点定位各块
     ParagraphStyle paragraphStyleUsed;
-    std::string sourceTextConcatenated; // UTF-8
-    std::vector<TextSpan> sourceSpansCopied;
+    std::pmr::string sourceTextConcatenated; // UTF-8, 布局期间唯一的拼接文本缓冲
+    SourceSpanList sourceSpans; // 输入 spans 的只读共享快照 (与调用者及后续布局共享，不做深拷贝)
+    std::shared_ptr<const TextBlockShapingCache> shapingCache; // 可为空；Rewrap 重用的整形数据 (Rewrap 后仍然有效)
+    // 可为空；DrawTextBlock 首次绘制时填充，之后每帧只绑定并绘制。布局 / Rewrap / AppendSpans / DropFrontLines 会清空它，
+    // 直接修改 elements 或 lines 的代码也必须 reset
+    mutable std::shared_ptr<TextBlockDrawCache> drawCache;
+    // 流式块 (AppendSpans / DropFrontLines)：元素的 sourceSpanIndex 减去 sourceSpanIndexBase 才是 GetSourceSpans() 的下标
+    uint32_t sourceSpanIndexBase = 0;
+    uint32_t sourceByteOffsetBase = 0; // 同理：元素的 sourceByteOffsetInBlockText 与行的字节范围减去它才是 sourceTextConcatenated 中的偏移
+    size_t elementIndexBase = 0; // 同理：行的 firstElementIndexInBlockElements 减去它才是 elements 的下标
+    float lineBoxYBase = 0.0f;   // 同理：行的 lineBoxY 减去它才是块内 y (丢弃的高度超过剩余高度时折算回 0，避免 float 精度随流增长而下降)
+    size_t droppedLineCount = 0; // DropFrontLines 累计丢弃的行数 (lines[i] 在整个流中是第 droppedLineCount + i 行)
+    // 行索引：与 lines 一一对应的有序行起始字节 / 行顶 y (与行字段一样是未减基准的值)，连续存放以便二分查找
+    // (见 FindLineIndexForByteOffset / FindLineIndexForY)
+    FrontErasableVector<uint32_t> lineStartBytes;
+    FrontErasableVector<float> lineTopYs;
+    // 流式块的宽度：(流中行号, lineExtentX) 的单调队列，行号递增、宽度递减，队首就是剩余行中最宽的一行。
+    // 第一次 AppendSpans / DropFrontLines 时按现有行建立，之后随追加和丢弃增量维护
+    FrontErasableVector<std::pair<size_t, float>> widestLines;
 
     TextBlock() = default;
+    explicit TextBlock(std::pmr::memory_resource* resource)
+        : elements(resource ? resource : std::pmr::get_default_resource()),
+          lines(resource ? resource : std::pmr::get_default_resource()),
+          sourceTextConcatenated(resource ? resource : std::pmr::get_default_resource()),
+          lineStartBytes(resource ? resource : std::pmr::get_default_resource()),
+          lineTopYs(resource ? resource : std::pmr::get_default_resource()),
+          widestLines(resource ? resource : std::pmr::get_default_resource()) {}
+
+    const SourceSpanList& GetSourceSpans() const { return sourceSpans; }
+};
+
+// --- 行字段访问：DropFrontLines 只累加 TextBlock 的基准而不改写剩余的行，读取行位置时减去基准 ---
+inline size_t GetLineFirstElementIndex(const TextBlock& textBlock, const LineLayoutInfo& line) {
+    return line.firstElementIndexInBlockElements - textBlock.elementIndexBase;
+}
+inline uint32_t GetLineByteStart(const TextBlock& textBlock, const LineLayoutInfo& line) {
+    return line.sourceTextByteStartIndexInBlockText - textBlock.sourceByteOffsetBase;
+}
+inline uint32_t GetLineByteEnd(const TextBlock& textBlock, const LineLayoutInfo& line) {
+    return line.sourceTextByteEndIndexInBlockText - textBlock.sourceByteOffsetBase;
+}
+inline float GetLineTopY(const TextBlock& textBlock, const LineLayoutInfo& line) {
+    return line.lineBoxY - textBlock.lineBoxYBase;
+}
+
+/** @brief 按 lines 重建行索引。后端在布局 / Rewrap 结束时调用。 */
+inline void RebuildLineIndex(TextBlock& textBlock) {
+    textBlock.lineStartBytes.resize(textBlock.lines.size());
+    textBlock.lineTopYs.resize(textBlock.lines.size());
+    for (size_t i = 0; i < textBlock.lines.size(); ++i) {
+        textBlock.lineStartBytes[i] = textBlock.lines[i].sourceTextByteStartIndexInBlockText;
+        textBlock.lineTopYs[i] = textBlock.lines[i].lineBoxY;
+    }
+}
+
+/**
+ * @brief 起始字节 <= byteOffset 的最后一行 (O(log n))。byteOffset 落在行末时返回的就是该行，调用者可据此判断是否属于下一行。
+ * lines 为空时返回 0；行索引与 lines 不一致时 (例如手工修改了 lines) 直接在 lines 上二分。
+ */
+inline size_t FindLineIndexForByteOffset(const TextBlock& textBlock, uint32_t byteOffset) {
+    if (textBlock.lines.empty()) return 0;
+    const uint32_t key = byteOffset + textBlock.sourceByteOffsetBase;
+    size_t count;
+    if (textBlock.lineStartBytes.size() == textBlock.lines.size()) {
+        count = std::upper_bound(textBlock.lineStartBytes.begin(), textBlock.lineStartBytes.end(), key) - textBlock.lineStartBytes.begin();
+    } else {
+        count = std::upper_bound(textBlock.lines.begin(), textBlock.lines.end(), key,
+                                 [](uint32_t offset, const LineLayoutInfo& line) { return offset < line.sourceTextByteStartIndexInBlockText; }) - textBlock.lines.begin();
+    }
+    return count > 0 ? count - 1 : 0;
+}
+
+/** @brief 行顶 <= y 的最后一行 (O(log n))；y 在第一行之上时返回 0。y 可能落在该行与下一行之间的空隙里，由调用者决定取哪一行。 */
+inline size_t FindLineIndexForY(const TextBlock& textBlock, float y) {
+    if (textBlock.lines.empty()) return 0;
+    const float key = y + textBlock.lineBoxYBase;
+    size_t count;
+    if (textBlock.lineTopYs.size() == textBlock.lines.size()) {
+        count = std::upper_bound(textBlock.lineTopYs.begin(), textBlock.lineTopYs.end(), key) - textBlock.lineTopYs.begin();
+    } else {
+        count = std::upper_bound(textBlock.lines.begin(), textBlock.lines.end(), key,
+                                 [](float value, const LineLayoutInfo& line) { return value < line.lineBoxY; }) - textBlock.lines.begin();
+    }
+    return count > 0 ? count - 1 : 0;
+}
+
+/**
+ * @brief 与 [minY, maxY] 相交的行范围 [firstLine, endLine) (O(log n))。上下各多含一行，
+ * 以覆盖伸出行框的字形 (斜体、阴影、超出行高的上标等)。
+ */
+inline void FindLineRangeForYSpan(const TextBlock& textBlock, float minY, float maxY, size_t& firstLine, size_t& endLine) {
+    firstLine = endLine = 0;
+    if (textBlock.lines.empty() || maxY < minY) return;
+    firstLine = FindLineIndexForY(textBlock, minY);
+    if (firstLine > 0) --firstLine;
+    endLine = std::min(FindLineIndexForY(textBlock, maxY) + 2, textBlock.lines.size());
+}
+
+/**
+ * @brief 把 DrawTextBlock 的 clipRect (transform 之后的空间) 反变换回 TextBlock 坐标，得到其轴对齐包围盒。
+ * 只处理二维仿射变换 (平移 / 缩放 / 旋转 / 错切)；透视或不可逆的 transform 返回 false，调用者此时不做剔除。
+ */
+inline bool GetClipBoundsInBlockSpace(const Matrix& transform, const Rectangle& clipRect, Rectangle& outBounds) {
+    if (transform.m3 != 0.0f || transform.m7 != 0.0f || transform.m15 != 1.0f) return false;
+    float det = transform.m0 * transform.m5 - transform.m4 * transform.m1;
+    if (det == 0.0f) return false;
+    float minX = 0, minY = 0, maxX = 0, maxY = 0;
+    const float cornersX[4] = {clipRect.x, clipRect.x + clipRect.width, clipRect.x, clipRect.x + clipRect.width};
+    const float cornersY[4] = {clipRect.y, clipRect.y, clipRect.y + clipRect.height, clipRect.y + clipRect.height};
+    for (int i = 0; i < 4; ++i) {
+        float dx = cornersX[i] - transform.m12, dy = cornersY[i] - transform.m13;
+        float x = (transform.m5 * dx - transform.m4 * dy) / det;
+        float y = (transform.m0 * dy - transform.m1 * dx) / det;
+        if (i == 0 || x < minX) minX = x;
+        if (i == 0 || x > maxX) maxX = x;
+        if (i == 0 || y < minY) minY = y;
+        if (i == 0 || y > maxY) maxY = y;
+    }
+    outBounds = {minX, minY, maxX - minX, maxY - minY};
+    return true;
+}
+
+/**
+ * @brief MeasureStyledText 的结果: 只有尺寸信息, 不含任何字形元素。
+ */
+struct TextMeasurement {
+    Vector2 size = {0, 0};          // 与 LayoutStyledText 得到的 overallBounds 宽高一致
+    size_t lineCount = 0;
+    float minContentWidth = 0.0f;   // 最宽的不可断开片段 (在每个断行机会都换行时的宽度)
+    float maxContentWidth = 0.0f;   // 不自动换行时的宽度 (只在硬换行处断开)
+
+    TextMeasurement() = default;
+};
+
+/**
+ * @brief 布局缓存的统计信息 (见 ITextEngine::LayoutStyledTextCached)。
+ */
+struct LayoutCacheStats {
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t evictions = 0;   // 因容量不足被淘汰的条目数
+    size_t entries = 0;     // 当前缓存的 TextBlock 数
+    size_t capacity = 0;
+
+    LayoutCacheStats() = default;
 };
 
 struct CursorLocationInfo {
@@ -381,7 +685,68 @@ public:
     virtual ScaledFontMetrics GetScaledFontMetrics(FontId fontId, float fontSize) const = 0;
 
     // --- Text Layout ---
-    virtual TextBlock LayoutStyledText(const std::vector<TextSpan>& spans, const ParagraphStyle& paragraphStyle) = 0;
+    /**
+     * @brief 布局入口。spans 以共享快照传入，TextBlock 直接持有该快照，不再复制 spans。
+     * 另有 const& (复制一次生成快照) 和 && (移动进快照) 两个便捷重载。
+     * @param resultResource 结果 TextBlock 的 elements/lines/文本缓冲所用的内存资源 (nullptr 为默认资源)；
+     *        调用者需保证其生命周期长于返回的 TextBlock。布局过程中的临时数据使用引擎自带的 arena，与此无关。
+     */
+    virtual TextBlock LayoutStyledText(std::shared_ptr<const std::vector<TextSpan>> spans, const ParagraphStyle& paragraphStyle,
+                                       std::pmr::memory_resource* resultResource = nullptr) = 0;
+    TextBlock LayoutStyledText(const std::vector<TextSpan>& spans, const ParagraphStyle& paragraphStyle, std::pmr::memory_resource* resultResource = nullptr) {
+        return LayoutStyledText(std::make_shared<const std::vector<TextSpan>>(spans), paragraphStyle, resultResource);
+    }
+    TextBlock LayoutStyledText(std::vector<TextSpan>&& spans, const ParagraphStyle& paragraphStyle, std::pmr::memory_resource* resultResource = nullptr) {
+        return LayoutStyledText(std::make_shared<const std::vector<TextSpan>>(std::move(spans)), paragraphStyle, resultResource);
+    }
+
+    /**
+     * @brief 只测量不布局：与 LayoutStyledText 共享整形和断行逻辑，但不生成 PositionedGlyph、不光栅化字形、不构建 BiDi 映射。
+     * 适用于按钮、提示框等只需要尺寸的场合，同时给出 min-content / max-content 固有宽度。
+     * @param spans 文本片段。
+     * @param paragraphStyle 段落样式 (wrapWidth 决定 size 与 lineCount，不影响固有宽度)。
+     * @return 测量结果。
+     */
+    virtual TextMeasurement MeasureStyledText(const std::vector<TextSpan>& spans, const ParagraphStyle& paragraphStyle) = 0;
+
+    /**
+     * @brief 以新的换行宽度和对齐方式重新断行，不重新整形：只重做行分配、对齐偏移和行度量 (窗口缩放时使用)。
+     * 需要 TextBlock 带有 shapingCache (FT 后端的快速路径与 ICU_LINE_BOUNDARIES_SHAPE_FIRST 会生成)；
+     * 否则，或新断点处的字形必须重新整形时，退回为用新样式完整重新布局。
+     * shapingCache 只保存整形输出 (字形、簇偏移、度量) 和断行机会，不保存元素副本；样式取自 sourceSpans。
+     * STB 后端没有整形阶段，Rewrap 就是一次完整的重新布局，总是返回 false。
+     * @return true 表示复用了整形结果；false 表示执行了完整布局 (textBlock 仍会被更新)。
+     */
+    virtual bool Rewrap(TextBlock& textBlock, float newWrapWidth, HorizontalAlignment newAlignment) = 0;
+
+    // --- Streaming (日志 / 聊天视图) ---
+    /**
+     * @brief 流式追加：把 newSpans 接到 textBlock 末尾。只重新布局最后一个 BiDi 段落 (最后一个 '\n' 之后的行) 和新内容，
+     * 之前的行与元素原样保留。textBlock 须来自 LayoutStyledText 或此前的 AppendSpans；追加后 shapingCache 被清空。
+     * 已有 spans 的快照原样共享，只复制 newSpans。
+     */
+    void AppendSpans(TextBlock& textBlock, const std::vector<TextSpan>& newSpans);
+    /**
+     * @brief 环形缓冲语义：丢弃开头的 lineCount 行及其元素、文本和不再被引用的 spans，剩余行上移。
+     * 剩余的行与元素不搬移也不改写，只累加 TextBlock 的各个基准 (行字段须用 GetLine* 读取)，均摊 O(丢弃的行与元素数)；
+     * 只有被截断的那个 span 内的元素会调整字节偏移，sourceTextConcatenated 仍整体前移一次。overallBounds.width 按剩余行重新计算。
+     */
+    static void DropFrontLines(TextBlock& textBlock, size_t lineCount);
+
+    // --- Layout Cache ---
+    /**
+     * @brief 带缓存的 LayoutStyledText：以 spans + paragraphStyle 的内容哈希为键，命中时直接返回共享的只读 TextBlock。
+     * 字体、回退链、默认字体或字形图集发生变化时缓存自动失效。
+     * @return 不可修改的布局结果；调用者可长期持有，缓存淘汰不影响已返回的指针。
+     */
+    virtual std::shared_ptr<const TextBlock> LayoutStyledTextCached(const std::vector<TextSpan>& spans, const ParagraphStyle& paragraphStyle) = 0; // 仅在未命中时复制 spans
+    virtual std::shared_ptr<const TextBlock> LayoutStyledTextCached(std::shared_ptr<const std::vector<TextSpan>> spans, const ParagraphStyle& paragraphStyle) = 0;
+    std::shared_ptr<const TextBlock> LayoutStyledTextCached(std::vector<TextSpan>&& spans, const ParagraphStyle& paragraphStyle) {
+        return LayoutStyledTextCached(std::make_shared<const std::vector<TextSpan>>(std::move(spans)), paragraphStyle);
+    }
+    virtual void SetLayoutCacheCapacity(size_t maxEntries) = 0; // 0 表示禁用缓存
+    virtual void ClearLayoutCache() = 0;
+    virtual LayoutCacheStats GetLayoutCacheStats() const = 0;
 
     /**
      * @brief 获取给定文本块中指定字节范围的视觉边界矩形列表。
@@ -395,8 +760,36 @@ public:
 
 
     // --- Text Drawing ---
+    /**
+     * @brief 开始一帧的文本批处理。到 EndTextFrame 为止，小文本块的 DrawTextBlock 只记录提交 (块、变换、tint、clipRect)，不立即绘制；
+     * 大文本块 (已有常驻网格，重新上传顶点不划算) 先绘出此前排队的块，再直接绘制。
+     * 变换、相机与投影都取提交时的状态 (含当时的 rlPushMatrix 变换)。
+     */
+    virtual void BeginTextFrame() = 0;
+
+    /**
+     * @brief 绘制自 BeginTextFrame 以来排队的全部文本块。
+     * 绘制顺序与提交顺序一致 (重叠的块后提交者在上)；只合并相邻且 (裁剪矩形, 相机, 纹理) 相同的片段，
+     * 因此连续提交、共用图集的大量标签只需一次绘制调用，交替使用不同图集的提交则会拆成多次。
+     */
+    virtual void EndTextFrame() = 0;
+
+    /** @brief 是否处于 BeginTextFrame / EndTextFrame 之间 (此时 DrawTextBlock 可能只排队、不立即绘制)。 */
+    virtual bool IsTextFrameActive() const = 0;
+
+    /**
+     * @brief 绘制文本块。clipRect 位于 transform 之后的空间 (未启用相机 / 渲染纹理变换时即屏幕坐标)：
+     * 以 scissor 精确裁剪，并按 lineBoxY 二分跳过完全落在其外的行 (FT 后端还会按视觉 run 剔除)。
+     */
     virtual void DrawTextBlock(const TextBlock& textBlock, const Matrix& transform, Color globalTint = WHITE, const Rectangle* clipRect = nullptr) = 0;
 
+    /**
+     * @brief 在 CPU 上把文本块栅格化进 image，不需要 OpenGL 上下文 (用于无 GPU 的缩略图 / 预览与像素级测试)。
+     * image 须为 PIXELFORMAT_UNCOMPRESSED_R8G8B8A8；transform 把块坐标映射到图像像素坐标，只支持 2D 仿射变换。
+     * 着色与混合 (BLEND_ALPHA) 与 DrawTextBlock 的着色器一致；内联图片只有 GPU 纹理，不会被绘制。
+     */
+    virtual void RenderTextBlockToImage(const TextBlock& textBlock, Image& image, const Matrix& transform, Color globalTint = WHITE) = 0;
+
     /**
      * @brief 绘制给定文本块中指定字节范围的选区高亮。
      * @param textBlock 已布局的文本块。
@@ -416,14 +809,227 @@ public:
     virtual void ClearGlyphCache() = 0;
     virtual void SetGlyphAtlasOptions(size_t maxGlyphsEstimate, int atlasWidth = 1024, int atlasHeight = 1024, GlyphAtlasType typeHint = GlyphAtlasType::ALPHA_ONLY_BITMAP) = 0;
     virtual Texture2D GetAtlasTextureForDebug(int atlasIndex = 0) const = 0;
+    /** @brief 选择 DrawTextBlock 的字形提交方式。不支持的后端忽略此设置；BeginTextFrame / EndTextFrame 之间排队的小文本块始终按顶点合批。 */
+    virtual void SetGlyphRenderPath(GlyphRenderPath path) = 0;
+    virtual GlyphRenderPath GetGlyphRenderPath() const = 0;
 
     // --- Cursor and Hit-Testing ---
     virtual CursorLocationInfo GetCursorInfoFromByteOffset(const TextBlock& textBlock, uint32_t byteOffsetInConcatenatedText, bool preferLeadingEdge = true) const = 0;
     virtual uint32_t GetByteOffsetFromVisualPosition(const TextBlock& textBlock, Vector2 positionInBlockLocalCoords, bool* isTrailingEdge = nullptr, float* distanceToClosestEdge = nullptr) const = 0;
 };
 
+// --- Glyph Atlas Storage ---
+
+/**
+ * @brief 图集页纹理的存储后端。引擎始终在 CPU 端保存图集像素 (灰度 Image)，只通过此接口创建 / 更新 / 释放对应的纹理，
+ * 因此布局、字形缓存与图集装箱本身不依赖 GL 上下文。
+ */
+class IAtlasStorage {
+public:
+    virtual ~IAtlasStorage() = default;
+    /** @brief 为新的图集页创建纹理；失败时返回 id 为 0 的纹理。 */
+    virtual Texture2D CreatePage(const Image& pageImage) = 0;
+    /** @brief 把 rect 大小、与页同格式的 pixels 写入页纹理的 rect 区域。 */
+    virtual void UpdatePage(const Texture2D& page, Rectangle rect, const void* pixels) = 0;
+    virtual void ReleasePage(const Texture2D& page) = 0;
+    /** @brief 是否有可用的 GL 上下文。为 false 时引擎不加载着色器，DrawTextBlock 等绘制接口直接返回。 */
+    virtual bool HasGpu() const = 0;
+};
+
+/** @brief 默认存储：raylib 纹理 (双线性过滤)，需要 InitWindow 之后的 GL 上下文。 */
+class GpuAtlasStorage final : public IAtlasStorage {
+public:
+    Texture2D CreatePage(const Image& pageImage) override {
+        Texture2D texture = LoadTextureFromImage(pageImage);
+        if (texture.id > 0) SetTextureFilter(texture, TEXTURE_FILTER_BILINEAR); // Good for SDF
+        return texture;
+    }
+    void UpdatePage(const Texture2D& page, Rectangle rect, const void* pixels) override { UpdateTextureRec(page, rect, pixels); }
+    void ReleasePage(const Texture2D& page) override { if (page.id > 0) UnloadTexture(page); }
+    bool HasGpu() const override { return true; }
+};
+
+/**
+ * @brief 无 GPU 存储：只分配互不相同的占位纹理 id (不是 GL 对象)，像素仍在引擎的 CPU 图集中。
+ * 用于没有窗口的单元测试、基准与服务端测量；可用 RenderTextBlockToImage 得到渲染结果。
+ * GetAtlasTextureForDebug 返回的纹理不可绘制。
+ */
+class HeadlessAtlasStorage final : public IAtlasStorage {
+public:
+    Texture2D CreatePage(const Image& pageImage) override {
+        return {++lastPageId_, pageImage.width, pageImage.height, 1, pageImage.format};
+    }
+    void UpdatePage(const Texture2D&, Rectangle, const void*) override {}
+    void ReleasePage(const Texture2D&) override {}
+    bool HasGpu() const override { return false; }
+
+private:
+    unsigned int lastPageId_ = 0;
+};
+
 // --- Engine Factory ---
 std::unique_ptr<ITextEngine> CreateTextEngine(); // 实现将位于 .cpp 文件中
+/** @brief 以指定的图集存储创建引擎，例如 std::make_unique<HeadlessAtlasStorage>()；为空时等同 CreateTextEngine()。 */
+std::unique_ptr<ITextEngine> CreateTextEngine(std::unique_ptr<IAtlasStorage> atlasStorage);
+
+// --- Cached Render-To-Texture ---
+
+/**
+ * @brief 静态文本块的渲染到纹理缓存 (可选)：按当前有效缩放把块渲染进 RenderTexture2D 一次，之后每帧只画一个四边形。
+ * 只有布局 (含样式) 改变或有效缩放偏离超过 scaleTolerance 时才重新渲染；适合帮助页、富文本提示这类效果
+ * (辉光、阴影、内阴影) 较重而很少变化的文本。与具体后端无关，必须在 GL 上下文中使用。
+ */
+class TextBlockRenderCache {
+public:
+    static constexpr int MAX_TEXTURE_SIZE = 4096; // 纹理边长上限，超出时降低渲染缩放
+    float scaleTolerance = 0.15f; // 有效缩放与缓存缩放之比超出 [1 / (1 + t), 1 + t] 时重新渲染
+    float padding = 8.0f;         // overallBounds 四周额外保留的边距 (块坐标)，容纳描边 / 辉光 / 阴影
+
+    TextBlockRenderCache() = default;
+    TextBlockRenderCache(const TextBlockRenderCache&) = delete;
+    TextBlockRenderCache& operator=(const TextBlockRenderCache&) = delete;
+    ~TextBlockRenderCache() { Release(); }
+
+    /**
+     * @brief 需要时重新渲染缓存纹理，返回是否重新渲染。effectiveScale 为块坐标到屏幕像素的缩放 (含相机 zoom)。
+     * 会切换渲染目标：须在 BeginTextureMode、BeginMode2D / BeginMode3D 以及 BeginTextFrame / EndTextFrame 之外调用
+     * (文本帧进行中时记录警告并返回 false)。检测布局、缩放、dynamicSmoothnessAdd 与字形提交方式的变化。
+     */
+    bool Update(ITextEngine& engine, const TextBlock& textBlock, float effectiveScale);
+
+    /** @brief 以 transform (与 DrawTextBlock 相同的块到世界变换) 绘制缓存纹理；tint 作用于整张纹理。 */
+    void Draw(const Matrix& transform, Color tint = WHITE) const;
+
+    /** @brief 标记缓存失效 (例如直接修改了块的元素)，下次 Update 必定重新渲染。 */
+    void Invalidate() { valid_ = false; }
+    /** @brief 释放渲染纹理；须在 CloseWindow 之前调用或析构。 */
+    void Release();
+    bool IsValid() const { return valid_; }
+
+private:
+    RenderTexture2D target_{};
+    bool valid_ = false;
+    float scale_ = 0.0f;            // 上次渲染时请求的有效缩放
+    Rectangle bounds_ = {0, 0, 0, 0}; // 纹理覆盖的块坐标区域 (overallBounds + padding)
+    // 布局指纹：布局 / Rewrap 等会生成新的 span 快照或清空 drawCache，持有 shared_ptr 保证地址不被复用
+    const TextBlock* block_ = nullptr;
+    SourceSpanList blockSpans_;
+    std::shared_ptr<TextBlockDrawCache> blockDrawCache_;
+    Rectangle blockBounds_ = {0, 0, 0, 0};
+    size_t elementCount_ = 0, lineCount_ = 0;
+    float smoothnessAdd_ = 0.0f; // 渲染时的 dynamicSmoothnessAdd
+    GlyphRenderPath renderPath_ = GlyphRenderPath::VERTEX_MESH;
+};
+
+// --- Layout Cache Helpers (供各后端的 LayoutStyledTextCached 使用) ---
+inline void HashCombineForLayout(size_t& seed, size_t value) {
+    seed ^= value + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+}
+inline size_t HashColorForLayout(Color c) {
+    return ((size_t)c.r << 24) | ((size_t)c.g << 16) | ((size_t)c.b << 8) | (size_t)c.a;
+}
+inline bool ColorsEqualForLayout(Color a, Color b) { return a.r == b.r && a.g == b.g && a.b == b.b && a.a == b.a; }
+
+// 只哈希影响几何与最常变化的字段 (文本、字体、字号、颜色、段落几何)；完整比较由 IsSameLayoutInput 负责
+inline size_t HashCharacterStyleForLayout(const CharacterStyle& s) {
+    std::hash<float> hf;
+    size_t seed = std::hash<int>()(s.fontId);
+    HashCombineForLayout(seed, hf(s.fontSize));
+    HashCombineForLayout(seed, (size_t)s.basicStyle);
+    HashCombineForLayout(seed, (size_t)s.fill.type);
+    HashCombineForLayout(seed, HashColorForLayout(s.fill.solidColor));
+    HashCombineForLayout(seed, std::hash<std::string>()(s.scriptTag));
+    HashCombineForLayout(seed, std::hash<std::string>()(s.languageTag));
+    HashCombineForLayout(seed, (size_t)s.isImage);
+    if (s.isImage) {
+        HashCombineForLayout(seed, (size_t)s.imageParams.texture.id);
+        HashCombineForLayout(seed, hf(s.imageParams.displayWidth));
+        HashCombineForLayout(seed, hf(s.imageParams.displayHeight));
+        HashCombineForLayout(seed, (size_t)s.imageParams.vAlign);
+    }
+    return seed;
+}
+
+inline size_t HashLayoutInput(const std::vector<TextSpan>& spans, const ParagraphStyle& p) {
+    std::hash<float> hf;
+    size_t seed = spans.size();
+    for (const auto& span : spans) {
+        HashCombineForLayout(seed, std::hash<std::string>()(span.text));
+        HashCombineForLayout(seed, HashCharacterStyleForLayout(span.style));
+    }
+    HashCombineForLayout(seed, (size_t)p.alignment);
+    HashCombineForLayout(seed, (size_t)p.lineHeightType);
+    HashCombineForLayout(seed, hf(p.lineHeightValue));
+    HashCombineForLayout(seed, hf(p.firstLineIndent));
+    HashCombineForLayout(seed, hf(p.wrapWidth));
+    HashCombineForLayout(seed, (size_t)p.baseDirection);
+    HashCombineForLayout(seed, (size_t)p.lineBreakStrategy);
+    HashCombineForLayout(seed, HashCharacterStyleForLayout(p.defaultCharacterStyle));
+    return seed;
+}
+
+inline bool CharacterStylesEqualForLayout(const CharacterStyle& a, const CharacterStyle& b) {
+    if (a.fontId != b.fontId || a.fontSize != b.fontSize || a.basicStyle != b.basicStyle ||
+        a.scriptTag != b.scriptTag || a.languageTag != b.languageTag || a.isImage != b.isImage) return false;
+    const FillStyle& fa = a.fill; const FillStyle& fb = b.fill;
+    if (fa.type != fb.type || !ColorsEqualForLayout(fa.solidColor, fb.solidColor) ||
+        fa.linearGradientStart.x != fb.linearGradientStart.x || fa.linearGradientStart.y != fb.linearGradientStart.y ||
+        fa.linearGradientEnd.x != fb.linearGradientEnd.x || fa.linearGradientEnd.y != fb.linearGradientEnd.y ||
+        fa.gradientStops.size() != fb.gradientStops.size()) return false;
+    for (size_t i = 0; i < fa.gradientStops.size(); ++i) {
+        if (!ColorsEqualForLayout(fa.gradientStops[i].color, fb.gradientStops[i].color) || fa.gradientStops[i].position != fb.gradientStops[i].position) return false;
+    }
+    if (a.outline.enabled != b.outline.enabled || !ColorsEqualForLayout(a.outline.color, b.outline.color) || a.outline.width != b.outline.width) return false;
+    if (a.glow.enabled != b.glow.enabled || !ColorsEqualForLayout(a.glow.color, b.glow.color) ||
+        a.glow.range != b.glow.range || a.glow.intensity != b.glow.intensity) return false;
+    if (a.shadow.enabled != b.shadow.enabled || !ColorsEqualForLayout(a.shadow.color, b.shadow.color) ||
+        a.shadow.offset.x != b.shadow.offset.x || a.shadow.offset.y != b.shadow.offset.y || a.shadow.sdfSpread != b.shadow.sdfSpread) return false;
+    if (a.innerEffect.enabled != b.innerEffect.enabled || !ColorsEqualForLayout(a.innerEffect.color, b.innerEffect.color) ||
+        a.innerEffect.range != b.innerEffect.range || a.innerEffect.isShadow != b.innerEffect.isShadow) return false;
+    const auto& ia = a.imageParams; const auto& ib = b.imageParams;
+    return ia.texture.id == ib.texture.id && ia.texture.width == ib.texture.width && ia.texture.height == ib.texture.height &&
+           ia.displayWidth == ib.displayWidth && ia.displayHeight == ib.displayHeight && ia.vAlign == ib.vAlign;
+}
+
+inline bool IsSameSpanSnapshot(const std::vector<TextSpan>& a, const std::vector<TextSpan>& b) { return &a == &b; }
+inline bool IsSameSpanSnapshot(const std::vector<TextSpan>& a, const SourceSpanList& b) { return b.IsWholeSnapshot(a); }
+
+/**
+ * @brief 判断两组布局输入是否完全相同 (逐字段比较，用于确认缓存命中并排除哈希碰撞)。
+ * spansB 可以是 std::vector<TextSpan> 或缓存块的 SourceSpanList。
+ */
+template <typename SpanListB>
+inline bool IsSameLayoutInput(const std::vector<TextSpan>& spansA, const ParagraphStyle& pA,
+                              const SpanListB& spansB, const ParagraphStyle& pB) {
+    if (spansA.size() != spansB.size()) return false;
+    if (pA.alignment != pB.alignment || pA.lineHeightType != pB.lineHeightType || pA.lineHeightValue != pB.lineHeightValue ||
+        pA.firstLineIndent != pB.firstLineIndent || pA.wrapWidth != pB.wrapWidth || pA.baseDirection != pB.baseDirection ||
+        pA.lineBreakStrategy != pB.lineBreakStrategy || pA.defaultTabWidthFactor != pB.defaultTabWidthFactor ||
+        pA.customTabStops.size() != pB.customTabStops.size()) return false;
+    for (size_t i = 0; i < pA.customTabStops.size(); ++i) {
+        if (pA.customTabStops[i].position != pB.customTabStops[i].position || pA.customTabStops[i].alignment != pB.customTabStops[i].alignment) return false;
+    }
+    if (!CharacterStylesEqualForLayout(pA.defaultCharacterStyle, pB.defaultCharacterStyle)) return false;
+    if (IsSameSpanSnapshot(spansA, spansB)) return true; // 同一份共享快照
+    for (size_t i = 0; i < spansA.size(); ++i) {
+        if (spansA[i].userData != spansB[i].userData || spansA[i].text != spansB[i].text ||
+            !CharacterStylesEqualForLayout(spansA[i].style, spansB[i].style)) return false;
+    }
+    return true;
+}
+
+// --- Streaming Layout (ITextEngine::AppendSpans / DropFrontLines 与后端无关，实现在 text_engine.cpp) ---
+inline uint32_t SourceSpanByteLength(const TextSpan& span) {
+    return (span.style.isImage && span.text.empty()) ? 3u : (uint32_t)span.text.length(); // 空文本图片 span 在拼接文本中占一个 U+FFFC
+}
+
+/** @brief 用 span 起点的前缀和一次算出所有元素的 sourceByteOffsetInBlockText。后端在布局 / Rewrap 结束时调用。 */
+void AssignElementSourceByteOffsets(TextBlock& textBlock);
+
+/** @brief 元素在 sourceTextConcatenated 中的起始字节，O(1)，不再需要对前面的 span 求和。 */
+inline uint32_t GetElementSourceByteStart(const TextBlock& textBlock, const PositionedElementVariant& element) {
+    return std::visit([](const auto& el) { return el.sourceByteOffsetInBlockText; }, element) - textBlock.sourceByteOffsetBase;
+}
 
 // --- UTF-8 Helper ---
 inline uint32_t GetNextCodepointFromUTF8(const char **textUtf8, int *byteCount) {
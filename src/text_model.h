@@ -0,0 +1,357 @@
+// text_model.h - 编辑器用的带样式文本模型 (piece table)
+#ifndef TEXT_MODEL_H
+#define TEXT_MODEL_H
+
+#include "text_engine.h"
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include <algorithm>
+
+/**
+ * @brief 编辑操作的通知：在 offset 处删除了 removedLength 字节并插入了 insertedLength 字节 (偏移均为修改前的 UTF-8 字节偏移)。
+ * 仅修改样式时 removedLength == insertedLength。可据此只重新布局受影响的段落 (见 StyledTextModel::GetParagraphRange)。
+ */
+struct TextChange {
+    size_t offset = 0;
+    size_t removedLength = 0;
+    size_t insertedLength = 0;
+    bool styleOnly = false;
+};
+
+/**
+ * @brief 带样式的文本模型：piece table，piece 按字节长度组织成隐式 treap。
+ * 按字节偏移查找 piece / 样式、插入、删除、改样式都是 O(log n)；插入不移动已有文本 (新文本只追加到 add buffer)，
+ * 在同一位置连续输入时直接延长上一个 piece。内联图片以 U+FFFC (3 字节) 存放，与 TextBlock 的拼接文本一致。
+ */
+class StyledTextModel {
+public:
+    using ChangeListener = std::function<void(const TextChange&)>;
+
+    StyledTextModel() = default;
+    explicit StyledTextModel(const std::vector<TextSpan>& spans) { for (const auto& span : spans) AppendSpan(span); }
+
+    size_t Length() const { return subtreeLength(root_); }
+    bool Empty() const { return root_ < 0; }
+
+    void AppendSpan(const TextSpan& span) {
+        if (span.style.isImage && span.text.empty()) InsertImage(Length(), span.style);
+        else Insert(Length(), span.text, span.style);
+    }
+
+    void Insert(size_t offset, std::string_view utf8, const CharacterStyle& style) {
+        if (utf8.empty()) return;
+        offset = std::min(offset, Length());
+        uint32_t styleIdx = internStyle(style);
+        // 连续输入：上一次插入的 piece 正好结束在 offset 且紧接 add buffer 末尾时直接延长
+        if (lastInsertEnd_ == offset && lastInsertStyle_ == styleIdx && lastInsertAddEnd_ == addBuffer_.length() && growPieceEndingAt(root_, offset, utf8.length())) {
+            addBuffer_.append(utf8);
+        } else {
+            int node = newNode((uint32_t)addBuffer_.length(), (uint32_t)utf8.length(), styleIdx);
+            addBuffer_.append(utf8);
+            int left = -1, right = -1;
+            split(root_, offset, left, right);
+            root_ = merge(merge(left, node), right);
+        }
+        lastInsertEnd_ = offset + utf8.length();
+        lastInsertStyle_ = styleIdx;
+        lastInsertAddEnd_ = addBuffer_.length();
+        notify({offset, 0, utf8.length(), false});
+    }
+
+    void InsertImage(size_t offset, const CharacterStyle& imageStyle) {
+        CharacterStyle style = imageStyle;
+        style.isImage = true;
+        offset = std::min(offset, Length());
+        int node = newNode((uint32_t)addBuffer_.length(), 3, internStyle(style));
+        addBuffer_.append("\xEF\xBF\xBC");
+        int left = -1, right = -1;
+        split(root_, offset, left, right);
+        root_ = merge(merge(left, node), right);
+        lastInsertEnd_ = SIZE_MAX;
+        notify({offset, 0, 3, false});
+    }
+
+    void Erase(size_t offset, size_t length) {
+        offset = std::min(offset, Length());
+        length = std::min(length, Length() - offset);
+        if (length == 0) return;
+        int left = -1, middle = -1, right = -1;
+        split(root_, offset, left, right);
+        split(right, length, middle, right);
+        freeSubtree(middle);
+        root_ = merge(left, right);
+        lastInsertEnd_ = SIZE_MAX;
+        notify({offset, length, 0, false});
+    }
+
+    /** @brief 把 [offset, offset + length) 的样式替换为 style (图片 piece 保持不变)。 */
+    void SetStyle(size_t offset, size_t length, const CharacterStyle& style) {
+        offset = std::min(offset, Length());
+        length = std::min(length, Length() - offset);
+        if (length == 0) return;
+        uint32_t styleIdx = internStyle(style);
+        int left = -1, middle = -1, right = -1;
+        split(root_, offset, left, right);
+        split(right, length, middle, right);
+        forEachNode(middle, [&](Node& node) { if (!styles_[node.style].isImage) node.style = styleIdx; });
+        root_ = merge(merge(left, middle), right);
+        lastInsertEnd_ = SIZE_MAX;
+        notify({offset, length, length, true});
+    }
+
+    /** @brief 对所有文本样式做同一修改 (例如全局开关描边)。O(不同样式数)，并通知整篇文本的样式变化。 */
+    void TransformTextStyles(const std::function<void(CharacterStyle&)>& transform) {
+        for (auto& style : styles_) if (!style.isImage) transform(style);
+        styleLookup_.clear();
+        for (uint32_t i = 0; i < styles_.size(); ++i) styleLookup_.emplace(HashCharacterStyleForLayout(styles_[i]), i);
+        lastInsertEnd_ = SIZE_MAX;
+        notify({0, Length(), Length(), true});
+    }
+
+    /** @brief 包含 offset 处字节的 piece 的样式；offset 在末尾时为最后一个 piece 的样式，模型为空时返回 nullptr。 */
+    const CharacterStyle* GetStyleAt(size_t offset) const {
+        if (root_ < 0) return nullptr;
+        int node = findNode(std::min(offset, Length() - 1), nullptr);
+        return node >= 0 ? &styles_[nodes_[node].style] : nullptr;
+    }
+
+    std::string GetText(size_t offset, size_t length) const {
+        std::string out;
+        forEachPiece(offset, offset + length, [&](const char* data, size_t len, uint32_t) { out.append(data, len); return true; });
+        return out;
+    }
+
+    /** @brief offset 之前一个 UTF-8 码点的起始偏移。 */
+    size_t PrevCodepointStart(size_t offset) const {
+        if (offset == 0) return 0;
+        size_t from = offset >= 4 ? offset - 4 : 0;
+        std::string tail = GetText(from, offset - from);
+        size_t i = tail.length();
+        while (i > 0) { --i; if (((unsigned char)tail[i] & 0xC0) != 0x80) break; }
+        return from + i;
+    }
+    /** @brief offset 之后一个 UTF-8 码点的结束偏移。 */
+    size_t NextCodepointEnd(size_t offset) const {
+        std::string head = GetText(offset, 4);
+        if (head.empty()) return offset;
+        int bytes = 0; const char* ptr = head.c_str();
+        GetNextCodepointFromUTF8(&ptr, &bytes);
+        return offset + std::max(bytes, 1);
+    }
+
+    /** @brief offset 所在段落 ('\n' 分隔) 的字节范围 [start, end)，end 包含结尾的 '\n'。 */
+    std::pair<size_t, size_t> GetParagraphRange(size_t offset) const {
+        offset = std::min(offset, Length());
+        size_t start = 0, end = Length();
+        forEachPieceReverse(0, offset, [&](const char* data, size_t len, size_t pieceStart) {
+            for (size_t i = len; i > 0; --i) if (data[i - 1] == '\n') { start = pieceStart + i; return false; }
+            return true;
+        });
+        size_t pos = offset;
+        forEachPiece(offset, Length(), [&](const char* data, size_t len, uint32_t) {
+            for (size_t i = 0; i < len; ++i) if (data[i] == '\n') { end = pos + i + 1; return false; }
+            pos += len;
+            return true;
+        });
+        return {start, end};
+    }
+
+    /** @brief [offset, offset + length) 的内容转成 TextSpan 列表 (相邻同样式 piece 合并)，可直接交给 LayoutStyledText。 */
+    std::vector<TextSpan> GetSpans(size_t offset, size_t length) const {
+        std::vector<TextSpan> spans;
+        uint32_t lastStyle = UINT32_MAX;
+        forEachPiece(offset, offset + length, [&](const char* data, size_t len, uint32_t styleIdx) {
+            const CharacterStyle& style = styles_[styleIdx];
+            if (style.isImage) {
+                TextSpan span; span.style = style;
+                spans.push_back(std::move(span));
+                lastStyle = UINT32_MAX;
+                return true;
+            }
+            if (styleIdx != lastStyle) {
+                TextSpan span; span.style = style;
+                spans.push_back(std::move(span));
+                lastStyle = styleIdx;
+            }
+            spans.back().text.append(data, len);
+            return true;
+        });
+        return spans;
+    }
+    std::vector<TextSpan> GetSpans() const { return GetSpans(0, Length()); }
+
+    size_t AddChangeListener(ChangeListener listener) {
+        listeners_.push_back({nextListenerId_, std::move(listener)});
+        return nextListenerId_++;
+    }
+    void RemoveChangeListener(size_t listenerId) {
+        listeners_.erase(std::remove_if(listeners_.begin(), listeners_.end(),
+                                        [listenerId](const auto& entry) { return entry.first == listenerId; }), listeners_.end());
+    }
+
+private:
+    struct Node {
+        uint32_t start = 0, length = 0; // 在 add buffer 中的字节范围
+        uint32_t style = 0;
+        uint32_t priority = 0;
+        int left = -1, right = -1;
+        size_t subtreeLength = 0;
+    };
+
+    size_t subtreeLength(int node) const { return node >= 0 ? nodes_[node].subtreeLength : 0; }
+    void update(int node) {
+        Node& n = nodes_[node];
+        n.subtreeLength = subtreeLength(n.left) + n.length + subtreeLength(n.right);
+    }
+    uint32_t nextPriority() { rng_ ^= rng_ << 13; rng_ ^= rng_ >> 17; rng_ ^= rng_ << 5; return rng_; }
+
+    int newNode(uint32_t start, uint32_t length, uint32_t style) {
+        int index;
+        if (!freeNodes_.empty()) { index = freeNodes_.back(); freeNodes_.pop_back(); }
+        else { index = (int)nodes_.size(); nodes_.emplace_back(); }
+        Node& n = nodes_[index];
+        n.start = start; n.length = length; n.style = style; n.priority = nextPriority();
+        n.left = n.right = -1;
+        n.subtreeLength = length;
+        return index;
+    }
+    void freeSubtree(int node) {
+        if (node < 0) return;
+        freeSubtree(nodes_[node].left);
+        freeSubtree(nodes_[node].right);
+        freeNodes_.push_back(node);
+    }
+
+    // 按字节偏移切分：left 含前 offset 个字节；偏移落在 piece 内部时把 piece 一分为二
+    void split(int node, size_t offset, int& left, int& right) {
+        if (node < 0) { left = right = -1; return; }
+        size_t leftLength = subtreeLength(nodes_[node].left);
+        if (offset <= leftLength) {
+            int childLeft = -1, childRight = -1;
+            split(nodes_[node].left, offset, childLeft, childRight);
+            nodes_[node].left = childRight; update(node);
+            left = childLeft; right = node;
+        } else if (offset >= leftLength + nodes_[node].length) {
+            int childLeft = -1, childRight = -1;
+            split(nodes_[node].right, offset - leftLength - nodes_[node].length, childLeft, childRight);
+            nodes_[node].right = childLeft; update(node);
+            left = node; right = childRight;
+        } else {
+            uint32_t cut = (uint32_t)(offset - leftLength);
+            int tail = newNode(nodes_[node].start + cut, nodes_[node].length - cut, nodes_[node].style);
+            int oldRight = nodes_[node].right;
+            nodes_[node].length = cut; nodes_[node].right = -1; update(node);
+            left = node; right = merge(tail, oldRight);
+        }
+    }
+    int merge(int a, int b) {
+        if (a < 0) return b;
+        if (b < 0) return a;
+        if (nodes_[a].priority > nodes_[b].priority) {
+            nodes_[a].right = merge(nodes_[a].right, b); update(a); return a;
+        }
+        nodes_[b].left = merge(a, nodes_[b].left); update(b); return b;
+    }
+
+    // 含 offset 处字节的节点；pieceStart 返回该 piece 的起始偏移
+    int findNode(size_t offset, size_t* pieceStart) const {
+        int node = root_; size_t base = 0;
+        while (node >= 0) {
+            size_t leftLength = subtreeLength(nodes_[node].left);
+            if (offset < leftLength) { node = nodes_[node].left; continue; }
+            if (offset < leftLength + nodes_[node].length) { if (pieceStart) *pieceStart = base + leftLength; return node; }
+            base += leftLength + nodes_[node].length;
+            offset -= leftLength + nodes_[node].length;
+            node = nodes_[node].right;
+        }
+        return -1;
+    }
+
+    // 把结束于 endOffset 的 piece 延长 extra 字节，并更新路径上的子树长度
+    bool growPieceEndingAt(int node, size_t endOffset, size_t extra) {
+        if (node < 0) return false;
+        size_t leftLength = subtreeLength(nodes_[node].left);
+        size_t nodeEnd = leftLength + nodes_[node].length;
+        bool grown = false;
+        if (endOffset == nodeEnd) {
+            if (nodes_[node].start + nodes_[node].length != addBuffer_.length()) return false; // 必须紧接 add buffer 末尾
+            nodes_[node].length += (uint32_t)extra; grown = true;
+        }
+        else if (endOffset <= leftLength) grown = growPieceEndingAt(nodes_[node].left, endOffset, extra);
+        else if (endOffset > nodeEnd) grown = growPieceEndingAt(nodes_[node].right, endOffset - nodeEnd, extra);
+        if (grown) nodes_[node].subtreeLength += extra;
+        return grown;
+    }
+
+    template <typename Fn>
+    void forEachNode(int node, Fn&& fn) {
+        if (node < 0) return;
+        forEachNode(nodes_[node].left, fn);
+        fn(nodes_[node]);
+        forEachNode(nodes_[node].right, fn);
+    }
+
+    // 依次访问与 [begin, end) 相交的 piece 片段 fn(data, len, style)，fn 返回 false 时停止。只进入相交的子树。
+    template <typename Fn>
+    bool forEachPieceIn(int node, size_t base, size_t begin, size_t end, Fn& fn) const {
+        if (node < 0 || begin >= end || base >= end || base + subtreeLength(node) <= begin) return true;
+        const Node& n = nodes_[node];
+        size_t nodeStart = base + subtreeLength(n.left);
+        if (!forEachPieceIn(n.left, base, begin, end, fn)) return false;
+        size_t from = std::max(begin, nodeStart), to = std::min(end, nodeStart + n.length);
+        if (from < to && !fn(addBuffer_.data() + n.start + (from - nodeStart), to - from, n.style)) return false;
+        return forEachPieceIn(n.right, nodeStart + n.length, begin, end, fn);
+    }
+    template <typename Fn>
+    void forEachPiece(size_t begin, size_t end, Fn&& fn) const { forEachPieceIn(root_, 0, begin, std::min(end, Length()), fn); }
+
+    // 逆序访问，fn(data, len, pieceStartOffset)
+    template <typename Fn>
+    bool forEachPieceReverseIn(int node, size_t base, size_t begin, size_t end, Fn& fn) const {
+        if (node < 0 || begin >= end || base >= end || base + subtreeLength(node) <= begin) return true;
+        const Node& n = nodes_[node];
+        size_t nodeStart = base + subtreeLength(n.left);
+        if (!forEachPieceReverseIn(n.right, nodeStart + n.length, begin, end, fn)) return false;
+        size_t from = std::max(begin, nodeStart), to = std::min(end, nodeStart + n.length);
+        if (from < to && !fn(addBuffer_.data() + n.start + (from - nodeStart), to - from, from)) return false;
+        return forEachPieceReverseIn(n.left, base, begin, end, fn);
+    }
+    template <typename Fn>
+    void forEachPieceReverse(size_t begin, size_t end, Fn&& fn) const { forEachPieceReverseIn(root_, 0, begin, std::min(end, Length()), fn); }
+
+    uint32_t internStyle(const CharacterStyle& style) {
+        size_t hash = HashCharacterStyleForLayout(style);
+        auto range = styleLookup_.equal_range(hash);
+        for (auto it = range.first; it != range.second; ++it) {
+            if (styles_[it->second].isImage == style.isImage && CharacterStylesEqualForLayout(styles_[it->second], style)) return it->second;
+        }
+        styles_.push_back(style);
+        styleLookup_.emplace(hash, (uint32_t)(styles_.size() - 1));
+        return (uint32_t)(styles_.size() - 1);
+    }
+
+    void notify(const TextChange& change) {
+        for (auto& entry : listeners_) entry.second(change);
+    }
+
+    std::string addBuffer_;               // 只追加：所有插入过的文本
+    std::vector<Node> nodes_;
+    std::vector<int> freeNodes_;
+    int root_ = -1;
+    uint32_t rng_ = 0x9E3779B9u;
+
+    std::vector<CharacterStyle> styles_;  // 去重后的样式，piece 只存下标
+    std::unordered_multimap<size_t, uint32_t> styleLookup_;
+
+    size_t lastInsertEnd_ = SIZE_MAX;     // 连续输入合并
+    uint32_t lastInsertStyle_ = UINT32_MAX;
+    size_t lastInsertAddEnd_ = 0;
+
+    std::vector<std::pair<size_t, ChangeListener>> listeners_;
+    size_t nextListenerId_ = 1;
+};
+
+#endif // TEXT_MODEL_H
@@ -0,0 +1,725 @@
+// text_engine_tests.cpp - 无窗口 (HeadlessAtlasStorage) 的回归测试：文本模型、文档高度树、行索引、流式布局、Rewrap、
+// 布局缓存与 CPU 光栅化。不依赖测试框架，任一检查失败时返回非零，由 CTest 运行。
+#include "text_engine.h"
+#include "text_model.h"
+#include "text_document.h"
+#include "raymath.h"
+#include <algorithm>
+#include <cstdio>
+#include <cmath>
+#include <random>
+#include <string>
+#include <vector>
+#include <memory>
+
+float dynamicSmoothnessAdd = 0.0f; // RaylibSDFTextEx.cpp 中声明为 extern (编辑器里由 PgUp/PgDn 调整)
+
+#ifndef TEST_RESOURCES_DIR
+#define TEST_RESOURCES_DIR "resources"
+#endif
+
+namespace {
+
+int g_failures = 0;
+
+#define CHECK(cond) do { if (!(cond)) { ++g_failures; printf("  FAILED %s:%d: %s\n", __FILE__, __LINE__, #cond); } } while (0)
+
+bool NearlyEqual(double a, double b, double tolerance = 1e-3) { return std::fabs(a - b) <= tolerance; }
+
+CharacterStyle MakeStyle(FontId fontId, float fontSize, Color color = {0, 0, 0, 255}) {
+    CharacterStyle style;
+    style.fontId = fontId;
+    style.fontSize = fontSize;
+    style.fill.solidColor = color;
+    return style;
+}
+
+ParagraphStyle MakeParagraphStyle(FontId fontId, float fontSize, float wrapWidth) {
+    ParagraphStyle style;
+    style.defaultCharacterStyle = MakeStyle(fontId, fontSize);
+    style.wrapWidth = wrapWidth;
+    return style;
+}
+
+uint32_t ElementSpanIndex(const PositionedElementVariant& element) {
+    return std::visit([](const auto& el) { return el.sourceSpanIndex; }, element);
+}
+uint32_t ElementByteOffsetInSpan(const PositionedElementVariant& element) {
+    return std::visit([](const auto& el) { return el.sourceCharByteOffsetInSpan; }, element);
+}
+float ElementX(const PositionedElementVariant& element) {
+    return std::visit([](const auto& el) { return el.position.x; }, element);
+}
+
+// 块中所有字形的 (字体, 字形 ID)，排序后比较：只在安全断点处换行时，换行宽度不应改变整形结果
+std::vector<std::pair<FontId, uint32_t>> SortedGlyphIds(const TextBlock& block) {
+    std::vector<std::pair<FontId, uint32_t>> ids;
+    for (const auto& element : block.elements) {
+        if (const PositionedGlyph* glyph = std::get_if<PositionedGlyph>(&element)) ids.push_back({glyph->sourceFont, glyph->glyphId});
+    }
+    std::sort(ids.begin(), ids.end());
+    return ids;
+}
+
+size_t CountCodepoints(const std::string& utf8, bool skipSpaces) {
+    size_t count = 0;
+    const char* ptr = utf8.c_str();
+    const char* end = ptr + utf8.length();
+    while (ptr < end) {
+        int bytes = 0;
+        uint32_t cp = GetNextCodepointFromUTF8(&ptr, &bytes);
+        if (bytes <= 0) break;
+        if (!(skipSpaces && cp == ' ')) ++count;
+    }
+    return count;
+}
+
+// 拼接文本、行索引、块宽度与每个元素的 span 下标 / 字节偏移必须互相一致 (布局、Rewrap、AppendSpans、DropFrontLines 之后都应成立)
+void CheckBlockBookkeeping(const TextBlock& block) {
+    const SourceSpanList& spans = block.GetSourceSpans();
+    std::string concatenated;
+    std::vector<uint32_t> spanStarts;
+    for (const auto& span : spans) {
+        spanStarts.push_back((uint32_t)concatenated.length());
+        concatenated += (span.style.isImage && span.text.empty()) ? std::string("\xEF\xBF\xBC") : span.text;
+    }
+    CHECK(concatenated == std::string(block.sourceTextConcatenated));
+    CHECK(block.lineStartBytes.size() == block.lines.size());
+    CHECK(block.lineTopYs.size() == block.lines.size());
+    if (block.lineStartBytes.size() != block.lines.size() || block.lineTopYs.size() != block.lines.size()) return;
+
+    size_t expectedElement = 0;
+    float widestLine = 0.0f;
+    for (size_t i = 0; i < block.lines.size(); ++i) {
+        const LineLayoutInfo& line = block.lines[i];
+        const uint32_t lineStart = GetLineByteStart(block, line);
+        const size_t firstElement = GetLineFirstElementIndex(block, line);
+        CHECK(block.lineStartBytes[i] == line.sourceTextByteStartIndexInBlockText);
+        CHECK(block.lineTopYs[i] == line.lineBoxY);
+        CHECK(firstElement == expectedElement);
+        if (i == 0) CHECK(lineStart == 0 && NearlyEqual(GetLineTopY(block, line), block.overallBounds.y));
+        if (i > 0) {
+            CHECK(lineStart >= GetLineByteStart(block, block.lines[i - 1]));
+            CHECK(GetLineTopY(block, line) >= GetLineTopY(block, block.lines[i - 1]));
+        }
+        const uint32_t lineEnd = (i + 1 < block.lines.size()) ? GetLineByteStart(block, block.lines[i + 1])
+                                                              : (uint32_t)block.sourceTextConcatenated.length();
+        for (size_t e = 0; e < line.numElementsInLine && firstElement + e < block.elements.size(); ++e) {
+            const PositionedElementVariant& element = block.elements[firstElement + e];
+            const uint32_t byteStart = GetElementSourceByteStart(block, element);
+            CHECK(byteStart >= lineStart && byteStart < lineEnd);
+            const uint32_t spanIdx = ElementSpanIndex(element) - block.sourceSpanIndexBase;
+            CHECK(spanIdx < spans.size());
+            if (spanIdx < spans.size()) CHECK(spanStarts[spanIdx] + ElementByteOffsetInSpan(element) == byteStart);
+        }
+        expectedElement += line.numElementsInLine;
+        widestLine = std::max(widestLine, line.lineExtentX);
+    }
+    CHECK(expectedElement == block.elements.size());
+    CHECK(NearlyEqual(block.overallBounds.width, widestLine, 0.01));
+}
+
+void CheckSameLineBreaks(const TextBlock& a, const TextBlock& b) {
+    CHECK(a.lines.size() == b.lines.size());
+    if (a.lines.size() != b.lines.size()) return;
+    for (size_t i = 0; i < a.lines.size(); ++i) {
+        CHECK(GetLineByteStart(a, a.lines[i]) == GetLineByteStart(b, b.lines[i]));
+        CHECK(a.lines[i].numElementsInLine == b.lines[i].numElementsInLine);
+        CHECK(NearlyEqual(GetLineTopY(a, a.lines[i]), GetLineTopY(b, b.lines[i]), 0.01));
+    }
+    CHECK(NearlyEqual(a.overallBounds.height, b.overallBounds.height, 0.01));
+}
+
+// --- StyledTextModel (piece table / treap) ---
+void TestStyledTextModel() {
+    printf("StyledTextModel\n");
+    const float styleSizes[3] = {10.0f, 11.0f, 12.0f};
+    CharacterStyle styles[3];
+    for (int i = 0; i < 3; ++i) styles[i] = MakeStyle(INVALID_FONT_ID, styleSizes[i]);
+
+    StyledTextModel model;
+    std::string reference;
+    std::vector<int> referenceStyles; // 每个字节的样式下标
+    TextChange lastChange;
+    size_t changeCount = 0;
+    size_t listenerId = model.AddChangeListener([&](const TextChange& change) { lastChange = change; ++changeCount; });
+
+    std::mt19937 rng(12345);
+    auto randomIn = [&](size_t lo, size_t hi) { return std::uniform_int_distribution<size_t>(lo, hi)(rng); };
+    for (int op = 0; op < 3000; ++op) {
+        const size_t kind = randomIn(0, 9);
+        if (kind <= 3 || reference.empty()) { // 插入
+            size_t offset = randomIn(0, reference.length());
+            int style = (int)randomIn(0, 2);
+            std::string text(randomIn(1, 8), 'a' + (char)randomIn(0, 25));
+            model.Insert(offset, text, styles[style]);
+            reference.insert(offset, text);
+            referenceStyles.insert(referenceStyles.begin() + offset, text.length(), style);
+            CHECK(lastChange.offset == offset && lastChange.removedLength == 0 && lastChange.insertedLength == text.length());
+        } else if (kind <= 5) { // 连续输入：延长上一个 piece 的路径
+            size_t offset = randomIn(0, reference.length());
+            int style = (int)randomIn(0, 2);
+            for (int k = 0; k < 6; ++k, ++offset) {
+                model.Insert(offset, "x", styles[style]);
+                reference.insert(offset, "x");
+                referenceStyles.insert(referenceStyles.begin() + offset, style);
+            }
+        } else if (kind <= 7 || reference.length() > 2000) { // 删除
+            size_t offset = randomIn(0, reference.length() - 1);
+            size_t length = std::min(randomIn(1, 40), reference.length() - offset);
+            model.Erase(offset, length);
+            reference.erase(offset, length);
+            referenceStyles.erase(referenceStyles.begin() + offset, referenceStyles.begin() + offset + length);
+            CHECK(lastChange.offset == offset && lastChange.removedLength == length && lastChange.insertedLength == 0);
+        } else { // 改样式
+            size_t offset = randomIn(0, reference.length() - 1);
+            size_t length = std::min(randomIn(1, 40), reference.length() - offset);
+            int style = (int)randomIn(0, 2);
+            model.SetStyle(offset, length, styles[style]);
+            std::fill(referenceStyles.begin() + offset, referenceStyles.begin() + offset + length, style);
+            CHECK(lastChange.styleOnly && lastChange.removedLength == length && lastChange.insertedLength == length);
+        }
+
+        CHECK(model.Length() == reference.length());
+        if (op % 50 == 0 || op == 2999) {
+            CHECK(model.GetText(0, model.Length()) == reference);
+            for (size_t k = 0; k < reference.length(); k += 7) {
+                const CharacterStyle* style = model.GetStyleAt(k);
+                CHECK(style && style->fontSize == styleSizes[referenceStyles[k]]);
+            }
+            // GetSpans：按样式合并后的内容与参考一致，相邻 span 样式不同
+            std::vector<TextSpan> spans = model.GetSpans();
+            std::string joined;
+            for (size_t s = 0; s < spans.size(); ++s) {
+                for (size_t b = 0; b < spans[s].text.length(); ++b) CHECK(spans[s].style.fontSize == styleSizes[referenceStyles[joined.length() + b]]);
+                joined += spans[s].text;
+                if (s > 0) CHECK(spans[s].style.fontSize != spans[s - 1].style.fontSize);
+            }
+            CHECK(joined == reference);
+        }
+    }
+    CHECK(changeCount > 0);
+    model.RemoveChangeListener(listenerId);
+    size_t countBefore = changeCount;
+    model.Insert(0, "z", styles[0]);
+    CHECK(changeCount == countBefore);
+
+    // 段落范围与 UTF-8 码点边界
+    StyledTextModel utf8Model;
+    utf8Model.Insert(0, "ab\n\xE4\xB8\xAD\xE6\x96\x87\ncd", styles[0]); // "ab\n中文\ncd"
+    CHECK(utf8Model.GetParagraphRange(4) == std::make_pair((size_t)3, (size_t)10));
+    CHECK(utf8Model.GetParagraphRange(11) == std::make_pair((size_t)10, (size_t)12));
+    CHECK(utf8Model.PrevCodepointStart(6) == 3);
+    CHECK(utf8Model.NextCodepointEnd(3) == 6);
+    CHECK(utf8Model.NextCodepointEnd(12) == 12);
+}
+
+// --- TextDocument 的 Fenwick 高度树 ---
+void CheckDocumentHeights(const TextDocument& document) {
+    double sum = 0.0;
+    for (size_t i = 0; i < document.GetParagraphCount(); ++i) {
+        CHECK(NearlyEqual(document.GetParagraphTop(i), sum));
+        const float height = document.GetParagraphHeight(i);
+        CHECK(height > 0.0f);
+        CHECK(document.FindParagraphAt(sum + height * 0.5) == i);
+        sum += height;
+    }
+    CHECK(NearlyEqual(document.GetContentHeight(), sum));
+}
+
+void TestTextDocument(ITextEngine& engine, FontId font) {
+    printf("TextDocument\n");
+    TextDocument document(engine, MakeParagraphStyle(font, 20.0f, 300.0f));
+    std::string text;
+    for (int i = 0; i < 300; ++i) {
+        if (i % 11 == 5) { text += "\n"; continue; } // 空段落
+        for (int w = 0; w <= i % 9; ++w) text += "lorem ipsum dolor ";
+        text += "\n";
+    }
+    text += "last";
+    document.SetText(text);
+    CHECK(document.GetParagraphCount() == 301);
+    CheckDocumentHeights(document);
+
+    document.SetViewportHeight(240.0f);
+    document.SetOverscan(60.0f);
+    document.Update();
+    CHECK(document.IsParagraphHeightExact(0));
+    CHECK(!document.IsParagraphHeightExact(document.GetParagraphCount() - 1));
+    CHECK(document.GetResidentParagraphCount() > 0);
+    CheckDocumentHeights(document);
+
+    document.SetScrollY(document.GetContentHeight() * 0.5);
+    document.Update();
+    const size_t middle = document.FindParagraphAt(document.GetScrollY());
+    CHECK(document.IsParagraphHeightExact(middle));
+    CHECK(document.GetParagraphBlock(middle) != nullptr);
+    CHECK(document.GetParagraphBlock(0) == nullptr); // 远离视口的段落已释放
+    CheckDocumentHeights(document);
+
+    document.SetWrapWidth(150.0f); // 常驻段落走 Rewrap，其余回到估算高度
+    document.Update();
+    CheckDocumentHeights(document);
+
+    // 初始估算 (每字节半个字号) 远小于宽字形的实际宽度：布局视口附近的段落后，远处相同内容的段落按修正后的参数重新估算，
+    // 视口顶部的段落与偏移保持不变
+    TextDocument wide(engine, MakeParagraphStyle(font, 20.0f, 300.0f));
+    std::string wideText;
+    for (int i = 0; i < 200; ++i) wideText += "WWWW WWWWW WWW WWWWWW WWWW WWWWW WWW WWWWWW WWWW WWWWW\n";
+    wide.SetText(wideText);
+    wide.SetViewportHeight(240.0f);
+    wide.SetOverscan(60.0f);
+    wide.SetScrollY(wide.GetParagraphTop(100));
+    wide.Update();
+    CHECK(wide.FindParagraphAt(wide.GetScrollY()) == 100);
+    CHECK(NearlyEqual(wide.GetScrollY(), wide.GetParagraphTop(100)));
+    CHECK(wide.IsParagraphHeightExact(100) && !wide.IsParagraphHeightExact(190));
+    const float exactHeight = wide.GetParagraphHeight(100);
+    const float lineHeight = exactHeight / (float)wide.GetParagraphBlock(100)->lines.size();
+    CHECK(std::fabs(wide.GetParagraphHeight(190) - exactHeight) <= lineHeight + 0.01f);
+    CheckDocumentHeights(wide);
+
+    // 文档字节偏移 <-> (段落, 段内偏移)
+    for (size_t offset : {(size_t)0, (size_t)17, text.length() / 2, text.length()}) {
+        TextDocument::Position position = document.GetPositionFromDocumentByteOffset(offset);
+        CHECK(document.GetDocumentByteOffset(position) == offset);
+    }
+}
+
+// --- 行索引的二分查找 ---
+void CheckLineLookups(const TextBlock& block) {
+    const uint32_t textLength = (uint32_t)block.sourceTextConcatenated.length();
+    for (size_t i = 0; i < block.lines.size(); ++i) {
+        const LineLayoutInfo& line = block.lines[i];
+        const uint32_t lineStart = GetLineByteStart(block, line);
+        const float lineTop = GetLineTopY(block, line);
+        const uint32_t nextStart = (i + 1 < block.lines.size()) ? GetLineByteStart(block, block.lines[i + 1]) : textLength + 1;
+        if (nextStart > lineStart) {
+            CHECK(FindLineIndexForByteOffset(block, lineStart) == i);
+            CHECK(FindLineIndexForByteOffset(block, nextStart - 1) == i);
+        }
+        CHECK(FindLineIndexForY(block, lineTop + line.lineBoxHeight * 0.5f) == i);
+        size_t firstLine = 0, endLine = 0;
+        FindLineRangeForYSpan(block, lineTop + 1.0f, lineTop + 2.0f, firstLine, endLine);
+        CHECK(firstLine <= i && i < endLine && endLine <= block.lines.size());
+    }
+    CHECK(FindLineIndexForY(block, -100.0f) == 0);
+    CHECK(FindLineIndexForY(block, block.overallBounds.height + 100.0f) == block.lines.size() - 1);
+    CHECK(FindLineIndexForByteOffset(block, textLength) == block.lines.size() - 1);
+}
+
+void TestLineIndex(ITextEngine& engine, FontId font) {
+    printf("Line index\n");
+    std::vector<TextSpan> spans(1);
+    spans[0].style = MakeStyle(font, 18.0f);
+    for (int i = 0; i < 40; ++i) spans[0].text += "binary search over line starts ";
+    TextBlock block = engine.LayoutStyledText(spans, MakeParagraphStyle(font, 18.0f, 220.0f));
+    CHECK(block.lines.size() > 10);
+    CheckBlockBookkeeping(block);
+    CheckLineLookups(block);
+
+    TextBlock withoutIndex = block; // 行索引与 lines 不一致时退回在 lines 上二分
+    withoutIndex.lineStartBytes.clear();
+    withoutIndex.lineTopYs.clear();
+    CheckLineLookups(withoutIndex);
+
+    TextBlock empty;
+    CHECK(FindLineIndexForByteOffset(empty, 5) == 0);
+    CHECK(FindLineIndexForY(empty, 5.0f) == 0);
+}
+
+// --- Rewrap ---
+void TestRewrap(ITextEngine& engine, FontId font) {
+    printf("Rewrap\n");
+    std::vector<TextSpan> spans(2);
+    spans[0].style = MakeStyle(font, 20.0f);
+    spans[0].text = "the quick brown fox jumps over the lazy dog and keeps running ";
+    spans[1].style = MakeStyle(font, 26.0f, {200, 30, 30, 255});
+    spans[1].text = "across the wide green field until the sun goes down";
+    const ParagraphStyle wide = MakeParagraphStyle(font, 20.0f, 420.0f);
+    TextBlock block = engine.LayoutStyledText(spans, wide);
+    CHECK(block.shapingCache != nullptr);
+    CheckBlockBookkeeping(block);
+
+    CHECK(engine.Rewrap(block, 160.0f, HorizontalAlignment::LEFT)); // 纯小写拉丁文：所有断点都可安全断开，复用整形结果
+    CHECK(block.paragraphStyleUsed.wrapWidth == 160.0f);
+    ParagraphStyle narrow = wide;
+    narrow.wrapWidth = 160.0f;
+    TextBlock fresh = engine.LayoutStyledText(spans, narrow);
+    CHECK(block.lines.size() > 2);
+    CheckSameLineBreaks(block, fresh);
+    CheckBlockBookkeeping(block);
+    CheckLineLookups(block);
+
+    engine.Rewrap(block, 420.0f, HorizontalAlignment::LEFT);
+    CheckSameLineBreaks(block, engine.LayoutStyledText(spans, wide));
+    CheckBlockBookkeeping(block);
+
+    TextBlock measured; // 没有 sourceSpans 的块无法重新布局
+    CHECK(!engine.Rewrap(measured, 100.0f, HorizontalAlignment::LEFT));
+}
+
+// --- 先整形后断行 (ICU_LINE_BOUNDARIES_SHAPE_FIRST)：连字与双向文本 ---
+void TestShapeThenBreak(ITextEngine& engine, FontId latinFont, FontId arabicFont) {
+    printf("Shape-then-break\n");
+    std::vector<TextSpan> spans(3);
+    spans[0].style = MakeStyle(latinFont, 22.0f);
+    spans[0].text = "mixed direction text ";
+    spans[1].style = MakeStyle(arabicFont, 22.0f);
+    spans[1].text = "السلام عليكم لا إله إلا الله ورحمة";
+    spans[2].style = MakeStyle(latinFont, 22.0f);
+    spans[2].text = " and more latin words after it";
+    ParagraphStyle paragraphStyle = MakeParagraphStyle(latinFont, 22.0f, 0.0f);
+    paragraphStyle.lineBreakStrategy = LineBreakStrategy::ICU_LINE_BOUNDARIES_SHAPE_FIRST;
+
+    const TextBlock unwrapped = engine.LayoutStyledText(spans, paragraphStyle);
+    CHECK(unwrapped.lines.size() == 1);
+    CheckBlockBookkeeping(unwrapped);
+    size_t arabicGlyphs = 0;
+    for (const auto& element : unwrapped.elements) {
+        if (ElementSpanIndex(element) == 1 && std::holds_alternative<PositionedGlyph>(element)) ++arabicGlyphs;
+    }
+    CHECK(arabicGlyphs > 0 && arabicGlyphs < CountCodepoints(spans[1].text, false)); // 含 lam-alef 等必选连字
+    const auto unwrappedGlyphs = SortedGlyphIds(unwrapped);
+
+    for (float wrapWidth : {260.0f, 150.0f, 90.0f}) {
+        paragraphStyle.wrapWidth = wrapWidth;
+        TextBlock block = engine.LayoutStyledText(spans, paragraphStyle);
+        CHECK(block.lines.size() > 1);
+        CheckBlockBookkeeping(block);
+        CheckLineLookups(block);
+        CHECK(SortedGlyphIds(block) == unwrappedGlyphs); // 断行只落在词间，连字与阿拉伯文连写形式不变
+
+        // 每行内：阿拉伯文按逻辑顺序从右向左排，拉丁文从左向右 (空格不参与比较：行尾空白按规则 L1 取段落方向)
+        auto isSpace = [&block](const PositionedElementVariant& element) { return block.sourceTextConcatenated[GetElementSourceByteStart(block, element)] == ' '; };
+        for (const auto& line : block.lines) {
+            for (size_t a = 0; a < line.numElementsInLine; ++a) {
+                for (size_t b = 0; b < line.numElementsInLine; ++b) {
+                    const auto& ea = block.elements[line.firstElementIndexInBlockElements + a];
+                    const auto& eb = block.elements[line.firstElementIndexInBlockElements + b];
+                    if (isSpace(ea) || isSpace(eb)) continue;
+                    if (ElementSpanIndex(ea) != ElementSpanIndex(eb) || GetElementSourceByteStart(block, ea) >= GetElementSourceByteStart(block, eb)) continue;
+                    if (ElementSpanIndex(ea) == 1) CHECK(ElementX(ea) > ElementX(eb) - 0.5f);
+                    else CHECK(ElementX(ea) < ElementX(eb) + 0.5f);
+                }
+            }
+        }
+
+        // Rewrap 复用整形结果时与直接布局得到相同的行
+        TextBlock rewrapped = unwrapped;
+        engine.Rewrap(rewrapped, wrapWidth, HorizontalAlignment::LEFT);
+        CheckSameLineBreaks(rewrapped, block);
+        CHECK(SortedGlyphIds(rewrapped) == unwrappedGlyphs);
+        CheckBlockBookkeeping(rewrapped);
+    }
+}
+
+// --- 简单 LTR 快速路径与 ICU 路径一致 ---
+void TestSimpleLtrFastPath(ITextEngine& engine, FontId latinFont, FontId cjkFont) {
+    printf("Simple LTR fast path\n");
+    const std::string lrm = "\xE2\x80\x8E"; // U+200E：零宽、无断行机会，但使文本不再是“简单 LTR”，强制走 ICU BiDi + UBRK_LINE
+    struct Case { FontId font; std::string text; };
+    const Case cases[] = {
+        {latinFont, "plain ascii label text that wraps over several lines when narrow"},
+        {cjkFont, "中文文本在任意汉字之间都可以换行，标点不在行首 mixed with latin words"},
+    };
+    for (const Case& testCase : cases) {
+        for (float wrapWidth : {0.0f, 180.0f, 96.0f}) {
+            ParagraphStyle paragraphStyle = MakeParagraphStyle(testCase.font, 20.0f, wrapWidth);
+            paragraphStyle.lineBreakStrategy = LineBreakStrategy::ICU_LINE_BOUNDARIES_SHAPE_FIRST;
+            std::vector<TextSpan> spans(1);
+            spans[0].style = MakeStyle(testCase.font, 20.0f);
+            spans[0].text = testCase.text;
+            const TextBlock fast = engine.LayoutStyledText(spans, paragraphStyle);
+            spans[0].text += lrm;
+            const TextBlock icu = engine.LayoutStyledText(spans, paragraphStyle);
+            CheckBlockBookkeeping(fast);
+            CheckBlockBookkeeping(icu);
+            if (wrapWidth > 0.0f) CHECK(fast.lines.size() > 1);
+
+            CHECK(fast.lines.size() == icu.lines.size());
+            if (fast.lines.size() != icu.lines.size()) continue;
+            for (size_t i = 0; i < fast.lines.size(); ++i) {
+                CHECK(fast.lines[i].sourceTextByteStartIndexInBlockText == icu.lines[i].sourceTextByteStartIndexInBlockText);
+                CHECK(NearlyEqual(fast.lines[i].lineWidth, icu.lines[i].lineWidth, 0.01));
+                CHECK(NearlyEqual(fast.lines[i].lineBoxY, icu.lines[i].lineBoxY, 0.01));
+            }
+            // LRM 之前的字形逐个相同 (LRM 本身可能被整形为不可见字形)
+            std::vector<std::pair<uint32_t, float>> fastGlyphs, icuGlyphs;
+            for (const auto& element : fast.elements) {
+                if (const PositionedGlyph* glyph = std::get_if<PositionedGlyph>(&element)) fastGlyphs.push_back({glyph->glyphId, glyph->position.x});
+            }
+            for (const auto& element : icu.elements) {
+                const PositionedGlyph* glyph = std::get_if<PositionedGlyph>(&element);
+                if (glyph && GetElementSourceByteStart(icu, element) < testCase.text.length()) icuGlyphs.push_back({glyph->glyphId, glyph->position.x});
+            }
+            CHECK(fastGlyphs.size() == icuGlyphs.size());
+            for (size_t i = 0; i < std::min(fastGlyphs.size(), icuGlyphs.size()); ++i) {
+                CHECK(fastGlyphs[i].first == icuGlyphs[i].first && NearlyEqual(fastGlyphs[i].second, icuGlyphs[i].second, 0.01));
+            }
+        }
+    }
+}
+
+// --- MeasureStyledText 与 LayoutStyledText 一致 ---
+void TestMeasure(ITextEngine& engine, FontId latinFont, FontId arabicFont) {
+    printf("MeasureStyledText\n");
+    struct Case { FontId font; std::string text; float indent; };
+    const Case cases[] = {
+        {latinFont, "alpha beta gamma delta\nepsilon zeta eta", 0.0f},
+        {latinFont, "indented first line with several short words", 12.0f},
+        {arabicFont, "\xD9\x85\xD8\xB1\xD8\xAD\xD8\xA8\xD8\xA7 \xD8\xA8\xD8\xA7\xD9\x84\xD8\xB9\xD8\xA7\xD9\x84\xD9\x85 hello world", 0.0f},
+    };
+    for (const Case& testCase : cases) {
+        std::vector<TextSpan> spans(1);
+        spans[0].style = MakeStyle(testCase.font, 20.0f);
+        spans[0].text = testCase.text;
+        for (LineBreakStrategy strategy : {LineBreakStrategy::SIMPLE_BY_WIDTH, LineBreakStrategy::ICU_LINE_BOUNDARIES_SHAPE_FIRST}) {
+            for (float wrapWidth : {0.0f, 150.0f, 60.0f}) {
+                ParagraphStyle paragraphStyle = MakeParagraphStyle(testCase.font, 20.0f, wrapWidth);
+                paragraphStyle.lineBreakStrategy = strategy;
+                paragraphStyle.firstLineIndent = testCase.indent;
+                const TextMeasurement measurement = engine.MeasureStyledText(spans, paragraphStyle);
+                const TextBlock block = engine.LayoutStyledText(spans, paragraphStyle);
+                CHECK(measurement.lineCount == block.lines.size());
+                CHECK(NearlyEqual(measurement.size.x, block.overallBounds.width, 0.01));
+                CHECK(NearlyEqual(measurement.size.y, block.overallBounds.height, 0.01));
+                CHECK(measurement.minContentWidth <= measurement.maxContentWidth + 0.01f);
+                CHECK(measurement.minContentWidth > 0.0f);
+            }
+        }
+
+        // 固有宽度：min-content = 最宽的单词，max-content = 最宽的硬换行行 (各自单独布局，不含行尾空白；缩进只算在第一个上)
+        ParagraphStyle paragraphStyle = MakeParagraphStyle(testCase.font, 20.0f, 0.0f);
+        paragraphStyle.lineBreakStrategy = LineBreakStrategy::ICU_LINE_BOUNDARIES_SHAPE_FIRST;
+        paragraphStyle.firstLineIndent = testCase.indent;
+        const TextMeasurement measurement = engine.MeasureStyledText(spans, paragraphStyle);
+        auto widestPiece = [&](const char* separators) {
+            float widest = 0.0f;
+            size_t pieceStart = 0;
+            while (pieceStart <= testCase.text.length()) {
+                size_t pieceEnd = testCase.text.find_first_of(separators, pieceStart);
+                if (pieceEnd == std::string::npos) pieceEnd = testCase.text.length();
+                ParagraphStyle pieceStyle = paragraphStyle;
+                pieceStyle.firstLineIndent = (pieceStart == 0) ? testCase.indent : 0.0f;
+                std::vector<TextSpan> pieceSpans(1);
+                pieceSpans[0].style = spans[0].style;
+                pieceSpans[0].text = testCase.text.substr(pieceStart, pieceEnd - pieceStart);
+                widest = std::max(widest, engine.LayoutStyledText(pieceSpans, pieceStyle).overallBounds.width);
+                pieceStart = pieceEnd + 1;
+            }
+            return widest;
+        };
+        CHECK(NearlyEqual(measurement.minContentWidth, widestPiece(" \n"), 0.01));
+        CHECK(NearlyEqual(measurement.maxContentWidth, widestPiece("\n"), 0.01));
+        CHECK(measurement.minContentWidth < measurement.maxContentWidth);
+        // 固有宽度与 wrapWidth 无关
+        paragraphStyle.wrapWidth = 60.0f;
+        const TextMeasurement wrapped = engine.MeasureStyledText(spans, paragraphStyle);
+        CHECK(NearlyEqual(wrapped.minContentWidth, measurement.minContentWidth, 0.01));
+        CHECK(NearlyEqual(wrapped.maxContentWidth, measurement.maxContentWidth, 0.01));
+    }
+}
+
+// --- AppendSpans / DropFrontLines ---
+void TestStreaming(ITextEngine& engine, FontId font) {
+    printf("AppendSpans / DropFrontLines\n");
+    const CharacterStyle styleA = MakeStyle(font, 18.0f);
+    const CharacterStyle styleB = MakeStyle(font, 18.0f, {20, 90, 200, 255});
+    std::vector<TextSpan> first(2), second(2);
+    first[0].style = styleA; first[0].text = "alpha beta gamma delta epsilon zeta eta theta\n";
+    first[1].style = styleB; first[1].text = "iota kappa lambda mu nu xi omicron";
+    second[0].style = styleA; second[0].text = " pi rho sigma tau";
+    second[1].style = styleB; second[1].text = "\nupsilon phi chi psi omega and more words to wrap";
+    const ParagraphStyle paragraphStyle = MakeParagraphStyle(font, 18.0f, 160.0f);
+
+    auto firstSnapshot = std::make_shared<const std::vector<TextSpan>>(first);
+    TextBlock block = engine.LayoutStyledText(firstSnapshot, paragraphStyle);
+    CheckBlockBookkeeping(block);
+    const size_t linesBefore = block.lines.size();
+    engine.AppendSpans(block, second);
+    CheckBlockBookkeeping(block);
+    CHECK(block.lines.size() > linesBefore);
+    CHECK(block.shapingCache == nullptr);
+    CHECK(firstSnapshot.use_count() == 2); // 已有 spans 的快照被共享而不是复制
+
+    std::vector<TextSpan> all = first;
+    all.insert(all.end(), second.begin(), second.end());
+    const TextBlock fresh = engine.LayoutStyledText(all, paragraphStyle);
+    CHECK(std::string(block.sourceTextConcatenated) == std::string(fresh.sourceTextConcatenated));
+    CheckSameLineBreaks(block, fresh);
+    CheckLineLookups(block);
+
+    // 逐行丢弃：先在第一个 span 内部截断 (只调整该 span 的字节偏移)，之后整个 span 被移除 (sourceSpanIndexBase 增加)
+    const std::string fullText(block.sourceTextConcatenated);
+    CHECK(GetLineByteStart(block, block.lines[1]) < first[0].text.length()); // 第一个 span 换行成多行
+    size_t dropped = 0;
+    while (block.lines.size() > 2) {
+        const uint32_t droppedBytes = GetLineByteStart(block, block.lines[1]);
+        const uint32_t byteBase = block.sourceByteOffsetBase;
+        const float secondLineY = GetLineTopY(block, block.lines[1]) - GetLineTopY(block, block.lines[0]);
+        const float heightBefore = block.overallBounds.height;
+        ITextEngine::DropFrontLines(block, 1);
+        ++dropped;
+        CHECK(block.droppedLineCount == dropped);
+        CHECK(block.sourceByteOffsetBase == byteBase + droppedBytes);
+        CHECK(std::string(block.sourceTextConcatenated) == fullText.substr(block.sourceByteOffsetBase));
+        CHECK(GetLineByteStart(block, block.lines.front()) == 0);
+        CHECK(NearlyEqual(block.overallBounds.height, heightBefore - secondLineY, 0.01));
+        CHECK(block.lineBoxYBase <= block.overallBounds.height); // 行 y 的基准不会随流无限增长
+        CheckBlockBookkeeping(block);
+        CheckLineLookups(block);
+    }
+    CHECK(block.sourceSpanIndexBase >= 2); // 前两个 span 已完全丢弃
+
+    // 丢弃之后继续追加，元素下标仍按 sourceSpanIndexBase 对应
+    std::vector<TextSpan> third(1);
+    third[0].style = styleA; third[0].text = " appended after dropping\nfinal line";
+    engine.AppendSpans(block, third);
+    CHECK(block.droppedLineCount == dropped);
+    CheckBlockBookkeeping(block);
+    CheckLineLookups(block);
+
+    ITextEngine::DropFrontLines(block, block.lines.size());
+    CHECK(block.lines.empty() && block.elements.empty() && block.sourceTextConcatenated.empty());
+    CHECK(block.GetSourceSpans().empty());
+    CHECK(block.overallBounds.width == 0.0f);
+
+    // 丢弃最宽的行后宽度按剩余行重新计算
+    std::vector<TextSpan> wide(1);
+    wide[0].style = styleA; wide[0].text = "a much wider first line than the rest\nshort\nmid sized line";
+    TextBlock unwrapped = engine.LayoutStyledText(wide, MakeParagraphStyle(font, 18.0f, 0.0f));
+    CHECK(unwrapped.lines.size() == 3);
+    const float wideWidth = unwrapped.overallBounds.width;
+    ITextEngine::DropFrontLines(unwrapped, 1);
+    CHECK(unwrapped.overallBounds.width < wideWidth);
+    CHECK(NearlyEqual(unwrapped.overallBounds.width, unwrapped.lines[1].lineExtentX, 0.01));
+    CheckBlockBookkeeping(unwrapped);
+    wide[0].text = "\na much wider first line than the rest";
+    engine.AppendSpans(unwrapped, wide); // 追加的行重新参与宽度计算
+    CHECK(NearlyEqual(unwrapped.overallBounds.width, wideWidth, 0.01));
+    CheckBlockBookkeeping(unwrapped);
+}
+
+// --- 布局缓存 (含哈希碰撞与淘汰) ---
+void TestLayoutCache(ITextEngine& engine, FontId font) {
+    printf("Layout cache\n");
+    engine.ClearLayoutCache();
+    engine.SetLayoutCacheCapacity(8);
+    const ParagraphStyle paragraphStyle = MakeParagraphStyle(font, 20.0f, 0.0f);
+    std::vector<TextSpan> spans(1);
+    spans[0].style = MakeStyle(font, 20.0f);
+    spans[0].text = "cached layout";
+
+    const LayoutCacheStats start = engine.GetLayoutCacheStats();
+    std::shared_ptr<const TextBlock> a = engine.LayoutStyledTextCached(spans, paragraphStyle);
+    std::vector<TextSpan> sameSpans = spans; // 内容相同的另一份拷贝也应命中
+    std::shared_ptr<const TextBlock> b = engine.LayoutStyledTextCached(sameSpans, paragraphStyle);
+    CHECK(a && a == b);
+    LayoutCacheStats stats = engine.GetLayoutCacheStats();
+    CHECK(stats.misses == start.misses + 1 && stats.hits == start.hits + 1 && stats.entries == 1);
+
+    // 描边不参与 HashLayoutInput，两组输入哈希相同但 IsSameLayoutInput 不同：必须重新布局并接管该槽位
+    std::vector<TextSpan> outlined = spans;
+    outlined[0].style.outline.enabled = true;
+    CHECK(HashLayoutInput(outlined, paragraphStyle) == HashLayoutInput(spans, paragraphStyle));
+    CHECK(!IsSameLayoutInput(outlined, paragraphStyle, spans, paragraphStyle));
+    std::shared_ptr<const TextBlock> c = engine.LayoutStyledTextCached(outlined, paragraphStyle);
+    CHECK(c && c != a);
+    CHECK(c->GetSourceSpans().size() == 1 && c->GetSourceSpans()[0].style.outline.enabled);
+    stats = engine.GetLayoutCacheStats();
+    CHECK(stats.misses == start.misses + 2 && stats.hits == start.hits + 1 && stats.entries == 1);
+    std::shared_ptr<const TextBlock> d = engine.LayoutStyledTextCached(spans, paragraphStyle); // 原输入已被挤出
+    CHECK(d && d != a && d != c && !d->GetSourceSpans()[0].style.outline.enabled);
+    CHECK(std::string(d->sourceTextConcatenated) == std::string(a->sourceTextConcatenated));
+    stats = engine.GetLayoutCacheStats();
+    CHECK(stats.misses == start.misses + 3 && stats.entries == 1);
+
+    // 容量不足时按 LRU 淘汰；已返回的块不受影响
+    engine.SetLayoutCacheCapacity(2);
+    engine.ClearLayoutCache();
+    const size_t evictionsBefore = engine.GetLayoutCacheStats().evictions;
+    std::vector<std::shared_ptr<const TextBlock>> kept;
+    for (const char* text : {"first entry", "second entry", "third entry"}) {
+        spans[0].text = text;
+        kept.push_back(engine.LayoutStyledTextCached(spans, paragraphStyle));
+    }
+    stats = engine.GetLayoutCacheStats();
+    CHECK(stats.entries == 2 && stats.capacity == 2 && stats.evictions == evictionsBefore + 1);
+    CHECK(std::string(kept[0]->sourceTextConcatenated) == "first entry");
+
+    engine.SetLayoutCacheCapacity(0); // 禁用：每次都是未命中
+    const size_t missesBefore = engine.GetLayoutCacheStats().misses;
+    std::shared_ptr<const TextBlock> e = engine.LayoutStyledTextCached(spans, paragraphStyle);
+    std::shared_ptr<const TextBlock> f = engine.LayoutStyledTextCached(spans, paragraphStyle);
+    CHECK(e && f && e != f && engine.GetLayoutCacheStats().misses == missesBefore + 2);
+    engine.SetLayoutCacheCapacity(256);
+}
+
+// --- RenderTextBlockToImage (CPU 光栅化) ---
+void TestRenderToImage(ITextEngine& engine, FontId font) {
+    printf("RenderTextBlockToImage\n");
+    std::vector<TextSpan> spans(1);
+    spans[0].style = MakeStyle(font, 96.0f, {255, 0, 0, 255});
+    spans[0].text = "H";
+    TextBlock block = engine.LayoutStyledText(spans, MakeParagraphStyle(font, 96.0f, 0.0f));
+    CHECK(!block.elements.empty());
+
+    Image image = GenImageColor(192, 192, BLANK);
+    CHECK(image.format == PIXELFORMAT_UNCOMPRESSED_R8G8B8A8);
+    engine.RenderTextBlockToImage(block, image, MatrixTranslate(16.0f, 16.0f, 0.0f), WHITE);
+
+    int solidText = 0;
+    for (int y = 0; y < image.height; ++y) {
+        for (int x = 0; x < image.width; ++x) {
+            Color c = GetImageColor(image, x, y);
+            if (c.a >= 240 && c.r >= 240 && c.g <= 16 && c.b <= 16) ++solidText;
+        }
+    }
+    CHECK(solidText > 200); // 字形内部完全覆盖为文字颜色
+    CHECK(GetImageColor(image, 0, 0).a == 0); // 变换后的块之外保持透明
+    CHECK(GetImageColor(image, image.width - 1, image.height - 1).a == 0);
+
+    Image wrongFormat = GenImageColor(8, 8, BLANK); // 非 RGBA8 的图像不被修改
+    ImageFormat(&wrongFormat, PIXELFORMAT_UNCOMPRESSED_GRAYSCALE);
+    engine.RenderTextBlockToImage(block, wrongFormat, MatrixIdentity(), WHITE);
+    CHECK(GetImageColor(wrongFormat, 4, 4).r == 0);
+    UnloadImage(wrongFormat);
+    UnloadImage(image);
+}
+
+} // namespace
+
+int main() {
+    SetTraceLogLevel(LOG_WARNING);
+    TestStyledTextModel();
+
+    std::unique_ptr<ITextEngine> engine = CreateTextEngine(std::make_unique<HeadlessAtlasStorage>());
+    const FontId font = engine->LoadFont(TEST_RESOURCES_DIR "/arial.ttf");
+    const FontId arabicFont = engine->LoadFont(TEST_RESOURCES_DIR "/NotoNaskhArabic-Regular.ttf");
+    const FontId cjkFont = engine->LoadFont(TEST_RESOURCES_DIR "/simhei.ttf");
+    CHECK(engine->IsFontValid(font) && engine->IsFontValid(arabicFont) && engine->IsFontValid(cjkFont));
+    if (!engine->IsFontValid(font) || !engine->IsFontValid(arabicFont) || !engine->IsFontValid(cjkFont)) {
+        printf("Cannot load fonts from %s\n", TEST_RESOURCES_DIR);
+        return 1;
+    }
+    engine->SetDefaultFont(font);
+
+    TestTextDocument(*engine, font);
+    TestLineIndex(*engine, font);
+    TestRewrap(*engine, font);
+    TestShapeThenBreak(*engine, font, arabicFont);
+    TestSimpleLtrFastPath(*engine, font, cjkFont);
+    TestMeasure(*engine, font, arabicFont);
+    TestStreaming(*engine, font);
+    TestLayoutCache(*engine, font);
+    TestRenderToImage(*engine, font);
+
+    engine.reset();
+    if (g_failures > 0) {
+        printf("%d check(s) failed\n", g_failures);
+        return 1;
+    }
+    printf("All checks passed\n");
+    return 0;
+}